@@ -2,12 +2,125 @@
 #include "couchdbserver.h"
 #include "couchdbquery.h"
 #include "couchdblistener.h"
+#include "couchdbwritequeue.h"
+#include "couchdbrevisiontable.h"
+#include "couchdbtimingwheel.h"
+#include "couchdbcluster.h"
+#include "couchdbratelimiter.h"
+#include "couchdbjson.h"
+#include "couchdbmultipart.h"
+#include "couchdblistmodel.h"
+#include "couchdbfuturewatcher.h"
 
 #include <QNetworkAccessManager>
 #include <QNetworkRequest>
+#include <QHttpMultiPart>
+#include <QTimer>
+#include <QPointer>
+#include <QPair>
+#include <QSet>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QtQml>
 #include <QDebug>
 
+#include <cctype>
+
+namespace
+{
+    bool isConnectivityError(const QNetworkReply::NetworkError& error)
+    {
+        switch(error)
+        {
+        case QNetworkReply::ConnectionRefusedError:
+        case QNetworkReply::RemoteHostClosedError:
+        case QNetworkReply::HostNotFoundError:
+        case QNetworkReply::TimeoutError:
+        case QNetworkReply::TemporaryNetworkFailureError:
+        case QNetworkReply::NetworkSessionFailedError:
+        case QNetworkReply::UnknownNetworkError:
+        case QNetworkReply::ProxyConnectionRefusedError:
+        case QNetworkReply::ProxyNotFoundError:
+        case QNetworkReply::ProxyTimeoutError:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    //Adds the known revision to a JSON document unless the caller already set one at the top level.
+    //With replace set an existing one is overwritten, or removed if no revision is known
+    QByteArray injectRevision(const QByteArray& document, const QString& revision, const bool& replace = false)
+    {
+        const CouchDBJsonView view(document);
+        if(!view.isObject()) return document;
+
+        if(view.contains(QStringLiteral("_rev")))
+        {
+            if(!replace) return document;
+
+            QJsonObject object = view.toObject();
+            if(revision.isEmpty()) object.remove(QStringLiteral("_rev"));
+            else object.insert(QStringLiteral("_rev"), revision);
+            return QJsonDocument(object).toJson(QJsonDocument::Compact);
+        }
+
+        if(revision.isEmpty()) return document;
+
+        const int start = document.indexOf('{');
+        if(start < 0) return document;
+
+        int next = start + 1;
+        while(next < document.size() && isspace(static_cast<unsigned char>(document.at(next)))) ++next;
+
+        QByteArray field;
+        field.reserve(revision.size() + 12);
+        field.append("\"_rev\":\"").append(revision.toLatin1()).append('"');
+        if(next < document.size() && document.at(next) != '}') field.append(',');
+
+        QByteArray result(document);
+        result.insert(start + 1, field);
+        return result;
+    }
+
+    bool isWriteOperation(const CouchDBOperation& operation)
+    {
+        switch(operation)
+        {
+        case COUCHDB_STARTSESSION:
+        case COUCHDB_ENDSESSION:
+        case COUCHDB_CREATEDATABASE:
+        case COUCHDB_DELETEDATABASE:
+        case COUCHDB_UPDATEDOCUMENT:
+        case COUCHDB_DELETEDOCUMENT:
+        case COUCHDB_UPLOADATTACHMENT:
+        case COUCHDB_DELETEATTACHMENT:
+        case COUCHDB_REPLICATEDATABASE:
+        case COUCHDB_BULKDOCUMENTS:
+        case COUCHDB_UPSERTDOCUMENT:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    QString joinPath(const QString& first, const QString& second = QString(), const QString& third = QString())
+    {
+        QString path;
+        path.reserve(first.size() + second.size() + third.size() + 3);
+        path.append(QLatin1Char('/')).append(first);
+        if(!second.isEmpty()) path.append(QLatin1Char('/')).append(second);
+        if(!third.isEmpty()) path.append(QLatin1Char('/')).append(third);
+        return path;
+    }
+
+    const int queryPoolSize = 64;
+    const int revisionsChunkSize = 1000;
+    const int queryTimeoutInterval = 20000;
+    const int maxFlushBatchSize = 1000;
+    const int reconnectInterval = 5000;
+    const int maxReconnectInterval = 300000;
+}
 
 class CouchDBPrivate
 {
@@ -15,7 +128,15 @@ public:
     CouchDBPrivate() :
         server(0),
         cleanServerOnQuit(true),
-        networkManager(0)
+        networkManager(0),
+        writeQueue(0),
+        revisionTable(0),
+        timingWheel(0),
+        reconnectTimer(0),
+        offline(false),
+        flushing(false),
+        flushBatchSize(maxFlushBatchSize),
+        priority(COUCHDB_PRIORITY_NORMAL)
     {}
     
     virtual ~CouchDBPrivate()
@@ -23,6 +144,40 @@ public:
         if(server && cleanServerOnQuit) delete server;
         
         if(networkManager) delete networkManager;
+
+        if(writeQueue)
+        {
+            writeQueue->disconnect();
+            delete writeQueue;
+        }
+        if(reconnectTimer) delete reconnectTimer;
+        if(revisionTable) delete revisionTable;
+        if(timingWheel) delete timingWheel;
+    }
+
+    //Without a cluster every request goes to the configured server. With one, 0 when no healthy node qualifies
+    CouchDBServer *serverFor(const CouchDBOperation& operation, CouchDBServer *excluded = 0) const
+    {
+        if(!cluster) return server;
+
+        return isWriteOperation(operation) ? cluster->writeNode(excluded) : cluster->readNode(excluded);
+    }
+
+    //Node a new request starts on: the preferred healthy one, else the first node, as the configured server
+    //is usually no member of the cluster
+    CouchDBServer *sendServerFor(const CouchDBOperation& operation) const
+    {
+        CouchDBServer *node = serverFor(operation);
+        if(node || !cluster) return node;
+
+        const QList<CouchDBServer*> nodes = cluster->nodes();
+        return nodes.isEmpty() ? server : nodes.first();
+    }
+
+    //While offline, or while older writes are still queued, writes go through the log to keep their order
+    bool useWriteQueue() const
+    {
+        return writeQueue && (offline || !writeQueue->isEmpty());
     }
     
     CouchDBServer *server;
@@ -30,6 +185,21 @@ public:
 
     QNetworkAccessManager *networkManager;
     QHash<QNetworkReply*, CouchDBQuery*> currentQueries;
+    QList<CouchDBQuery*> queryPool;
+
+    CouchDBWriteQueue *writeQueue;
+    CouchDBRevisionTable *revisionTable;
+    CouchDBTimingWheel *timingWheel;
+    QPointer<CouchDBCluster> cluster; //CouchDB doesn't own the cluster
+    QTimer *reconnectTimer;
+    bool offline;
+    bool flushing;
+    int flushBatchSize;
+    CouchDBPriority priority;
+    QSet<CouchDBQuery*> admittedQueries; //Sent from the rate limiter, not to be submitted again
+    QMap<CouchDBOperation, CouchDBOperationStatistics> statistics;
+    QList<QPair<CouchDBWriteQueueEntry, CouchDBFuture> > awaitingCommit;
+    QHash<CouchDBQuery*, QList<CouchDBWriteQueueEntry> > flushBatches;
 };
 
 CouchDB::CouchDB(QObject *parent) :
@@ -38,8 +208,19 @@ CouchDB::CouchDB(QObject *parent) :
 {
     Q_D(CouchDB);
 
+    //Futures cross queued connections and QVariants without declareQML being called
+    qRegisterMetaType<CouchDBFuture>();
+
     d->server = new CouchDBServer(this);
     d->networkManager = new QNetworkAccessManager(this);
+    d->revisionTable = new CouchDBRevisionTable(this);
+    d->timingWheel = new CouchDBTimingWheel(this);
+
+    d->reconnectTimer = new QTimer(this);
+    d->reconnectTimer->setInterval(reconnectInterval);
+    d->reconnectTimer->setSingleShot(true);
+    connect(d->reconnectTimer, SIGNAL(timeout()), this, SLOT(flushWriteQueue()));
+
 }
 
 CouchDB::~CouchDB()
@@ -50,6 +231,8 @@ CouchDB::~CouchDB()
 void CouchDB::declareQML()
 {
     qmlRegisterType<CouchDB>("TOP.CouchDB", 1, 0, "CouchDB");
+    qmlRegisterType<CouchDBListModel>("TOP.CouchDB", 1, 0, "CouchDBListModel");
+    qmlRegisterType<CouchDBFutureWatcher>("TOP.CouchDB", 1, 0, "CouchDBFutureWatcher");
 }
 
 CouchDBServer *CouchDB::server() const
@@ -75,17 +258,280 @@ void CouchDB::setServerConfiguration(const QString &url, const int &port, const
     if(!username.isEmpty() && !password.isEmpty()) d->server->setCredential(username, password);
 }
 
-void CouchDB::executeQuery(CouchDBQuery *query)
+CouchDBWriteQueue *CouchDB::writeQueue() const
+{
+    Q_D(const CouchDB);
+    return d->writeQueue;
+}
+
+bool CouchDB::setWriteAheadLog(const QString &path)
+{
+    Q_D(CouchDB);
+
+    if(d->writeQueue)
+    {
+        d->writeQueue->close();
+        delete d->writeQueue;
+        d->writeQueue = 0;
+        d->flushBatches.clear();
+        d->awaitingCommit.clear();
+    }
+
+    if(path.isEmpty()) return true;
+
+    d->writeQueue = new CouchDBWriteQueue(path, this);
+    if(!d->writeQueue->open())
+    {
+        delete d->writeQueue;
+        d->writeQueue = 0;
+        return false;
+    }
+
+    connect(d->writeQueue, SIGNAL(committed()), this, SLOT(writeQueueCommitted()));
+    if(!d->writeQueue->isEmpty()) QTimer::singleShot(0, this, SLOT(flushWriteQueue()));
+
+    return true;
+}
+
+bool CouchDB::isOffline() const
+{
+    Q_D(const CouchDB);
+    return d->offline;
+}
+
+CouchDBRevisionTable *CouchDB::revisionTable() const
+{
+    Q_D(const CouchDB);
+    return d->revisionTable;
+}
+
+CouchDBTimingWheel *CouchDB::timingWheel() const
+{
+    Q_D(const CouchDB);
+    return d->timingWheel;
+}
+
+CouchDBCluster *CouchDB::cluster() const
+{
+    Q_D(const CouchDB);
+    return d->cluster;
+}
+
+void CouchDB::setCluster(CouchDBCluster *cluster)
+{
+    Q_D(CouchDB);
+    d->cluster = cluster;
+}
+
+CouchDBPriority CouchDB::priority() const
+{
+    Q_D(const CouchDB);
+    return d->priority;
+}
+
+void CouchDB::setPriority(const CouchDBPriority &priority)
+{
+    Q_D(CouchDB);
+    d->priority = priority;
+}
+
+QMap<CouchDBOperation, CouchDBOperationStatistics> CouchDB::operationStatistics() const
+{
+    Q_D(const CouchDB);
+    return d->statistics;
+}
+
+CouchDBOperationStatistics CouchDB::operationStatistics(const CouchDBOperation &operation) const
+{
+    Q_D(const CouchDB);
+    return d->statistics.value(operation);
+}
+
+void CouchDB::resetOperationStatistics()
+{
+    Q_D(CouchDB);
+    d->statistics.clear();
+}
+
+CouchDBQuery *CouchDB::createQuery(const CouchDBOperation &operation, const QString &path, const QString &database, const QString &documentID)
+{
+    Q_D(CouchDB);
+
+    CouchDBQuery *query;
+    if(d->queryPool.isEmpty())
+    {
+        query = new CouchDBQuery(d->server, this);
+        connect(query, SIGNAL(timeout()), SLOT(queryTimeout()));
+    }
+    else
+    {
+        query = d->queryPool.takeLast();
+    }
+    CouchDBServer *server = d->sendServerFor(operation);
+    query->setServer(server);
+    query->setOperation(operation);
+    query->setPath(path);
+    query->setUrl(QUrl(server->baseURL() + path));
+    query->setFuture(CouchDBFuture());
+    query->setDatabase(database);
+    query->setDocumentID(documentID);
+    query->setPriority(d->priority);
+
+    return query;
+}
+
+bool CouchDB::failover(CouchDBQuery *query)
+{
+    Q_D(CouchDB);
+    if(!d->cluster || query->multiPart()) return false;
+
+    d->cluster->recordFailure(query->server());
+    if(query->failoverCount() >= d->cluster->nodes().size() - 1) return false;
+
+    CouchDBServer *server = d->serverFor(query->operation(), query->server());
+    if(!server || server == query->server()) return false;
+
+    qWarning() << "Moving" << query->path() << "to cluster node" << server->baseURL(false);
+
+    query->setFailoverCount(query->failoverCount() + 1);
+    query->setServer(server);
+    query->setUrl(QUrl(server->baseURL() + query->path()));
+    query->request()->setRawHeader(QByteArrayLiteral("Authorization"), QByteArray());
+    return true;
+}
+
+bool CouchDB::admitQuery(CouchDBQuery *query)
+{
+    Q_D(CouchDB);
+
+    if(d->admittedQueries.remove(query)) return true;
+
+    CouchDBRateLimiter *limiter = query->server()->rateLimiter();
+    if(!limiter) return true;
+
+    //Queries wait in the limiter's queue with the requests of the other components, so priority holds across all of them.
+    //The query is sent from the limiter right away or once a token is available
+    const bool write = isWriteOperation(query->operation());
+    const bool admitted = limiter->submit(write, query->priority(), query, [this, d, query]() {
+        d->admittedQueries.insert(query);
+        executeQuery(query);
+    }, true);
+
+    if(!admitted)
+    {
+        qWarning() << "Shedding" << query->path() << "while the server is throttled";
+        failQuery(query, COUCHDB_THROTTLED);
+    }
+    return false;
+}
+
+void CouchDB::failQuery(CouchDBQuery *query, const CouchDBReplyStatus &status)
+{
+    Q_D(CouchDB);
+
+    CouchDBResponse response;
+    response.setQuery(query);
+    response.setStatus(status);
+
+    switch(query->operation())
+    {
+    case COUCHDB_CHECKINSTALLATION:
+    default:
+        emit installationChecked(response);
+        break;
+    case COUCHDB_STARTSESSION:
+        emit sessionStarted(response);
+        break;
+    case COUCHDB_ENDSESSION:
+        emit sessionEnded(response);
+        break;
+    case COUCHDB_LISTDATABASES:
+        emit databasesListed(response);
+        break;
+    case COUCHDB_CREATEDATABASE:
+        emit databaseCreated(response);
+        break;
+    case COUCHDB_DELETEDATABASE:
+        emit databaseDeleted(response);
+        break;
+    case COUCHDB_LISTDOCUMENTS:
+        emit documentsListed(response);
+        break;
+    case COUCHDB_RETRIEVEREVISION:
+        emit revisionRetrieved(response);
+        break;
+    case COUCHDB_RETRIEVEREVISIONS:
+        break;
+    case COUCHDB_RETRIEVEDOCUMENT:
+        emit documentRetrieved(response);
+        break;
+    case COUCHDB_UPDATEDOCUMENT:
+    case COUCHDB_UPSERTDOCUMENT:
+        emit documentUpdated(response);
+        break;
+    case COUCHDB_DELETEDOCUMENT:
+        emit documentDeleted(response);
+        break;
+    case COUCHDB_UPLOADATTACHMENT:
+        emit attachmentUploaded(response);
+        break;
+    case COUCHDB_DELETEATTACHMENT:
+        emit attachmentDeleted(response);
+        break;
+    case COUCHDB_REPLICATEDATABASE:
+        emit databaseReplicated(response);
+        break;
+    case COUCHDB_BULKDOCUMENTS:
+        //The batch stays in the log and is sent again later
+        if(d->writeQueue)
+        {
+            foreach(const CouchDBWriteQueueEntry& entry, d->flushBatches.take(query)) d->writeQueue->release(entry.sequence);
+            d->flushing = false;
+            d->reconnectTimer->start();
+        }
+        emit writeQueueFlushed(response);
+        break;
+    }
+
+    //Shed calls never reached the server, only timeouts count
+    if(status == COUCHDB_TIMEOUT) d->statistics[query->operation()].record(query->callElapsed(), true);
+
+    query->future().resolve(response);
+    releaseQuery(query);
+}
+
+void CouchDB::releaseQuery(CouchDBQuery *query)
+{
+    Q_D(CouchDB);
+
+    d->timingWheel->cancel(query->timeoutHandle());
+
+    if(d->queryPool.size() >= queryPoolSize)
+    {
+        query->deleteLater();
+        return;
+    }
+
+    query->reset();
+    d->queryPool.append(query);
+}
+
+CouchDBFuture CouchDB::executeQuery(CouchDBQuery *query)
 {
     Q_D(CouchDB);
 
+    const CouchDBFuture future = query->future();
+    if(!admitQuery(query)) return future;
+
     if(query->server()->hasCredential() && query->operation() != COUCHDB_STARTSESSION)
     {
-        query->request()->setRawHeader("Authorization", "Basic " + query->server()->credential());
+        query->request()->setRawHeader(QByteArrayLiteral("Authorization"), query->server()->authorizationHeader());
     }
 
     qDebug() << "Invoked url:" << query->operation() << query->request()->url().toString();
 
+    query->startTiming();
+
     QNetworkReply * reply;
     switch(query->operation()) {
     case COUCHDB_CHECKINSTALLATION:
@@ -117,7 +563,15 @@ void CouchDB::executeQuery(CouchDBQuery *query)
         reply = d->networkManager->get(*query->request());
         break;
     case COUCHDB_UPDATEDOCUMENT:
-        reply = d->networkManager->put(*query->request(), query->body());
+        if(query->multiPart())
+        {
+            reply = d->networkManager->put(*query->request(), query->multiPart());
+            query->multiPart()->setParent(reply);
+        }
+        else
+        {
+            reply = d->networkManager->put(*query->request(), query->body());
+        }
         break;
     case COUCHDB_DELETEDOCUMENT:
         reply = d->networkManager->deleteResource(*query->request());
@@ -131,16 +585,69 @@ void CouchDB::executeQuery(CouchDBQuery *query)
     case COUCHDB_REPLICATEDATABASE:
         reply = d->networkManager->post(*query->request(), query->body());
         break;
+    case COUCHDB_BULKDOCUMENTS:
+    case COUCHDB_RETRIEVEREVISIONS:
+        reply = d->networkManager->post(*query->request(), query->body());
+        break;
+    case COUCHDB_UPSERTDOCUMENT:
+        //The retry after a conflict writes over whatever revision the caller sent with the refetched one
+        reply = d->networkManager->put(*query->request(), injectRevision(query->body(), query->revision(), query->retryCount() > 0));
+        break;
     }
 
     if(query->operation() != COUCHDB_REPLICATEDATABASE)
     {
-        connect(query, SIGNAL(timeout()), SLOT(queryTimeout()));
-        query->startTimeoutTimer();
+        d->timingWheel->cancel(query->timeoutHandle());
+        query->setTimeoutHandle(d->timingWheel->schedule(queryTimeoutInterval, query, "timeout"));
     }
 
+    if(query->operation() == COUCHDB_RETRIEVEDOCUMENT) connect(reply, SIGNAL(readyRead()), this, SLOT(queryReadyRead()));
+    if(query->multiPart()) connect(reply, SIGNAL(uploadProgress(qint64,qint64)), this, SLOT(queryUploadProgress()));
     connect(reply, SIGNAL(finished()), this, SLOT(queryFinished()));
     d->currentQueries[reply] = query;
+
+    return query->future();
+}
+
+void CouchDB::queryUploadProgress()
+{
+    Q_D(CouchDB);
+
+    QNetworkReply* reply = qobject_cast<QNetworkReply*>(sender());
+    if(!reply) return;
+
+    CouchDBQuery *query = d->currentQueries.value(reply);
+    if(!query) return;
+
+    //A large upload keeps going out, only a stalled one times out
+    d->timingWheel->cancel(query->timeoutHandle());
+    query->setTimeoutHandle(d->timingWheel->schedule(queryTimeoutInterval, query, "timeout"));
+}
+
+void CouchDB::queryReadyRead()
+{
+    Q_D(CouchDB);
+
+    QNetworkReply* reply = qobject_cast<QNetworkReply*>(sender());
+    if(!reply || reply->error() != QNetworkReply::NoError) return;
+
+    CouchDBQuery *query = d->currentQueries.value(reply);
+    if(!query) return;
+
+    //A large body keeps arriving, only a stalled one times out
+    d->timingWheel->cancel(query->timeoutHandle());
+    query->setTimeoutHandle(d->timingWheel->schedule(queryTimeoutInterval, query, "timeout"));
+
+    //Multipart bodies are parsed as they arrive, plain JSON is read once finished
+    CouchDBMultipartParser *parser = reply->findChild<CouchDBMultipartParser*>();
+    if(!parser)
+    {
+        const QByteArray boundary = CouchDBMultipartParser::boundary(reply->rawHeader("Content-Type"));
+        if(boundary.isEmpty()) return;
+        parser = new CouchDBMultipartParser(boundary, reply);
+    }
+
+    parser->feed(reply->readAll());
 }
 
 void CouchDB::queryFinished()
@@ -153,9 +660,35 @@ void CouchDB::queryFinished()
     QByteArray data;
     CouchDBQuery *query = d->currentQueries[reply];
     bool hasError = false;
+
+    QByteArray multipartBody;
+    QList<CouchDBMultipartPart> attachments;
     if(reply->error() == QNetworkReply::NoError)
     {
         data = reply->readAll();
+
+        CouchDBMultipartParser *parser = reply->findChild<CouchDBMultipartParser*>();
+        if(!parser && query->operation() == COUCHDB_RETRIEVEDOCUMENT)
+        {
+            const QByteArray boundary = CouchDBMultipartParser::boundary(reply->rawHeader("Content-Type"));
+            if(!boundary.isEmpty()) parser = new CouchDBMultipartParser(boundary, reply);
+        }
+
+        if(parser)
+        {
+            if(parser->feed(data) && parser->isComplete())
+            {
+                data = parser->document();
+                multipartBody = parser->body();
+                attachments = parser->attachments();
+            }
+            else
+            {
+                qWarning() << "Malformed multipart response for" << query->path();
+                data.clear();
+                hasError = true;
+            }
+        }
     }
     else
     {
@@ -163,21 +696,138 @@ void CouchDB::queryFinished()
         hasError = true;
     }
 
+    const int httpStatus = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    const bool throttled = httpStatus == 429 || httpStatus == 503;
+    CouchDBRateLimiter *limiter = query->server()->rateLimiter();
+    if(limiter && httpStatus > 0) limiter->recordResponse(httpStatus, reply->rawHeader("Retry-After"));
+
+    if(query->operation() == COUCHDB_UPSERTDOCUMENT)
+    {
+        if(reply->operation() == QNetworkAccessManager::HeadOperation)
+        {
+            //Revision refetched after a conflict, retry the write once with it
+            if(!hasError)
+            {
+                QString revision = reply->rawHeader("ETag");
+                revision.remove("\"");
+                query->setRevision(revision);
+                d->revisionTable->setRevision(query->database(), query->documentID(), revision);
+            }
+            else if(reply->error() == QNetworkReply::ContentNotFoundError)
+            {
+                query->setRevision(QString());
+                d->revisionTable->removeRevision(query->database(), query->documentID());
+            }
+
+            d->currentQueries.remove(reply);
+            reply->deleteLater();
+            executeQuery(query);
+            return;
+        }
+
+        if(reply->error() == QNetworkReply::ContentConflictError && query->retryCount() == 0)
+        {
+            query->setRetryCount(1);
+
+            d->currentQueries.remove(reply);
+            reply->deleteLater();
+
+            //The refetch is admitted like any other request, a conflict storm under a 429 doesn't bypass the limiter.
+            //Like a query waiting for its first send, it has no deadline until it is sent
+            d->timingWheel->cancel(query->timeoutHandle());
+            query->setTimeoutHandle(0);
+
+            const std::function<void()> refetch = [this, d, query]() {
+                QNetworkReply *revisionReply = d->networkManager->head(*query->request());
+                connect(revisionReply, SIGNAL(finished()), this, SLOT(queryFinished()));
+                d->currentQueries[revisionReply] = query;
+                query->setTimeoutHandle(d->timingWheel->schedule(queryTimeoutInterval, query, "timeout"));
+            };
+
+            if(!limiter) refetch();
+            else if(!limiter->submit(false, query->priority(), query, refetch, true))
+            {
+                qWarning() << "Shedding" << query->path() << "while the server is throttled";
+                failQuery(query, COUCHDB_THROTTLED);
+            }
+            return;
+        }
+    }
+
+    if(hasError && isConnectivityError(reply->error()) && failover(query))
+    {
+        d->currentQueries.remove(reply);
+        reply->deleteLater();
+        executeQuery(query);
+        return;
+    }
+
+    if(hasError && isConnectivityError(reply->error()) && handleOffline(query))
+    {
+        d->currentQueries.remove(reply);
+        reply->deleteLater();
+        releaseQuery(query);
+        return;
+    }
+
+    //A node answering with a server error is as unusable as an unreachable one
+    if(d->cluster && !(hasError && isConnectivityError(reply->error())))
+    {
+        if(httpStatus >= 500) d->cluster->recordFailure(query->server());
+        else d->cluster->recordLatency(query->server(), query->elapsed());
+    }
+
     CouchDBResponse response;
     response.setQuery(query);
     response.setData(data);
+    response.setAttachments(multipartBody, attachments);
     response.setStatus(hasError || (query->operation() != COUCHDB_CHECKINSTALLATION && query->operation() != COUCHDB_RETRIEVEDOCUMENT &&
-            !response.documentObj().value("ok").toBool()) ? COUCHDB_ERROR : COUCHDB_SUCCESS);
+            query->operation() != COUCHDB_BULKDOCUMENTS && query->operation() != COUCHDB_RETRIEVEREVISIONS && !response.view().value(QStringLiteral("ok")).toBool()) ? COUCHDB_ERROR : COUCHDB_SUCCESS);
+    //Not retried, the limiter already slowed down and the caller decides whether the call is still worth making
+    if(throttled) response.setStatus(COUCHDB_THROTTLED);
+
+    if(!hasError)
+    {
+        switch(query->operation())
+        {
+        case COUCHDB_UPDATEDOCUMENT:
+        case COUCHDB_UPSERTDOCUMENT:
+        case COUCHDB_UPLOADATTACHMENT:
+        case COUCHDB_DELETEATTACHMENT:
+            d->revisionTable->setRevision(query->database(), query->documentID(), response.view().value(QStringLiteral("rev")).toString());
+            break;
+        case COUCHDB_RETRIEVEDOCUMENT:
+            d->revisionTable->setRevision(query->database(), query->documentID(), CouchDBJson::readString(data, QStringLiteral("_rev")));
+            break;
+        case COUCHDB_DELETEDOCUMENT:
+            d->revisionTable->removeRevision(query->database(), query->documentID());
+            break;
+        case COUCHDB_RETRIEVEREVISIONS:
+            foreach(const CouchDBJsonView& row, response.view().value(QStringLiteral("rows")).elements())
+            {
+                const QString documentID = row.value(QStringLiteral("key")).toString();
+                const CouchDBJsonView value = row.value(QStringLiteral("value"));
+                if(value.isObject() && !value.value(QStringLiteral("deleted")).toBool())
+                {
+                    d->revisionTable->setRevision(query->database(), documentID, value.value(QStringLiteral("rev")).toString());
+                }
+                else d->revisionTable->removeRevision(query->database(), documentID);
+            }
+            break;
+        default:
+            break;
+        }
+    }
 
     switch(query->operation())
     {
     case COUCHDB_CHECKINSTALLATION:
     default:
-        if(!hasError) response.setStatus(response.documentObj().contains("couchdb") ? COUCHDB_SUCCESS : COUCHDB_ERROR);
+        if(!hasError) response.setStatus(response.view().contains(QStringLiteral("couchdb")) ? COUCHDB_SUCCESS : COUCHDB_ERROR);
         emit installationChecked(response);
         break;
     case COUCHDB_STARTSESSION:
-        if(hasError && reply->error() >= 201 && reply->error() <= 299) response.setStatus(COUCHDB_AUTHERROR);
+        if(hasError && !throttled && reply->error() >= 201 && reply->error() <= 299) response.setStatus(COUCHDB_AUTHERROR);
         emit sessionStarted(response);
         break;
     case COUCHDB_ENDSESSION:
@@ -200,13 +850,18 @@ void CouchDB::queryFinished()
         QString revision = reply->rawHeader("ETag");
         revision.remove("\"");
         response.setRevisionData(revision);
+        if(!hasError) d->revisionTable->setRevision(query->database(), query->documentID(), revision);
         emit revisionRetrieved(response);
         break;
     }
+    case COUCHDB_RETRIEVEREVISIONS:
+        //Chunks are reported together once all of them finished, see retrieveRevisions
+        break;
     case COUCHDB_RETRIEVEDOCUMENT:
         emit documentRetrieved(response);
         break;
     case COUCHDB_UPDATEDOCUMENT:
+    case COUCHDB_UPSERTDOCUMENT:
         emit documentUpdated(response);
         break;
     case COUCHDB_DELETEDOCUMENT:
@@ -221,11 +876,76 @@ void CouchDB::queryFinished()
     case COUCHDB_REPLICATEDATABASE:
         emit databaseReplicated(response);
         break;
+    case COUCHDB_BULKDOCUMENTS:
+    {
+        QList<CouchDBWriteQueueEntry> batch = d->flushBatches.take(query);
+        d->flushing = false;
+
+        if(!d->writeQueue) break;
+
+        if(hasError)
+        {
+            //A malformed or oversized request is split until the entry causing it is isolated and dropped, anything
+            //else (server failures, credentials, missing database) is retried with a growing delay
+            const bool refused = httpStatus == 400 || httpStatus == 413;
+            if(refused && batch.size() == 1)
+            {
+                d->writeQueue->acknowledge(batch.first().sequence);
+                rejectQueuedWrite(batch.first(), data);
+                d->flushBatchSize = maxFlushBatchSize;
+            }
+            else
+            {
+                foreach(const CouchDBWriteQueueEntry& entry, batch) d->writeQueue->release(entry.sequence);
+                if(refused) d->flushBatchSize = qMax(1, batch.size() / 2);
+            }
+
+            emit writeQueueFlushed(response);
+
+            if(refused) flushWriteQueue();
+            else
+            {
+                d->reconnectTimer->setInterval(qMin(maxReconnectInterval, d->reconnectTimer->interval() * 2));
+                d->reconnectTimer->start();
+            }
+            break;
+        }
+
+        d->offline = false;
+        d->flushBatchSize = maxFlushBatchSize;
+        d->reconnectTimer->setInterval(reconnectInterval);
+
+        //Rejected documents (e.g. conflicts) are dropped as well, sending them again would fail the same way
+        QHash<QString, CouchDBWriteQueueEntry> entries;
+        foreach(const CouchDBWriteQueueEntry& entry, batch) entries.insert(entry.documentID, entry);
+
+        foreach(const CouchDBJsonView& result, response.view().elements())
+        {
+            const QString documentID = result.value(QStringLiteral("id")).toString();
+            if(!entries.contains(documentID)) continue;
+
+            const CouchDBWriteQueueEntry entry = entries.take(documentID);
+            d->writeQueue->acknowledge(entry.sequence);
+            if(result.contains(QStringLiteral("error"))) rejectQueuedWrite(entry, result.raw());
+            else d->revisionTable->setRevision(query->database(), documentID, result.value(QStringLiteral("rev")).toString());
+        }
+
+        foreach(const CouchDBWriteQueueEntry& entry, entries) d->writeQueue->release(entry.sequence);
+
+        emit writeQueueFlushed(response);
+        flushWriteQueue();
+        break;
+    }
     }
 
+    d->statistics[query->operation()].record(query->callElapsed(), response.status() != COUCHDB_SUCCESS);
+
+    //Resolved while the query is still alive, continuations may read it
+    query->future().resolve(response);
+
     d->currentQueries.remove(reply);
     reply->deleteLater();
-    delete query;
+    releaseQuery(query);
 }
 
 void CouchDB::queryTimeout()
@@ -233,215 +953,473 @@ void CouchDB::queryTimeout()
     CouchDBQuery *query = qobject_cast<CouchDBQuery*>(sender());
     if(!query) return;
 
-    qWarning() << query->url() << "timed out. Retrying...";
+    Q_D(CouchDB);
+
+    //The stalled reply is dropped, only the retried one may finish the query
+    QNetworkReply *reply = d->currentQueries.key(query);
+    if(reply)
+    {
+        d->currentQueries.remove(reply);
+        disconnect(reply, 0, this, 0);
+        reply->abort();
+        reply->deleteLater();
+    }
+
+    //A streamed upload has consumed its devices and cannot be sent again, the call fails instead
+    if(query->multiPart())
+    {
+        qWarning() << query->path() << "timed out";
+        failQuery(query, COUCHDB_TIMEOUT);
+        return;
+    }
+
+    if(failover(query))
+    {
+        qWarning() << query->path() << "timed out. Retrying on another cluster node...";
+    }
+    else if(handleOffline(query))
+    {
+        qWarning() << query->url() << "timed out. Kept in write-ahead log.";
+        releaseQuery(query);
+        return;
+    }
+    else
+    {
+        qWarning() << query->url() << "timed out. Retrying...";
+    }
 
     executeQuery(query);
 }
 
-void CouchDB::checkInstallation()
+CouchDBFuture CouchDB::queueWrite(const CouchDBOperation &operation, const QString &database, const QString &documentID, const QString &revision,
+                                  const QByteArray &document, const CouchDBFuture &future)
 {
     Q_D(CouchDB);
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1").arg(d->server->baseURL()));
-    query->setOperation(COUCHDB_CHECKINSTALLATION);
-
-    executeQuery(query);
+    if(operation == COUCHDB_DELETEDOCUMENT) d->writeQueue->enqueueDelete(database, documentID, revision);
+    else d->writeQueue->enqueueUpdate(database, documentID, document);
+
+    //Acknowledged once the group commit holding it has been synced to disk
+    CouchDBWriteQueueEntry entry;
+    entry.operation = operation;
+    entry.database = database;
+    entry.documentID = documentID;
+    entry.revision = revision;
+    d->awaitingCommit.append(qMakePair(entry, future));
+    return future;
 }
 
-void CouchDB::startSession(const QString &username, const QString &password)
+bool CouchDB::handleOffline(CouchDBQuery *query)
 {
     Q_D(CouchDB);
+    if(!d->writeQueue || query->multiPart()) return false;
 
-    QUrlQuery postData;
-    postData.addQueryItem("name", username);
-    postData.addQueryItem("password", password);
+    switch(query->operation())
+    {
+    case COUCHDB_UPDATEDOCUMENT:
+    case COUCHDB_DELETEDOCUMENT:
+        queueWrite(query->operation(), query->database(), query->documentID(), query->revision(), query->body(), query->future());
+        break;
+    case COUCHDB_UPSERTDOCUMENT:
+        queueWrite(COUCHDB_UPDATEDOCUMENT, query->database(), query->documentID(), QString(),
+                   injectRevision(query->body(), query->revision()), query->future());
+        break;
+    case COUCHDB_BULKDOCUMENTS:
+        foreach(const CouchDBWriteQueueEntry& entry, d->flushBatches.take(query)) d->writeQueue->release(entry.sequence);
+        d->flushing = false;
+        break;
+    default:
+        return false;
+    }
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1/_session").arg(d->server->baseURL()));
-    query->setOperation(COUCHDB_STARTSESSION);
-    query->request()->setRawHeader("Accept", "application/json");
-    query->request()->setRawHeader("Content-Type", "application/x-www-form-urlencoded");
-    query->setBody(postData.toString(QUrl::FullyEncoded).toUtf8());
+    if(!d->offline) qWarning() << "Server unreachable, writes are kept in the write-ahead log";
 
-    executeQuery(query);
+    d->offline = true;
+    d->reconnectTimer->start();
+    return true;
 }
 
-void CouchDB::endSession()
+void CouchDB::writeQueueCommitted()
 {
     Q_D(CouchDB);
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1/_session").arg(d->server->baseURL()));
-    query->setOperation(COUCHDB_ENDSESSION);
+    const QList<QPair<CouchDBWriteQueueEntry, CouchDBFuture> > acknowledged = d->awaitingCommit;
+    d->awaitingCommit.clear();
 
-    executeQuery(query);
+    for(int i = 0; i < acknowledged.size(); ++i)
+    {
+        const CouchDBWriteQueueEntry& entry = acknowledged.at(i).first;
+        CouchDBFuture future = acknowledged.at(i).second;
+
+        CouchDBQuery query(d->server);
+        query.setOperation(entry.operation);
+        query.setDatabase(entry.database);
+        query.setDocumentID(entry.documentID);
+        query.setRevision(entry.revision);
+
+        CouchDBResponse response;
+        response.setQuery(&query);
+        response.setStatus(COUCHDB_QUEUED);
+
+        if(entry.operation == COUCHDB_DELETEDOCUMENT) emit documentDeleted(response);
+        else emit documentUpdated(response);
+        future.resolve(response);
+    }
+
+    if(!d->offline) flushWriteQueue();
 }
 
-void CouchDB::listDatabases()
+void CouchDB::rejectQueuedWrite(const CouchDBWriteQueueEntry &entry, const QByteArray &result)
 {
     Q_D(CouchDB);
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1/_all_dbs").arg(d->server->baseURL()));
-    query->setOperation(COUCHDB_LISTDATABASES);
+    qWarning() << "Queued write for" << entry.documentID << "rejected:" << CouchDBJsonView(result).value(QStringLiteral("reason")).toString();
 
-    executeQuery(query);
+    CouchDBQuery query(d->server);
+    query.setOperation(entry.operation);
+    query.setDatabase(entry.database);
+    query.setDocumentID(entry.documentID);
+    query.setRevision(entry.revision);
+
+    CouchDBResponse response;
+    response.setQuery(&query);
+    response.setStatus(COUCHDB_ERROR);
+    response.setData(result);
+    emit queuedWriteRejected(response);
 }
 
-void CouchDB::createDatabase(const QString &database)
+void CouchDB::flushWriteQueue()
 {
     Q_D(CouchDB);
+    if(!d->writeQueue || d->flushing) return;
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1/%2").arg(d->server->baseURL(), database));
-    query->setOperation(COUCHDB_CREATEDATABASE);
-    query->setDatabase(database);
+    const QStringList databases = d->writeQueue->databases();
+    if(databases.isEmpty()) return;
+
+    const QString database = databases.first();
+    const QList<CouchDBWriteQueueEntry> batch = d->writeQueue->takeBatch(database, d->flushBatchSize);
 
+    QJsonArray documents;
+    foreach(const CouchDBWriteQueueEntry& entry, batch)
+    {
+        QJsonObject object;
+        if(entry.operation == COUCHDB_DELETEDOCUMENT)
+        {
+            object.insert("_rev", entry.revision);
+            object.insert("_deleted", true);
+        }
+        else
+        {
+            object = QJsonDocument::fromJson(entry.document).object();
+        }
+        object.insert("_id", entry.documentID);
+        documents.append(object);
+    }
+
+    QJsonObject object;
+    object.insert("docs", documents);
+    QJsonDocument document(object);
+
+    CouchDBQuery *query = createQuery(COUCHDB_BULKDOCUMENTS, joinPath(database, QStringLiteral("_bulk_docs")), database);
+    query->request()->setRawHeader(QByteArrayLiteral("Accept"), QByteArrayLiteral("application/json"));
+    query->request()->setRawHeader(QByteArrayLiteral("Content-Type"), QByteArrayLiteral("application/json"));
+    query->setBody(document.toJson(QJsonDocument::Compact));
+
+    qDebug() << "Flushing" << batch.size() << "queued writes to database:" << database;
+
+    d->flushing = true;
+    d->flushBatches.insert(query, batch);
     executeQuery(query);
 }
 
-void CouchDB::deleteDatabase(const QString &database)
+CouchDBFuture CouchDB::checkInstallation()
 {
-    Q_D(CouchDB);
+    CouchDBQuery *query = createQuery(COUCHDB_CHECKINSTALLATION, QString());
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1/%2").arg(d->server->baseURL(), database));
-    query->setOperation(COUCHDB_DELETEDATABASE);
-    query->setDatabase(database);
+    return executeQuery(query);
+}
 
-    executeQuery(query);
+CouchDBFuture CouchDB::startSession(const QString &username, const QString &password)
+{
+    QUrlQuery postData;
+    postData.addQueryItem("name", username);
+    postData.addQueryItem("password", password);
+
+    CouchDBQuery *query = createQuery(COUCHDB_STARTSESSION, QStringLiteral("/_session"));
+    query->request()->setRawHeader(QByteArrayLiteral("Accept"), QByteArrayLiteral("application/json"));
+    query->request()->setRawHeader(QByteArrayLiteral("Content-Type"), QByteArrayLiteral("application/x-www-form-urlencoded"));
+    query->setBody(postData.toString(QUrl::FullyEncoded).toUtf8());
+
+    return executeQuery(query);
 }
 
-void CouchDB::listDocuments(const QString& database)
+CouchDBFuture CouchDB::endSession()
 {
-    Q_D(CouchDB);
+    CouchDBQuery *query = createQuery(COUCHDB_ENDSESSION, QStringLiteral("/_session"));
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1/%2/_all_docs").arg(d->server->baseURL(), database));
-    query->setOperation(COUCHDB_LISTDOCUMENTS);
-    query->setDatabase(database);
+    return executeQuery(query);
+}
 
-    executeQuery(query);
+CouchDBFuture CouchDB::listDatabases()
+{
+    CouchDBQuery *query = createQuery(COUCHDB_LISTDATABASES, QStringLiteral("/_all_dbs"));
+
+    return executeQuery(query);
 }
 
-void CouchDB::retrieveRevision(const QString &database, const QString &id)
+CouchDBFuture CouchDB::createDatabase(const QString &database)
 {
-    Q_D(CouchDB);
+    CouchDBQuery *query = createQuery(COUCHDB_CREATEDATABASE, joinPath(database), database);
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1/%2/%3").arg(d->server->baseURL(), database, id));
-    query->setOperation(COUCHDB_RETRIEVEREVISION);
-    query->setDatabase(database);
-    query->setDocumentID(id);
+    return executeQuery(query);
+}
 
-    executeQuery(query);
+CouchDBFuture CouchDB::deleteDatabase(const QString &database)
+{
+    CouchDBQuery *query = createQuery(COUCHDB_DELETEDATABASE, joinPath(database), database);
+
+    return executeQuery(query);
 }
 
-void CouchDB::retrieveDocument(const QString &database, const QString &id)
+CouchDBFuture CouchDB::listDocuments(const QString& database)
 {
-    Q_D(CouchDB);
+    CouchDBQuery *query = createQuery(COUCHDB_LISTDOCUMENTS, joinPath(database, QStringLiteral("_all_docs")), database);
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1/%2/%3").arg(d->server->baseURL(), database, id));
-    query->setOperation(COUCHDB_RETRIEVEDOCUMENT);
-    query->setDatabase(database);
-    query->setDocumentID(id);
+    return executeQuery(query);
+}
 
-    executeQuery(query);
+CouchDBFuture CouchDB::retrieveRevision(const QString &database, const QString &id)
+{
+    CouchDBQuery *query = createQuery(COUCHDB_RETRIEVEREVISION, joinPath(database, id), database, id);
+
+    return executeQuery(query);
 }
 
-void CouchDB::updateDocument(const QString &database, const QString &id, QByteArray document)
+CouchDBFuture CouchDB::retrieveRevisions(const QString &database, const QStringList &ids)
+{
+    QList<CouchDBFuture> chunks;
+    for(int i = 0; i < ids.size(); i += revisionsChunkSize)
+    {
+        QJsonObject keys;
+        keys.insert(QStringLiteral("keys"), QJsonArray::fromStringList(ids.mid(i, revisionsChunkSize)));
+
+        CouchDBQuery *query = createQuery(COUCHDB_RETRIEVEREVISIONS, joinPath(database, QStringLiteral("_all_docs")), database);
+        query->request()->setRawHeader(QByteArrayLiteral("Accept"), QByteArrayLiteral("application/json"));
+        query->request()->setRawHeader(QByteArrayLiteral("Content-Type"), QByteArrayLiteral("application/json"));
+        query->setBody(QJsonDocument(keys).toJson(QJsonDocument::Compact));
+        chunks.append(executeQuery(query));
+    }
+
+    //The rows of every chunk are joined into one _all_docs body, callers get a single response whatever the chunking
+    CouchDBFuture combined;
+    CouchDBFuture::whenAll(chunks).then(this, [this, combined, chunks](const CouchDBResponse& result) mutable {
+        QByteArray rows;
+        foreach(const CouchDBFuture& chunk, chunks)
+        {
+            const QByteArray raw = CouchDBJsonView(chunk.data()).value(QStringLiteral("rows")).raw();
+            const QByteArray elements = raw.mid(1, raw.size() - 2).trimmed();
+            if(elements.isEmpty()) continue;
+
+            if(!rows.isEmpty()) rows.append(',');
+            rows.append(elements);
+        }
+
+        CouchDBResponse response;
+        response.setStatus(result.status());
+        response.setData(QByteArrayLiteral("{\"rows\":[") + rows + QByteArrayLiteral("]}"));
+        emit revisionsRetrieved(response);
+        combined.resolve(response);
+    });
+
+    return combined;
+}
+
+CouchDBFuture CouchDB::retrieveDocument(const QString &database, const QString &id)
+{
+    CouchDBQuery *query = createQuery(COUCHDB_RETRIEVEDOCUMENT, joinPath(database, id), database, id);
+
+    return executeQuery(query);
+}
+
+CouchDBFuture CouchDB::retrieveDocumentWithAttachments(const QString &database, const QString &id, const QStringList &knownRevisions)
+{
+    QString path = joinPath(database, id) + QStringLiteral("?attachments=true");
+    if(!knownRevisions.isEmpty())
+    {
+        const QByteArray revisions = QJsonDocument(QJsonArray::fromStringList(knownRevisions)).toJson(QJsonDocument::Compact);
+        path += QStringLiteral("&atts_since=") + QString::fromLatin1(QUrl::toPercentEncoding(revisions));
+    }
+
+    CouchDBQuery *query = createQuery(COUCHDB_RETRIEVEDOCUMENT, path, database, id);
+    query->request()->setRawHeader(QByteArrayLiteral("Accept"), QByteArrayLiteral("multipart/related"));
+
+    return executeQuery(query);
+}
+
+CouchDBFuture CouchDB::updateDocument(const QString &database, const QString &id, QByteArray document)
 {
     Q_D(CouchDB);
 
-    QByteArray postDataSize = QByteArray::number(document.size());
+    if(d->useWriteQueue())
+    {
+        return queueWrite(COUCHDB_UPDATEDOCUMENT, database, id, QString(), document);
+    }
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1/%2/%3").arg(d->server->baseURL(), database, id));
-    query->setOperation(COUCHDB_UPDATEDOCUMENT);
-    query->setDatabase(database);
-    query->setDocumentID(id);
-    query->request()->setRawHeader("Accept", "application/json");
-    query->request()->setRawHeader("Content-Type", "application/json");
-    query->request()->setRawHeader("Content-Length", postDataSize);
+    CouchDBQuery *query = createQuery(COUCHDB_UPDATEDOCUMENT, joinPath(database, id), database, id);
+    query->request()->setRawHeader(QByteArrayLiteral("Accept"), QByteArrayLiteral("application/json"));
+    query->request()->setRawHeader(QByteArrayLiteral("Content-Type"), QByteArrayLiteral("application/json"));
     query->setBody(document);
 
-    executeQuery(query);
+    return executeQuery(query);
 }
 
-void CouchDB::deleteDocument(const QString &database, const QString &id, const QString &revision)
+CouchDBFuture CouchDB::updateDocumentWithAttachments(const QString &database, const QString &id, const QByteArray &document,
+                                                     const QList<CouchDBAttachment> &attachments)
 {
-    Q_D(CouchDB);
+    QHash<QString, CouchDBAttachment> attachmentsByName;
+    QHash<QString, qint64> lengths;
+    foreach(const CouchDBAttachment& attachment, attachments)
+    {
+        qint64 length = attachment.data.size();
+        if(attachment.device)
+        {
+            length = attachment.length;
+            if(length < 0 && !attachment.device->isSequential()) length = attachment.device->size() - attachment.device->pos();
+        }
+
+        if(length < 0)
+        {
+            qWarning() << "Attachment" << attachment.name << "is read from a sequential device without a length";
+
+            CouchDBQuery *query = createQuery(COUCHDB_UPDATEDOCUMENT, joinPath(database, id), database, id);
+            const CouchDBFuture future = query->future();
+            failQuery(query, COUCHDB_ERROR);
+            return future;
+        }
+
+        attachmentsByName.insert(attachment.name, attachment);
+        lengths.insert(attachment.name, length);
+    }
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1/%2/%3?rev=%4").arg(d->server->baseURL(), database, id, revision));
-    query->setOperation(COUCHDB_DELETEDOCUMENT);
-    query->setDatabase(database);
-    query->setDocumentID(id);
+    //Stubs marked "follows" announce the parts after the document
+    QJsonObject object = QJsonDocument::fromJson(document).object();
+    QJsonObject stubs = object.value("_attachments").toObject();
+    foreach(const CouchDBAttachment& attachment, attachmentsByName)
+    {
+        QJsonObject stub;
+        stub.insert("follows", true);
+        stub.insert("content_type", QString::fromLatin1(attachment.contentType));
+        stub.insert("length", double(lengths.value(attachment.name)));
+        stubs.insert(attachment.name, stub);
+    }
+    object.insert("_attachments", stubs);
 
-    executeQuery(query);
+    QHttpMultiPart *multiPart = new QHttpMultiPart(QHttpMultiPart::RelatedType);
+
+    QHttpPart documentPart;
+    documentPart.setHeader(QNetworkRequest::ContentTypeHeader, QByteArrayLiteral("application/json"));
+    documentPart.setBody(QJsonDocument(object).toJson(QJsonDocument::Compact));
+    multiPart->append(documentPart);
+
+    //The server pairs parts with stubs in the order they appear in the document, which QJsonObject keeps sorted by name
+    foreach(const QString& name, stubs.keys())
+    {
+        if(!attachmentsByName.contains(name)) continue;
+        const CouchDBAttachment attachment = attachmentsByName.value(name);
+
+        QHttpPart part;
+        part.setHeader(QNetworkRequest::ContentTypeHeader, attachment.contentType);
+        part.setRawHeader(QByteArrayLiteral("Content-Disposition"), QByteArrayLiteral("attachment; filename=\"") + name.toUtf8() + '"');
+        if(attachment.device) part.setBodyDevice(attachment.device);
+        else part.setBody(attachment.data);
+        multiPart->append(part);
+    }
+
+    //Streamed bodies can't go through the write-ahead log, the upload is always sent directly
+    CouchDBQuery *query = createQuery(COUCHDB_UPDATEDOCUMENT, joinPath(database, id), database, id);
+    query->request()->setRawHeader(QByteArrayLiteral("Accept"), QByteArrayLiteral("application/json"));
+    query->setMultiPart(multiPart);
+
+    return executeQuery(query);
 }
 
-void CouchDB::uploadAttachment(const QString &database, const QString &id, const QString& attachmentName,
-                               QByteArray attachment, QString mimeType, const QString& revision)
+CouchDBFuture CouchDB::upsertDocument(const QString &database, const QString &id, QByteArray document)
 {
     Q_D(CouchDB);
 
-    QByteArray postDataSize = QByteArray::number(attachment.size());
+    const QString revision = d->revisionTable->revision(database, id);
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1/%2/%3/%4?rev=%5").arg(d->server->baseURL(), database, id, attachmentName, revision));
-    query->setOperation(COUCHDB_DELETEDOCUMENT);
-    query->setDatabase(database);
-    query->setDocumentID(id);
-    query->request()->setRawHeader("Content-Type", mimeType.toLatin1());
-    query->request()->setRawHeader("Content-Length", postDataSize);
-    query->setBody(attachment);
+    if(d->useWriteQueue())
+    {
+        return queueWrite(COUCHDB_UPDATEDOCUMENT, database, id, QString(), injectRevision(document, revision));
+    }
 
-    executeQuery(query);
+    CouchDBQuery *query = createQuery(COUCHDB_UPSERTDOCUMENT, joinPath(database, id), database, id);
+    query->setRevision(revision);
+    query->request()->setRawHeader(QByteArrayLiteral("Accept"), QByteArrayLiteral("application/json"));
+    query->request()->setRawHeader(QByteArrayLiteral("Content-Type"), QByteArrayLiteral("application/json"));
+    query->setBody(document);
+
+    return executeQuery(query);
 }
 
-void CouchDB::deleteAttachment(const QString &database, const QString &id, const QString &attachmentName, const QString &revision)
+CouchDBFuture CouchDB::deleteDocument(const QString &database, const QString &id, const QString &revision)
 {
     Q_D(CouchDB);
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1/%2/%3/%4?rev=%5").arg(d->server->baseURL(), database, id, attachmentName, revision));
-    query->setOperation(COUCHDB_DELETEATTACHMENT);
-    query->setDatabase(database);
-    query->setDocumentID(id);
+    if(d->useWriteQueue())
+    {
+        return queueWrite(COUCHDB_DELETEDOCUMENT, database, id, revision, QByteArray());
+    }
 
-    executeQuery(query);
+    CouchDBQuery *query = createQuery(COUCHDB_DELETEDOCUMENT, joinPath(database, id) + QStringLiteral("?rev=") + revision, database, id);
+    query->setRevision(revision);
+
+    return executeQuery(query);
 }
 
-void CouchDB::replicateDatabaseFrom(CouchDBServer *sourceServer, const QString& sourceDatabase, const QString& targetDatabase,
-                                    const bool& createTarget, const bool& continuous, const bool& cancel)
+CouchDBFuture CouchDB::uploadAttachment(const QString &database, const QString &id, const QString& attachmentName,
+                                        QByteArray attachment, QString mimeType, const QString& revision)
+{
+    CouchDBQuery *query = createQuery(COUCHDB_UPLOADATTACHMENT, joinPath(database, id, attachmentName) + QStringLiteral("?rev=") + revision, database, id);
+    query->request()->setRawHeader(QByteArrayLiteral("Content-Type"), mimeType.toLatin1());
+    query->setBody(attachment);
+
+    return executeQuery(query);
+}
+
+CouchDBFuture CouchDB::deleteAttachment(const QString &database, const QString &id, const QString &attachmentName, const QString &revision)
+{
+    CouchDBQuery *query = createQuery(COUCHDB_DELETEATTACHMENT, joinPath(database, id, attachmentName) + QStringLiteral("?rev=") + revision, database, id);
+
+    return executeQuery(query);
+}
+
+CouchDBFuture CouchDB::replicateDatabaseFrom(CouchDBServer *sourceServer, const QString& sourceDatabase, const QString& targetDatabase,
+                                             const bool& createTarget, const bool& continuous, const bool& cancel)
 {
     Q_D(CouchDB);
 
     QString source = QString("%1/%2").arg(sourceServer->baseURL(true), sourceDatabase);
     QString target = d->server->url().contains("localhost") ? targetDatabase : QString("%1/%2").arg(d->server->baseURL(true), targetDatabase);
 
-    replicateDatabase(source, target, targetDatabase, createTarget, continuous, cancel);
+    return replicateDatabase(source, target, targetDatabase, createTarget, continuous, cancel);
 }
 
-void CouchDB::replicateDatabaseTo(CouchDBServer *targetServer, const QString& sourceDatabase, const QString& targetDatabase,
-                                    const bool& createTarget, const bool& continuous, const bool& cancel)
+CouchDBFuture CouchDB::replicateDatabaseTo(CouchDBServer *targetServer, const QString& sourceDatabase, const QString& targetDatabase,
+                                           const bool& createTarget, const bool& continuous, const bool& cancel)
 {
     Q_D(CouchDB);
 
     QString source = d->server->url().contains("localhost") ? sourceDatabase : QString("%1/%2").arg(d->server->baseURL(true), sourceDatabase);
     QString target = QString("%1/%2").arg(targetServer->baseURL(true), targetDatabase);
 
-    replicateDatabase(source, target, targetDatabase, createTarget, continuous, cancel);
+    return replicateDatabase(source, target, targetDatabase, createTarget, continuous, cancel);
 }
 
-void CouchDB::replicateDatabase(const QString &source, const QString &target, const QString& database, const bool &createTarget,
-                                const bool &continuous, const bool &cancel)
+CouchDBFuture CouchDB::replicateDatabase(const QString &source, const QString &target, const QString& database, const bool &createTarget,
+                                         const bool &continuous, const bool &cancel)
 {
-    Q_D(CouchDB);
-
     if(!cancel) qDebug() << "Starting replication from" << source << "to" << target;
     else qDebug() << "Cancelling replication from" << source << "to" << target;
 
@@ -453,23 +1431,23 @@ void CouchDB::replicateDatabase(const QString &source, const QString &target, co
     object.insert("cancel", cancel);
     QJsonDocument document(object);
 
-    CouchDBQuery *query = new CouchDBQuery(d->server, this);
-    query->setUrl(QString("%1/_replicate").arg(d->server->baseURL(true)));
-    query->setOperation(COUCHDB_REPLICATEDATABASE);
-    query->setDatabase(database);
-    query->request()->setRawHeader("Accept", "application/json");
-    query->request()->setRawHeader("Content-Type", "application/json");
+    CouchDBQuery *query = createQuery(COUCHDB_REPLICATEDATABASE, QStringLiteral("/_replicate"), database);
+    query->request()->setRawHeader(QByteArrayLiteral("Accept"), QByteArrayLiteral("application/json"));
+    query->request()->setRawHeader(QByteArrayLiteral("Content-Type"), QByteArrayLiteral("application/json"));
     query->setBody(document.toJson());
 
-    executeQuery(query);
+    return executeQuery(query);
 }
 
 CouchDBListener* CouchDB::createListener(const QString &database, const QString &documentID)
 {
     Q_D(CouchDB);
 
-    CouchDBListener *listener = new CouchDBListener(d->server);
+    CouchDBListener *listener = new CouchDBListener(d->sendServerFor(COUCHDB_LISTDOCUMENTS));
     listener->setCookieJar(d->networkManager->cookieJar());
+    listener->setRevisionTable(d->revisionTable);
+    listener->setTimingWheel(d->timingWheel);
+    listener->setCluster(d->cluster);
     d->networkManager->cookieJar()->setParent(0);
     listener->setDatabase(database);
     listener->setDocumentID(documentID);
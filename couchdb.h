@@ -6,12 +6,24 @@
 
 #include "couchdbenums.h"
 #include "couchdbresponse.h"
+#include "couchdbfuture.h"
+#include "couchdbjson.h"
+#include "couchdbmultipart.h"
+#include "couchdboperationstatistics.h"
+
+#include <type_traits>
+#include <functional>
 
 class QQmlEngine;
 class QJSEngine;
 class CouchDBListener;
 class CouchDBQuery;
 class CouchDBServer;
+class CouchDBWriteQueue;
+struct CouchDBWriteQueueEntry;
+class CouchDBRevisionTable;
+class CouchDBTimingWheel;
+class CouchDBCluster;
 class CouchDBPrivate;
 class CouchDB : public QObject
 {
@@ -27,6 +39,57 @@ public:
     void setServer(CouchDBServer *server);
     void setServerConfiguration(const QString& url, const int& port, const QString& username = "", const QString& password = "");
 
+    CouchDBWriteQueue *writeQueue() const;
+    bool setWriteAheadLog(const QString& path);
+    bool isOffline() const;
+
+    CouchDBRevisionTable *revisionTable() const;
+    CouchDBTimingWheel *timingWheel() const;
+
+    //With a cluster set, reads are routed to the fastest healthy node and writes to the preferred one, failing over on errors
+    CouchDBCluster *cluster() const;
+    void setCluster(CouchDBCluster *cluster);
+
+    //Priority given to the queries of later calls, used when their server has a rate limiter
+    CouchDBPriority priority() const;
+    void setPriority(const CouchDBPriority& priority);
+
+    //Latencies of the calls made so far by operation, see CouchDBStatsPoller to follow them next to the server statistics
+    QMap<CouchDBOperation, CouchDBOperationStatistics> operationStatistics() const;
+    CouchDBOperationStatistics operationStatistics(const CouchDBOperation& operation) const;
+    void resetOperationStatistics();
+
+    //Document and attachments written in one multipart request, creating a single revision
+    CouchDBFuture updateDocumentWithAttachments(const QString& database, const QString& documentID, const QByteArray& document,
+                                                const QList<CouchDBAttachment>& attachments);
+
+    //Typed documents: any Q_GADGET is written and read through its Q_PROPERTY list, see CouchDBJson
+    template<typename T>
+    typename std::enable_if<std::is_void<typename T::QtGadgetHelper>::value, CouchDBFuture>::type
+    updateDocument(const QString& database, const QString& documentID, const T& document)
+    {
+        return updateDocument(database, documentID, CouchDBJson::write(document));
+    }
+
+    template<typename T>
+    typename std::enable_if<std::is_void<typename T::QtGadgetHelper>::value, CouchDBFuture>::type
+    upsertDocument(const QString& database, const QString& documentID, const T& document)
+    {
+        return upsertDocument(database, documentID, CouchDBJson::write(document));
+    }
+
+    //The document is default constructed when the call fails
+    template<typename T>
+    typename std::enable_if<std::is_void<typename T::QtGadgetHelper>::value, CouchDBFuture>::type
+    retrieveDocument(const QString& database, const QString& documentID, const std::function<void(const T&, const CouchDBResponse&)>& continuation)
+    {
+        return retrieveDocument(database, documentID).then([continuation](const CouchDBResponse& response) {
+            T document;
+            if(response.status() == COUCHDB_SUCCESS) CouchDBJson::read(response.data(), &document);
+            continuation(document, response);
+        });
+    }
+
 signals:
     void installationChecked(const CouchDBResponse& response);
     void sessionStarted(const CouchDBResponse& response);
@@ -36,48 +99,75 @@ signals:
     void databaseDeleted(const CouchDBResponse& response);
     void documentsListed(const CouchDBResponse& response);
     void revisionRetrieved(const CouchDBResponse& response);
+    void revisionsRetrieved(const CouchDBResponse& response);
     void documentRetrieved(const CouchDBResponse& response);
     void documentUpdated(const CouchDBResponse& response);
     void documentDeleted(const CouchDBResponse& response);
     void attachmentUploaded(const CouchDBResponse& response);
     void attachmentDeleted(const CouchDBResponse& response);
     void databaseReplicated(const CouchDBResponse& response);
+    void writeQueueFlushed(const CouchDBResponse& response);
+    //A write already reported as COUCHDB_QUEUED was refused by the server when flushed, the data holds its error
+    void queuedWriteRejected(const CouchDBResponse& response);
 
 public slots:
-    Q_INVOKABLE void checkInstallation();
-
-    Q_INVOKABLE void startSession(const QString& username, const QString& password);
-    Q_INVOKABLE void endSession();
-
-    Q_INVOKABLE void listDatabases();
-    Q_INVOKABLE void createDatabase(const QString& database);
-    Q_INVOKABLE void deleteDatabase(const QString& database);
-
-    Q_INVOKABLE void listDocuments(const QString& database);
-    Q_INVOKABLE void retrieveRevision(const QString& database, const QString& documentID);
-    Q_INVOKABLE void retrieveDocument(const QString& database, const QString& documentID);
-    Q_INVOKABLE void updateDocument(const QString& database, const QString& documentID, QByteArray document);
-    Q_INVOKABLE void deleteDocument(const QString& database, const QString& documentID, const QString& revision);
-
-    Q_INVOKABLE void uploadAttachment(const QString& database, const QString& documentID, const QString &attachmentName, QByteArray attachment,
-                                      QString mimeType, const QString &revision);
-    Q_INVOKABLE void deleteAttachment(const QString& database, const QString& documentID, const QString &attachmentName, const QString &revision);
-
-    Q_INVOKABLE void replicateDatabaseFrom(CouchDBServer *sourceServer, const QString& sourceDatabase, const QString& targetDatabase,
-                                           const bool& createTarget, const bool& continuous, const bool& cancel = false);
-    Q_INVOKABLE void replicateDatabaseTo(CouchDBServer *targetServer, const QString& sourceDatabase, const QString& targetDatabase,
-                                         const bool& createTarget, const bool& continuous, const bool& cancel = false);
+    //Every call returns a future resolved only for its caller, alongside the broadcast signal of its operation
+    Q_INVOKABLE CouchDBFuture checkInstallation();
+
+    Q_INVOKABLE CouchDBFuture startSession(const QString& username, const QString& password);
+    Q_INVOKABLE CouchDBFuture endSession();
+
+    Q_INVOKABLE CouchDBFuture listDatabases();
+    Q_INVOKABLE CouchDBFuture createDatabase(const QString& database);
+    Q_INVOKABLE CouchDBFuture deleteDatabase(const QString& database);
+
+    Q_INVOKABLE CouchDBFuture listDocuments(const QString& database);
+    Q_INVOKABLE CouchDBFuture retrieveRevision(const QString& database, const QString& documentID);
+    //Current revisions of many documents through _all_docs keys, a few requests instead of one HEAD per document
+    Q_INVOKABLE CouchDBFuture retrieveRevisions(const QString& database, const QStringList& documentIDs);
+    Q_INVOKABLE CouchDBFuture retrieveDocument(const QString& database, const QString& documentID);
+    //Document and its attachments in one multipart response, skipping attachments unchanged since any of the known revisions
+    Q_INVOKABLE CouchDBFuture retrieveDocumentWithAttachments(const QString& database, const QString& documentID,
+                                                              const QStringList& knownRevisions = QStringList());
+    Q_INVOKABLE CouchDBFuture updateDocument(const QString& database, const QString& documentID, QByteArray document);
+    Q_INVOKABLE CouchDBFuture deleteDocument(const QString& database, const QString& documentID, const QString& revision);
+    Q_INVOKABLE CouchDBFuture upsertDocument(const QString& database, const QString& documentID, QByteArray document);
+
+    Q_INVOKABLE CouchDBFuture uploadAttachment(const QString& database, const QString& documentID, const QString &attachmentName, QByteArray attachment,
+                                               QString mimeType, const QString &revision);
+    Q_INVOKABLE CouchDBFuture deleteAttachment(const QString& database, const QString& documentID, const QString &attachmentName, const QString &revision);
+
+    Q_INVOKABLE CouchDBFuture replicateDatabaseFrom(CouchDBServer *sourceServer, const QString& sourceDatabase, const QString& targetDatabase,
+                                                    const bool& createTarget, const bool& continuous, const bool& cancel = false);
+    Q_INVOKABLE CouchDBFuture replicateDatabaseTo(CouchDBServer *targetServer, const QString& sourceDatabase, const QString& targetDatabase,
+                                                  const bool& createTarget, const bool& continuous, const bool& cancel = false);
 
     Q_INVOKABLE CouchDBListener* createListener(const QString& database, const QString& documentID);
 
 private slots:
+    void queryReadyRead();
+    void queryUploadProgress();
     void queryFinished();
     void queryTimeout();
+    void writeQueueCommitted();
+    void flushWriteQueue();
 
 protected:
-    void executeQuery(CouchDBQuery *query);
-
-    void replicateDatabase(const QString& source, const QString& target, const QString &database, const bool& createTarget, const bool& continuous, const bool& cancel = false);
+    CouchDBQuery *createQuery(const CouchDBOperation& operation, const QString& path, const QString& database = QString(),
+                              const QString& documentID = QString());
+    void releaseQuery(CouchDBQuery *query);
+    bool failover(CouchDBQuery *query);
+    //False when the query was left to the rate limiter of its server, which sends it later, or shed
+    bool admitQuery(CouchDBQuery *query);
+    void failQuery(CouchDBQuery *query, const CouchDBReplyStatus& status);
+    CouchDBFuture executeQuery(CouchDBQuery *query);
+
+    CouchDBFuture replicateDatabase(const QString& source, const QString& target, const QString &database, const bool& createTarget, const bool& continuous, const bool& cancel = false);
+
+    CouchDBFuture queueWrite(const CouchDBOperation& operation, const QString& database, const QString& documentID, const QString& revision,
+                             const QByteArray& document, const CouchDBFuture& future = CouchDBFuture());
+    bool handleOffline(CouchDBQuery *query);
+    void rejectQueuedWrite(const CouchDBWriteQueueEntry& entry, const QByteArray& result);
 
 private:
     Q_DECLARE_PRIVATE(CouchDB)
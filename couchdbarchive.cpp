@@ -0,0 +1,653 @@
+#include "couchdbarchive.h"
+#include "couchdbserver.h"
+#include "couchdbscanner.h"
+
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+#include <QCryptographicHash>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QFile>
+#include <QPointer>
+#include <QHash>
+#include <QUrl>
+#include <QtEndian>
+#include <QDebug>
+
+namespace
+{
+    enum Mode
+    {
+        MODE_IDLE,
+        MODE_EXPORT,
+        MODE_IMPORT
+    };
+
+    enum ChunkStatus
+    {
+        CHUNK_OK,
+        CHUNK_END,
+        CHUNK_TRUNCATED,
+        CHUNK_CORRUPT
+    };
+
+    const char archiveMagic[] = "TCDBARC1";
+    const int archiveMagicSize = 8;
+    const int chunkHeaderSize = 14; //quint32 payload size + quint32 partition + quint32 documents + quint16 key size
+    const int checksumSize = 16;
+    const quint32 endPartition = 0xFFFFFFFF; //Partition of the record closing a complete archive
+    const quint32 maxPayloadSize = 256 * 1024 * 1024;
+    const int maxRetries = 3;
+
+    struct Chunk
+    {
+        quint32 partition;
+        quint32 documentCount;
+        QString lastKey;
+        QByteArray payload;
+    };
+
+    struct Batch
+    {
+        qint64 offset;
+        int documentCount;
+        QByteArray body;
+        int retries;
+    };
+
+    //Header, last key and payload are covered by the MD5 that follows the key
+    QByteArray encodeChunk(const quint32& partition, const quint32& documentCount, const QString& lastKey, const QByteArray& payload)
+    {
+        const QByteArray key = lastKey.toUtf8().left(0xFFFF);
+
+        QByteArray header(chunkHeaderSize, Qt::Uninitialized);
+        uchar *data = reinterpret_cast<uchar*>(header.data());
+        qToBigEndian<quint32>(payload.size(), data);
+        qToBigEndian<quint32>(partition, data + 4);
+        qToBigEndian<quint32>(documentCount, data + 8);
+        qToBigEndian<quint16>(key.size(), data + 12);
+
+        QCryptographicHash hash(QCryptographicHash::Md5);
+        hash.addData(header);
+        hash.addData(key);
+        hash.addData(payload);
+
+        QByteArray chunk;
+        chunk.reserve(chunkHeaderSize + key.size() + checksumSize + payload.size());
+        chunk.append(header).append(key).append(hash.result()).append(payload);
+        return chunk;
+    }
+
+    ChunkStatus readChunk(QFile& file, Chunk *chunk)
+    {
+        const QByteArray header = file.read(chunkHeaderSize);
+        if(header.isEmpty()) return CHUNK_END;
+        if(header.size() < chunkHeaderSize) return CHUNK_TRUNCATED;
+
+        const uchar *data = reinterpret_cast<const uchar*>(header.constData());
+        const quint32 payloadSize = qFromBigEndian<quint32>(data);
+        if(payloadSize > maxPayloadSize) return CHUNK_CORRUPT;
+
+        const QByteArray key = file.read(qFromBigEndian<quint16>(data + 12));
+        const QByteArray checksum = file.read(checksumSize);
+        const QByteArray payload = file.read(payloadSize);
+        if(key.size() != qFromBigEndian<quint16>(data + 12) || checksum.size() != checksumSize || payload.size() != int(payloadSize)) return CHUNK_TRUNCATED;
+
+        QCryptographicHash hash(QCryptographicHash::Md5);
+        hash.addData(header);
+        hash.addData(key);
+        hash.addData(payload);
+        if(hash.result() != checksum) return CHUNK_CORRUPT;
+
+        chunk->partition = qFromBigEndian<quint32>(data + 4);
+        chunk->documentCount = qFromBigEndian<quint32>(data + 8);
+        chunk->lastKey = QString::fromUtf8(key);
+        chunk->payload = payload;
+        return CHUNK_OK;
+    }
+
+    //Magic, then the size of the JSON header and the header itself
+    bool readHeader(QFile& file, QJsonObject *header)
+    {
+        if(file.read(archiveMagicSize) != QByteArray(archiveMagic, archiveMagicSize)) return false;
+
+        const QByteArray size = file.read(4);
+        if(size.size() != 4) return false;
+
+        const quint32 headerSize = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(size.constData()));
+        if(headerSize > maxPayloadSize) return false;
+
+        const QJsonDocument document = QJsonDocument::fromJson(file.read(headerSize));
+        if(!document.isObject()) return false;
+
+        *header = document.object();
+        return true;
+    }
+}
+
+class CouchDBArchivePrivate
+{
+public:
+    CouchDBArchivePrivate(CouchDBServer *s) :
+        server(s),
+        networkManager(0),
+        scanner(0),
+        includeAttachments(false),
+        compressionLevel(-1),
+        maxInFlight(4),
+        mode(MODE_IDLE),
+        headerWritten(false),
+        readEnded(false),
+        complete(false),
+        readOffset(0),
+        waitingBatches(0),
+        generation(0),
+        documentCount(0),
+        rejectedCount(0)
+    {}
+
+    virtual ~CouchDBArchivePrivate()
+    {
+        if(scanner) delete scanner;
+        if(networkManager) delete networkManager;
+    }
+
+    bool write(const QByteArray& data)
+    {
+        return file.write(data) == data.size() && file.flush();
+    }
+
+    bool loadExport(QStringList *splitKeys, QStringList *resumeKeys, QString *error);
+    void sendBatch(CouchDBArchive *archive, const Batch& batch);
+
+    QPointer<CouchDBServer> server; //Archive doesn't own server
+    QNetworkAccessManager *networkManager;
+    CouchDBScanner *scanner;
+    bool includeAttachments;
+    int compressionLevel;
+    int maxInFlight;
+    Mode mode;
+    QString database;
+    QString path;
+    QFile file;
+    bool headerWritten;
+    bool readEnded;
+    bool complete;
+    qint64 readOffset;
+    QList<qint64> pendingOffsets; //Chunks read but not acknowledged yet, in file order
+    QHash<QNetworkReply*, Batch> batches;
+    int waitingBatches; //Batches held back by the rate limiter, in flight as far as reading ahead goes
+    int generation; //Bumped on abort
+    qint64 documentCount;
+    qint64 rejectedCount;
+};
+
+//Verifies the chunks already written and drops anything after the last good one
+bool CouchDBArchivePrivate::loadExport(QStringList *splitKeys, QStringList *resumeKeys, QString *error)
+{
+    QJsonObject header;
+    if(!readHeader(file, &header))
+    {
+        *error = QStringLiteral("Not an archive");
+        return false;
+    }
+    if(header.value(QStringLiteral("database")).toString() != database)
+    {
+        *error = QStringLiteral("Archive holds database %1").arg(header.value(QStringLiteral("database")).toString());
+        return false;
+    }
+
+    foreach(const QJsonValue& key, header.value(QStringLiteral("splitKeys")).toArray()) splitKeys->append(key.toString());
+    includeAttachments = header.value(QStringLiteral("attachments")).toBool();
+    for(int i = 0; i <= splitKeys->size(); ++i) resumeKeys->append(QString());
+
+    qint64 validEnd = file.pos();
+    Chunk chunk;
+    ChunkStatus status;
+    while((status = readChunk(file, &chunk)) == CHUNK_OK)
+    {
+        validEnd = file.pos();
+        if(chunk.partition == endPartition)
+        {
+            complete = true;
+            break;
+        }
+        if(int(chunk.partition) < resumeKeys->size()) (*resumeKeys)[chunk.partition] = chunk.lastKey;
+        documentCount += chunk.documentCount;
+    }
+
+    if(status == CHUNK_TRUNCATED || status == CHUNK_CORRUPT) qWarning() << "Dropping the end of" << path << "from offset" << validEnd;
+
+    if(!file.resize(validEnd) || !file.seek(validEnd))
+    {
+        *error = file.errorString();
+        return false;
+    }
+    return true;
+}
+
+void CouchDBArchivePrivate::sendBatch(CouchDBArchive *archive, const Batch& batch)
+{
+    if(!server) return;
+
+    waitingBatches++;
+    const int current = generation;
+    server->submit(true, COUCHDB_PRIORITY_LOW, archive, [this, archive, batch, current]() {
+        if(!server || generation != current) return;
+        waitingBatches--;
+
+        QNetworkRequest request(QUrl(server->baseURL(false) + QStringLiteral("/%1/_bulk_docs").arg(database)));
+        request.setRawHeader("Accept", "application/json");
+        request.setRawHeader("Content-Type", "application/json");
+        if(server->hasCredential()) request.setRawHeader("Authorization", server->authorizationHeader());
+
+        QNetworkReply *reply = networkManager->post(request, batch.body);
+        QObject::connect(reply, SIGNAL(finished()), archive, SLOT(replyFinished()));
+        batches.insert(reply, batch);
+    });
+}
+
+CouchDBArchive::CouchDBArchive(CouchDBServer *server, QObject *parent) :
+    QObject(parent),
+    d_ptr(new CouchDBArchivePrivate(server))
+{
+    Q_D(CouchDBArchive);
+
+    d->networkManager = new QNetworkAccessManager(this);
+
+    d->scanner = new CouchDBScanner(server, this);
+    d->scanner->setIncludeDocuments(true);
+    connect(d->scanner, SIGNAL(partitionsPlanned(QString,QStringList)), this, SLOT(partitionsPlanned(QString,QStringList)));
+    connect(d->scanner, SIGNAL(pageReceived(int,CouchDBJsonView)), this, SLOT(pageReceived(int,CouchDBJsonView)));
+    connect(d->scanner, SIGNAL(scanFinished(QString,qint64)), this, SLOT(scanFinished()));
+    connect(d->scanner, SIGNAL(scanFailed(QString,QString)), this, SLOT(scanFailed(QString,QString)));
+}
+
+CouchDBArchive::~CouchDBArchive()
+{
+    abort();
+    delete d_ptr;
+}
+
+int CouchDBArchive::partitions() const
+{
+    Q_D(const CouchDBArchive);
+    return d->scanner->partitions();
+}
+
+void CouchDBArchive::setPartitions(const int &partitions)
+{
+    Q_D(CouchDBArchive);
+    d->scanner->setPartitions(partitions);
+}
+
+int CouchDBArchive::chunkSize() const
+{
+    Q_D(const CouchDBArchive);
+    return d->scanner->pageSize();
+}
+
+void CouchDBArchive::setChunkSize(const int &chunkSize)
+{
+    Q_D(CouchDBArchive);
+    d->scanner->setPageSize(chunkSize);
+}
+
+bool CouchDBArchive::includeAttachments() const
+{
+    Q_D(const CouchDBArchive);
+    return d->includeAttachments;
+}
+
+void CouchDBArchive::setIncludeAttachments(const bool &includeAttachments)
+{
+    Q_D(CouchDBArchive);
+    d->includeAttachments = includeAttachments;
+}
+
+int CouchDBArchive::compressionLevel() const
+{
+    Q_D(const CouchDBArchive);
+    return d->compressionLevel;
+}
+
+void CouchDBArchive::setCompressionLevel(const int &compressionLevel)
+{
+    Q_D(CouchDBArchive);
+    d->compressionLevel = qBound(-1, compressionLevel, 9);
+}
+
+int CouchDBArchive::maxInFlight() const
+{
+    Q_D(const CouchDBArchive);
+    return d->maxInFlight;
+}
+
+void CouchDBArchive::setMaxInFlight(const int &maxInFlight)
+{
+    Q_D(CouchDBArchive);
+    d->maxInFlight = qMax(1, maxInFlight);
+}
+
+bool CouchDBArchive::isRunning() const
+{
+    Q_D(const CouchDBArchive);
+    return d->mode != MODE_IDLE;
+}
+
+qint64 CouchDBArchive::resumeOffset() const
+{
+    Q_D(const CouchDBArchive);
+    return d->pendingOffsets.isEmpty() ? d->readOffset : d->pendingOffsets.first();
+}
+
+void CouchDBArchive::exportDatabase(const QString &database, const QString &path, const bool &resume)
+{
+    Q_D(CouchDBArchive);
+
+    abort();
+    d->mode = MODE_EXPORT;
+    d->database = database;
+    d->path = path;
+    d->documentCount = 0;
+    d->complete = false;
+    d->file.setFileName(path);
+
+    //A file the previous run created without writing its header yet is started over
+    if(resume && d->file.exists() && d->file.size() > 0)
+    {
+        QStringList splitKeys;
+        QStringList resumeKeys;
+        QString error;
+        if(!d->file.open(QIODevice::ReadWrite) || !d->loadExport(&splitKeys, &resumeKeys, &error))
+        {
+            if(error.isEmpty()) error = d->file.errorString();
+            abort();
+            emit failed(path, error);
+            return;
+        }
+
+        if(d->complete)
+        {
+            const qint64 documentCount = d->documentCount;
+            abort();
+            emit exportFinished(database, path, documentCount);
+            return;
+        }
+
+        qDebug() << "Resuming export of" << database << "with" << d->documentCount << "documents already in" << path;
+        d->headerWritten = true;
+        d->scanner->setIncludeAttachments(d->includeAttachments);
+        d->scanner->resume(database, splitKeys, resumeKeys);
+        return;
+    }
+
+    if(!d->file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        const QString error = d->file.errorString();
+        abort();
+        emit failed(path, error);
+        return;
+    }
+
+    d->headerWritten = false;
+    d->scanner->setIncludeAttachments(d->includeAttachments);
+    d->scanner->scan(database);
+}
+
+void CouchDBArchive::importDatabase(const QString &path, const QString &database, const qint64 &offset)
+{
+    Q_D(CouchDBArchive);
+
+    abort();
+    d->mode = MODE_IMPORT;
+    d->database = database;
+    d->path = path;
+    d->documentCount = 0;
+    d->rejectedCount = 0;
+    d->readEnded = false;
+    d->complete = false;
+    d->pendingOffsets.clear();
+    d->file.setFileName(path);
+
+    QJsonObject header;
+    if(!d->file.open(QIODevice::ReadOnly) || !readHeader(d->file, &header) || (offset > d->file.pos() && !d->file.seek(offset)))
+    {
+        abort();
+        emit failed(path, QStringLiteral("Cannot read archive"));
+        return;
+    }
+
+    d->readOffset = d->file.pos();
+    replyFinished();
+}
+
+void CouchDBArchive::abort()
+{
+    Q_D(CouchDBArchive);
+
+    if(d->mode == MODE_EXPORT) d->scanner->abort();
+
+    d->generation++;
+    d->waitingBatches = 0;
+
+    QHash<QNetworkReply*, Batch> batches;
+    batches.swap(d->batches);
+    foreach(QNetworkReply *reply, batches.keys())
+    {
+        disconnect(reply, 0, this, 0);
+        reply->abort();
+        reply->deleteLater();
+    }
+
+    if(d->file.isOpen()) d->file.close();
+    d->mode = MODE_IDLE;
+}
+
+void CouchDBArchive::partitionsPlanned(const QString &database, const QStringList &splitKeys)
+{
+    Q_D(CouchDBArchive);
+
+    if(d->mode != MODE_EXPORT || d->headerWritten) return;
+
+    QJsonObject header;
+    header.insert(QStringLiteral("database"), database);
+    header.insert(QStringLiteral("splitKeys"), QJsonArray::fromStringList(splitKeys));
+    header.insert(QStringLiteral("attachments"), d->includeAttachments);
+    const QByteArray json = QJsonDocument(header).toJson(QJsonDocument::Compact);
+
+    QByteArray data(archiveMagic, archiveMagicSize);
+    QByteArray size(4, Qt::Uninitialized);
+    qToBigEndian<quint32>(json.size(), reinterpret_cast<uchar*>(size.data()));
+    data.append(size).append(json);
+
+    if(!d->write(data))
+    {
+        scanFailed(database, d->file.errorString());
+        return;
+    }
+    d->headerWritten = true;
+}
+
+void CouchDBArchive::pageReceived(const int &partition, const CouchDBJsonView &rows)
+{
+    Q_D(CouchDBArchive);
+
+    if(d->mode != MODE_EXPORT) return;
+
+    QByteArray lines;
+    quint32 count = 0;
+    foreach(const CouchDBJsonView& row, rows.elements())
+    {
+        const CouchDBJsonView document = row.value(QStringLiteral("doc"));
+        if(!document.isObject()) continue;
+
+        //One document per line, the server may format bodies over several
+        QByteArray raw = document.raw();
+        if(raw.contains('\n')) raw = QJsonDocument(document.toObject()).toJson(QJsonDocument::Compact);
+
+        lines.append(raw).append('\n');
+        count++;
+    }
+
+    const QString lastKey = rows.at(rows.size() - 1).value(QStringLiteral("key")).toString();
+    if(!d->write(encodeChunk(partition, count, lastKey, qCompress(lines, d->compressionLevel))))
+    {
+        scanFailed(d->database, d->file.errorString());
+        return;
+    }
+
+    d->documentCount += count;
+    emit progress(d->documentCount);
+}
+
+void CouchDBArchive::scanFinished()
+{
+    Q_D(CouchDBArchive);
+
+    if(d->mode != MODE_EXPORT) return;
+
+    if(!d->write(encodeChunk(endPartition, quint32(d->documentCount), QString(), QByteArray())))
+    {
+        scanFailed(d->database, d->file.errorString());
+        return;
+    }
+
+    const QString database = d->database;
+    const QString path = d->path;
+    const qint64 documentCount = d->documentCount;
+    abort();
+    emit exportFinished(database, path, documentCount);
+}
+
+void CouchDBArchive::scanFailed(const QString &database, const QString &error)
+{
+    Q_D(CouchDBArchive);
+
+    if(d->mode != MODE_EXPORT) return;
+
+    //The file is kept, exportDatabase with resume set continues it
+    qWarning() << "Export of" << database << "failed:" << error;
+    const QString path = d->path;
+    abort();
+    emit failed(path, error);
+}
+
+void CouchDBArchive::replyFinished()
+{
+    Q_D(CouchDBArchive);
+
+    //Also called without a reply to start an import
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if(reply)
+    {
+        reply->deleteLater();
+        if(!d->batches.contains(reply)) return;
+
+        Batch batch = d->batches.take(reply);
+        if(d->server) d->server->recordReply(reply);
+        if(reply->error() != QNetworkReply::NoError)
+        {
+            if(batch.retries++ < maxRetries)
+            {
+                qWarning() << "Retrying chunk at offset" << batch.offset << "of" << d->path << ":" << reply->errorString();
+                d->sendBatch(this, batch);
+                return;
+            }
+
+            qWarning() << "Import of" << d->path << "failed:" << reply->errorString();
+            const QString path = d->path;
+            const QString error = reply->errorString();
+            abort();
+            emit failed(path, error);
+            return;
+        }
+
+        //With new_edits=false only rejected documents are listed
+        const QList<CouchDBJsonView> rejected = CouchDBJsonView(reply->readAll()).elements();
+        d->pendingOffsets.removeOne(batch.offset);
+        d->documentCount += qMax(0, batch.documentCount - rejected.size());
+        d->rejectedCount += rejected.size();
+
+        const int generation = d->generation;
+        foreach(const CouchDBJsonView& result, rejected)
+        {
+            const QString id = result.value(QStringLiteral("id")).toString();
+            const QString reason = result.value(QStringLiteral("reason")).toString();
+            qWarning() << "Document" << id << "rejected:" << reason;
+            emit documentRejected(id, reason);
+            if(generation != d->generation) return;
+        }
+
+        emit progress(d->documentCount);
+        if(generation != d->generation) return;
+    }
+
+    if(d->mode != MODE_IMPORT) return;
+
+    //Chunks are read only as batches complete, memory stays bounded by the batches in flight
+    while(!d->readEnded && d->batches.size() + d->waitingBatches < d->maxInFlight)
+    {
+        const qint64 offset = d->file.pos();
+        Chunk chunk;
+        const ChunkStatus status = readChunk(d->file, &chunk);
+
+        if(status == CHUNK_END)
+        {
+            d->readEnded = true;
+            break;
+        }
+        if(status != CHUNK_OK)
+        {
+            const QString path = d->path;
+            abort();
+            emit failed(path, QStringLiteral("Corrupt chunk at offset %1").arg(offset));
+            return;
+        }
+
+        d->readOffset = d->file.pos();
+        if(chunk.partition == endPartition)
+        {
+            d->readEnded = true;
+            d->complete = true;
+            break;
+        }
+
+        QByteArray documents = qUncompress(chunk.payload);
+        if(documents.isEmpty() && chunk.documentCount > 0)
+        {
+            const QString path = d->path;
+            abort();
+            emit failed(path, QStringLiteral("Corrupt chunk at offset %1").arg(offset));
+            return;
+        }
+        if(documents.isEmpty()) continue;
+
+        //NDJSON lines become the docs array as is
+        documents.chop(1);
+        documents.replace('\n', ',');
+
+        Batch batch;
+        batch.offset = offset;
+        batch.documentCount = chunk.documentCount;
+        batch.retries = 0;
+        batch.body = QByteArrayLiteral("{\"new_edits\":false,\"docs\":[") + documents + QByteArrayLiteral("]}");
+
+        d->pendingOffsets.append(offset);
+        d->sendBatch(this, batch);
+    }
+
+    if(!d->readEnded || !d->batches.isEmpty() || d->waitingBatches > 0) return;
+
+    const QString path = d->path;
+    const QString database = d->database;
+    const qint64 documentCount = d->documentCount;
+    const qint64 rejectedCount = d->rejectedCount;
+    const bool complete = d->complete;
+    abort();
+
+    if(complete) emit importFinished(path, database, documentCount, rejectedCount);
+    else emit failed(path, QStringLiteral("Archive ends before its end record, its export may not have finished"));
+}
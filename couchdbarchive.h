@@ -0,0 +1,71 @@
+#ifndef COUCHDBARCHIVE_H
+#define COUCHDBARCHIVE_H
+
+#include <QObject>
+#include <QStringList>
+
+#include "couchdbjsonview.h"
+
+class CouchDBServer;
+class CouchDBArchivePrivate;
+//Streams a database to and from a file of checksummed chunks, each holding one page of documents as compressed NDJSON.
+//Exports read the database through a scanner in parallel key ranges and keep the partition boundaries in the file
+//header, so an interrupted export resumes where every partition stopped. Imports replay the chunks through _bulk_docs
+//with new_edits=false, several batches in flight, keeping the revisions of the source. The target database must exist.
+class CouchDBArchive : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CouchDBArchive(CouchDBServer *server, QObject *parent = 0);
+    virtual ~CouchDBArchive();
+
+    int partitions() const;
+    void setPartitions(const int& partitions);
+
+    //Documents per chunk, also the page size of the export scan
+    int chunkSize() const;
+    void setChunkSize(const int& chunkSize);
+
+    bool includeAttachments() const;
+    void setIncludeAttachments(const bool& includeAttachments);
+
+    //zlib level from 0 to 9, -1 for the default
+    int compressionLevel() const;
+    void setCompressionLevel(const int& compressionLevel);
+
+    //_bulk_docs requests sent at the same time while importing
+    int maxInFlight() const;
+    void setMaxInFlight(const int& maxInFlight);
+
+    bool isRunning() const;
+
+    //File offset an interrupted import continues from. Chunks are imported again from there, which new_edits=false makes harmless
+    qint64 resumeOffset() const;
+
+signals:
+    void progress(const qint64& documentCount);
+    void exportFinished(const QString& database, const QString& path, const qint64& documentCount);
+    //documentCount counts the documents written, rejectedCount those _bulk_docs refused, each reported by documentRejected
+    void importFinished(const QString& path, const QString& database, const qint64& documentCount, const qint64& rejectedCount);
+    void documentRejected(const QString& documentID, const QString& reason);
+    void failed(const QString& path, const QString& error);
+
+public slots:
+    //With resume set an existing file is checked and completed instead of replaced
+    void exportDatabase(const QString& database, const QString& path, const bool& resume = false);
+    void importDatabase(const QString& path, const QString& database, const qint64& offset = 0);
+    void abort();
+
+private slots:
+    void partitionsPlanned(const QString& database, const QStringList& splitKeys);
+    void pageReceived(const int& partition, const CouchDBJsonView& rows);
+    void scanFinished();
+    void scanFailed(const QString& database, const QString& error);
+    void replyFinished();
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBArchive)
+    CouchDBArchivePrivate * const d_ptr;
+};
+
+#endif // COUCHDBARCHIVE_H
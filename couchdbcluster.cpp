@@ -0,0 +1,284 @@
+#include "couchdbcluster.h"
+#include "couchdbserver.h"
+
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QElapsedTimer>
+#include <QPointer>
+#include <QTimer>
+#include <QHash>
+#include <QSet>
+#include <QDebug>
+
+namespace
+{
+    //Weight of the newest sample in the latency average
+    const double latencyWeight = 0.2;
+
+    struct Node
+    {
+        Node() :
+            server(0),
+            healthy(true),
+            latency(0),
+            samples(0)
+        {}
+
+        QPointer<CouchDBServer> server;
+        bool healthy;
+        double latency;
+        int samples;
+    };
+
+    struct Check
+    {
+        QPointer<CouchDBServer> server; //Node may be removed and deleted before its check finishes
+        QElapsedTimer timer;
+    };
+}
+
+class CouchDBClusterPrivate
+{
+public:
+    CouchDBClusterPrivate() :
+        networkManager(0),
+        healthTimer(0),
+        healthCheckTimeout(5000)
+    {}
+
+    virtual ~CouchDBClusterPrivate()
+    {
+        if(healthTimer) delete healthTimer;
+        if(networkManager) delete networkManager;
+    }
+
+    int indexOf(CouchDBServer *server) const
+    {
+        for(int i = 0; i < nodes.size(); ++i)
+        {
+            if(nodes.at(i).server == server) return i;
+        }
+        return -1;
+    }
+
+    QNetworkAccessManager *networkManager;
+    QTimer *healthTimer;
+    int healthCheckTimeout;
+    QList<Node> nodes;
+    QHash<QNetworkReply*, Check> checks;
+};
+
+CouchDBCluster::CouchDBCluster(QObject *parent) :
+    QObject(parent),
+    d_ptr(new CouchDBClusterPrivate)
+{
+    Q_D(CouchDBCluster);
+
+    d->networkManager = new QNetworkAccessManager(this);
+
+    d->healthTimer = new QTimer(this);
+    d->healthTimer->setInterval(10000);
+    connect(d->healthTimer, SIGNAL(timeout()), this, SLOT(checkNodes()));
+}
+
+CouchDBCluster::~CouchDBCluster()
+{
+    delete d_ptr;
+}
+
+QList<CouchDBServer *> CouchDBCluster::nodes() const
+{
+    Q_D(const CouchDBCluster);
+
+    QList<CouchDBServer*> servers;
+    foreach(const Node& node, d->nodes)
+    {
+        if(node.server) servers.append(node.server);
+    }
+    return servers;
+}
+
+void CouchDBCluster::addNode(CouchDBServer *server)
+{
+    Q_D(CouchDBCluster);
+    if(!server || d->indexOf(server) >= 0) return;
+
+    Node node;
+    node.server = server;
+    d->nodes.append(node);
+
+    if(!d->healthTimer->isActive()) d->healthTimer->start();
+}
+
+void CouchDBCluster::removeNode(CouchDBServer *server)
+{
+    Q_D(CouchDBCluster);
+
+    const int index = d->indexOf(server);
+    if(index >= 0) d->nodes.removeAt(index);
+
+    foreach(QNetworkReply *reply, d->checks.keys())
+    {
+        if(d->checks.value(reply).server != server) continue;
+
+        d->checks.remove(reply);
+        disconnect(reply, 0, this, 0);
+        reply->abort();
+        reply->deleteLater();
+    }
+}
+
+int CouchDBCluster::healthCheckInterval() const
+{
+    Q_D(const CouchDBCluster);
+    return d->healthTimer->interval();
+}
+
+void CouchDBCluster::setHealthCheckInterval(const int &msec)
+{
+    Q_D(CouchDBCluster);
+    d->healthTimer->setInterval(msec);
+}
+
+int CouchDBCluster::healthCheckTimeout() const
+{
+    Q_D(const CouchDBCluster);
+    return d->healthCheckTimeout;
+}
+
+void CouchDBCluster::setHealthCheckTimeout(const int &msec)
+{
+    Q_D(CouchDBCluster);
+    d->healthCheckTimeout = msec;
+}
+
+bool CouchDBCluster::isHealthy(CouchDBServer *server) const
+{
+    Q_D(const CouchDBCluster);
+
+    const int index = d->indexOf(server);
+    return index >= 0 && d->nodes.at(index).healthy;
+}
+
+double CouchDBCluster::latency(CouchDBServer *server) const
+{
+    Q_D(const CouchDBCluster);
+
+    const int index = d->indexOf(server);
+    return index >= 0 ? d->nodes.at(index).latency : 0;
+}
+
+CouchDBServer *CouchDBCluster::readNode(CouchDBServer *excluded) const
+{
+    Q_D(const CouchDBCluster);
+
+    CouchDBServer *best = 0;
+    double bestLatency = 0;
+    foreach(const Node& node, d->nodes)
+    {
+        if(!node.server || !node.healthy || node.server == excluded) continue;
+
+        if(!best || node.latency < bestLatency)
+        {
+            best = node.server;
+            bestLatency = node.latency;
+        }
+    }
+
+    return best;
+}
+
+CouchDBServer *CouchDBCluster::writeNode(CouchDBServer *excluded) const
+{
+    Q_D(const CouchDBCluster);
+
+    foreach(const Node& node, d->nodes)
+    {
+        if(node.server && node.healthy && node.server != excluded) return node.server;
+    }
+
+    return 0;
+}
+
+void CouchDBCluster::recordLatency(CouchDBServer *server, const qint64 &msec)
+{
+    Q_D(CouchDBCluster);
+
+    const int index = d->indexOf(server);
+    if(index < 0) return;
+
+    Node& node = d->nodes[index];
+    node.latency = node.samples == 0 ? msec : latencyWeight * msec + (1 - latencyWeight) * node.latency;
+    ++node.samples;
+
+    if(!node.healthy)
+    {
+        node.healthy = true;
+        emit nodeStatusChanged(server, true);
+    }
+}
+
+void CouchDBCluster::recordFailure(CouchDBServer *server)
+{
+    Q_D(CouchDBCluster);
+
+    const int index = d->indexOf(server);
+    if(index < 0 || !d->nodes.at(index).healthy) return;
+
+    qWarning() << "Cluster node" << server->baseURL(false) << "is unreachable";
+
+    d->nodes[index].healthy = false;
+    emit nodeStatusChanged(server, false);
+}
+
+void CouchDBCluster::checkNodes()
+{
+    Q_D(CouchDBCluster);
+
+    //Nodes still being checked are skipped, their check is aborted on its own deadline
+    QSet<CouchDBServer*> pending;
+    foreach(const Check& check, d->checks) pending.insert(check.server);
+
+    //Same request as CouchDB::checkInstallation, the welcome message of the node
+    foreach(const Node& node, d->nodes)
+    {
+        if(!node.server || pending.contains(node.server)) continue;
+
+        QNetworkRequest request(QUrl(node.server->baseURL(false)));
+        if(node.server->hasCredential()) request.setRawHeader("Authorization", node.server->authorizationHeader());
+
+        QNetworkReply *reply = d->networkManager->get(request);
+        connect(reply, SIGNAL(finished()), this, SLOT(nodeChecked()));
+        if(d->healthCheckTimeout > 0) QTimer::singleShot(d->healthCheckTimeout, reply, SLOT(abort()));
+
+        Check check;
+        check.server = node.server;
+        check.timer.start();
+        d->checks.insert(reply, check);
+    }
+}
+
+void CouchDBCluster::nodeChecked()
+{
+    Q_D(CouchDBCluster);
+
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if(!reply) return;
+
+    reply->deleteLater();
+    if(!d->checks.contains(reply)) return;
+
+    const Check check = d->checks.take(reply);
+    const qint64 elapsed = check.timer.elapsed();
+    CouchDBServer *server = check.server;
+    if(!server) return;
+
+    const bool installed = reply->error() == QNetworkReply::NoError &&
+            QJsonDocument::fromJson(reply->readAll()).object().contains("couchdb");
+
+    if(installed) recordLatency(server, elapsed);
+    else recordFailure(server);
+}
@@ -0,0 +1,54 @@
+#ifndef COUCHDBCLUSTER_H
+#define COUCHDBCLUSTER_H
+
+#include <QObject>
+#include <QList>
+
+class QNetworkReply;
+class CouchDBServer;
+class CouchDBClusterPrivate;
+class CouchDBCluster : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CouchDBCluster(QObject *parent = 0);
+    virtual ~CouchDBCluster();
+
+    //Nodes are kept in write preference order, the cluster doesn't own them
+    QList<CouchDBServer*> nodes() const;
+    void addNode(CouchDBServer *server);
+    void removeNode(CouchDBServer *server);
+
+    int healthCheckInterval() const;
+    void setHealthCheckInterval(const int& msec);
+
+    //A health check without an answer within this time is aborted and its node marked down
+    int healthCheckTimeout() const;
+    void setHealthCheckTimeout(const int& msec);
+
+    bool isHealthy(CouchDBServer *server) const;
+    double latency(CouchDBServer *server) const;
+
+    //Reads go to the healthy node with the lowest average latency, writes to the first healthy node
+    CouchDBServer* readNode(CouchDBServer *excluded = 0) const;
+    CouchDBServer* writeNode(CouchDBServer *excluded = 0) const;
+
+    //Successful answers only, server errors are failures
+    void recordLatency(CouchDBServer *server, const qint64& msec);
+    void recordFailure(CouchDBServer *server);
+
+signals:
+    void nodeStatusChanged(CouchDBServer *server, const bool& healthy);
+
+public slots:
+    void checkNodes();
+
+private slots:
+    void nodeChecked();
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBCluster)
+    CouchDBClusterPrivate * const d_ptr;
+};
+
+#endif // COUCHDBCLUSTER_H
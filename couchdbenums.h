@@ -6,7 +6,9 @@ enum CouchDBReplyStatus
     COUCHDB_SUCCESS,
     COUCHDB_ERROR,
     COUCHDB_AUTHERROR,
-    COUCHDB_TIMEOUT
+    COUCHDB_TIMEOUT,
+    COUCHDB_QUEUED,
+    COUCHDB_THROTTLED
 };
 
 enum CouchDBOperation
@@ -24,7 +26,37 @@ enum CouchDBOperation
     COUCHDB_DELETEDOCUMENT,
     COUCHDB_UPLOADATTACHMENT,
     COUCHDB_DELETEATTACHMENT,
-    COUCHDB_REPLICATEDATABASE
+    COUCHDB_REPLICATEDATABASE,
+    COUCHDB_BULKDOCUMENTS,
+    COUCHDB_UPSERTDOCUMENT,
+    COUCHDB_RETRIEVEREVISIONS
+};
+
+enum CouchDBListenerFilter
+{
+    COUCHDB_FILTER_NONE,
+    COUCHDB_FILTER_DESIGNDOC,
+    COUCHDB_FILTER_DOCIDS,
+    COUCHDB_FILTER_SELECTOR
+};
+
+enum CouchDBJsonBackend
+{
+    COUCHDB_JSON_STRUCTURAL,
+    COUCHDB_JSON_QJSONDOCUMENT
+};
+
+enum CouchDBPriority
+{
+    COUCHDB_PRIORITY_HIGH,
+    COUCHDB_PRIORITY_NORMAL,
+    COUCHDB_PRIORITY_LOW
+};
+
+enum CouchDBIndexType
+{
+    COUCHDB_INDEX_ORDERED,
+    COUCHDB_INDEX_HASHED
 };
 
 #endif // COUCHDBENUMS_H
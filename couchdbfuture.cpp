@@ -0,0 +1,244 @@
+#include "couchdbfuture.h"
+#include "couchdbresponse.h"
+#include "couchdbquery.h"
+
+#include <QSharedData>
+#include <QSharedPointer>
+#include <QPointer>
+
+namespace
+{
+    struct Callback
+    {
+        QPointer<QObject> context;
+        bool hasContext;
+        CouchDBFuture::Continuation continuation;
+
+        void invoke(const CouchDBResponse& response) const
+        {
+            if(hasContext && !context) return;
+            continuation(response);
+        }
+    };
+}
+
+class CouchDBFuturePrivate : public QSharedData
+{
+public:
+    CouchDBFuturePrivate() :
+        finished(false),
+        status(COUCHDB_ERROR),
+        operation(COUCHDB_CHECKINSTALLATION)
+    {}
+
+    virtual ~CouchDBFuturePrivate()
+    {}
+
+    bool finished;
+    CouchDBReplyStatus status;
+    CouchDBOperation operation;
+    QString database;
+    QString documentID;
+    QString revisionData;
+    QByteArray data;
+    QByteArray multipartBody;
+    QList<CouchDBMultipartPart> attachments;
+    QList<CouchDBFuture> futures;
+    QList<Callback> callbacks;
+};
+
+CouchDBFuture::CouchDBFuture() :
+    d(new CouchDBFuturePrivate)
+{
+}
+
+CouchDBFuture::CouchDBFuture(const CouchDBFuture &other) :
+    d(other.d)
+{
+}
+
+CouchDBFuture &CouchDBFuture::operator=(const CouchDBFuture &other)
+{
+    d = other.d;
+    return *this;
+}
+
+CouchDBFuture::~CouchDBFuture()
+{
+}
+
+bool CouchDBFuture::operator==(const CouchDBFuture &other) const
+{
+    return d == other.d;
+}
+
+bool CouchDBFuture::operator!=(const CouchDBFuture &other) const
+{
+    return d != other.d;
+}
+
+bool CouchDBFuture::isFinished() const
+{
+    return d->finished;
+}
+
+CouchDBReplyStatus CouchDBFuture::status() const
+{
+    return d->status;
+}
+
+CouchDBOperation CouchDBFuture::operation() const
+{
+    return d->operation;
+}
+
+QString CouchDBFuture::database() const
+{
+    return d->database;
+}
+
+QString CouchDBFuture::documentID() const
+{
+    return d->documentID;
+}
+
+QString CouchDBFuture::revisionData() const
+{
+    return d->revisionData;
+}
+
+QByteArray CouchDBFuture::data() const
+{
+    return d->data;
+}
+
+QStringList CouchDBFuture::attachmentNames() const
+{
+    QStringList names;
+    foreach(const CouchDBMultipartPart& part, d->attachments) names.append(part.name);
+    return names;
+}
+
+QByteArray CouchDBFuture::attachment(const QString &name) const
+{
+    foreach(const CouchDBMultipartPart& part, d->attachments)
+    {
+        if(part.name == name) return d->multipartBody.mid(part.offset, part.length);
+    }
+    return QByteArray();
+}
+
+QByteArray CouchDBFuture::attachmentContentType(const QString &name) const
+{
+    foreach(const CouchDBMultipartPart& part, d->attachments)
+    {
+        if(part.name == name) return part.contentType;
+    }
+    return QByteArray();
+}
+
+QList<CouchDBFuture> CouchDBFuture::futures() const
+{
+    return d->futures;
+}
+
+CouchDBFuture &CouchDBFuture::then(const Continuation &continuation)
+{
+    return then(0, continuation);
+}
+
+CouchDBFuture &CouchDBFuture::then(QObject *context, const Continuation &continuation)
+{
+    if(!continuation) return *this;
+
+    Callback callback;
+    callback.context = context;
+    callback.hasContext = context != 0;
+    callback.continuation = continuation;
+
+    if(!d->finished)
+    {
+        d->callbacks.append(callback);
+        return *this;
+    }
+
+    //Already finished, the response is rebuilt from the stored outcome
+    CouchDBResponse response;
+    response.setData(d->data);
+    response.setStatus(d->status);
+    response.setRevisionData(d->revisionData);
+    response.setAttachments(d->multipartBody, d->attachments);
+    callback.invoke(response);
+    return *this;
+}
+
+void CouchDBFuture::resolve(const CouchDBResponse &response)
+{
+    if(d->finished) return;
+
+    d->finished = true;
+    d->status = response.status();
+    d->revisionData = response.revisionData();
+    d->data = response.data();
+    d->multipartBody = response.multipartBody();
+    d->attachments = response.attachmentParts();
+    if(response.query())
+    {
+        d->operation = response.query()->operation();
+        d->database = response.query()->database();
+        d->documentID = response.query()->documentID();
+    }
+
+    //Taken first, a continuation may add more or drop the last copy of this future
+    QExplicitlySharedDataPointer<CouchDBFuturePrivate> keep(d);
+    const QList<Callback> callbacks = keep->callbacks;
+    keep->callbacks.clear();
+
+    foreach(const Callback& callback, callbacks) callback.invoke(response);
+}
+
+CouchDBFuture CouchDBFuture::whenAll(const QList<CouchDBFuture> &futures)
+{
+    CouchDBFuture combined;
+    combined.d->futures = futures;
+
+    if(futures.isEmpty())
+    {
+        CouchDBResponse response;
+        response.setStatus(COUCHDB_SUCCESS);
+        combined.resolve(response);
+        return combined;
+    }
+
+    //The combined future holds its parts and their continuations hold it back, so the join state lets go of it
+    //as soon as it resolves instead of keeping the cycle alive for as long as any part is referenced
+    struct Join
+    {
+        CouchDBFuture combined;
+        int remaining;
+    };
+
+    QSharedPointer<Join> join(new Join);
+    join->combined = combined;
+    join->remaining = futures.size();
+    for(int i = 0; i < futures.size(); ++i)
+    {
+        CouchDBFuture future = futures.at(i);
+        future.then([join](const CouchDBResponse&) {
+            if(--join->remaining > 0) return;
+
+            CouchDBFuture combined = join->combined;
+            join->combined = CouchDBFuture();
+
+            CouchDBResponse response;
+            response.setStatus(COUCHDB_SUCCESS);
+            foreach(const CouchDBFuture& future, combined.futures())
+            {
+                if(future.status() != COUCHDB_SUCCESS && future.status() != COUCHDB_QUEUED) response.setStatus(COUCHDB_ERROR);
+            }
+            combined.resolve(response);
+        });
+    }
+
+    return combined;
+}
@@ -0,0 +1,65 @@
+#ifndef COUCHDBFUTURE_H
+#define COUCHDBFUTURE_H
+
+#include <QObject>
+#include <QList>
+#include <QStringList>
+#include <QExplicitlySharedDataPointer>
+
+#include <functional>
+
+#include "couchdbenums.h"
+
+class CouchDBResponse;
+
+//Result of a single call, resolved only for the caller that made it.
+//Copies share the same state. Continuations run once, in the order they were added, as soon as the call finishes;
+//the response and its query are only valid during the continuation, the outcome stays readable from the future afterwards.
+//QML can't call into a future, it watches one through CouchDBFutureWatcher instead.
+class CouchDBFuturePrivate;
+class CouchDBFuture
+{
+public:
+    typedef std::function<void(const CouchDBResponse&)> Continuation;
+
+    CouchDBFuture();
+    CouchDBFuture(const CouchDBFuture& other);
+    CouchDBFuture& operator=(const CouchDBFuture& other);
+    ~CouchDBFuture();
+
+    bool operator==(const CouchDBFuture& other) const;
+    bool operator!=(const CouchDBFuture& other) const;
+
+    bool isFinished() const;
+
+    CouchDBReplyStatus status() const;
+    CouchDBOperation operation() const;
+    QString database() const;
+    QString documentID() const;
+    QString revisionData() const;
+    QByteArray data() const;
+
+    //Attachments of a multipart document, see CouchDBResponse
+    QStringList attachmentNames() const;
+    QByteArray attachment(const QString& name) const;
+    QByteArray attachmentContentType(const QString& name) const;
+
+    //Futures combined by whenAll, empty otherwise
+    QList<CouchDBFuture> futures() const;
+
+    CouchDBFuture& then(const Continuation& continuation);
+    //Skipped if the context is destroyed before the call finishes
+    CouchDBFuture& then(QObject *context, const Continuation& continuation);
+
+    void resolve(const CouchDBResponse& response);
+
+    //Finishes once every future has finished, with COUCHDB_ERROR if any of them failed
+    static CouchDBFuture whenAll(const QList<CouchDBFuture>& futures);
+
+private:
+    QExplicitlySharedDataPointer<CouchDBFuturePrivate> d;
+};
+
+Q_DECLARE_METATYPE(CouchDBFuture)
+
+#endif // COUCHDBFUTURE_H
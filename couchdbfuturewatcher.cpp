@@ -0,0 +1,77 @@
+#include "couchdbfuturewatcher.h"
+#include "couchdbresponse.h"
+
+class CouchDBFutureWatcherPrivate
+{
+public:
+    CouchDBFutureWatcherPrivate() :
+        hasFuture(false),
+        generation(0)
+    {}
+
+    virtual ~CouchDBFutureWatcherPrivate()
+    {}
+
+    CouchDBFuture future;
+    bool hasFuture;
+    int generation;
+};
+
+CouchDBFutureWatcher::CouchDBFutureWatcher(QObject *parent) :
+    QObject(parent),
+    d_ptr(new CouchDBFutureWatcherPrivate)
+{
+}
+
+CouchDBFutureWatcher::~CouchDBFutureWatcher()
+{
+    delete d_ptr;
+}
+
+CouchDBFuture CouchDBFutureWatcher::future() const
+{
+    Q_D(const CouchDBFutureWatcher);
+    return d->future;
+}
+
+void CouchDBFutureWatcher::setFuture(const CouchDBFuture &future)
+{
+    Q_D(CouchDBFutureWatcher);
+    if(d->hasFuture && d->future == future) return;
+
+    d->future = future;
+    d->hasFuture = true;
+    const int generation = ++d->generation;
+    emit futureChanged();
+
+    //A future replaced before finishing must not report into the watcher anymore. The continuation holds no copy
+    //of the future, which would keep it alive through its own callback list
+    d->future.then(this, [this, generation](const CouchDBResponse&) {
+        Q_D(CouchDBFutureWatcher);
+        if(d->generation == generation) emit finished();
+    });
+}
+
+bool CouchDBFutureWatcher::isFinished() const
+{
+    Q_D(const CouchDBFutureWatcher);
+    return d->hasFuture && d->future.isFinished();
+}
+
+int CouchDBFutureWatcher::status() const
+{
+    Q_D(const CouchDBFutureWatcher);
+    return d->future.status();
+}
+
+QString CouchDBFutureWatcher::revision() const
+{
+    Q_D(const CouchDBFutureWatcher);
+    return d->future.revisionData();
+}
+
+QString CouchDBFutureWatcher::data() const
+{
+    Q_D(const CouchDBFutureWatcher);
+    return QString::fromUtf8(d->future.data());
+}
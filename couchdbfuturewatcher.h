@@ -0,0 +1,41 @@
+#ifndef COUCHDBFUTUREWATCHER_H
+#define COUCHDBFUTUREWATCHER_H
+
+#include <QObject>
+
+#include "couchdbfuture.h"
+
+class CouchDBFutureWatcherPrivate;
+//Exposes a CouchDBFuture to QML, where the future itself is an opaque value. The call result is copied into
+//properties and finished() is emitted once it arrives, or right away if the future already finished:
+//CouchDBFutureWatcher { future: couchdb.retrieveDocument("db", "id"); onFinished: console.log(data) }
+class CouchDBFutureWatcher : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(CouchDBFuture future READ future WRITE setFuture NOTIFY futureChanged)
+    Q_PROPERTY(bool finished READ isFinished NOTIFY finished)
+    Q_PROPERTY(int status READ status NOTIFY finished)
+    Q_PROPERTY(QString revision READ revision NOTIFY finished)
+    Q_PROPERTY(QString data READ data NOTIFY finished)
+public:
+    explicit CouchDBFutureWatcher(QObject *parent = 0);
+    virtual ~CouchDBFutureWatcher();
+
+    CouchDBFuture future() const;
+    void setFuture(const CouchDBFuture& future);
+
+    bool isFinished() const;
+    int status() const;
+    QString revision() const;
+    QString data() const;
+
+signals:
+    void futureChanged();
+    void finished();
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBFutureWatcher)
+    CouchDBFutureWatcherPrivate * const d_ptr;
+};
+
+#endif // COUCHDBFUTUREWATCHER_H
@@ -0,0 +1,414 @@
+#include "couchdbindex.h"
+#include "couchdblistener.h"
+#include "couchdbscanner.h"
+
+#include <QPointer>
+#include <QHash>
+#include <QSet>
+#include <QCollator>
+#include <QDebug>
+
+#include <map>
+
+namespace
+{
+    //Keys are kept as bool, double or QString only
+    QVariant normalizeKey(const QVariant& key)
+    {
+        switch(key.userType())
+        {
+        case QMetaType::Bool:
+            return key;
+        case QMetaType::Int:
+        case QMetaType::UInt:
+        case QMetaType::LongLong:
+        case QMetaType::ULongLong:
+        case QMetaType::Float:
+        case QMetaType::Double:
+            return key.toDouble();
+        case QMetaType::QString:
+            return key;
+        case QMetaType::QByteArray:
+            return QString::fromUtf8(key.toByteArray());
+        default:
+            return QVariant();
+        }
+    }
+
+    int rank(const QVariant& key)
+    {
+        switch(key.userType())
+        {
+        case QMetaType::Bool: return 0;
+        case QMetaType::Double: return 1;
+        default: return 2;
+        }
+    }
+
+    //Strings are collated like CouchDB views, by the Unicode collation algorithm (ICU, root locale) rather than by
+    //code point: "a" < "A" < "b". English has no tailoring so it collates like root; not the C locale, which Qt compares
+    //by code unit. Strings the collator finds equal are told apart by code point to keep a strict order
+    bool stringLess(const QString& a, const QString& b)
+    {
+        static const QCollator collator = []() {
+            QCollator collator(QLocale(QLocale::English));
+            collator.setCaseSensitivity(Qt::CaseSensitive);
+            collator.setNumericMode(false);
+            return collator;
+        }();
+
+        const int order = collator.compare(a, b);
+        return order != 0 ? order < 0 : a < b;
+    }
+
+    //View collation: booleans, then numbers, then strings
+    struct KeyLess
+    {
+        bool operator()(const QVariant& a, const QVariant& b) const
+        {
+            const int rankA = rank(a);
+            const int rankB = rank(b);
+            if(rankA != rankB) return rankA < rankB;
+
+            switch(rankA)
+            {
+            case 0: return a.toBool() < b.toBool();
+            case 1: return a.toDouble() < b.toDouble();
+            default: return stringLess(a.toString(), b.toString());
+            }
+        }
+    };
+
+    QByteArray hashKey(const QVariant& key)
+    {
+        switch(rank(key))
+        {
+        case 0: return key.toBool() ? QByteArrayLiteral("b1") : QByteArrayLiteral("b0");
+        case 1: return 'n' + QByteArray::number(key.toDouble(), 'g', 17);
+        default: return 's' + key.toString().toUtf8();
+        }
+    }
+
+    QVariant keyFromView(const CouchDBJsonView& value)
+    {
+        switch(value.type())
+        {
+        case CouchDBJsonView::String: return value.toString();
+        case CouchDBJsonView::Number: return value.toDouble();
+        case CouchDBJsonView::Bool: return value.toBool();
+        default: return QVariant();
+        }
+    }
+
+    int generation(const QString& revision)
+    {
+        return revision.left(revision.indexOf(QLatin1Char('-'))).toInt();
+    }
+
+    struct Entry
+    {
+        QString revision;
+        QVariantList keys;
+    };
+}
+
+class CouchDBIndexPrivate
+{
+public:
+    CouchDBIndexPrivate(const CouchDBIndexType& t) :
+        type(t),
+        keyed(0),
+        building(false)
+    {}
+
+    virtual ~CouchDBIndexPrivate()
+    {}
+
+    void insertKeys(const QString& documentID, const QVariantList& keys)
+    {
+        foreach(const QVariant& key, keys)
+        {
+            if(type == COUCHDB_INDEX_ORDERED) ordered.insert(std::make_pair(key, documentID));
+            else hashed.insert(hashKey(key), documentID);
+        }
+        if(!keys.isEmpty()) keyed++;
+    }
+
+    void removeKeys(const QString& documentID, const QVariantList& keys)
+    {
+        foreach(const QVariant& key, keys)
+        {
+            if(type == COUCHDB_INDEX_HASHED)
+            {
+                hashed.remove(hashKey(key), documentID);
+                continue;
+            }
+
+            std::pair<OrderedIndex::iterator, OrderedIndex::iterator> matches = ordered.equal_range(key);
+            for(OrderedIndex::iterator it = matches.first; it != matches.second; ++it)
+            {
+                if(it->second != documentID) continue;
+                ordered.erase(it);
+                break;
+            }
+        }
+        if(!keys.isEmpty()) keyed--;
+    }
+
+    typedef std::multimap<QVariant, QString, KeyLess> OrderedIndex;
+
+    CouchDBIndexType type;
+    CouchDBIndex::Projection projection;
+    QPointer<CouchDBListener> listener; //Index doesn't own listener
+    QPointer<CouchDBScanner> scanner; //Index doesn't own scanner
+    QHash<QString, Entry> documents; //Every document seen, with its keys if it has any
+    OrderedIndex ordered;
+    QMultiHash<QByteArray, QString> hashed;
+    int keyed;
+    bool building;
+    QHash<QString, int> tombstones; //Deletions received while building, scanned pages may predate them
+};
+
+CouchDBIndex::CouchDBIndex(const CouchDBIndexType &type, QObject *parent) :
+    QObject(parent),
+    d_ptr(new CouchDBIndexPrivate(type))
+{
+}
+
+CouchDBIndex::~CouchDBIndex()
+{
+    delete d_ptr;
+}
+
+CouchDBIndexType CouchDBIndex::type() const
+{
+    Q_D(const CouchDBIndex);
+    return d->type;
+}
+
+void CouchDBIndex::setProjection(const Projection &projection)
+{
+    Q_D(CouchDBIndex);
+    d->projection = projection;
+}
+
+void CouchDBIndex::setKeyPath(const QString &keyPath)
+{
+    const QStringList members = keyPath.split(QLatin1Char('.'), QString::SkipEmptyParts);
+
+    setProjection([members](const CouchDBJsonView& document) {
+        CouchDBJsonView value = document;
+        foreach(const QString& member, members) value = value.value(member);
+
+        QVariantList keys;
+        if(value.isArray())
+        {
+            foreach(const CouchDBJsonView& element, value.elements()) keys.append(keyFromView(element));
+        }
+        else
+        {
+            keys.append(keyFromView(value));
+        }
+        return keys;
+    });
+}
+
+CouchDBListener *CouchDBIndex::listener() const
+{
+    Q_D(const CouchDBIndex);
+    return d->listener;
+}
+
+void CouchDBIndex::setListener(CouchDBListener *listener)
+{
+    Q_D(CouchDBIndex);
+
+    if(d->listener) disconnect(d->listener, 0, this, 0);
+    d->listener = listener;
+    if(!listener) return;
+
+    listener->setIncludeDocuments(true);
+    connect(listener, SIGNAL(documentReceived(QString,QString,bool,QByteArray)),
+            this, SLOT(documentReceived(QString,QString,bool,QByteArray)));
+}
+
+void CouchDBIndex::build(CouchDBScanner *scanner, const QString &database)
+{
+    Q_D(CouchDBIndex);
+
+    if(d->scanner) disconnect(d->scanner, 0, this, 0);
+    d->scanner = scanner;
+    d->building = true;
+    d->tombstones.clear();
+
+    connect(scanner, SIGNAL(pageReceived(int,CouchDBJsonView)), this, SLOT(pageReceived(int,CouchDBJsonView)));
+    connect(scanner, SIGNAL(scanFinished(QString,qint64)), this, SLOT(scanFinished()));
+    connect(scanner, SIGNAL(scanFailed(QString,QString)), this, SLOT(scanFinished()));
+
+    scanner->setIncludeDocuments(true);
+    scanner->scan(database);
+}
+
+bool CouchDBIndex::isBuilding() const
+{
+    Q_D(const CouchDBIndex);
+    return d->building;
+}
+
+QStringList CouchDBIndex::find(const QVariant &key) const
+{
+    Q_D(const CouchDBIndex);
+
+    const QVariant normalized = normalizeKey(key);
+    if(!normalized.isValid()) return QStringList();
+
+    if(d->type == COUCHDB_INDEX_HASHED) return d->hashed.values(hashKey(normalized));
+
+    QStringList documentIDs;
+    std::pair<CouchDBIndexPrivate::OrderedIndex::const_iterator, CouchDBIndexPrivate::OrderedIndex::const_iterator> matches = d->ordered.equal_range(normalized);
+    for(CouchDBIndexPrivate::OrderedIndex::const_iterator it = matches.first; it != matches.second; ++it) documentIDs.append(it->second);
+    return documentIDs;
+}
+
+QStringList CouchDBIndex::range(const QVariant &from, const QVariant &to, const bool &inclusiveEnd) const
+{
+    Q_D(const CouchDBIndex);
+
+    if(d->type != COUCHDB_INDEX_ORDERED)
+    {
+        qWarning() << "Range lookups need an ordered index";
+        return QStringList();
+    }
+
+    //An invalid bound leaves that side of the range open
+    const QVariant lower = normalizeKey(from);
+    const QVariant upper = normalizeKey(to);
+
+    CouchDBIndexPrivate::OrderedIndex::const_iterator it = lower.isValid() ? d->ordered.lower_bound(lower) : d->ordered.begin();
+    CouchDBIndexPrivate::OrderedIndex::const_iterator end = !upper.isValid() ? d->ordered.end() :
+                                                            inclusiveEnd ? d->ordered.upper_bound(upper) : d->ordered.lower_bound(upper);
+
+    //A document with several keys in the range is listed once, at its first key
+    QStringList documentIDs;
+    QSet<QString> listed;
+    for(; it != end; ++it)
+    {
+        if(listed.contains(it->second)) continue;
+        listed.insert(it->second);
+        documentIDs.append(it->second);
+    }
+    return documentIDs;
+}
+
+bool CouchDBIndex::contains(const QVariant &key) const
+{
+    Q_D(const CouchDBIndex);
+
+    const QVariant normalized = normalizeKey(key);
+    if(!normalized.isValid()) return false;
+
+    if(d->type == COUCHDB_INDEX_HASHED) return d->hashed.contains(hashKey(normalized));
+    return d->ordered.find(normalized) != d->ordered.end();
+}
+
+QVariantList CouchDBIndex::keys(const QString &documentID) const
+{
+    Q_D(const CouchDBIndex);
+    return d->documents.value(documentID).keys;
+}
+
+int CouchDBIndex::size() const
+{
+    Q_D(const CouchDBIndex);
+    return d->keyed;
+}
+
+void CouchDBIndex::clear()
+{
+    Q_D(CouchDBIndex);
+
+    d->documents.clear();
+    d->ordered.clear();
+    d->hashed.clear();
+    d->tombstones.clear();
+    d->keyed = 0;
+}
+
+void CouchDBIndex::indexDocument(const QString &documentID, const QString &revision, const CouchDBJsonView &document)
+{
+    Q_D(CouchDBIndex);
+
+    if(!d->projection)
+    {
+        qWarning() << "Index has no projection, call setProjection or setKeyPath first";
+        return;
+    }
+
+    //Scanned pages and the feed overlap, an older revision never replaces a newer one
+    const int documentGeneration = generation(revision);
+    QHash<QString, Entry>::iterator existing = d->documents.find(documentID);
+    if(existing != d->documents.end() && documentGeneration < generation(existing->revision)) return;
+    if(d->tombstones.contains(documentID) && documentGeneration <= d->tombstones.value(documentID)) return;
+
+    QVariantList keys;
+    foreach(const QVariant& key, d->projection(document))
+    {
+        const QVariant normalized = normalizeKey(key);
+        if(normalized.isValid() && !keys.contains(normalized)) keys.append(normalized);
+    }
+
+    const bool wasKeyed = existing != d->documents.end() && !existing->keys.isEmpty();
+    if(existing != d->documents.end()) d->removeKeys(documentID, existing->keys);
+
+    Entry& entry = d->documents[documentID];
+    entry.revision = revision;
+    entry.keys = keys;
+    d->insertKeys(documentID, keys);
+
+    if(!keys.isEmpty()) emit documentIndexed(documentID);
+    else if(wasKeyed) emit documentRemoved(documentID);
+}
+
+void CouchDBIndex::removeDocument(const QString &documentID, const QString &revision)
+{
+    Q_D(CouchDBIndex);
+
+    if(d->building) d->tombstones.insert(documentID, qMax(d->tombstones.value(documentID), generation(revision)));
+
+    if(!d->documents.contains(documentID)) return;
+
+    const Entry entry = d->documents.take(documentID);
+    d->removeKeys(documentID, entry.keys);
+    if(!entry.keys.isEmpty()) emit documentRemoved(documentID);
+}
+
+void CouchDBIndex::documentReceived(const QString &documentID, const QString &revision, const bool &deleted, const QByteArray &document)
+{
+    if(deleted) removeDocument(documentID, revision);
+    else indexDocument(documentID, revision, CouchDBJsonView(document));
+}
+
+void CouchDBIndex::pageReceived(const int &partition, const CouchDBJsonView &rows)
+{
+    Q_UNUSED(partition);
+
+    foreach(const CouchDBJsonView& row, rows.elements())
+    {
+        const CouchDBJsonView document = row.value(QStringLiteral("doc"));
+        if(!document.isObject()) continue;
+
+        indexDocument(row.value(QStringLiteral("id")).toString(), row.value(QStringLiteral("value")).value(QStringLiteral("rev")).toString(), document);
+    }
+}
+
+void CouchDBIndex::scanFinished()
+{
+    Q_D(CouchDBIndex);
+
+    if(d->scanner) disconnect(d->scanner, 0, this, 0);
+    d->scanner = 0;
+    d->building = false;
+    d->tombstones.clear();
+
+    emit buildFinished();
+}
@@ -0,0 +1,73 @@
+#ifndef COUCHDBINDEX_H
+#define COUCHDBINDEX_H
+
+#include <QObject>
+#include <QStringList>
+#include <QVariantList>
+
+#include <functional>
+
+#include "couchdbenums.h"
+#include "couchdbjsonview.h"
+
+class CouchDBListener;
+class CouchDBScanner;
+class CouchDBIndexPrivate;
+//Local secondary index of document IDs by keys projected from the documents, answering lookups without the server.
+//Keys are strings, numbers or booleans, ordered as in CouchDB views (booleans, then numbers, then strings, which are
+//compared with QCollator and only match the view order when Qt is built with ICU).
+//An ordered index also answers ranges, a hashed one only equality. The index is built from a scanner and kept
+//current by a listener, a document is reindexed only by a revision at least as recent as the one indexed.
+class CouchDBIndex : public QObject
+{
+    Q_OBJECT
+public:
+    //Keys of a document, none to leave it out
+    typedef std::function<QVariantList(const CouchDBJsonView& document)> Projection;
+
+    explicit CouchDBIndex(const CouchDBIndexType& type = COUCHDB_INDEX_ORDERED, QObject *parent = 0);
+    virtual ~CouchDBIndex();
+
+    CouchDBIndexType type() const;
+
+    void setProjection(const Projection& projection);
+    //Projection reading a member by its dotted path, e.g. "device.serial". Every element of an array is a key
+    void setKeyPath(const QString& keyPath);
+
+    //Turns on include_docs, documents outside the feed filter are not indexed
+    CouchDBListener* listener() const;
+    void setListener(CouchDBListener *listener);
+
+    //Indexes every document of the database, the listener should be set first so no change is missed
+    void build(CouchDBScanner *scanner, const QString& database);
+    bool isBuilding() const;
+
+    QStringList find(const QVariant& key) const;
+    QStringList range(const QVariant& from, const QVariant& to, const bool& inclusiveEnd = true) const;
+    bool contains(const QVariant& key) const;
+    QVariantList keys(const QString& documentID) const;
+
+    //Indexed documents
+    int size() const;
+    void clear();
+
+    void indexDocument(const QString& documentID, const QString& revision, const CouchDBJsonView& document);
+    void removeDocument(const QString& documentID, const QString& revision = QString());
+
+signals:
+    void documentIndexed(const QString& documentID);
+    void documentRemoved(const QString& documentID);
+    //Once the scan ended, failed scans included
+    void buildFinished();
+
+private slots:
+    void documentReceived(const QString& documentID, const QString& revision, const bool& deleted, const QByteArray& document);
+    void pageReceived(const int& partition, const CouchDBJsonView& rows);
+    void scanFinished();
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBIndex)
+    CouchDBIndexPrivate * const d_ptr;
+};
+
+#endif // COUCHDBINDEX_H
@@ -0,0 +1,506 @@
+#include "couchdbjson.h"
+
+#include <QMetaObject>
+#include <QMetaProperty>
+#include <QVariant>
+#include <QStringList>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QLocale>
+#include <QtNumeric>
+
+#include <cstring>
+
+namespace
+{
+    const QMetaObject *gadgetMetaObject(const int& type)
+    {
+        if(!(QMetaType::typeFlags(type) & QMetaType::IsGadget)) return 0;
+        return QMetaType::metaObjectForType(type);
+    }
+
+    void writeString(QByteArray& out, const QString& string)
+    {
+        const QByteArray utf8 = string.toUtf8();
+        out.reserve(out.size() + utf8.size() + 2);
+        out.append('"');
+
+        const char *data = utf8.constData();
+        int start = 0;
+        for(int i = 0; i < utf8.size(); ++i)
+        {
+            const uchar c = uchar(data[i]);
+            if(c >= 0x20 && c != '"' && c != '\\') continue;
+
+            out.append(data + start, i - start);
+            start = i + 1;
+
+            switch(c)
+            {
+            case '"': out.append("\\\""); break;
+            case '\\': out.append("\\\\"); break;
+            case '\b': out.append("\\b"); break;
+            case '\f': out.append("\\f"); break;
+            case '\n': out.append("\\n"); break;
+            case '\r': out.append("\\r"); break;
+            case '\t': out.append("\\t"); break;
+            default:
+            {
+                static const char hex[] = "0123456789abcdef";
+                const char escape[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+                out.append(escape, sizeof(escape));
+                break;
+            }
+            }
+        }
+
+        out.append(data + start, utf8.size() - start);
+        out.append('"');
+    }
+
+    void writeGadgetTo(QByteArray& out, const QMetaObject *metaObject, const void *gadget);
+
+    void writeValue(QByteArray& out, const QVariant& value)
+    {
+        const int type = value.userType();
+        switch(type)
+        {
+        case QMetaType::UnknownType:
+        case QMetaType::Nullptr:
+            out.append("null");
+            return;
+        case QMetaType::Bool:
+            out.append(value.toBool() ? "true" : "false");
+            return;
+        case QMetaType::Short:
+        case QMetaType::Int:
+        case QMetaType::Long:
+        case QMetaType::LongLong:
+            out.append(QByteArray::number(value.toLongLong()));
+            return;
+        case QMetaType::UShort:
+        case QMetaType::UInt:
+        case QMetaType::ULong:
+        case QMetaType::ULongLong:
+            out.append(QByteArray::number(value.toULongLong()));
+            return;
+        case QMetaType::Float:
+        case QMetaType::Double:
+        {
+            const double number = value.toDouble();
+            if(qIsFinite(number)) out.append(QByteArray::number(number, 'g', QLocale::FloatingPointShortest));
+            else out.append("null");
+            return;
+        }
+        case QMetaType::QString:
+            writeString(out, value.toString());
+            return;
+        case QMetaType::QByteArray:
+            writeString(out, QString::fromUtf8(value.toByteArray()));
+            return;
+        case QMetaType::QDateTime:
+            writeString(out, value.toDateTime().toString(Qt::ISODate));
+            return;
+        case QMetaType::QDate:
+            writeString(out, value.toDate().toString(Qt::ISODate));
+            return;
+        case QMetaType::QTime:
+            writeString(out, value.toTime().toString(Qt::ISODate));
+            return;
+        case QMetaType::QStringList:
+        {
+            const QStringList list = value.toStringList();
+            out.append('[');
+            for(int i = 0; i < list.size(); ++i)
+            {
+                if(i > 0) out.append(',');
+                writeString(out, list.at(i));
+            }
+            out.append(']');
+            return;
+        }
+        case QMetaType::QVariantMap:
+        {
+            const QVariantMap map = value.toMap();
+            out.append('{');
+            for(QVariantMap::const_iterator it = map.constBegin(); it != map.constEnd(); ++it)
+            {
+                if(it != map.constBegin()) out.append(',');
+                writeString(out, it.key());
+                out.append(':');
+                writeValue(out, it.value());
+            }
+            out.append('}');
+            return;
+        }
+        case QMetaType::QJsonObject:
+            out.append(QJsonDocument(value.toJsonObject()).toJson(QJsonDocument::Compact));
+            return;
+        case QMetaType::QJsonArray:
+            out.append(QJsonDocument(value.toJsonArray()).toJson(QJsonDocument::Compact));
+            return;
+        default:
+            break;
+        }
+
+        if(const QMetaObject *metaObject = gadgetMetaObject(type))
+        {
+            writeGadgetTo(out, metaObject, value.constData());
+            return;
+        }
+
+        //Any registered sequential container, QVariantList included
+        if(value.canConvert<QVariantList>())
+        {
+            QSequentialIterable iterable = value.value<QSequentialIterable>();
+            out.append('[');
+            bool first = true;
+            for(QSequentialIterable::const_iterator it = iterable.begin(); it != iterable.end(); ++it)
+            {
+                if(!first) out.append(',');
+                first = false;
+                writeValue(out, *it);
+            }
+            out.append(']');
+            return;
+        }
+
+        if(value.canConvert<QString>()) writeString(out, value.toString());
+        else out.append("null");
+    }
+
+    void writeGadgetTo(QByteArray& out, const QMetaObject *metaObject, const void *gadget)
+    {
+        out.append('{');
+
+        bool first = true;
+        for(int i = 0; i < metaObject->propertyCount(); ++i)
+        {
+            const QMetaProperty property = metaObject->property(i);
+            if(!property.isStored()) continue;
+
+            const QVariant value = property.readOnGadget(gadget);
+            if(property.name()[0] == '_' && value.userType() == QMetaType::QString && value.toString().isEmpty()) continue;
+
+            if(!first) out.append(',');
+            first = false;
+
+            out.append('"').append(property.name()).append("\":");
+            writeValue(out, value);
+        }
+
+        out.append('}');
+    }
+
+    //Recursive descent reader working directly on the UTF-8 bytes
+    class Reader
+    {
+    public:
+        Reader(const QByteArray& json) :
+            p(json.constData()),
+            end(json.constData() + json.size())
+        {}
+
+        void skipSpace()
+        {
+            while(p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) ++p;
+        }
+
+        bool consume(const char& c)
+        {
+            skipSpace();
+            if(p >= end || *p != c) return false;
+            ++p;
+            return true;
+        }
+
+        bool peek(const char& c)
+        {
+            skipSpace();
+            return p < end && *p == c;
+        }
+
+        bool parseString(QString *out);
+        bool parseLiteral(const char *literal);
+        bool parseNumber(QVariant *out);
+        bool parseValue(QVariant *out, const int& type);
+        bool skipValue() { return parseValue(0, QMetaType::UnknownType); }
+        bool parseGadget(const QMetaObject *metaObject, void *gadget);
+
+        const char *p;
+        const char *end;
+    };
+
+    int hexDigit(const char& c)
+    {
+        if(c >= '0' && c <= '9') return c - '0';
+        if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    bool Reader::parseString(QString *out)
+    {
+        if(!consume('"')) return false;
+
+        const char *start = p;
+        QString result;
+        bool escaped = false;
+
+        while(p < end)
+        {
+            const char c = *p;
+            if(c == '"')
+            {
+                if(out)
+                {
+                    if(escaped) *out = result + QString::fromUtf8(start, p - start);
+                    else *out = QString::fromUtf8(start, p - start);
+                }
+                ++p;
+                return true;
+            }
+
+            if(c != '\\')
+            {
+                ++p;
+                continue;
+            }
+
+            if(out) result.append(QString::fromUtf8(start, p - start));
+            escaped = true;
+            if(++p >= end) return false;
+
+            switch(*p)
+            {
+            case '"': result.append(QLatin1Char('"')); break;
+            case '\\': result.append(QLatin1Char('\\')); break;
+            case '/': result.append(QLatin1Char('/')); break;
+            case 'b': result.append(QLatin1Char('\b')); break;
+            case 'f': result.append(QLatin1Char('\f')); break;
+            case 'n': result.append(QLatin1Char('\n')); break;
+            case 'r': result.append(QLatin1Char('\r')); break;
+            case 't': result.append(QLatin1Char('\t')); break;
+            case 'u':
+            {
+                if(end - p < 5) return false;
+                int unit = 0;
+                for(int i = 1; i <= 4; ++i)
+                {
+                    const int digit = hexDigit(p[i]);
+                    if(digit < 0) return false;
+                    unit = (unit << 4) | digit;
+                }
+                result.append(QChar(ushort(unit)));
+                p += 4;
+                break;
+            }
+            default:
+                return false;
+            }
+
+            start = ++p;
+        }
+
+        return false;
+    }
+
+    bool Reader::parseLiteral(const char *literal)
+    {
+        const int length = int(strlen(literal));
+        if(end - p < length || memcmp(p, literal, length) != 0) return false;
+        p += length;
+        return true;
+    }
+
+    bool Reader::parseNumber(QVariant *out)
+    {
+        const char *start = p;
+        bool integral = true;
+        while(p < end)
+        {
+            const char c = *p;
+            if(c == '.' || c == 'e' || c == 'E') integral = false;
+            else if(!(c == '-' || c == '+' || (c >= '0' && c <= '9'))) break;
+            ++p;
+        }
+        if(p == start) return false;
+        if(!out) return true;
+
+        bool ok;
+        const QByteArray number(start, p - start);
+        if(integral)
+        {
+            const qlonglong value = number.toLongLong(&ok);
+            if(ok)
+            {
+                *out = value;
+                return true;
+            }
+        }
+
+        *out = number.toDouble(&ok);
+        return ok;
+    }
+
+    bool Reader::parseValue(QVariant *out, const int& type)
+    {
+        skipSpace();
+        if(p >= end) return false;
+
+        switch(*p)
+        {
+        case '"':
+        {
+            QString string;
+            if(!parseString(out ? &string : 0)) return false;
+            if(out) *out = string;
+            return true;
+        }
+        case '{':
+        {
+            if(const QMetaObject *metaObject = out ? gadgetMetaObject(type) : 0)
+            {
+                QVariant gadget(type, static_cast<const void*>(0));
+                if(!parseGadget(metaObject, gadget.data())) return false;
+                *out = gadget;
+                return true;
+            }
+
+            ++p;
+            QVariantMap map;
+            if(consume('}'))
+            {
+                if(out) *out = map;
+                return true;
+            }
+
+            do
+            {
+                QString key;
+                if(!parseString(out ? &key : 0) || !consume(':')) return false;
+
+                QVariant value;
+                if(!parseValue(out ? &value : 0, QMetaType::QVariant)) return false;
+                if(out) map.insert(key, value);
+            }
+            while(consume(','));
+
+            if(!consume('}')) return false;
+            if(out) *out = map;
+            return true;
+        }
+        case '[':
+        {
+            ++p;
+            QVariantList list;
+            if(!consume(']'))
+            {
+                do
+                {
+                    QVariant value;
+                    if(!parseValue(out ? &value : 0, QMetaType::QVariant)) return false;
+                    if(out) list.append(value);
+                }
+                while(consume(','));
+
+                if(!consume(']')) return false;
+            }
+
+            if(out) *out = list;
+            return true;
+        }
+        case 't':
+            if(!parseLiteral("true")) return false;
+            if(out) *out = true;
+            return true;
+        case 'f':
+            if(!parseLiteral("false")) return false;
+            if(out) *out = false;
+            return true;
+        case 'n':
+            if(!parseLiteral("null")) return false;
+            if(out) *out = QVariant();
+            return true;
+        default:
+            return parseNumber(out);
+        }
+    }
+
+    bool Reader::parseGadget(const QMetaObject *metaObject, void *gadget)
+    {
+        if(!consume('{')) return false;
+        if(consume('}')) return true;
+
+        do
+        {
+            QString key;
+            if(!parseString(&key) || !consume(':')) return false;
+
+            const int index = metaObject->indexOfProperty(key.toUtf8().constData());
+            if(index < 0)
+            {
+                if(!skipValue()) return false;
+                continue;
+            }
+
+            const QMetaProperty property = metaObject->property(index);
+            const int type = property.userType();
+            QVariant value;
+            if(!parseValue(&value, type)) return false;
+
+            //null leaves the default value in place, everything else is converted by the property itself
+            if(!value.isValid()) continue;
+
+            //QVariant doesn't turn lists and maps into their QJson counterparts
+            if(type == QMetaType::QJsonArray && value.userType() == QMetaType::QVariantList) value = QJsonArray::fromVariantList(value.toList());
+            else if(type == QMetaType::QJsonObject && value.userType() == QMetaType::QVariantMap) value = QJsonObject::fromVariantMap(value.toMap());
+
+            //e.g. an array for a QList<int>, which would otherwise keep its default without notice
+            if(!property.writeOnGadget(gadget, value)) return false;
+        }
+        while(consume(','));
+
+        return consume('}');
+    }
+}
+
+QByteArray CouchDBJson::writeGadget(const QMetaObject *metaObject, const void *gadget)
+{
+    QByteArray out;
+    out.reserve(256);
+    writeGadgetTo(out, metaObject, gadget);
+    return out;
+}
+
+bool CouchDBJson::readGadget(const QByteArray &json, const QMetaObject *metaObject, void *gadget)
+{
+    Reader reader(json);
+    return reader.parseGadget(metaObject, gadget);
+}
+
+QString CouchDBJson::readString(const QByteArray &json, const QString &key)
+{
+    Reader reader(json);
+    if(!reader.consume('{') || reader.consume('}')) return QString();
+
+    do
+    {
+        QString name;
+        if(!reader.parseString(&name) || !reader.consume(':')) return QString();
+
+        if(name == key && reader.peek('"'))
+        {
+            QString value;
+            reader.parseString(&value);
+            return value;
+        }
+
+        if(!reader.skipValue()) return QString();
+    }
+    while(reader.consume(','));
+
+    return QString();
+}
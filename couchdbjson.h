@@ -0,0 +1,35 @@
+#ifndef COUCHDBJSON_H
+#define COUCHDBJSON_H
+
+#include <QByteArray>
+#include <QString>
+
+struct QMetaObject;
+
+//Maps Q_GADGET structs straight to and from JSON text using their Q_PROPERTY list, without building a QJsonDocument.
+//Properties are written under their own name; nested gadgets, sequential containers and maps are supported. Empty strings
+//are not written for properties starting with '_' so that a new document can leave _id and _rev unset. Reading fills
+//nested gadgets, QStringList, QVariantList, QVariantMap, QJsonArray and QJsonObject but no other containers (e.g.
+//QList<int>): a member its property can't hold fails the read. Unknown members are skipped on read.
+namespace CouchDBJson
+{
+    QByteArray writeGadget(const QMetaObject *metaObject, const void *gadget);
+    bool readGadget(const QByteArray& json, const QMetaObject *metaObject, void *gadget);
+
+    //Value of a top level string member, read without parsing the rest of the document
+    QString readString(const QByteArray& json, const QString& key);
+
+    template<typename T>
+    QByteArray write(const T& gadget)
+    {
+        return writeGadget(&T::staticMetaObject, &gadget);
+    }
+
+    template<typename T>
+    bool read(const QByteArray& json, T *gadget)
+    {
+        return readGadget(json, &T::staticMetaObject, gadget);
+    }
+}
+
+#endif // COUCHDBJSON_H
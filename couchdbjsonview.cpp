@@ -0,0 +1,569 @@
+#include "couchdbjsonview.h"
+
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QVector>
+#include <QtAlgorithms>
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define COUCHDB_JSON_SSE2
+#endif
+
+struct CouchDBJsonIndex
+{
+    QByteArray data;
+    QVector<int> positions; //Byte offsets of { } [ ] : , and of both quotes of every string
+    QVector<int> matches;   //Structural index of the matching bracket, -1 for other characters
+};
+
+namespace
+{
+    CouchDBJsonBackend currentBackend = COUCHDB_JSON_STRUCTURAL;
+
+    bool isSpace(const char& c)
+    {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    void scanScalar(const char *data, int from, const int& to, bool& inString, bool& escaped, QVector<int>& positions)
+    {
+        for(; from < to; ++from)
+        {
+            const char c = data[from];
+            if(inString)
+            {
+                if(escaped) escaped = false;
+                else if(c == '\\') escaped = true;
+                else if(c == '"')
+                {
+                    inString = false;
+                    positions.append(from);
+                }
+                continue;
+            }
+
+            switch(c)
+            {
+            case '"':
+                inString = true;
+                positions.append(from);
+                break;
+            case '{':
+            case '}':
+            case '[':
+            case ']':
+            case ':':
+            case ',':
+                positions.append(from);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    bool buildIndex(CouchDBJsonIndex& index)
+    {
+        const char *data = index.data.constData();
+        const int size = index.data.size();
+        index.positions.reserve(size / 8 + 16);
+
+        bool inString = false;
+        bool escaped = false;
+        int i = 0;
+
+#ifdef COUCHDB_JSON_SSE2
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i colon = _mm_set1_epi8(':');
+        const __m128i comma = _mm_set1_epi8(',');
+        const __m128i openBrace = _mm_set1_epi8('{');
+        const __m128i closeBrace = _mm_set1_epi8('}');
+        const __m128i openBracket = _mm_set1_epi8('[');
+        const __m128i closeBracket = _mm_set1_epi8(']');
+
+        for(; i + 16 <= size; i += 16)
+        {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            const quint32 backslashes = quint32(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, backslash)));
+
+            //Escapes are rare in CouchDB payloads, those blocks take the byte by byte path
+            if(backslashes || escaped)
+            {
+                scanScalar(data, i, i + 16, inString, escaped, index.positions);
+                continue;
+            }
+
+            const quint32 quotes = quint32(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, quote)));
+            const __m128i structural = _mm_or_si128(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, colon), _mm_cmpeq_epi8(chunk, comma)),
+                                                                 _mm_or_si128(_mm_cmpeq_epi8(chunk, openBrace), _mm_cmpeq_epi8(chunk, closeBrace))),
+                                                    _mm_or_si128(_mm_cmpeq_epi8(chunk, openBracket), _mm_cmpeq_epi8(chunk, closeBracket)));
+
+            //Prefix xor of the quotes marks every byte from an opening quote up to, not including, its closing quote
+            quint32 inside = quotes;
+            inside ^= inside << 1;
+            inside ^= inside << 2;
+            inside ^= inside << 4;
+            inside ^= inside << 8;
+            inside &= 0xFFFF;
+            if(inString) inside ^= 0xFFFF;
+            inString = (inside & 0x8000) != 0;
+
+            quint32 mask = (quint32(_mm_movemask_epi8(structural)) & ~inside) | quotes;
+            while(mask)
+            {
+                index.positions.append(i + qCountTrailingZeroBits(mask));
+                mask &= mask - 1;
+            }
+        }
+#endif
+
+        scanScalar(data, i, size, inString, escaped, index.positions);
+        if(inString) return false;
+
+        //Pair the brackets so a container can be skipped in one step
+        index.matches.fill(-1, index.positions.size());
+        QVector<int> stack;
+        for(int k = 0; k < index.positions.size(); ++k)
+        {
+            const char c = data[index.positions.at(k)];
+            if(c == '{' || c == '[')
+            {
+                stack.append(k);
+            }
+            else if(c == '}' || c == ']')
+            {
+                if(stack.isEmpty()) return false;
+
+                const int open = stack.takeLast();
+                if((c == '}') != (data[index.positions.at(open)] == '{')) return false;
+                index.matches[open] = k;
+                index.matches[k] = open;
+            }
+        }
+
+        return stack.isEmpty();
+    }
+
+    struct Slice
+    {
+        int token;
+        int begin;
+        int end;
+        int next; //Structural index following the value
+    };
+
+    //Locates the value starting after byte `from`, whose first structural character is at index k
+    bool sliceAt(const CouchDBJsonIndex& index, const int& k, int from, Slice& slice)
+    {
+        const char *data = index.data.constData();
+        const int size = index.data.size();
+        while(from < size && isSpace(data[from])) ++from;
+        if(from >= size) return false;
+
+        const char c = data[from];
+        if(c == '"' || c == '{' || c == '[')
+        {
+            if(k >= index.positions.size() || index.positions.at(k) != from) return false;
+
+            const int last = c == '"' ? k + 1 : index.matches.at(k);
+            if(last < 0 || last >= index.positions.size()) return false;
+
+            slice.token = k;
+            slice.begin = from;
+            slice.end = index.positions.at(last) + 1;
+            slice.next = last + 1;
+            return true;
+        }
+
+        int end = k < index.positions.size() ? index.positions.at(k) : size;
+        while(end > from && isSpace(data[end - 1])) --end;
+        if(end == from) return false;
+
+        slice.token = -1;
+        slice.begin = from;
+        slice.end = end;
+        slice.next = k;
+        return true;
+    }
+
+    //Visits the members of the object at structural index `token`, stops when the visitor returns false
+    template<typename Visitor>
+    void forEachMember(const CouchDBJsonIndex& index, const int& token, Visitor visitor)
+    {
+        const int close = index.matches.at(token);
+        int k = token + 1;
+        while(k + 2 < close)
+        {
+            //Key quotes at k and k + 1, the colon at k + 2
+            const int keyBegin = index.positions.at(k);
+            const int keyEnd = index.positions.at(k + 1);
+
+            Slice slice;
+            if(!sliceAt(index, k + 3, index.positions.at(k + 2) + 1, slice)) return;
+            if(!visitor(keyBegin + 1, keyEnd, slice)) return;
+
+            if(slice.next >= close) return;
+            k = slice.next + 1;
+        }
+    }
+
+    template<typename Visitor>
+    void forEachElement(const CouchDBJsonIndex& index, const int& token, Visitor visitor)
+    {
+        const int close = index.matches.at(token);
+        int k = token + 1;
+        int from = index.positions.at(token) + 1;
+        while(k <= close)
+        {
+            Slice slice;
+            if(!sliceAt(index, k, from, slice)) return;
+            if(!visitor(slice)) return;
+
+            if(slice.next >= close) return;
+            from = index.positions.at(slice.next) + 1;
+            k = slice.next + 1;
+        }
+    }
+
+    QString decodeString(const char *data, const int& size)
+    {
+        if(!memchr(data, '\\', size)) return QString::fromUtf8(data, size);
+
+        //Escaped strings are rare enough to be handed to QJsonDocument
+        QByteArray wrapped;
+        wrapped.reserve(size + 4);
+        wrapped.append("[\"").append(data, size).append("\"]");
+        return QJsonDocument::fromJson(wrapped).array().at(0).toString();
+    }
+}
+
+CouchDBJsonView::CouchDBJsonView() :
+    token(-1),
+    begin(-1),
+    end(-1),
+    fallback(false)
+{
+}
+
+CouchDBJsonView::CouchDBJsonView(const QByteArray &json) :
+    token(-1),
+    begin(-1),
+    end(-1),
+    fallback(false)
+{
+    if(currentBackend == COUCHDB_JSON_STRUCTURAL)
+    {
+        QSharedPointer<CouchDBJsonIndex> built(new CouchDBJsonIndex);
+        built->data = json;
+
+        Slice slice;
+        if(buildIndex(*built) && sliceAt(*built, 0, 0, slice))
+        {
+            index = built;
+            token = slice.token;
+            begin = slice.begin;
+            end = slice.end;
+            return;
+        }
+    }
+
+    //Also taken for text the structural index rejects, QJsonDocument reports it as undefined
+    fallback = true;
+    QJsonDocument document = QJsonDocument::fromJson(json);
+    if(document.isObject()) this->json = document.object();
+    else if(document.isArray()) this->json = document.array();
+    else this->json = QJsonValue(QJsonValue::Undefined);
+}
+
+CouchDBJsonView::CouchDBJsonView(const QSharedPointer<const CouchDBJsonIndex> &index, const int &token, const int &begin, const int &end) :
+    index(index),
+    token(token),
+    begin(begin),
+    end(end),
+    fallback(false)
+{
+}
+
+CouchDBJsonView::CouchDBJsonView(const QJsonValue &json) :
+    token(-1),
+    begin(-1),
+    end(-1),
+    json(json),
+    fallback(true)
+{
+}
+
+CouchDBJsonBackend CouchDBJsonView::backend()
+{
+    return currentBackend;
+}
+
+void CouchDBJsonView::setBackend(const CouchDBJsonBackend &backend)
+{
+    currentBackend = backend;
+}
+
+CouchDBJsonView::Type CouchDBJsonView::type() const
+{
+    if(fallback)
+    {
+        switch(json.type())
+        {
+        case QJsonValue::Null: return Null;
+        case QJsonValue::Bool: return Bool;
+        case QJsonValue::Double: return Number;
+        case QJsonValue::String: return String;
+        case QJsonValue::Array: return Array;
+        case QJsonValue::Object: return Object;
+        default: return Undefined;
+        }
+    }
+
+    if(!index || begin < 0) return Undefined;
+
+    switch(index->data.at(begin))
+    {
+    case '{': return Object;
+    case '[': return Array;
+    case '"': return String;
+    case 't':
+    case 'f': return Bool;
+    case 'n': return Null;
+    default: return Number;
+    }
+}
+
+bool CouchDBJsonView::contains(const QString &key) const
+{
+    return !value(key).isUndefined();
+}
+
+CouchDBJsonView CouchDBJsonView::value(const QString &key) const
+{
+    if(fallback) return CouchDBJsonView(json.toObject().value(key));
+    if(type() != Object) return CouchDBJsonView();
+
+    const QByteArray name = key.toUtf8();
+    const char *data = index->data.constData();
+
+    CouchDBJsonView result;
+    forEachMember(*index, token, [&](const int& keyBegin, const int& keyEnd, const Slice& slice) {
+        const int length = keyEnd - keyBegin;
+        const bool matches = (length == name.size() && memcmp(data + keyBegin, name.constData(), length) == 0) ||
+                (memchr(data + keyBegin, '\\', length) && decodeString(data + keyBegin, length) == key);
+        if(!matches) return true;
+
+        result = CouchDBJsonView(index, slice.token, slice.begin, slice.end);
+        return false;
+    });
+
+    return result;
+}
+
+CouchDBJsonView CouchDBJsonView::at(const int &i) const
+{
+    if(fallback) return CouchDBJsonView(json.toArray().at(i));
+    if(type() != Array || i < 0) return CouchDBJsonView();
+
+    int current = 0;
+    CouchDBJsonView result;
+    forEachElement(*index, token, [&](const Slice& slice) {
+        if(current++ < i) return true;
+
+        result = CouchDBJsonView(index, slice.token, slice.begin, slice.end);
+        return false;
+    });
+
+    return result;
+}
+
+CouchDBJsonView CouchDBJsonView::mid(const int &position) const
+{
+    if(type() != Array) return CouchDBJsonView();
+    if(position <= 0) return *this;
+
+    if(fallback)
+    {
+        const QJsonArray array = json.toArray();
+        QJsonArray rest;
+        for(int i = position; i < array.size(); ++i) rest.append(array.at(i));
+        return CouchDBJsonView(QJsonValue(rest));
+    }
+
+    const CouchDBJsonView first = at(position);
+    if(first.begin < 0) return CouchDBJsonView(QByteArrayLiteral("[]"));
+
+    //From the first element kept up to the closing bracket
+    return CouchDBJsonView('[' + index->data.mid(first.begin, end - first.begin));
+}
+
+QList<CouchDBJsonView> CouchDBJsonView::elements() const
+{
+    QList<CouchDBJsonView> elements;
+
+    if(fallback)
+    {
+        if(json.isArray()) foreach(const QJsonValue& value, json.toArray()) elements.append(CouchDBJsonView(value));
+        else if(json.isObject()) foreach(const QJsonValue& value, json.toObject()) elements.append(CouchDBJsonView(value));
+        return elements;
+    }
+
+    const Type t = type();
+    if(t == Array)
+    {
+        forEachElement(*index, token, [&](const Slice& slice) {
+            elements.append(CouchDBJsonView(index, slice.token, slice.begin, slice.end));
+            return true;
+        });
+    }
+    else if(t == Object)
+    {
+        forEachMember(*index, token, [&](const int&, const int&, const Slice& slice) {
+            elements.append(CouchDBJsonView(index, slice.token, slice.begin, slice.end));
+            return true;
+        });
+    }
+
+    return elements;
+}
+
+QStringList CouchDBJsonView::keys() const
+{
+    if(fallback) return json.toObject().keys();
+    if(type() != Object) return QStringList();
+
+    const char *data = index->data.constData();
+
+    QStringList keys;
+    forEachMember(*index, token, [&](const int& keyBegin, const int& keyEnd, const Slice&) {
+        keys.append(decodeString(data + keyBegin, keyEnd - keyBegin));
+        return true;
+    });
+
+    return keys;
+}
+
+int CouchDBJsonView::size() const
+{
+    if(fallback) return json.isArray() ? json.toArray().size() : json.toObject().size();
+
+    int count = 0;
+    const Type t = type();
+    if(t == Array) forEachElement(*index, token, [&](const Slice&) { ++count; return true; });
+    else if(t == Object) forEachMember(*index, token, [&](const int&, const int&, const Slice&) { ++count; return true; });
+    return count;
+}
+
+QString CouchDBJsonView::toString(const QString &defaultValue) const
+{
+    if(fallback) return json.toString(defaultValue);
+    if(type() != String) return defaultValue;
+
+    return decodeString(index->data.constData() + begin + 1, end - begin - 2);
+}
+
+double CouchDBJsonView::toDouble(const double &defaultValue) const
+{
+    if(fallback) return json.toDouble(defaultValue);
+    if(type() != Number) return defaultValue;
+
+    bool ok;
+    const double value = raw().toDouble(&ok);
+    return ok ? value : defaultValue;
+}
+
+qint64 CouchDBJsonView::toLongLong(const qint64 &defaultValue) const
+{
+    if(fallback) return json.isDouble() ? qint64(json.toDouble()) : defaultValue;
+    if(type() != Number) return defaultValue;
+
+    bool ok;
+    const QByteArray text = raw();
+    const qint64 value = text.toLongLong(&ok);
+    if(ok) return value;
+
+    const double number = text.toDouble(&ok);
+    return ok ? qint64(number) : defaultValue;
+}
+
+bool CouchDBJsonView::toBool(const bool &defaultValue) const
+{
+    if(fallback) return json.toBool(defaultValue);
+    if(type() != Bool) return defaultValue;
+
+    return index->data.at(begin) == 't';
+}
+
+QByteArray CouchDBJsonView::raw() const
+{
+    if(fallback)
+    {
+        if(json.isObject()) return QJsonDocument(json.toObject()).toJson(QJsonDocument::Compact);
+        if(json.isArray()) return QJsonDocument(json.toArray()).toJson(QJsonDocument::Compact);
+
+        QJsonArray wrapper;
+        wrapper.append(json);
+        const QByteArray text = QJsonDocument(wrapper).toJson(QJsonDocument::Compact);
+        return text.mid(1, text.size() - 2);
+    }
+
+    if(begin < 0) return QByteArray();
+    return index->data.mid(begin, end - begin);
+}
+
+QJsonValue CouchDBJsonView::toJsonValue() const
+{
+    if(fallback) return json;
+
+    switch(type())
+    {
+    case Object: return toObject();
+    case Array: return toArray();
+    case String: return toString();
+    case Number: return toDouble();
+    case Bool: return toBool();
+    case Null: return QJsonValue(QJsonValue::Null);
+    default: return QJsonValue(QJsonValue::Undefined);
+    }
+}
+
+QJsonObject CouchDBJsonView::toObject() const
+{
+    if(fallback) return json.toObject();
+    if(type() != Object) return QJsonObject();
+
+    //Built from the structural index, the text isn't tokenized a second time
+    const char *data = index->data.constData();
+
+    QJsonObject object;
+    forEachMember(*index, token, [&](const int& keyBegin, const int& keyEnd, const Slice& slice) {
+        object.insert(decodeString(data + keyBegin, keyEnd - keyBegin), CouchDBJsonView(index, slice.token, slice.begin, slice.end).toJsonValue());
+        return true;
+    });
+
+    return object;
+}
+
+QJsonArray CouchDBJsonView::toArray() const
+{
+    if(fallback) return json.toArray();
+    if(type() != Array) return QJsonArray();
+
+    QJsonArray array;
+    forEachElement(*index, token, [&](const Slice& slice) {
+        array.append(CouchDBJsonView(index, slice.token, slice.begin, slice.end).toJsonValue());
+        return true;
+    });
+
+    return array;
+}
+
+QVariant CouchDBJsonView::toVariant() const
+{
+    return toJsonValue().toVariant();
+}
@@ -0,0 +1,84 @@
+#ifndef COUCHDBJSONVIEW_H
+#define COUCHDBJSONVIEW_H
+
+#include <QByteArray>
+#include <QSharedPointer>
+#include <QJsonValue>
+#include <QVariant>
+#include <QStringList>
+
+#include "couchdbenums.h"
+
+class QJsonObject;
+class QJsonArray;
+
+//Read-only, on-demand view over JSON text. Building one only indexes the structural characters of the text
+//(SSE2 when available); members are located when asked for and values are decoded only when read.
+//Copies are cheap and share the text. With the QJsonDocument backend the text is parsed into a DOM instead.
+struct CouchDBJsonIndex;
+class CouchDBJsonView
+{
+public:
+    enum Type
+    {
+        Undefined,
+        Null,
+        Bool,
+        Number,
+        String,
+        Array,
+        Object
+    };
+
+    CouchDBJsonView();
+    explicit CouchDBJsonView(const QByteArray& json);
+
+    //Backend used by views created afterwards, meant to be chosen once at startup
+    static CouchDBJsonBackend backend();
+    static void setBackend(const CouchDBJsonBackend& backend);
+
+    Type type() const;
+    bool isUndefined() const { return type() == Undefined; }
+    bool isNull() const { return type() == Null; }
+    bool isString() const { return type() == String; }
+    bool isArray() const { return type() == Array; }
+    bool isObject() const { return type() == Object; }
+
+    bool contains(const QString& key) const;
+    CouchDBJsonView value(const QString& key) const;
+    CouchDBJsonView operator[](const QString& key) const { return value(key); }
+    CouchDBJsonView at(const int& index) const;
+    //Array of the elements from position on, indexed again over a copy of their text
+    CouchDBJsonView mid(const int& position) const;
+
+    //Elements of an array, or member values of an object
+    QList<CouchDBJsonView> elements() const;
+    QStringList keys() const;
+    int size() const;
+
+    QString toString(const QString& defaultValue = QString()) const;
+    double toDouble(const double& defaultValue = 0) const;
+    qint64 toLongLong(const qint64& defaultValue = 0) const;
+    bool toBool(const bool& defaultValue = false) const;
+
+    //Text of the value exactly as received, e.g. a sequence number without rounding through double
+    QByteArray raw() const;
+
+    QJsonValue toJsonValue() const;
+    QJsonObject toObject() const;
+    QJsonArray toArray() const;
+    QVariant toVariant() const;
+
+private:
+    CouchDBJsonView(const QSharedPointer<const CouchDBJsonIndex>& index, const int& token, const int& begin, const int& end);
+    explicit CouchDBJsonView(const QJsonValue& json);
+
+    QSharedPointer<const CouchDBJsonIndex> index;
+    int token; //Structural index of the opening character for strings and containers, -1 for other values
+    int begin;
+    int end;
+    QJsonValue json; //QJsonDocument backend
+    bool fallback;
+};
+
+#endif // COUCHDBJSONVIEW_H
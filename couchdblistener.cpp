@@ -1,6 +1,9 @@
 #include "couchdblistener.h"
 #include "couchdb.h"
 #include "couchdbserver.h"
+#include "couchdbrevisiontable.h"
+#include "couchdbtimingwheel.h"
+#include "couchdbcluster.h"
 
 #include <QNetworkAccessManager>
 #include <QNetworkRequest>
@@ -10,8 +13,29 @@
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QTimer>
+#include <QPointer>
+#include <QQueue>
+#include <QMetaMethod>
 #include <QDebug>
 
+namespace
+{
+    //Sequences are integers on CouchDB 1.x and opaque strings from 2.0 on
+    QString sequenceString(const CouchDBJsonView& sequence)
+    {
+        return sequence.isString() ? sequence.toString() : QString::fromLatin1(sequence.raw());
+    }
+
+    //Numeric part of a sequence, the sum of the shard sequences on clusters
+    qint64 sequenceNumber(const QString& sequence)
+    {
+        return sequence.left(sequence.indexOf(QLatin1Char('-'))).toLongLong();
+    }
+
+    const qint64 readChunkSize = 64 * 1024;
+    //Changes delivered per event loop pass, so a long backlog doesn't block the thread
+    const int deliveryChunkSize = 100;
+}
 
 class CouchDBListenerPrivate
 {
@@ -19,8 +43,25 @@ public:
     CouchDBListenerPrivate(CouchDBServer *s) :
         server(s),
         networkManager(0),
+        filter(COUCHDB_FILTER_DESIGNDOC),
+        designFilter("app/docFilter"),
+        includeDocuments(false),
+        includeAttachments(false),
+        includeConflicts(false),
         reply(0),
-        retryTimer(0)
+        retryTimer(0),
+        batchTimer(0),
+        batchSize(0),
+        revisions(0),
+        heartbeatHandle(0),
+        readBufferSize(1024 * 1024),
+        maxQueuedChanges(1000),
+        deliveryTimer(0),
+        lagTimer(0),
+        lagReply(0),
+        lag(-1),
+        openPending(false),
+        lagPending(false)
     {}
 
     virtual ~CouchDBListenerPrivate()
@@ -30,6 +71,10 @@ public:
 
         if(reply) delete reply;
         if(retryTimer) delete retryTimer;
+        if(batchTimer) delete batchTimer;
+        if(deliveryTimer) delete deliveryTimer;
+        if(lagTimer) delete lagTimer;
+        if(revisions) delete revisions;
 
         if(networkManager) delete networkManager;
     }
@@ -38,10 +83,58 @@ public:
     QNetworkAccessManager *networkManager;
     QString database;
     QString documentID;
+    CouchDBListenerFilter filter;
+    QString designFilter;
+    QStringList documentIDs;
+    QJsonObject selector;
+    QString lastSequence;
+    bool includeDocuments;
+    bool includeAttachments;
+    bool includeConflicts;
+    QByteArray buffer;
     QNetworkReply *reply;
     QTimer* retryTimer;
+    QTimer* batchTimer;
+    int batchSize;
+    QVariantList batch;
+    QHash<QString, int> batchIndex;
     QMap<QString,QString> parameters;
-    QMap<QString,QString> revisionsMap;
+    CouchDBRevisionTable *revisions;
+    QPointer<CouchDBRevisionTable> revisionTable; //Listener doesn't own the table
+    QPointer<CouchDBTimingWheel> timingWheel; //Listener doesn't own the wheel
+    QPointer<CouchDBCluster> cluster; //Listener doesn't own the cluster
+    quint64 heartbeatHandle;
+    qint64 readBufferSize;
+    int maxQueuedChanges;
+    QQueue<QByteArray> queue; //Change lines read from the feed, waiting for delivery
+    QTimer* deliveryTimer;
+    QTimer* lagTimer;
+    QNetworkReply *lagReply;
+    QString updateSequence;
+    qint64 lag;
+    bool openPending; //Feed waiting in the server's rate limiter
+    bool lagPending;
+
+    void armHeartbeat(CouchDBListener *listener)
+    {
+        if(!timingWheel) return;
+
+        timingWheel->cancel(heartbeatHandle);
+        const int heartbeat = parameters.value("heartbeat").toInt();
+        if(heartbeat > 0) heartbeatHandle = timingWheel->schedule(2 * heartbeat, listener, "heartbeatMissed");
+    }
+
+    void reattach()
+    {
+        if(!cluster) return;
+
+        cluster->recordFailure(server);
+        CouchDBServer *node = cluster->readNode(server);
+        if(!node) return;
+
+        qDebug() << "Reattaching changes feed of" << database << "to" << node->baseURL(false);
+        server = node;
+    }
 };
 
 
@@ -59,7 +152,22 @@ CouchDBListener::CouchDBListener(CouchDBServer * server) :
     d->retryTimer->setSingleShot(true);
     connect(d->retryTimer, SIGNAL(timeout()), this, SLOT(start()));
 
-    d->parameters.insert("filter", "app/docFilter");
+    d->batchTimer = new QTimer(this);
+    d->batchTimer->setInterval(0);
+    d->batchTimer->setSingleShot(true);
+    connect(d->batchTimer, SIGNAL(timeout()), this, SLOT(flushBatch()));
+
+    d->deliveryTimer = new QTimer(this);
+    d->deliveryTimer->setInterval(0);
+    d->deliveryTimer->setSingleShot(true);
+    connect(d->deliveryTimer, SIGNAL(timeout()), this, SLOT(deliverChanges()));
+
+    d->lagTimer = new QTimer(this);
+    d->lagTimer->setInterval(10000);
+    connect(d->lagTimer, SIGNAL(timeout()), this, SLOT(pollLag()));
+
+    d->revisions = new CouchDBRevisionTable(this);
+
     d->parameters.insert("feed", "continuous");
     d->parameters.insert("heartbeat", "10000");
     d->parameters.insert("timeout", "60000");
@@ -67,6 +175,9 @@ CouchDBListener::CouchDBListener(CouchDBServer * server) :
 
 CouchDBListener::~CouchDBListener()
 {
+    Q_D(CouchDBListener);
+    if(d->timingWheel) d->timingWheel->cancel(d->heartbeatHandle);
+
     delete d_ptr;
 }
 
@@ -98,7 +209,73 @@ void CouchDBListener::setDocumentID(const QString &documentID)
 {
     Q_D(CouchDBListener);
     d->documentID = documentID;
-    d->parameters.insert("name", d->documentID);
+}
+
+CouchDBListenerFilter CouchDBListener::filter() const
+{
+    Q_D(const CouchDBListener);
+    return d->filter;
+}
+
+QString CouchDBListener::designFilter() const
+{
+    Q_D(const CouchDBListener);
+    return d->designFilter;
+}
+
+void CouchDBListener::setDesignFilter(const QString &designFilter)
+{
+    Q_D(CouchDBListener);
+    d->filter = COUCHDB_FILTER_DESIGNDOC;
+    d->designFilter = designFilter;
+    if(d->reply) start();
+}
+
+QStringList CouchDBListener::documentIDs() const
+{
+    Q_D(const CouchDBListener);
+    return d->documentIDs;
+}
+
+void CouchDBListener::setDocumentIDs(const QStringList &documentIDs)
+{
+    Q_D(CouchDBListener);
+    d->filter = COUCHDB_FILTER_DOCIDS;
+    d->documentIDs = documentIDs;
+    if(d->reply) start();
+}
+
+QJsonObject CouchDBListener::selector() const
+{
+    Q_D(const CouchDBListener);
+    return d->selector;
+}
+
+void CouchDBListener::setSelector(const QJsonObject &selector)
+{
+    Q_D(CouchDBListener);
+    d->filter = COUCHDB_FILTER_SELECTOR;
+    d->selector = selector;
+    if(d->reply) start();
+}
+
+void CouchDBListener::clearFilter()
+{
+    Q_D(CouchDBListener);
+    d->filter = COUCHDB_FILTER_NONE;
+    if(d->reply) start();
+}
+
+QString CouchDBListener::lastSequence() const
+{
+    Q_D(const CouchDBListener);
+    return d->lastSequence;
+}
+
+void CouchDBListener::setLastSequence(const QString &lastSequence)
+{
+    Q_D(CouchDBListener);
+    d->lastSequence = lastSequence;
 }
 
 QString CouchDBListener::revision(const QString &documentID) const
@@ -108,7 +285,82 @@ QString CouchDBListener::revision(const QString &documentID) const
     QString docID = d->documentID;
     if(!documentID.isEmpty()) docID = documentID;
 
-    return d->revisionsMap.value(docID);
+    return d->revisions->revision(QString(), docID);
+}
+
+int CouchDBListener::revisionCapacity() const
+{
+    Q_D(const CouchDBListener);
+    return d->revisions->capacity();
+}
+
+void CouchDBListener::setRevisionCapacity(const int &capacity)
+{
+    Q_D(CouchDBListener);
+    d->revisions->setCapacity(capacity);
+}
+
+qint64 CouchDBListener::revisionMemoryUsage() const
+{
+    Q_D(const CouchDBListener);
+    return d->revisions->memoryUsage();
+}
+
+qint64 CouchDBListener::readBufferSize() const
+{
+    Q_D(const CouchDBListener);
+    return d->readBufferSize;
+}
+
+void CouchDBListener::setReadBufferSize(const qint64 &readBufferSize)
+{
+    Q_D(CouchDBListener);
+    d->readBufferSize = qMax<qint64>(0, readBufferSize);
+    if(d->reply) d->reply->setReadBufferSize(d->readBufferSize);
+}
+
+int CouchDBListener::maxQueuedChanges() const
+{
+    Q_D(const CouchDBListener);
+    return d->maxQueuedChanges;
+}
+
+void CouchDBListener::setMaxQueuedChanges(const int &maxQueuedChanges)
+{
+    Q_D(CouchDBListener);
+    d->maxQueuedChanges = qMax(1, maxQueuedChanges);
+}
+
+int CouchDBListener::queueDepth() const
+{
+    Q_D(const CouchDBListener);
+    return d->queue.size();
+}
+
+int CouchDBListener::lagInterval() const
+{
+    Q_D(const CouchDBListener);
+    return d->lagTimer->interval();
+}
+
+void CouchDBListener::setLagInterval(const int &msec)
+{
+    Q_D(CouchDBListener);
+    d->lagTimer->setInterval(msec);
+    if(msec <= 0) d->lagTimer->stop();
+    else if(d->reply) d->lagTimer->start();
+}
+
+QString CouchDBListener::updateSequence() const
+{
+    Q_D(const CouchDBListener);
+    return d->updateSequence;
+}
+
+qint64 CouchDBListener::lag() const
+{
+    Q_D(const CouchDBListener);
+    return d->lag;
 }
 
 void CouchDBListener::setCookieJar(QNetworkCookieJar *cookieJar)
@@ -117,22 +369,143 @@ void CouchDBListener::setCookieJar(QNetworkCookieJar *cookieJar)
     d->networkManager->setCookieJar(cookieJar);
 }
 
+CouchDBRevisionTable *CouchDBListener::revisionTable() const
+{
+    Q_D(const CouchDBListener);
+    return d->revisionTable;
+}
+
+void CouchDBListener::setRevisionTable(CouchDBRevisionTable *revisionTable)
+{
+    Q_D(CouchDBListener);
+    d->revisionTable = revisionTable;
+}
+
+CouchDBTimingWheel *CouchDBListener::timingWheel() const
+{
+    Q_D(const CouchDBListener);
+    return d->timingWheel;
+}
+
+void CouchDBListener::setTimingWheel(CouchDBTimingWheel *timingWheel)
+{
+    Q_D(CouchDBListener);
+    if(d->timingWheel) d->timingWheel->cancel(d->heartbeatHandle);
+
+    d->timingWheel = timingWheel;
+    if(d->reply) d->armHeartbeat(this);
+}
+
+CouchDBCluster *CouchDBListener::cluster() const
+{
+    Q_D(const CouchDBListener);
+    return d->cluster;
+}
+
+void CouchDBListener::setCluster(CouchDBCluster *cluster)
+{
+    Q_D(CouchDBListener);
+    d->cluster = cluster;
+}
+
 void CouchDBListener::setParam(const QString& name, const QString& value)
 {
     Q_D(CouchDBListener);
     d->parameters.insert(name, value);
 }
 
+bool CouchDBListener::includeDocuments() const
+{
+    Q_D(const CouchDBListener);
+    return d->includeDocuments;
+}
+
+void CouchDBListener::setIncludeDocuments(const bool &includeDocuments)
+{
+    Q_D(CouchDBListener);
+    if(d->includeDocuments == includeDocuments) return;
+
+    d->includeDocuments = includeDocuments;
+    if(d->reply) start();
+}
+
+bool CouchDBListener::includeAttachments() const
+{
+    Q_D(const CouchDBListener);
+    return d->includeAttachments;
+}
+
+void CouchDBListener::setIncludeAttachments(const bool &includeAttachments)
+{
+    Q_D(CouchDBListener);
+    if(d->includeAttachments == includeAttachments) return;
+
+    d->includeAttachments = includeAttachments;
+    if(d->reply && d->includeDocuments) start();
+}
+
+bool CouchDBListener::includeConflicts() const
+{
+    Q_D(const CouchDBListener);
+    return d->includeConflicts;
+}
+
+void CouchDBListener::setIncludeConflicts(const bool &includeConflicts)
+{
+    Q_D(CouchDBListener);
+    if(d->includeConflicts == includeConflicts) return;
+
+    d->includeConflicts = includeConflicts;
+    if(d->reply && d->includeDocuments) start();
+}
+
+int CouchDBListener::batchInterval() const
+{
+    Q_D(const CouchDBListener);
+    return d->batchTimer->interval();
+}
+
+void CouchDBListener::setBatchInterval(const int &msec)
+{
+    Q_D(CouchDBListener);
+    d->batchTimer->setInterval(msec);
+    if(msec <= 0) flushBatch();
+}
+
+int CouchDBListener::batchSize() const
+{
+    Q_D(const CouchDBListener);
+    return d->batchSize;
+}
+
+void CouchDBListener::setBatchSize(const int &batchSize)
+{
+    Q_D(CouchDBListener);
+    d->batchSize = batchSize;
+}
+
 void CouchDBListener::launch()
 {
     Q_D(CouchDBListener);
     d->retryTimer->start();
 }
 
+//Restarts wait in the server's rate limiter like any other request, so reconnecting listeners don't add to a 429
 void CouchDBListener::start()
 {
     Q_D(CouchDBListener);
 
+    if(d->openPending) return;
+    d->openPending = true;
+    d->server->submit(false, COUCHDB_PRIORITY_NORMAL, this, [this]() { open(); });
+}
+
+void CouchDBListener::open()
+{
+    Q_D(CouchDBListener);
+
+    d->openPending = false;
+
     QUrlQuery urlQuery;
     QMapIterator<QString, QString> i(d->parameters);
     while (i.hasNext())
@@ -141,6 +514,38 @@ void CouchDBListener::start()
         urlQuery.addQueryItem(i.key(), i.value());
     }
 
+    //Resume where the previous feed stopped instead of replaying the database history
+    if(!d->lastSequence.isEmpty() && !d->parameters.contains("since")) urlQuery.addQueryItem("since", d->lastSequence);
+
+    if(d->includeDocuments)
+    {
+        urlQuery.addQueryItem("include_docs", "true");
+        if(d->includeAttachments) urlQuery.addQueryItem("attachments", "true");
+        if(d->includeConflicts) urlQuery.addQueryItem("conflicts", "true");
+    }
+
+    QJsonObject filterBody;
+    if(!d->parameters.contains("filter"))
+    {
+        switch(d->filter)
+        {
+        case COUCHDB_FILTER_NONE:
+            break;
+        case COUCHDB_FILTER_DESIGNDOC:
+            urlQuery.addQueryItem("filter", d->designFilter);
+            if(!d->documentID.isEmpty() && !d->parameters.contains("name")) urlQuery.addQueryItem("name", d->documentID);
+            break;
+        case COUCHDB_FILTER_DOCIDS:
+            urlQuery.addQueryItem("filter", "_doc_ids");
+            filterBody.insert("doc_ids", QJsonArray::fromStringList(d->documentIDs));
+            break;
+        case COUCHDB_FILTER_SELECTOR:
+            urlQuery.addQueryItem("filter", "_selector");
+            filterBody.insert("selector", d->selector);
+            break;
+        }
+    }
+
     qDebug() << d->server->secureConnection() << d->server->baseURL();
     QUrl url = QUrl(QString("%1/%2/_changes").arg(d->server->baseURL(), d->database));
     url.setQuery(urlQuery);
@@ -149,35 +554,227 @@ void CouchDBListener::start()
 
     QNetworkRequest request;
     request.setUrl(url);
-    if(d->server->hasCredential()) request.setRawHeader("Authorization", "Basic " + d->server->credential());
+    if(d->server->hasCredential()) request.setRawHeader("Authorization", d->server->authorizationHeader());
 
-    d->reply = d->networkManager->get(request);
+    //The new feed is opened before the running one is dropped so no change falls in between
+    QNetworkReply *previousReply = d->reply;
+
+    if(filterBody.isEmpty())
+    {
+        d->reply = d->networkManager->get(request);
+    }
+    else
+    {
+        request.setRawHeader("Content-Type", "application/json");
+        d->reply = d->networkManager->post(request, QJsonDocument(filterBody).toJson(QJsonDocument::Compact));
+    }
+    d->buffer.clear();
+    //Changes queued from the previous feed are sent again after lastSequence
+    d->queue.clear();
+    d->reply->setReadBufferSize(d->readBufferSize);
     connect(d->reply, SIGNAL(readyRead()), this, SLOT(readChanges()));
+    d->armHeartbeat(this);
+    if(d->lagTimer->interval() > 0 && !d->lagTimer->isActive()) d->lagTimer->start();
+
+    if(previousReply && previousReply->isRunning())
+    {
+        disconnect(previousReply, SIGNAL(readyRead()), this, SLOT(readChanges()));
+        previousReply->abort();
+    }
 }
 
 void CouchDBListener::readChanges()
 {
     Q_D(CouchDBListener);
 
-    const QByteArray replyBA = d->reply->readAll();
-    QJsonDocument document = QJsonDocument::fromJson(replyBA);
+    //Called by the running feed, or after deliveries made room in the queue
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if(reply && reply != d->reply) return;
 
-    if(!document.object().contains("changes")) return;
+    reply = d->reply;
+    if(!reply) return;
 
-    QString revision = document.object().value("changes").toArray().first().toObject().value("rev").toString();
-    QString docID = d->documentID.isEmpty() ? document.object().value("id").toString() : d->documentID;
+    d->armHeartbeat(this);
+
+    //The continuous feed sends one change per line, a read can end in the middle of one.
+    //Once the queue is full the rest stays in the reply, whose bounded buffer makes Qt stop reading the socket
+    int start = 0;
+    int searchFrom = 0;
+    forever
+    {
+        int end;
+        while(d->queue.size() < d->maxQueuedChanges && (end = d->buffer.indexOf('\n', searchFrom)) >= 0)
+        {
+            const QByteArray line = d->buffer.mid(start, end - start).trimmed();
+            start = searchFrom = end + 1;
+
+            //Empty lines are heartbeats
+            if(!line.isEmpty()) d->queue.enqueue(line);
+        }
+
+        if(d->queue.size() >= d->maxQueuedChanges || reply->bytesAvailable() <= 0) break;
+
+        d->buffer.remove(0, start);
+        searchFrom = d->buffer.size();
+        start = 0;
+        d->buffer.append(reply->read(readChunkSize));
+    }
+    d->buffer.remove(0, start);
+
+    if(!d->queue.isEmpty() && !d->deliveryTimer->isActive()) d->deliveryTimer->start();
+}
+
+void CouchDBListener::deliverChanges()
+{
+    Q_D(CouchDBListener);
+
+    //A slow consumer still proves the feed alive
+    if(d->reply) d->armHeartbeat(this);
+
+    const bool wasFull = d->queue.size() >= d->maxQueuedChanges;
+    for(int i = 0; i < deliveryChunkSize && !d->queue.isEmpty(); ++i) processChange(CouchDBJsonView(d->queue.dequeue()));
+
+    if(wasFull && d->queue.size() < d->maxQueuedChanges) readChanges();
+    if(!d->queue.isEmpty() && !d->deliveryTimer->isActive()) d->deliveryTimer->start();
+}
+
+void CouchDBListener::pollLag()
+{
+    Q_D(CouchDBListener);
+
+    if(!d->reply)
+    {
+        d->lagTimer->stop();
+        return;
+    }
+    if(d->lagReply || d->lagPending) return;
+
+    d->lagPending = true;
+    d->server->submit(false, COUCHDB_PRIORITY_LOW, this, [this, d]() {
+        d->lagPending = false;
+        if(!d->reply) return;
+
+        QNetworkRequest request(QUrl(QString("%1/%2").arg(d->server->baseURL(false), d->database)));
+        if(d->server->hasCredential()) request.setRawHeader("Authorization", d->server->authorizationHeader());
+        d->lagReply = d->networkManager->get(request);
+    });
+}
+
+void CouchDBListener::processChange(const CouchDBJsonView &change)
+{
+    Q_D(CouchDBListener);
+
+    const CouchDBJsonView lastSequence = change.value(QStringLiteral("last_seq"));
+    if(!lastSequence.isUndefined())
+    {
+        d->lastSequence = sequenceString(lastSequence);
+        return;
+    }
+
+    const CouchDBJsonView changes = change.value(QStringLiteral("changes"));
+    if(changes.isUndefined()) return;
+
+    d->lastSequence = sequenceString(change.value(QStringLiteral("seq")));
+
+    QString revision = changes.at(0).value(QStringLiteral("rev")).toString();
+    QString docID = change.value(QStringLiteral("id")).toString();
+    if(docID.isEmpty()) docID = d->documentID;
 
     //If the revision is the same as previous changes return
-    if(d->revisionsMap.value(docID) == revision) return;
+    if(d->revisions->revision(QString(), docID) == revision) return;
+
+    d->revisions->setRevision(QString(), docID, revision);
+    if(d->revisionTable) d->revisionTable->setRevision(d->database, docID, revision);
+
+    if(d->includeDocuments && isSignalConnected(QMetaMethod::fromSignal(&CouchDBListener::documentReceived)))
+    {
+        emit documentReceived(docID, revision, change.value(QStringLiteral("deleted")).toBool(), change.value(QStringLiteral("doc")).raw());
+    }
+
+    if(d->batchTimer->interval() > 0)
+    {
+        QVariantMap entry;
+        entry.insert("id", docID);
+        entry.insert("rev", revision);
+        entry.insert("deleted", change.value(QStringLiteral("deleted")).toBool());
+        if(d->includeDocuments) entry.insert("doc", change.value(QStringLiteral("doc")).toVariant());
+
+        //Only the latest revision of a document is kept in the batch
+        if(d->batchIndex.contains(docID))
+        {
+            d->batch[d->batchIndex.value(docID)] = entry;
+        }
+        else
+        {
+            d->batchIndex.insert(docID, d->batch.size());
+            d->batch.append(entry);
+        }
+
+        if(d->batchSize > 0 && d->batch.size() >= d->batchSize) flushBatch();
+        else if(!d->batchTimer->isActive()) d->batchTimer->start();
+        return;
+    }
 
-    d->revisionsMap.insert(docID, revision);
     emit changesMade(revision);
+    if(d->includeDocuments && isSignalConnected(QMetaMethod::fromSignal(&CouchDBListener::documentChanged)))
+    {
+        emit documentChanged(docID, revision, change.value(QStringLiteral("doc")).toObject());
+    }
+}
+
+void CouchDBListener::flushBatch()
+{
+    Q_D(CouchDBListener);
+
+    d->batchTimer->stop();
+    if(d->batch.isEmpty()) return;
+
+    const QVariantList changes = d->batch;
+    d->batch.clear();
+    d->batchIndex.clear();
+
+    emit changesBatch(changes);
+}
+
+void CouchDBListener::heartbeatMissed()
+{
+    Q_D(CouchDBListener);
+    if(!d->reply) return;
+
+    qWarning() << "No heartbeat on changes feed of" << d->database << ", reconnecting";
+    d->reattach();
+    d->reply->abort();
 }
 
 void CouchDBListener::listenFinished(QNetworkReply *reply)
 {
     Q_D(CouchDBListener);
 
+    d->server->recordReply(reply);
+
+    if(reply == d->lagReply)
+    {
+        d->lagReply = 0;
+        reply->deleteLater();
+        if(reply->error() != QNetworkReply::NoError) return;
+
+        const CouchDBJsonView info(reply->readAll());
+        d->updateSequence = sequenceString(info.value(QStringLiteral("update_seq")));
+        //Without a sequence of our own yet (feed from "now" or nothing received) the lag isn't known
+        if(d->lastSequence.isEmpty()) return;
+
+        d->lag = qMax<qint64>(0, sequenceNumber(d->updateSequence) - sequenceNumber(d->lastSequence));
+        emit lagUpdated(d->lag);
+        return;
+    }
+
+    //A feed replaced after a filter change
+    if(reply != d->reply)
+    {
+        reply->deleteLater();
+        return;
+    }
+
     // Check the network reply for errors.
     QNetworkReply::NetworkError netError = reply->error();
     if(netError != QNetworkReply::NoError)
@@ -198,7 +795,11 @@ void CouchDBListener::listenFinished(QNetworkReply *reply)
             break;
         }
 
+        //An aborted feed is restarted on purpose, only a lost one moves to another node
+        if(netError != QNetworkReply::OperationCanceledError) d->reattach();
     }
     reply->deleteLater();
+    d->reply = 0;
+    if(d->timingWheel) d->timingWheel->cancel(d->heartbeatHandle);
     d->retryTimer->start();
 }
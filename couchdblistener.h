@@ -3,8 +3,17 @@
 
 #include <QObject>
 #include <QNetworkReply>
+#include <QJsonObject>
+#include <QStringList>
+#include <QVariantList>
+
+#include "couchdbenums.h"
+#include "couchdbjsonview.h"
 
 class CouchDBServer;
+class CouchDBRevisionTable;
+class CouchDBTimingWheel;
+class CouchDBCluster;
 class CouchDBListenerPrivate;
 class CouchDBListener : public QObject
 {
@@ -21,21 +30,102 @@ public:
     QString documentID() const;
     void setDocumentID(const QString& documentID);
 
+    //Filtering defaults to the "app/docFilter" design document filter, called with the document ID as "name"
+    CouchDBListenerFilter filter() const;
+    QString designFilter() const;
+    void setDesignFilter(const QString& designFilter);
+
+    //Built-in filters evaluated natively by the server, switching them on a running feed resumes from the last sequence
+    QStringList documentIDs() const;
+    void setDocumentIDs(const QStringList& documentIDs);
+
+    QJsonObject selector() const;
+    void setSelector(const QJsonObject& selector);
+
+    void clearFilter();
+
+    //Sequence the feed resumes from, set before launching to continue from a saved checkpoint
+    QString lastSequence() const;
+    void setLastSequence(const QString& lastSequence);
+
+    //Deliver the changed document with the notification (include_docs), optionally with inline attachments and conflicts
+    bool includeDocuments() const;
+    void setIncludeDocuments(const bool& includeDocuments);
+
+    bool includeAttachments() const;
+    void setIncludeAttachments(const bool& includeAttachments);
+
+    bool includeConflicts() const;
+    void setIncludeConflicts(const bool& includeConflicts);
+
+    //A batch interval above 0 replaces per-change signals with changesBatch, holding the latest revision of each document
+    //changed during the interval. The batch is emitted earlier once it reaches batchSize documents (0 means no limit)
+    int batchInterval() const;
+    void setBatchInterval(const int& msec);
+
+    int batchSize() const;
+    void setBatchSize(const int& batchSize);
+
     QString revision(const QString& documentID = "") const;
 
+    //Bounds the revisions remembered to drop duplicate notifications, 0 keeps them all
+    int revisionCapacity() const;
+    void setRevisionCapacity(const int& capacity);
+    qint64 revisionMemoryUsage() const;
+
+    //Bytes Qt may buffer from the feed before it stops reading from the socket, 0 means no limit
+    qint64 readBufferSize() const;
+    void setReadBufferSize(const qint64& readBufferSize);
+
+    //Changes read but not delivered yet. Reading pauses once maxQueuedChanges are waiting, leaving the rest to the socket
+    int maxQueuedChanges() const;
+    void setMaxQueuedChanges(const int& maxQueuedChanges);
+    int queueDepth() const;
+
+    //Changes behind the server, from its update_seq polled every lagInterval msecs (0 disables). Approximate on clusters, -1 until known
+    int lagInterval() const;
+    void setLagInterval(const int& msec);
+    QString updateSequence() const;
+    qint64 lag() const;
+
     void setCookieJar(QNetworkCookieJar *cookieJar);
 
+    //Shared table updated with every revision seen on the feed
+    CouchDBRevisionTable* revisionTable() const;
+    void setRevisionTable(CouchDBRevisionTable *revisionTable);
+
+    //Wheel tracking the heartbeat deadline, a feed silent for two heartbeats is reconnected
+    CouchDBTimingWheel* timingWheel() const;
+    void setTimingWheel(CouchDBTimingWheel *timingWheel);
+
+    //With a cluster set, a feed lost with its node is reattached to a healthy node
+    CouchDBCluster* cluster() const;
+    void setCluster(CouchDBCluster *cluster);
+
     void setParam(const QString &name, const QString &value);
     
     void launch();
 
 signals:
     void changesMade(const QString& revision);
+    void documentChanged(const QString& documentID, const QString& revision, const QJsonObject& document);
+    void changesBatch(const QVariantList& changes);
+    //Document as received on the feed (include_docs), without being parsed. Emitted for every change, batched or not
+    void documentReceived(const QString& documentID, const QString& revision, const bool& deleted, const QByteArray& document);
+    void lagUpdated(const qint64& lag);
 
 private slots:
     void start();
+    void open();
     void readChanges();
+    void deliverChanges();
+    void pollLag();
     void listenFinished(QNetworkReply *reply);
+    void flushBatch();
+    void heartbeatMissed();
+
+protected:
+    void processChange(const CouchDBJsonView& change);
 
 private:
     Q_DECLARE_PRIVATE(CouchDBListener)
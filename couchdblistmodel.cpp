@@ -0,0 +1,549 @@
+#include "couchdblistmodel.h"
+#include "couchdbserver.h"
+#include "couchdblistener.h"
+#include "couchdbjsonview.h"
+
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QPointer>
+#include <QVector>
+#include <QHash>
+#include <QSet>
+#include <QTimer>
+#include <QUrl>
+#include <QDebug>
+
+#include <algorithm>
+
+namespace
+{
+    struct Row
+    {
+        QString documentID;
+        QString revision;
+        QByteArray document; //Null once evicted from the cache
+    };
+
+    struct Change
+    {
+        QString revision;
+        bool deleted;
+        QByteArray document;
+    };
+
+    bool lessThan(const Row& row, const QString& documentID)
+    {
+        return row.documentID < documentID;
+    }
+
+    bool isDesignDocument(const QString& documentID)
+    {
+        return documentID.startsWith(QLatin1String("_design/"));
+    }
+
+    QString encodeKey(const QString& key)
+    {
+        const QByteArray json = QJsonDocument(QJsonArray() << key).toJson(QJsonDocument::Compact);
+        return QString::fromLatin1(QUrl::toPercentEncoding(json.mid(1, json.size() - 2)));
+    }
+
+    const int documentsBatchSize = 1000;
+}
+
+class CouchDBListModelPrivate
+{
+public:
+    CouchDBListModelPrivate() :
+        networkManager(0),
+        pageSize(100),
+        cacheSize(1000),
+        atEnd(true),
+        pageReply(0),
+        pageWaiting(false),
+        documentsReply(0),
+        documentsWaiting(false),
+        generation(0),
+        listener(0),
+        fetchTimer(0),
+        resident(0),
+        lastRead(0)
+    {}
+
+    virtual ~CouchDBListModelPrivate()
+    {
+        if(listener) delete listener;
+        if(fetchTimer) delete fetchTimer;
+        if(networkManager) delete networkManager;
+    }
+
+    //Rows are kept in key order, _all_docs sorts IDs by their code points as QString does
+    int find(const QString& documentID) const
+    {
+        return std::lower_bound(rows.constBegin(), rows.constEnd(), documentID, lessThan) - rows.constBegin();
+    }
+
+    bool contains(const int& position, const QString& documentID) const
+    {
+        return position < rows.size() && rows.at(position).documentID == documentID;
+    }
+
+    void setDocument(Row& row, const QByteArray& document)
+    {
+        if(row.document.isNull() && !document.isNull()) resident++;
+        row.document = document;
+    }
+
+    //Keeps the bodies of a window around the last row read, once the cache is half as large again
+    void evict()
+    {
+        if(resident <= cacheSize + cacheSize / 2) return;
+
+        const int first = qBound(0, lastRead - cacheSize / 2, qMax(0, rows.size() - cacheSize));
+        const int last = first + cacheSize;
+        for(int i = 0; i < rows.size() && resident > cacheSize; ++i)
+        {
+            if(i >= first && i < last) continue;
+            if(rows.at(i).document.isNull()) continue;
+
+            rows[i].document = QByteArray();
+            resident--;
+        }
+    }
+
+    //Reads only, the POST of keys included. Waiting counts as in flight until the rate limiter lets the request go
+    //and its reply is stored in target
+    void send(QObject *receiver, const char *slot, QNetworkReply **target, bool *waiting, const QString& path,
+              const QByteArray& body = QByteArray())
+    {
+        *waiting = true;
+        const int current = generation;
+        couchdb->server()->submit(false, COUCHDB_PRIORITY_NORMAL, receiver, [this, receiver, slot, target, waiting, path, body, current]() {
+            if(!couchdb || generation != current) return;
+            *waiting = false;
+
+            QNetworkRequest request(QUrl(couchdb->server()->baseURL(false) + path));
+            request.setRawHeader("Accept", "application/json");
+            if(couchdb->server()->hasCredential()) request.setRawHeader("Authorization", couchdb->server()->authorizationHeader());
+
+            QNetworkReply *reply;
+            if(body.isNull())
+            {
+                reply = networkManager->get(request);
+            }
+            else
+            {
+                request.setRawHeader("Content-Type", "application/json");
+                reply = networkManager->post(request, body);
+            }
+
+            QObject::connect(reply, SIGNAL(finished()), receiver, slot);
+            *target = reply;
+        });
+    }
+
+    void dropReply(QObject *receiver, QNetworkReply *&reply)
+    {
+        if(!reply) return;
+
+        QObject::disconnect(reply, 0, receiver, 0);
+        reply->abort();
+        reply->deleteLater();
+        reply = 0;
+    }
+
+    QPointer<CouchDB> couchdb; //Model doesn't own couchdb
+    QNetworkAccessManager *networkManager;
+    QString database;
+    int pageSize;
+    int cacheSize;
+
+    QVector<Row> rows;
+    QString lastKey; //Last key paged in, design documents included
+    bool atEnd;
+    QNetworkReply *pageReply;
+    bool pageWaiting;
+    QHash<QString, Change> lateChanges; //Changes past the loaded rows received while a page is on its way
+
+    QNetworkReply *documentsReply;
+    bool documentsWaiting;
+    int generation; //Bumped on reload, requests still held by the rate limiter are dropped
+    mutable QSet<QString> pendingDocuments;
+
+    CouchDBListener *listener;
+    QTimer *fetchTimer;
+    int resident;
+    mutable int lastRead;
+};
+
+CouchDBListModel::CouchDBListModel(QObject *parent) :
+    QAbstractListModel(parent),
+    d_ptr(new CouchDBListModelPrivate)
+{
+    Q_D(CouchDBListModel);
+
+    d->networkManager = new QNetworkAccessManager(this);
+
+    //Bodies read while scrolling are gathered into one request
+    d->fetchTimer = new QTimer(this);
+    d->fetchTimer->setInterval(0);
+    d->fetchTimer->setSingleShot(true);
+    connect(d->fetchTimer, SIGNAL(timeout()), this, SLOT(fetchDocuments()));
+}
+
+CouchDBListModel::~CouchDBListModel()
+{
+    delete d_ptr;
+}
+
+CouchDB *CouchDBListModel::couchdb() const
+{
+    Q_D(const CouchDBListModel);
+    return d->couchdb;
+}
+
+void CouchDBListModel::setCouchdb(CouchDB *couchdb)
+{
+    Q_D(CouchDBListModel);
+    if(d->couchdb == couchdb) return;
+
+    d->couchdb = couchdb;
+    emit couchdbChanged();
+    reload();
+}
+
+QString CouchDBListModel::database() const
+{
+    Q_D(const CouchDBListModel);
+    return d->database;
+}
+
+void CouchDBListModel::setDatabase(const QString &database)
+{
+    Q_D(CouchDBListModel);
+    if(d->database == database) return;
+
+    d->database = database;
+    emit databaseChanged();
+    reload();
+}
+
+int CouchDBListModel::pageSize() const
+{
+    Q_D(const CouchDBListModel);
+    return d->pageSize;
+}
+
+void CouchDBListModel::setPageSize(const int &pageSize)
+{
+    Q_D(CouchDBListModel);
+    if(d->pageSize == pageSize) return;
+
+    d->pageSize = qMax(1, pageSize);
+    emit pageSizeChanged();
+}
+
+int CouchDBListModel::cacheSize() const
+{
+    Q_D(const CouchDBListModel);
+    return d->cacheSize;
+}
+
+void CouchDBListModel::setCacheSize(const int &cacheSize)
+{
+    Q_D(CouchDBListModel);
+    if(d->cacheSize == cacheSize) return;
+
+    d->cacheSize = qMax(1, cacheSize);
+    d->evict();
+    emit cacheSizeChanged();
+}
+
+int CouchDBListModel::rowCount(const QModelIndex &parent) const
+{
+    Q_D(const CouchDBListModel);
+    return parent.isValid() ? 0 : d->rows.size();
+}
+
+QVariant CouchDBListModel::data(const QModelIndex &index, int role) const
+{
+    Q_D(const CouchDBListModel);
+    if(!index.isValid() || index.row() >= d->rows.size()) return QVariant();
+
+    const Row& row = d->rows.at(index.row());
+    switch(role)
+    {
+    case DocumentIDRole:
+    case Qt::DisplayRole:
+        return row.documentID;
+    case RevisionRole:
+        return row.revision;
+    case DocumentRole:
+        d->lastRead = index.row();
+        if(row.document.isNull())
+        {
+            //Evicted, the row is updated once the body is back
+            d->pendingDocuments.insert(row.documentID);
+            if(!d->fetchTimer->isActive()) d->fetchTimer->start();
+            return QVariant();
+        }
+        return CouchDBJsonView(row.document).toVariant();
+    default:
+        return QVariant();
+    }
+}
+
+QHash<int, QByteArray> CouchDBListModel::roleNames() const
+{
+    QHash<int, QByteArray> roles;
+    roles.insert(DocumentIDRole, "documentID");
+    roles.insert(RevisionRole, "revision");
+    roles.insert(DocumentRole, "document");
+    return roles;
+}
+
+bool CouchDBListModel::canFetchMore(const QModelIndex &parent) const
+{
+    Q_D(const CouchDBListModel);
+    return !parent.isValid() && !d->atEnd && !d->pageReply && !d->pageWaiting;
+}
+
+void CouchDBListModel::fetchMore(const QModelIndex &parent)
+{
+    Q_D(CouchDBListModel);
+    if(!canFetchMore(parent) || !d->couchdb) return;
+
+    //Keyset paging: the next page starts at the last key, at the same cost however deep the list is. That row comes
+    //back and is dropped, so one more is asked for. Not skip=1, which drops a live row if the last one was deleted
+    QString path = QStringLiteral("/%1/_all_docs?include_docs=true&limit=%2").arg(d->database).arg(d->lastKey.isEmpty() ? d->pageSize : d->pageSize + 1);
+    if(d->lastKey.isEmpty()) path += QStringLiteral("&update_seq=true");
+    else path += QStringLiteral("&startkey=") + encodeKey(d->lastKey);
+
+    d->send(this, SLOT(pageFinished()), &d->pageReply, &d->pageWaiting, path);
+}
+
+int CouchDBListModel::indexOf(const QString &documentID) const
+{
+    Q_D(const CouchDBListModel);
+
+    const int position = d->find(documentID);
+    return d->contains(position, documentID) ? position : -1;
+}
+
+void CouchDBListModel::reload()
+{
+    Q_D(CouchDBListModel);
+
+    d->dropReply(this, d->pageReply);
+    d->dropReply(this, d->documentsReply);
+    d->pageWaiting = d->documentsWaiting = false;
+    d->generation++;
+    d->fetchTimer->stop();
+
+    if(d->listener) delete d->listener;
+    d->listener = 0;
+
+    beginResetModel();
+    d->rows.clear();
+    d->lastKey.clear();
+    d->lateChanges.clear();
+    d->pendingDocuments.clear();
+    d->resident = 0;
+    d->lastRead = 0;
+    d->atEnd = !d->couchdb || d->database.isEmpty();
+    endResetModel();
+
+    emit countChanged();
+}
+
+void CouchDBListModel::pageFinished()
+{
+    Q_D(CouchDBListModel);
+
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if(!reply || reply != d->pageReply) return;
+
+    reply->deleteLater();
+    d->pageReply = 0;
+    if(d->couchdb) d->couchdb->server()->recordReply(reply);
+
+    if(reply->error() != QNetworkReply::NoError)
+    {
+        //Stops paging, otherwise the view would ask again right away; reload() starts over
+        qWarning() << "Failed to page" << d->database << ":" << reply->errorString();
+        d->atEnd = true;
+        d->lateChanges.clear();
+        return;
+    }
+
+    const CouchDBJsonView result(reply->readAll());
+    const QList<CouchDBJsonView> elements = result.value(QStringLiteral("rows")).elements();
+
+    const QString previousKey = d->lastKey;
+
+    QVector<Row> page;
+    page.reserve(elements.size());
+    foreach(const CouchDBJsonView& element, elements)
+    {
+        d->lastKey = element.value(QStringLiteral("key")).toString();
+        if(d->lastKey == previousKey || isDesignDocument(d->lastKey)) continue;
+
+        Row row;
+        row.documentID = d->lastKey;
+        row.revision = element.value(QStringLiteral("value")).value(QStringLiteral("rev")).toString();
+        row.document = element.value(QStringLiteral("doc")).raw();
+        page.append(row);
+    }
+    d->atEnd = elements.size() < (previousKey.isEmpty() ? d->pageSize : d->pageSize + 1);
+
+    if(!page.isEmpty())
+    {
+        beginInsertRows(QModelIndex(), d->rows.size(), d->rows.size() + page.size() - 1);
+        d->rows += page;
+        d->resident += page.size();
+        endInsertRows();
+        emit countChanged();
+    }
+
+    //The feed starts where the first page was read, no change is missed in between
+    if(!d->listener && d->couchdb)
+    {
+        const CouchDBJsonView sequence = result.value(QStringLiteral("update_seq"));
+
+        d->listener = d->couchdb->createListener(d->database, QString());
+        d->listener->setLastSequence(sequence.isString() ? sequence.toString() : QString::fromLatin1(sequence.raw()));
+        d->listener->clearFilter();
+        d->listener->setIncludeDocuments(true);
+        connect(d->listener, SIGNAL(documentReceived(QString,QString,bool,QByteArray)),
+                this, SLOT(documentReceived(QString,QString,bool,QByteArray)));
+    }
+
+    //The page may predate changes already received for its rows
+    QHash<QString, Change> lateChanges;
+    lateChanges.swap(d->lateChanges);
+    for(QHash<QString, Change>::const_iterator it = lateChanges.constBegin(); it != lateChanges.constEnd(); ++it)
+    {
+        documentReceived(it.key(), it.value().revision, it.value().deleted, it.value().document);
+    }
+
+    d->evict();
+}
+
+void CouchDBListModel::fetchDocuments()
+{
+    Q_D(CouchDBListModel);
+    if(d->documentsReply || d->documentsWaiting || d->pendingDocuments.isEmpty() || !d->couchdb) return;
+
+    QStringList documentIDs;
+    QSet<QString>::iterator it = d->pendingDocuments.begin();
+    while(it != d->pendingDocuments.end() && documentIDs.size() < documentsBatchSize)
+    {
+        documentIDs.append(*it);
+        it = d->pendingDocuments.erase(it);
+    }
+
+    QJsonObject keys;
+    keys.insert(QStringLiteral("keys"), QJsonArray::fromStringList(documentIDs));
+    d->send(this, SLOT(documentsFinished()), &d->documentsReply, &d->documentsWaiting,
+            QStringLiteral("/%1/_all_docs?include_docs=true").arg(d->database), QJsonDocument(keys).toJson(QJsonDocument::Compact));
+}
+
+void CouchDBListModel::documentsFinished()
+{
+    Q_D(CouchDBListModel);
+
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if(!reply || reply != d->documentsReply) return;
+
+    reply->deleteLater();
+    d->documentsReply = 0;
+    if(d->couchdb) d->couchdb->server()->recordReply(reply);
+
+    if(reply->error() != QNetworkReply::NoError)
+    {
+        qWarning() << "Failed to fetch documents of" << d->database << ":" << reply->errorString();
+        return;
+    }
+
+    const QVector<int> roles = QVector<int>() << RevisionRole << DocumentRole;
+
+    const CouchDBJsonView result(reply->readAll());
+    foreach(const CouchDBJsonView& element, result.value(QStringLiteral("rows")).elements())
+    {
+        const CouchDBJsonView document = element.value(QStringLiteral("doc"));
+        if(!document.isObject()) continue;
+
+        const QString documentID = element.value(QStringLiteral("key")).toString();
+        const int position = d->find(documentID);
+        if(!d->contains(position, documentID)) continue;
+
+        Row& row = d->rows[position];
+        row.revision = element.value(QStringLiteral("value")).value(QStringLiteral("rev")).toString();
+        d->setDocument(row, document.raw());
+
+        const QModelIndex changed = index(position);
+        emit dataChanged(changed, changed, roles);
+    }
+
+    d->evict();
+    if(!d->pendingDocuments.isEmpty()) d->fetchTimer->start();
+}
+
+void CouchDBListModel::documentReceived(const QString &documentID, const QString &revision, const bool &deleted, const QByteArray &document)
+{
+    Q_D(CouchDBListModel);
+    if(isDesignDocument(documentID)) return;
+
+    const int position = d->find(documentID);
+
+    if(d->contains(position, documentID))
+    {
+        if(deleted)
+        {
+            beginRemoveRows(QModelIndex(), position, position);
+            if(!d->rows.at(position).document.isNull()) d->resident--;
+            d->rows.remove(position);
+            endRemoveRows();
+            emit countChanged();
+            return;
+        }
+
+        Row& row = d->rows[position];
+        row.revision = revision;
+        d->setDocument(row, document);
+
+        const QModelIndex changed = index(position);
+        emit dataChanged(changed, changed, QVector<int>() << RevisionRole << DocumentRole);
+        d->evict();
+        return;
+    }
+
+    //Rows past the last key are read with the pages still to come
+    if(deleted || (!d->atEnd && (d->lastKey.isEmpty() || documentID > d->lastKey)))
+    {
+        if(d->pageReply || d->pageWaiting)
+        {
+            Change change;
+            change.revision = revision;
+            change.deleted = deleted;
+            change.document = document;
+            d->lateChanges.insert(documentID, change);
+        }
+        return;
+    }
+
+    Row row;
+    row.documentID = documentID;
+    row.revision = revision;
+
+    beginInsertRows(QModelIndex(), position, position);
+    d->rows.insert(position, row);
+    d->setDocument(d->rows[position], document);
+    endInsertRows();
+    emit countChanged();
+
+    d->evict();
+}
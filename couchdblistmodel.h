@@ -0,0 +1,75 @@
+#ifndef COUCHDBLISTMODEL_H
+#define COUCHDBLISTMODEL_H
+
+#include <QAbstractListModel>
+
+#include "couchdb.h"
+
+class CouchDBListModelPrivate;
+//Documents of a database in _all_docs order (design documents left out), for QML views. Rows are paged in through
+//fetchMore as the view scrolls, each page starting after the last key loaded. A changes feed started with the first
+//page inserts, updates and removes single rows. Only the bodies of cacheSize rows around the last one read are kept,
+//the others are fetched again in batches when read; IDs and revisions of every loaded row stay in memory.
+class CouchDBListModel : public QAbstractListModel
+{
+    Q_OBJECT
+    Q_PROPERTY(CouchDB* couchdb READ couchdb WRITE setCouchdb NOTIFY couchdbChanged)
+    Q_PROPERTY(QString database READ database WRITE setDatabase NOTIFY databaseChanged)
+    Q_PROPERTY(int pageSize READ pageSize WRITE setPageSize NOTIFY pageSizeChanged)
+    Q_PROPERTY(int cacheSize READ cacheSize WRITE setCacheSize NOTIFY cacheSizeChanged)
+    Q_PROPERTY(int count READ rowCount NOTIFY countChanged)
+public:
+    enum Roles
+    {
+        DocumentIDRole = Qt::UserRole + 1,
+        RevisionRole,
+        DocumentRole
+    };
+
+    explicit CouchDBListModel(QObject *parent = 0);
+    virtual ~CouchDBListModel();
+
+    CouchDB* couchdb() const;
+    void setCouchdb(CouchDB *couchdb);
+
+    QString database() const;
+    void setDatabase(const QString& database);
+
+    int pageSize() const;
+    void setPageSize(const int& pageSize);
+
+    //Document bodies kept in memory
+    int cacheSize() const;
+    void setCacheSize(const int& cacheSize);
+
+    int rowCount(const QModelIndex& parent = QModelIndex()) const;
+    QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const;
+    QHash<int, QByteArray> roleNames() const;
+
+    bool canFetchMore(const QModelIndex& parent) const;
+    void fetchMore(const QModelIndex& parent);
+
+    Q_INVOKABLE int indexOf(const QString& documentID) const;
+
+signals:
+    void couchdbChanged();
+    void databaseChanged();
+    void pageSizeChanged();
+    void cacheSizeChanged();
+    void countChanged();
+
+public slots:
+    void reload();
+
+private slots:
+    void pageFinished();
+    void documentsFinished();
+    void fetchDocuments();
+    void documentReceived(const QString& documentID, const QString& revision, const bool& deleted, const QByteArray& document);
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBListModel)
+    CouchDBListModelPrivate * const d_ptr;
+};
+
+#endif // COUCHDBLISTMODEL_H
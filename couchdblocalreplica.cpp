@@ -0,0 +1,550 @@
+#include "couchdblocalreplica.h"
+#include "couchdblistener.h"
+
+#include <QFile>
+#include <QSaveFile>
+#include <QHash>
+#include <QVector>
+#include <QPointer>
+#include <QTimer>
+#include <QtEndian>
+#include <QDebug>
+
+#if defined(Q_OS_WIN)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace
+{
+    enum RecordType
+    {
+        RECORD_PUT = 1,
+        RECORD_REMOVE = 2,
+        RECORD_CHECKPOINT = 3
+    };
+
+    const char segmentMagic[] = "TCDBRPL1";
+    const int segmentMagicSize = 8;
+    const int recordHeaderSize = 6; //quint32 payload size + quint16 checksum
+    const qint64 growthStep = 16 * 1024 * 1024;
+
+    //Everything else about a document is read back from its record in the segment
+    struct Entry
+    {
+        qint64 offset;
+        quint32 size;
+    };
+
+    struct Record
+    {
+        quint8 type;
+        const char *id;
+        int idLength;
+        const char *revision;
+        int revisionLength;
+        const char *body;
+        int bodyLength;
+    };
+
+    QByteArray encodeRecord(const RecordType& type, const QByteArray& id, const QByteArray& revision, const QByteArray& body)
+    {
+        const quint32 payloadSize = 1 + 2 + id.size() + 2 + revision.size() + body.size();
+
+        QByteArray record(recordHeaderSize + payloadSize, Qt::Uninitialized);
+        uchar *data = reinterpret_cast<uchar*>(record.data());
+        uchar *payload = data + recordHeaderSize;
+
+        payload[0] = uchar(type);
+        qToBigEndian<quint16>(id.size(), payload + 1);
+        memcpy(payload + 3, id.constData(), id.size());
+        qToBigEndian<quint16>(revision.size(), payload + 3 + id.size());
+        memcpy(payload + 5 + id.size(), revision.constData(), revision.size());
+        memcpy(payload + 5 + id.size() + revision.size(), body.constData(), body.size());
+
+        qToBigEndian<quint32>(payloadSize, data);
+        qToBigEndian<quint16>(qChecksum(reinterpret_cast<const char*>(payload), payloadSize), data + 4);
+        return record;
+    }
+
+    //Reads the record at the start of data, without verifying its checksum
+    bool decodeRecord(const uchar *data, const qint64& available, Record *record, quint32 *recordSize)
+    {
+        if(available < recordHeaderSize) return false;
+
+        const quint32 payloadSize = qFromBigEndian<quint32>(data);
+        if(payloadSize < 5 || qint64(recordHeaderSize) + payloadSize > available) return false;
+
+        const uchar *payload = data + recordHeaderSize;
+        const int idLength = qFromBigEndian<quint16>(payload + 1);
+        if(5u + idLength > payloadSize) return false;
+        const int revisionLength = qFromBigEndian<quint16>(payload + 3 + idLength);
+        if(5u + idLength + revisionLength > payloadSize) return false;
+
+        record->type = payload[0];
+        record->id = reinterpret_cast<const char*>(payload + 3);
+        record->idLength = idLength;
+        record->revision = reinterpret_cast<const char*>(payload + 5 + idLength);
+        record->revisionLength = revisionLength;
+        record->body = record->revision + revisionLength;
+        record->bodyLength = payloadSize - 5 - idLength - revisionLength;
+        *recordSize = recordHeaderSize + payloadSize;
+        return true;
+    }
+
+    bool verifyRecord(const uchar *data)
+    {
+        const quint32 payloadSize = qFromBigEndian<quint32>(data);
+        return qChecksum(reinterpret_cast<const char*>(data + recordHeaderSize), payloadSize) == qFromBigEndian<quint16>(data + 4);
+    }
+
+    bool syncFile(QFile& file)
+    {
+        if(!file.flush()) return false;
+#if defined(Q_OS_WIN)
+        return _commit(file.handle()) == 0;
+#else
+        return ::fsync(file.handle()) == 0;
+#endif
+    }
+}
+
+class CouchDBLocalReplicaPrivate
+{
+public:
+    CouchDBLocalReplicaPrivate(const QString& p) :
+        path(p),
+        map(0),
+        capacity(0),
+        end(0),
+        garbage(0),
+        checkpointSize(0),
+        checkpointTimer(0)
+    {}
+
+    virtual ~CouchDBLocalReplicaPrivate()
+    {
+        if(checkpointTimer) delete checkpointTimer;
+    }
+
+    bool record(const Entry& entry, Record *record) const
+    {
+        quint32 size;
+        return decodeRecord(map + entry.offset, end - entry.offset, record, &size);
+    }
+
+    bool reserve(const qint64& bytes);
+    bool append(const QByteArray& record, Entry *entry);
+    bool load();
+    bool compact();
+    void unmapAll();
+
+    QString path;
+    QFile file;
+    uchar *map;
+    QList<uchar*> retiredMaps; //Earlier, smaller mappings still referenced by documents handed out
+    qint64 capacity;
+    qint64 end;
+    qint64 garbage;
+    quint32 checkpointSize;
+    QHash<QString, Entry> index;
+    QString checkpoint;
+    QPointer<CouchDBListener> listener; //Replica doesn't own the listener
+    QTimer *checkpointTimer;
+};
+
+bool CouchDBLocalReplicaPrivate::reserve(const qint64 &bytes)
+{
+    if(end + bytes <= capacity) return true;
+
+    //The file grows ahead of the data so the mapping is replaced only now and then
+    const qint64 grown = qMax(end + bytes + growthStep, capacity * 2);
+#if defined(Q_OS_WIN)
+    //Windows refuses to resize a file with a view mapped, documents are copied out there so none points into it
+    unmapAll();
+    if(!file.resize(grown))
+    {
+        map = file.map(0, capacity);
+        return false;
+    }
+#else
+    if(!file.resize(grown)) return false;
+#endif
+
+    uchar *grownMap = file.map(0, grown);
+    if(!grownMap) return false;
+
+    if(map) retiredMaps.append(map);
+    map = grownMap;
+    capacity = grown;
+    return true;
+}
+
+bool CouchDBLocalReplicaPrivate::append(const QByteArray &record, Entry *entry)
+{
+    if(!reserve(record.size())) return false;
+    if(!file.seek(end) || file.write(record) != record.size()) return false;
+
+    if(entry)
+    {
+        entry->offset = end;
+        entry->size = record.size();
+    }
+    end += record.size();
+    return true;
+}
+
+bool CouchDBLocalReplicaPrivate::load()
+{
+    if(file.size() == 0 && file.write(segmentMagic, segmentMagicSize) != segmentMagicSize) return false;
+
+    capacity = file.size();
+    map = file.map(0, capacity);
+    if(!map || memcmp(map, segmentMagic, segmentMagicSize) != 0)
+    {
+        qWarning() << "Local replica" << path << "is not a segment file";
+        return false;
+    }
+
+    //Headers only: record boundaries, and the last checkpoint, up to the zeroed space reserved ahead
+    QVector<qint64> offsets;
+    int lastCheckpoint = -1;
+    qint64 offset = segmentMagicSize;
+    Record record;
+    quint32 size;
+    while(decodeRecord(map + offset, capacity - offset, &record, &size))
+    {
+        //A torn checkpoint doesn't count, the one before it still covers what it covered
+        if(record.type == RECORD_CHECKPOINT && verifyRecord(map + offset)) lastCheckpoint = offsets.size();
+        offsets.append(offset);
+        offset += size;
+    }
+
+    //Everything before the last valid checkpoint was synced to disk ahead of it, only the records after it may be torn
+    int valid = offsets.size();
+    for(int i = lastCheckpoint + 1; i < offsets.size(); ++i)
+    {
+        if(verifyRecord(map + offsets.at(i))) continue;
+        valid = i;
+        break;
+    }
+
+    end = valid < offsets.size() ? offsets.at(valid) : offset;
+
+    for(int i = 0; i < valid; ++i)
+    {
+        decodeRecord(map + offsets.at(i), end - offsets.at(i), &record, &size);
+
+        Entry entry;
+        entry.offset = offsets.at(i);
+        entry.size = size;
+
+        const QString id = QString::fromUtf8(record.id, record.idLength);
+        switch(record.type)
+        {
+        case RECORD_PUT:
+            if(index.contains(id)) garbage += index.value(id).size;
+            index.insert(id, entry);
+            break;
+        case RECORD_REMOVE:
+            if(index.contains(id)) garbage += index.take(id).size;
+            garbage += size;
+            break;
+        case RECORD_CHECKPOINT:
+            garbage += checkpointSize;
+            checkpointSize = size;
+            checkpoint = QString::fromUtf8(record.revision, record.revisionLength);
+            break;
+        default:
+            garbage += size;
+            break;
+        }
+    }
+
+    //Drops the torn tail and the space reserved ahead, stale bytes must never follow new records
+    if(end != capacity)
+    {
+        file.unmap(map);
+        map = 0;
+        if(!file.resize(end)) return false;
+
+        capacity = end;
+        map = file.map(0, capacity);
+        if(!map) return false;
+    }
+
+    return true;
+}
+
+bool CouchDBLocalReplicaPrivate::compact()
+{
+    QByteArray segment(segmentMagic, segmentMagicSize);
+    segment.reserve(end - garbage);
+
+    for(QHash<QString, Entry>::const_iterator it = index.constBegin(); it != index.constEnd(); ++it)
+    {
+        segment.append(reinterpret_cast<const char*>(map + it.value().offset), it.value().size);
+    }
+    if(!checkpoint.isEmpty()) segment.append(encodeRecord(RECORD_CHECKPOINT, QByteArray(), checkpoint.toUtf8(), QByteArray()));
+
+    QSaveFile saveFile(path);
+    if(!saveFile.open(QIODevice::WriteOnly) || saveFile.write(segment) != segment.size() || !saveFile.commit())
+    {
+        qWarning() << "Failed to compact local replica" << path << saveFile.errorString();
+        return false;
+    }
+
+    return true;
+}
+
+void CouchDBLocalReplicaPrivate::unmapAll()
+{
+    foreach(uchar *retired, retiredMaps) file.unmap(retired);
+    retiredMaps.clear();
+
+    if(map) file.unmap(map);
+    map = 0;
+}
+
+CouchDBLocalReplica::CouchDBLocalReplica(const QString &path, QObject *parent) :
+    QObject(parent),
+    d_ptr(new CouchDBLocalReplicaPrivate(path))
+{
+    Q_D(CouchDBLocalReplica);
+
+    d->file.setFileName(path);
+
+    d->checkpointTimer = new QTimer(this);
+    d->checkpointTimer->setInterval(1000);
+    d->checkpointTimer->setSingleShot(true);
+    connect(d->checkpointTimer, SIGNAL(timeout()), this, SLOT(saveCheckpoint()));
+}
+
+CouchDBLocalReplica::~CouchDBLocalReplica()
+{
+    close();
+    delete d_ptr;
+}
+
+QString CouchDBLocalReplica::path() const
+{
+    Q_D(const CouchDBLocalReplica);
+    return d->path;
+}
+
+bool CouchDBLocalReplica::open()
+{
+    Q_D(CouchDBLocalReplica);
+    if(d->file.isOpen()) return true;
+
+    //Unbuffered so appended records are visible through the mapping right away
+    if(!d->file.open(QIODevice::ReadWrite | QIODevice::Unbuffered))
+    {
+        qWarning() << "Failed to open local replica" << d->path << d->file.errorString();
+        return false;
+    }
+
+    bool loaded = d->load();
+
+    //Compacting now is safe, no document has been handed out of the mapping yet
+    if(loaded && d->garbage > 1024 * 1024 && d->garbage * 2 > d->end && d->compact())
+    {
+        d->unmapAll();
+        d->file.close();
+        d->index.clear();
+        d->garbage = 0;
+        d->checkpointSize = 0;
+
+        loaded = d->file.open(QIODevice::ReadWrite | QIODevice::Unbuffered) && d->load();
+    }
+
+    if(!loaded)
+    {
+        d->unmapAll();
+        d->file.close();
+        d->index.clear();
+        return false;
+    }
+
+    qDebug() << "Local replica" << d->path << "opened with" << d->index.size() << "documents at sequence" << d->checkpoint;
+    return true;
+}
+
+void CouchDBLocalReplica::close()
+{
+    Q_D(CouchDBLocalReplica);
+    if(!d->file.isOpen()) return;
+
+    saveCheckpoint();
+
+    d->unmapAll();
+    d->file.resize(d->end);
+    d->file.close();
+
+    d->index.clear();
+    d->capacity = d->end = d->garbage = 0;
+    d->checkpointSize = 0;
+}
+
+bool CouchDBLocalReplica::isOpen() const
+{
+    Q_D(const CouchDBLocalReplica);
+    return d->file.isOpen();
+}
+
+CouchDBListener *CouchDBLocalReplica::listener() const
+{
+    Q_D(const CouchDBLocalReplica);
+    return d->listener;
+}
+
+void CouchDBLocalReplica::setListener(CouchDBListener *listener)
+{
+    Q_D(CouchDBLocalReplica);
+
+    if(d->listener) disconnect(d->listener, 0, this, 0);
+    d->listener = listener;
+    if(!listener) return;
+
+    //The sequence goes first, the other settings restart a running feed
+    if(!d->checkpoint.isEmpty()) listener->setLastSequence(d->checkpoint);
+    listener->clearFilter();
+    listener->setIncludeDocuments(true);
+
+    connect(listener, SIGNAL(documentReceived(QString,QString,bool,QByteArray)),
+            this, SLOT(documentReceived(QString,QString,bool,QByteArray)));
+}
+
+QString CouchDBLocalReplica::checkpoint() const
+{
+    Q_D(const CouchDBLocalReplica);
+    return d->checkpoint;
+}
+
+int CouchDBLocalReplica::checkpointInterval() const
+{
+    Q_D(const CouchDBLocalReplica);
+    return d->checkpointTimer->interval();
+}
+
+void CouchDBLocalReplica::setCheckpointInterval(const int &msec)
+{
+    Q_D(CouchDBLocalReplica);
+    d->checkpointTimer->setInterval(msec);
+}
+
+int CouchDBLocalReplica::size() const
+{
+    Q_D(const CouchDBLocalReplica);
+    return d->index.size();
+}
+
+QStringList CouchDBLocalReplica::documentIDs() const
+{
+    Q_D(const CouchDBLocalReplica);
+    return d->index.keys();
+}
+
+bool CouchDBLocalReplica::contains(const QString &documentID) const
+{
+    Q_D(const CouchDBLocalReplica);
+    return d->index.contains(documentID);
+}
+
+QString CouchDBLocalReplica::revision(const QString &documentID) const
+{
+    Q_D(const CouchDBLocalReplica);
+
+    Record record;
+    if(!d->index.contains(documentID) || !d->record(d->index.value(documentID), &record)) return QString();
+
+    return QString::fromUtf8(record.revision, record.revisionLength);
+}
+
+QByteArray CouchDBLocalReplica::document(const QString &documentID) const
+{
+    Q_D(const CouchDBLocalReplica);
+
+    Record record;
+    if(!d->index.contains(documentID) || !d->record(d->index.value(documentID), &record)) return QByteArray();
+
+#if defined(Q_OS_WIN)
+    return QByteArray(record.body, record.bodyLength);
+#else
+    return QByteArray::fromRawData(record.body, record.bodyLength);
+#endif
+}
+
+void CouchDBLocalReplica::putDocument(const QString &documentID, const QString &revision, const QByteArray &document)
+{
+    Q_D(CouchDBLocalReplica);
+    if(!d->file.isOpen()) return;
+
+    Entry entry;
+    if(!d->append(encodeRecord(RECORD_PUT, documentID.toUtf8(), revision.toUtf8(), document), &entry))
+    {
+        qWarning() << "Failed to write to local replica" << d->path << d->file.errorString();
+        return;
+    }
+
+    if(d->index.contains(documentID)) d->garbage += d->index.value(documentID).size;
+    d->index.insert(documentID, entry);
+    if(!d->checkpointTimer->isActive()) d->checkpointTimer->start();
+
+    emit documentStored(documentID, revision);
+}
+
+void CouchDBLocalReplica::removeDocument(const QString &documentID)
+{
+    Q_D(CouchDBLocalReplica);
+    if(!d->file.isOpen() || !d->index.contains(documentID)) return;
+
+    Entry entry;
+    if(!d->append(encodeRecord(RECORD_REMOVE, documentID.toUtf8(), QByteArray(), QByteArray()), &entry))
+    {
+        qWarning() << "Failed to write to local replica" << d->path << d->file.errorString();
+        return;
+    }
+
+    d->garbage += d->index.take(documentID).size + entry.size;
+    if(!d->checkpointTimer->isActive()) d->checkpointTimer->start();
+
+    emit documentRemoved(documentID);
+}
+
+void CouchDBLocalReplica::saveCheckpoint()
+{
+    Q_D(CouchDBLocalReplica);
+
+    d->checkpointTimer->stop();
+    if(!d->file.isOpen()) return;
+
+    //Every change up to the listener's sequence has already been delivered and appended
+    const QString sequence = d->listener ? d->listener->lastSequence() : d->checkpoint;
+    if(sequence.isEmpty()) return;
+
+    //The records it covers reach the disk before the checkpoint is written, a crash can't keep it without them
+    Entry entry;
+    if(!syncFile(d->file) || !d->append(encodeRecord(RECORD_CHECKPOINT, QByteArray(), sequence.toUtf8(), QByteArray()), &entry) ||
+            !syncFile(d->file))
+    {
+        qWarning() << "Failed to checkpoint local replica" << d->path << d->file.errorString();
+        return;
+    }
+
+    d->garbage += d->checkpointSize;
+    d->checkpointSize = entry.size;
+    d->checkpoint = sequence;
+}
+
+void CouchDBLocalReplica::documentReceived(const QString &documentID, const QString &revision, const bool &deleted, const QByteArray &document)
+{
+    Q_D(CouchDBLocalReplica);
+
+    if(deleted) removeDocument(documentID);
+    else putDocument(documentID, revision, document);
+
+    //Changes that leave the replica untouched still move the checkpoint forward
+    if(!d->checkpointTimer->isActive()) d->checkpointTimer->start();
+}
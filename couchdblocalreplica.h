@@ -0,0 +1,62 @@
+#ifndef COUCHDBLOCALREPLICA_H
+#define COUCHDBLOCALREPLICA_H
+
+#include <QObject>
+#include <QStringList>
+
+class CouchDBListener;
+class CouchDBLocalReplicaPrivate;
+//On-disk copy of a database kept current from a changes feed. Documents are appended to a single segment file
+//that is memory mapped for reading, so a started application can read them without network access or parsing.
+//The feed resumes from the sequence checkpointed with the data, only the changes made since are transferred.
+class CouchDBLocalReplica : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CouchDBLocalReplica(const QString& path, QObject *parent = 0);
+    virtual ~CouchDBLocalReplica();
+
+    QString path() const;
+
+    //Rebuilds the index from the segment, compacting it first when most of it is superseded data
+    bool open();
+    void close();
+    bool isOpen() const;
+
+    //Switches the listener to unfiltered include_docs and resumes it from the checkpoint
+    CouchDBListener* listener() const;
+    void setListener(CouchDBListener *listener);
+
+    QString checkpoint() const;
+
+    int checkpointInterval() const;
+    void setCheckpointInterval(const int& msec);
+
+    int size() const;
+    QStringList documentIDs() const;
+    bool contains(const QString& documentID) const;
+    QString revision(const QString& documentID) const;
+
+    //Points straight into the mapped segment, valid until the replica is closed. A copy on Windows, where a mapped
+    //file can't grow and the mapping is replaced whenever it does
+    QByteArray document(const QString& documentID) const;
+
+    void putDocument(const QString& documentID, const QString& revision, const QByteArray& document);
+    void removeDocument(const QString& documentID);
+
+signals:
+    void documentStored(const QString& documentID, const QString& revision);
+    void documentRemoved(const QString& documentID);
+
+public slots:
+    void saveCheckpoint();
+
+private slots:
+    void documentReceived(const QString& documentID, const QString& revision, const bool& deleted, const QByteArray& document);
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBLocalReplica)
+    CouchDBLocalReplicaPrivate * const d_ptr;
+};
+
+#endif // COUCHDBLOCALREPLICA_H
@@ -0,0 +1,555 @@
+#include "couchdbmaintenance.h"
+#include "couchdb.h"
+#include "couchdbserver.h"
+#include "couchdbquery.h"
+#include "couchdbjsonview.h"
+
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+#include <QPointer>
+#include <QTimer>
+#include <QHash>
+#include <QSet>
+#include <QDebug>
+
+namespace
+{
+    enum TaskType
+    {
+        TASK_COMPACTDATABASE,
+        TASK_COMPACTVIEW,
+        TASK_CLEANUP,
+        TASK_WARM
+    };
+
+    enum RequestType
+    {
+        REQUEST_DATABASEINFO,
+        REQUEST_DESIGNDOCUMENTS,
+        REQUEST_VIEWINFO,
+        REQUEST_TASK,
+        REQUEST_PROGRESS,
+        REQUEST_WARMLIST
+    };
+
+    struct Task
+    {
+        Task() :
+            type(TASK_COMPACTDATABASE)
+        {}
+
+        Task(const TaskType& t, const QString& db, const QString& ddoc = QString(), const QString& v = QString()) :
+            type(t),
+            database(db),
+            designDocument(ddoc),
+            view(v)
+        {}
+
+        bool operator==(const Task& other) const
+        {
+            return type == other.type && database == other.database && designDocument == other.designDocument;
+        }
+
+        //Compaction and cleanup load the server, they wait for the maintenance window
+        bool needsWindow() const
+        {
+            return type != TASK_WARM;
+        }
+
+        TaskType type;
+        QString database;
+        QString designDocument; //Name without the _design/ prefix
+        QString view;
+    };
+
+    struct Request
+    {
+        RequestType type;
+        Task task;
+    };
+
+    //Sizes are reported under "sizes" from CouchDB 2.0 on, as disk_size and data_size before
+    void readSizes(const CouchDBJsonView& info, qint64 *fileSize, qint64 *activeSize)
+    {
+        const CouchDBJsonView sizes = info.value(QStringLiteral("sizes"));
+        if(sizes.isObject())
+        {
+            *fileSize = sizes.value(QStringLiteral("file")).toLongLong();
+            *activeSize = sizes.value(QStringLiteral("active")).toLongLong();
+        }
+        else
+        {
+            *fileSize = info.value(QStringLiteral("disk_size")).toLongLong();
+            *activeSize = info.value(QStringLiteral("data_size")).toLongLong();
+        }
+    }
+
+    QString designPath(const QString& database, const QString& designDocument)
+    {
+        return QStringLiteral("/%1/_design/%2").arg(database, designDocument);
+    }
+}
+
+class CouchDBMaintenancePrivate
+{
+public:
+    CouchDBMaintenancePrivate(CouchDBServer *s) :
+        server(s),
+        networkManager(0),
+        pollTimer(0),
+        progressTimer(0),
+        warmTimer(0),
+        fragmentationThreshold(0.5),
+        minimumFileSize(16 * 1024 * 1024),
+        maxConcurrentTasks(1)
+    {}
+
+    virtual ~CouchDBMaintenancePrivate()
+    {
+        if(pollTimer) delete pollTimer;
+        if(progressTimer) delete progressTimer;
+        if(warmTimer) delete warmTimer;
+        if(networkManager) delete networkManager;
+    }
+
+    bool shouldCompact(const qint64& fileSize, const qint64& activeSize) const
+    {
+        if(fileSize < minimumFileSize || fileSize <= 0) return false;
+        return double(fileSize - activeSize) / double(fileSize) >= fragmentationThreshold;
+    }
+
+    bool isKnown(const Task& task) const
+    {
+        return queue.contains(task) || running.contains(task);
+    }
+
+    QPointer<CouchDBServer> server; //Maintenance doesn't own server
+    QNetworkAccessManager *networkManager;
+    QTimer *pollTimer;
+    QTimer *progressTimer;
+    QTimer *warmTimer;
+    QStringList databases;
+    double fragmentationThreshold;
+    qint64 minimumFileSize;
+    QTime windowStart;
+    QTime windowEnd;
+    int maxConcurrentTasks;
+    QList<Task> queue;
+    QList<Task> running;
+    QSet<QString> warmPending;
+    QHash<QNetworkReply*, Request> requests;
+};
+
+namespace
+{
+    //Maintenance waits behind everything else while the server is throttled
+    void send(CouchDBMaintenancePrivate *d, QObject *receiver, const QByteArray& verb, const QString& path,
+              const RequestType& type, const Task& task)
+    {
+        if(!d->server) return;
+
+        d->server->submit(verb == "POST", COUCHDB_PRIORITY_LOW, receiver, [d, receiver, verb, path, type, task]() {
+            if(!d->server) return;
+
+            QNetworkRequest request(QUrl(d->server->baseURL(false) + path));
+            request.setRawHeader("Accept", "application/json");
+            if(d->server->hasCredential()) request.setRawHeader("Authorization", d->server->authorizationHeader());
+
+            QNetworkReply *reply;
+            if(verb == "POST")
+            {
+                request.setRawHeader("Content-Type", "application/json");
+                reply = d->networkManager->post(request, QByteArray());
+            }
+            else
+            {
+                reply = d->networkManager->get(request);
+            }
+
+            QObject::connect(reply, SIGNAL(finished()), receiver, SLOT(replyFinished()));
+
+            Request entry;
+            entry.type = type;
+            entry.task = task;
+            d->requests.insert(reply, entry);
+        });
+    }
+
+    void dispatch(CouchDBMaintenancePrivate *d, CouchDBMaintenance *maintenance)
+    {
+        const bool inWindow = maintenance->isInMaintenanceWindow();
+
+        for(int i = 0; i < d->queue.size() && d->running.size() < d->maxConcurrentTasks;)
+        {
+            if(d->queue.at(i).needsWindow() && !inWindow)
+            {
+                ++i;
+                continue;
+            }
+
+            const Task task = d->queue.takeAt(i);
+            d->running.append(task);
+
+            switch(task.type)
+            {
+            case TASK_COMPACTDATABASE:
+                qDebug() << "Compacting database" << task.database;
+                send(d, maintenance, "POST", QStringLiteral("/%1/_compact").arg(task.database), REQUEST_TASK, task);
+                break;
+            case TASK_COMPACTVIEW:
+                qDebug() << "Compacting views of" << task.database << task.designDocument;
+                send(d, maintenance, "POST", QStringLiteral("/%1/_compact/%2").arg(task.database, task.designDocument), REQUEST_TASK, task);
+                break;
+            case TASK_CLEANUP:
+                send(d, maintenance, "POST", QStringLiteral("/%1/_view_cleanup").arg(task.database), REQUEST_TASK, task);
+                break;
+            case TASK_WARM:
+                //Querying one view builds every view of the design document, they share an index file
+                send(d, maintenance, "GET", designPath(task.database, task.designDocument) + QStringLiteral("/_view/%1?limit=0").arg(task.view),
+                     REQUEST_TASK, task);
+                break;
+            }
+        }
+    }
+}
+
+CouchDBMaintenance::CouchDBMaintenance(CouchDBServer *server, QObject *parent) :
+    QObject(parent),
+    d_ptr(new CouchDBMaintenancePrivate(server))
+{
+    Q_D(CouchDBMaintenance);
+
+    d->networkManager = new QNetworkAccessManager(this);
+
+    d->pollTimer = new QTimer(this);
+    d->pollTimer->setInterval(300000);
+    connect(d->pollTimer, SIGNAL(timeout()), this, SLOT(checkDatabases()));
+
+    //Compactions run on the server, their progress is polled to know when a slot frees up
+    d->progressTimer = new QTimer(this);
+    d->progressTimer->setInterval(10000);
+    connect(d->progressTimer, SIGNAL(timeout()), this, SLOT(checkProgress()));
+
+    d->warmTimer = new QTimer(this);
+    d->warmTimer->setInterval(2000);
+    d->warmTimer->setSingleShot(true);
+    connect(d->warmTimer, SIGNAL(timeout()), this, SLOT(startWarming()));
+}
+
+CouchDBMaintenance::~CouchDBMaintenance()
+{
+    delete d_ptr;
+}
+
+QStringList CouchDBMaintenance::databases() const
+{
+    Q_D(const CouchDBMaintenance);
+    return d->databases;
+}
+
+void CouchDBMaintenance::addDatabase(const QString &database)
+{
+    Q_D(CouchDBMaintenance);
+    if(d->databases.contains(database)) return;
+
+    d->databases.append(database);
+    if(!d->pollTimer->isActive()) d->pollTimer->start();
+}
+
+void CouchDBMaintenance::removeDatabase(const QString &database)
+{
+    Q_D(CouchDBMaintenance);
+    d->databases.removeAll(database);
+    if(d->databases.isEmpty()) d->pollTimer->stop();
+}
+
+int CouchDBMaintenance::pollInterval() const
+{
+    Q_D(const CouchDBMaintenance);
+    return d->pollTimer->interval();
+}
+
+void CouchDBMaintenance::setPollInterval(const int &msec)
+{
+    Q_D(CouchDBMaintenance);
+    d->pollTimer->setInterval(msec);
+}
+
+double CouchDBMaintenance::fragmentationThreshold() const
+{
+    Q_D(const CouchDBMaintenance);
+    return d->fragmentationThreshold;
+}
+
+void CouchDBMaintenance::setFragmentationThreshold(const double &threshold)
+{
+    Q_D(CouchDBMaintenance);
+    d->fragmentationThreshold = qBound(0.0, threshold, 1.0);
+}
+
+qint64 CouchDBMaintenance::minimumFileSize() const
+{
+    Q_D(const CouchDBMaintenance);
+    return d->minimumFileSize;
+}
+
+void CouchDBMaintenance::setMinimumFileSize(const qint64 &bytes)
+{
+    Q_D(CouchDBMaintenance);
+    d->minimumFileSize = bytes;
+}
+
+QTime CouchDBMaintenance::windowStart() const
+{
+    Q_D(const CouchDBMaintenance);
+    return d->windowStart;
+}
+
+QTime CouchDBMaintenance::windowEnd() const
+{
+    Q_D(const CouchDBMaintenance);
+    return d->windowEnd;
+}
+
+void CouchDBMaintenance::setMaintenanceWindow(const QTime &start, const QTime &end)
+{
+    Q_D(CouchDBMaintenance);
+    d->windowStart = start;
+    d->windowEnd = end;
+}
+
+bool CouchDBMaintenance::isInMaintenanceWindow() const
+{
+    Q_D(const CouchDBMaintenance);
+    if(!d->windowStart.isValid() || !d->windowEnd.isValid()) return true;
+
+    const QTime now = QTime::currentTime();
+    if(d->windowStart <= d->windowEnd) return now >= d->windowStart && now < d->windowEnd;
+    return now >= d->windowStart || now < d->windowEnd;
+}
+
+int CouchDBMaintenance::maxConcurrentTasks() const
+{
+    Q_D(const CouchDBMaintenance);
+    return d->maxConcurrentTasks;
+}
+
+void CouchDBMaintenance::setMaxConcurrentTasks(const int &count)
+{
+    Q_D(CouchDBMaintenance);
+    d->maxConcurrentTasks = qMax(1, count);
+    dispatch(d, this);
+}
+
+int CouchDBMaintenance::warmDelay() const
+{
+    Q_D(const CouchDBMaintenance);
+    return d->warmTimer->interval();
+}
+
+void CouchDBMaintenance::setWarmDelay(const int &msec)
+{
+    Q_D(CouchDBMaintenance);
+    d->warmTimer->setInterval(msec);
+}
+
+void CouchDBMaintenance::watch(CouchDB *couchdb)
+{
+    connect(couchdb, SIGNAL(writeQueueFlushed(CouchDBResponse)), this, SLOT(writeQueueFlushed(CouchDBResponse)));
+}
+
+void CouchDBMaintenance::checkDatabases()
+{
+    Q_D(CouchDBMaintenance);
+
+    //Queued work waiting for the window may start now
+    dispatch(d, this);
+    if(!isInMaintenanceWindow()) return;
+
+    foreach(const QString& database, d->databases)
+    {
+        send(d, this, "GET", QStringLiteral("/%1").arg(database), REQUEST_DATABASEINFO, Task(TASK_COMPACTDATABASE, database));
+        send(d, this, "GET", QStringLiteral("/%1/_design_docs").arg(database), REQUEST_DESIGNDOCUMENTS, Task(TASK_COMPACTVIEW, database));
+    }
+}
+
+void CouchDBMaintenance::compactDatabase(const QString &database)
+{
+    Q_D(CouchDBMaintenance);
+
+    const Task task(TASK_COMPACTDATABASE, database);
+    if(!d->isKnown(task)) d->queue.append(task);
+    dispatch(d, this);
+}
+
+void CouchDBMaintenance::compactView(const QString &database, const QString &designDocument)
+{
+    Q_D(CouchDBMaintenance);
+
+    const Task task(TASK_COMPACTVIEW, database, designDocument);
+    if(!d->isKnown(task)) d->queue.append(task);
+    dispatch(d, this);
+}
+
+void CouchDBMaintenance::cleanupViews(const QString &database)
+{
+    Q_D(CouchDBMaintenance);
+
+    const Task task(TASK_CLEANUP, database);
+    if(!d->isKnown(task)) d->queue.append(task);
+    dispatch(d, this);
+}
+
+void CouchDBMaintenance::warmIndexes(const QString &database)
+{
+    Q_D(CouchDBMaintenance);
+
+    //Bulk loads arrive in many batches, the indexes are built once the writes settle
+    d->warmPending.insert(database);
+    d->warmTimer->start();
+}
+
+void CouchDBMaintenance::startWarming()
+{
+    Q_D(CouchDBMaintenance);
+
+    foreach(const QString& database, d->warmPending)
+    {
+        send(d, this, "GET", QStringLiteral("/%1/_design_docs?include_docs=true").arg(database), REQUEST_WARMLIST, Task(TASK_WARM, database));
+    }
+    d->warmPending.clear();
+}
+
+void CouchDBMaintenance::writeQueueFlushed(const CouchDBResponse &response)
+{
+    if(response.status() != COUCHDB_SUCCESS || !response.query()) return;
+    warmIndexes(response.query()->database());
+}
+
+void CouchDBMaintenance::checkProgress()
+{
+    Q_D(CouchDBMaintenance);
+
+    bool compacting = false;
+    foreach(const Task& task, d->running)
+    {
+        if(task.type == TASK_COMPACTDATABASE)
+        {
+            send(d, this, "GET", QStringLiteral("/%1").arg(task.database), REQUEST_PROGRESS, task);
+            compacting = true;
+        }
+        else if(task.type == TASK_COMPACTVIEW)
+        {
+            send(d, this, "GET", designPath(task.database, task.designDocument) + QStringLiteral("/_info"), REQUEST_PROGRESS, task);
+            compacting = true;
+        }
+    }
+
+    if(!compacting) d->progressTimer->stop();
+}
+
+void CouchDBMaintenance::replyFinished()
+{
+    Q_D(CouchDBMaintenance);
+
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if(!reply) return;
+
+    reply->deleteLater();
+    if(!d->requests.contains(reply)) return;
+
+    const Request request = d->requests.take(reply);
+    if(d->server) d->server->recordReply(reply);
+    const Task& task = request.task;
+
+    if(reply->error() != QNetworkReply::NoError)
+    {
+        qWarning() << "Maintenance of" << task.database << "failed:" << reply->errorString();
+        if(request.type == REQUEST_TASK || request.type == REQUEST_PROGRESS) d->running.removeAll(task);
+        emit maintenanceFailed(task.database, reply->errorString());
+        dispatch(d, this);
+        return;
+    }
+
+    const CouchDBJsonView info(reply->readAll());
+
+    switch(request.type)
+    {
+    case REQUEST_DATABASEINFO:
+    {
+        qint64 fileSize, activeSize;
+        readSizes(info, &fileSize, &activeSize);
+        emit databaseChecked(task.database, fileSize, activeSize);
+
+        if(d->shouldCompact(fileSize, activeSize) && !info.value(QStringLiteral("compact_running")).toBool()) compactDatabase(task.database);
+        break;
+    }
+    case REQUEST_DESIGNDOCUMENTS:
+        foreach(const CouchDBJsonView& row, info.value(QStringLiteral("rows")).elements())
+        {
+            const QString id = row.value(QStringLiteral("id")).toString();
+            if(!id.startsWith(QLatin1String("_design/"))) continue;
+
+            send(d, this, "GET", designPath(task.database, id.mid(8)) + QStringLiteral("/_info"), REQUEST_VIEWINFO,
+                 Task(TASK_COMPACTVIEW, task.database, id.mid(8)));
+        }
+        break;
+    case REQUEST_VIEWINFO:
+    {
+        const CouchDBJsonView index = info.value(QStringLiteral("view_index"));
+        qint64 fileSize, activeSize;
+        readSizes(index, &fileSize, &activeSize);
+
+        if(d->shouldCompact(fileSize, activeSize) && !index.value(QStringLiteral("compact_running")).toBool())
+        {
+            compactView(task.database, task.designDocument);
+        }
+        break;
+    }
+    case REQUEST_WARMLIST:
+        foreach(const CouchDBJsonView& row, info.value(QStringLiteral("rows")).elements())
+        {
+            const QString id = row.value(QStringLiteral("id")).toString();
+            const QStringList views = row.value(QStringLiteral("doc")).value(QStringLiteral("views")).keys();
+            if(!id.startsWith(QLatin1String("_design/")) || views.isEmpty()) continue;
+
+            const Task warm(TASK_WARM, task.database, id.mid(8), views.first());
+            if(!d->isKnown(warm)) d->queue.append(warm);
+        }
+        break;
+    case REQUEST_TASK:
+        switch(task.type)
+        {
+        case TASK_COMPACTDATABASE:
+        case TASK_COMPACTVIEW:
+            //Accepted, the slot is held until the server reports the compaction done
+            emit compactionStarted(task.database, task.designDocument);
+            if(!d->progressTimer->isActive()) d->progressTimer->start();
+            return;
+        case TASK_CLEANUP:
+            d->running.removeAll(task);
+            emit viewCleanupFinished(task.database);
+            break;
+        case TASK_WARM:
+            d->running.removeAll(task);
+            emit indexWarmed(task.database, task.designDocument);
+            break;
+        }
+        break;
+    case REQUEST_PROGRESS:
+    {
+        const CouchDBJsonView status = task.type == TASK_COMPACTVIEW ? info.value(QStringLiteral("view_index")) : info;
+        if(status.value(QStringLiteral("compact_running")).toBool() || !d->running.contains(task)) break;
+
+        d->running.removeAll(task);
+        emit compactionFinished(task.database, task.designDocument);
+
+        //Compacted views may leave index files of older design documents behind
+        if(task.type == TASK_COMPACTVIEW) cleanupViews(task.database);
+        break;
+    }
+    }
+
+    dispatch(d, this);
+}
@@ -0,0 +1,80 @@
+#ifndef COUCHDBMAINTENANCE_H
+#define COUCHDBMAINTENANCE_H
+
+#include <QObject>
+#include <QStringList>
+#include <QTime>
+
+class CouchDB;
+class CouchDBServer;
+class CouchDBResponse;
+class CouchDBMaintenancePrivate;
+//Keeps databases healthy in the background: compacts databases and views once their files hold too much
+//garbage, removes index files left behind by old design documents and builds indexes after bulk writes,
+//so the first query doesn't wait for them. Compaction and cleanup only start inside the maintenance window.
+class CouchDBMaintenance : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CouchDBMaintenance(CouchDBServer *server, QObject *parent = 0);
+    virtual ~CouchDBMaintenance();
+
+    QStringList databases() const;
+    void addDatabase(const QString& database);
+    void removeDatabase(const QString& database);
+
+    int pollInterval() const;
+    void setPollInterval(const int& msec);
+
+    //Share of the file not holding live data, from 0 to 1, above which a compaction is started
+    double fragmentationThreshold() const;
+    void setFragmentationThreshold(const double& threshold);
+
+    //Files smaller than this are never compacted, whatever their fragmentation
+    qint64 minimumFileSize() const;
+    void setMinimumFileSize(const qint64& bytes);
+
+    //Local time range, may wrap around midnight. Without one maintenance can run at any time
+    QTime windowStart() const;
+    QTime windowEnd() const;
+    void setMaintenanceWindow(const QTime& start, const QTime& end);
+    bool isInMaintenanceWindow() const;
+
+    //Compactions, cleanups and index builds running on the server at the same time
+    int maxConcurrentTasks() const;
+    void setMaxConcurrentTasks(const int& count);
+
+    //Delay after the last bulk write before indexes are warmed
+    int warmDelay() const;
+    void setWarmDelay(const int& msec);
+
+    //Warms the indexes of a database after each write-ahead log flush
+    void watch(CouchDB *couchdb);
+
+signals:
+    void databaseChecked(const QString& database, const qint64& fileSize, const qint64& activeSize);
+    void compactionStarted(const QString& database, const QString& designDocument);
+    void compactionFinished(const QString& database, const QString& designDocument);
+    void viewCleanupFinished(const QString& database);
+    void indexWarmed(const QString& database, const QString& designDocument);
+    void maintenanceFailed(const QString& database, const QString& error);
+
+public slots:
+    void checkDatabases();
+    void compactDatabase(const QString& database);
+    void compactView(const QString& database, const QString& designDocument);
+    void cleanupViews(const QString& database);
+    void warmIndexes(const QString& database);
+
+private slots:
+    void replyFinished();
+    void checkProgress();
+    void startWarming();
+    void writeQueueFlushed(const CouchDBResponse& response);
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBMaintenance)
+    CouchDBMaintenancePrivate * const d_ptr;
+};
+
+#endif // COUCHDBMAINTENANCE_H
@@ -0,0 +1,226 @@
+#include "couchdbmultipart.h"
+#include "couchdbjsonview.h"
+
+#include <QByteArrayMatcher>
+#include <QStringList>
+
+namespace
+{
+    enum ParserState
+    {
+        STATE_PREAMBLE,
+        STATE_HEADERS,
+        STATE_CONTENT,
+        STATE_DONE,
+        STATE_ERROR
+    };
+
+    //Value of a header parameter such as filename="a.png", quoted or not
+    QByteArray headerParameter(const QByteArray& header, const QByteArray& name)
+    {
+        const QList<QByteArray> parameters = header.split(';');
+        foreach(const QByteArray& parameter, parameters)
+        {
+            const int equals = parameter.indexOf('=');
+            if(equals < 0 || parameter.left(equals).trimmed().toLower() != name) continue;
+
+            QByteArray value = parameter.mid(equals + 1).trimmed();
+            if(value.size() >= 2 && value.startsWith('"') && value.endsWith('"')) value = value.mid(1, value.size() - 2);
+            return value;
+        }
+
+        return QByteArray();
+    }
+}
+
+class CouchDBMultipartParserPrivate
+{
+public:
+    CouchDBMultipartParserPrivate(const QByteArray& boundary) :
+        delimiter("\r\n--" + boundary),
+        matcher(delimiter),
+        state(STATE_PREAMBLE),
+        position(0),
+        contentLength(-1)
+    {}
+
+    virtual ~CouchDBMultipartParserPrivate()
+    {}
+
+    bool advance();
+
+    QByteArray delimiter;
+    QByteArrayMatcher matcher;
+    QByteArray body;
+    ParserState state;
+    int position;
+    int contentLength;
+    CouchDBMultipartPart current;
+    QList<CouchDBMultipartPart> parts;
+};
+
+//Moves through as much of the body as is available, returns false when more data is needed
+bool CouchDBMultipartParserPrivate::advance()
+{
+    switch(state)
+    {
+    case STATE_PREAMBLE:
+    {
+        //The first boundary may open the body without the leading CRLF
+        const QByteArray opening = delimiter.mid(2);
+        const int index = body.startsWith(opening) ? 0 : matcher.indexIn(body, position);
+        if(index < 0)
+        {
+            position = qMax(0, body.size() - delimiter.size() + 1);
+            return false;
+        }
+
+        const int after = index + (index == 0 && body.startsWith(opening) ? opening.size() : delimiter.size());
+        if(body.size() < after + 2) return false;
+
+        if(body.mid(after, 2) == "--") state = STATE_DONE;
+        else state = STATE_HEADERS;
+        position = after + 2;
+        return true;
+    }
+    case STATE_HEADERS:
+    {
+        const int end = body.indexOf("\r\n\r\n", position);
+        if(end < 0) return false;
+
+        current = CouchDBMultipartPart();
+        contentLength = -1;
+
+        const QList<QByteArray> lines = body.mid(position, end - position).split('\n');
+        foreach(const QByteArray& line, lines)
+        {
+            const int colon = line.indexOf(':');
+            if(colon < 0) continue;
+
+            const QByteArray name = line.left(colon).trimmed().toLower();
+            const QByteArray value = line.mid(colon + 1).trimmed();
+            if(name == "content-type") current.contentType = value;
+            else if(name == "content-disposition") current.name = QString::fromUtf8(headerParameter(value, "filename"));
+            else if(name == "content-length") contentLength = value.toInt();
+        }
+
+        current.offset = end + 4;
+        position = current.offset;
+        state = STATE_CONTENT;
+        return true;
+    }
+    case STATE_CONTENT:
+    {
+        int index;
+        if(contentLength >= 0)
+        {
+            //With a length the delimiter is known to follow, no need to search the content
+            index = current.offset + contentLength;
+            if(body.size() < index + delimiter.size()) return false;
+            if(body.mid(index, delimiter.size()) != delimiter)
+            {
+                state = STATE_ERROR;
+                return false;
+            }
+        }
+        else
+        {
+            index = matcher.indexIn(body, position);
+            if(index < 0)
+            {
+                position = qMax(current.offset, body.size() - delimiter.size() + 1);
+                return false;
+            }
+        }
+
+        const int after = index + delimiter.size();
+        if(body.size() < after + 2) return false;
+
+        current.length = index - current.offset;
+        parts.append(current);
+
+        if(body.mid(after, 2) == "--") state = STATE_DONE;
+        else state = STATE_HEADERS;
+        position = after + 2;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+CouchDBMultipartParser::CouchDBMultipartParser(const QByteArray &boundary, QObject *parent) :
+    QObject(parent),
+    d_ptr(new CouchDBMultipartParserPrivate(boundary))
+{
+}
+
+CouchDBMultipartParser::~CouchDBMultipartParser()
+{
+    delete d_ptr;
+}
+
+QByteArray CouchDBMultipartParser::boundary(const QByteArray &contentType)
+{
+    if(!contentType.trimmed().toLower().startsWith("multipart/")) return QByteArray();
+    return headerParameter(contentType, "boundary");
+}
+
+bool CouchDBMultipartParser::feed(const QByteArray &data)
+{
+    Q_D(CouchDBMultipartParser);
+    if(d->state == STATE_ERROR) return false;
+
+    d->body.append(data);
+    while(d->advance()) {}
+
+    return d->state != STATE_ERROR;
+}
+
+bool CouchDBMultipartParser::isComplete() const
+{
+    Q_D(const CouchDBMultipartParser);
+    return d->state == STATE_DONE;
+}
+
+bool CouchDBMultipartParser::hasError() const
+{
+    Q_D(const CouchDBMultipartParser);
+    return d->state == STATE_ERROR;
+}
+
+QByteArray CouchDBMultipartParser::body() const
+{
+    Q_D(const CouchDBMultipartParser);
+    return d->body;
+}
+
+QByteArray CouchDBMultipartParser::document() const
+{
+    Q_D(const CouchDBMultipartParser);
+    if(d->parts.isEmpty()) return QByteArray();
+
+    return d->body.mid(d->parts.first().offset, d->parts.first().length);
+}
+
+QList<CouchDBMultipartPart> CouchDBMultipartParser::attachments() const
+{
+    Q_D(const CouchDBMultipartParser);
+
+    QList<CouchDBMultipartPart> attachments = d->parts.mid(1);
+
+    //Older servers don't name the parts, they follow the order of the stubs marked "follows"
+    QStringList following;
+    const CouchDBJsonView stubs = CouchDBJsonView(document()).value(QStringLiteral("_attachments"));
+    foreach(const QString& name, stubs.keys())
+    {
+        if(stubs.value(name).value(QStringLiteral("follows")).toBool()) following.append(name);
+    }
+
+    for(int i = 0; i < attachments.size(); ++i)
+    {
+        if(attachments.at(i).name.isEmpty() && i < following.size()) attachments[i].name = following.at(i);
+    }
+
+    return attachments;
+}
@@ -0,0 +1,71 @@
+#ifndef COUCHDBMULTIPART_H
+#define COUCHDBMULTIPART_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QList>
+
+class QIODevice;
+
+//Attachment sent along with a document. The content is streamed from the device when one is set, which must then
+//stay open until the call finishes; otherwise the data is sent. The server needs every length up front: a random
+//access device reports it from its size, a sequential one (socket, process) must have it set in length.
+struct CouchDBAttachment
+{
+    CouchDBAttachment() :
+        device(0),
+        length(-1)
+    {}
+
+    QString name;
+    QByteArray contentType;
+    QByteArray data;
+    QIODevice *device;
+    qint64 length; //Bytes read from the device, -1 for the rest of a random access device
+};
+
+struct CouchDBMultipartPart
+{
+    CouchDBMultipartPart() :
+        offset(0),
+        length(0)
+    {}
+
+    QString name;
+    QByteArray contentType;
+    int offset; //Position of the part content in the received body
+    int length;
+};
+
+//Incremental parser for multipart/related bodies as sent by CouchDB for documents with attachments.
+//The first part is the JSON document, every following part is one attachment. Data can be fed as it arrives;
+//parts are recorded as ranges of the accumulated body so attachments are never copied.
+class CouchDBMultipartParserPrivate;
+class CouchDBMultipartParser : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CouchDBMultipartParser(const QByteArray& boundary, QObject *parent = 0);
+    virtual ~CouchDBMultipartParser();
+
+    //Boundary parameter of a Content-Type header, empty if it is not multipart
+    static QByteArray boundary(const QByteArray& contentType);
+
+    //Returns false once the body is found to be malformed
+    bool feed(const QByteArray& data);
+
+    bool isComplete() const;
+    bool hasError() const;
+
+    QByteArray body() const;
+    QByteArray document() const;
+
+    //Attachment parts, named after Content-Disposition or else after the "follows" stubs of the document, in order
+    QList<CouchDBMultipartPart> attachments() const;
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBMultipartParser)
+    CouchDBMultipartParserPrivate * const d_ptr;
+};
+
+#endif // COUCHDBMULTIPART_H
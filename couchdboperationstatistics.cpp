@@ -0,0 +1,63 @@
+#include "couchdboperationstatistics.h"
+
+CouchDBOperationStatistics::CouchDBOperationStatistics() :
+    count(0),
+    errors(0),
+    totalTime(0),
+    maxTime(0)
+{
+    for(int i = 0; i < BucketCount; ++i) buckets[i] = 0;
+}
+
+void CouchDBOperationStatistics::record(const qint64 &msec, const bool &failed)
+{
+    count++;
+    if(failed) errors++;
+    totalTime += msec;
+    maxTime = qMax(maxTime, msec);
+
+    int bucket = 0;
+    while(bucket < BucketCount - 1 && msec >= (Q_INT64_C(1) << bucket)) bucket++;
+    buckets[bucket]++;
+}
+
+double CouchDBOperationStatistics::meanTime() const
+{
+    return count > 0 ? double(totalTime) / count : 0;
+}
+
+qint64 CouchDBOperationStatistics::percentile(const double &share) const
+{
+    if(count == 0) return 0;
+
+    const qint64 target = qMax<qint64>(1, qint64(share * count + 0.5));
+    qint64 seen = 0;
+    for(int i = 0; i < BucketCount - 1; ++i)
+    {
+        seen += buckets[i];
+        if(seen >= target) return Q_INT64_C(1) << i;
+    }
+    return maxTime;
+}
+
+CouchDBOperationStatistics CouchDBOperationStatistics::since(const CouchDBOperationStatistics &previous) const
+{
+    CouchDBOperationStatistics delta;
+    delta.count = count - previous.count;
+    delta.errors = errors - previous.errors;
+    delta.totalTime = totalTime - previous.totalTime;
+
+    int highest = -1;
+    for(int i = 0; i < BucketCount; ++i)
+    {
+        delta.buckets[i] = buckets[i] - previous.buckets[i];
+        if(delta.buckets[i] > 0) highest = i;
+    }
+
+    //A max that grew was set in between, otherwise the slowest call in between is only known up to its bucket
+    if(maxTime > previous.maxTime) delta.maxTime = maxTime;
+    else if(highest >= 0 && highest < BucketCount - 1) delta.maxTime = qMin(maxTime, Q_INT64_C(1) << highest);
+    else if(highest >= 0) delta.maxTime = maxTime;
+
+    return delta;
+}
@@ -0,0 +1,29 @@
+#ifndef COUCHDBOPERATIONSTATISTICS_H
+#define COUCHDBOPERATIONSTATISTICS_H
+
+#include <QtGlobal>
+
+//Latencies of the calls of one operation as seen by the client, from the first send of the call to its response
+struct CouchDBOperationStatistics
+{
+    enum { BucketCount = 24 };
+
+    CouchDBOperationStatistics();
+
+    void record(const qint64& msec, const bool& failed);
+
+    double meanTime() const;
+    //Upper bound in msecs of the power of two bucket reaching the given share of the calls, e.g. 0.99
+    qint64 percentile(const double& share) const;
+
+    //Calls recorded since the given earlier statistics of the same operation
+    CouchDBOperationStatistics since(const CouchDBOperationStatistics& previous) const;
+
+    qint64 count;
+    qint64 errors;
+    qint64 totalTime;
+    qint64 maxTime;
+    qint64 buckets[BucketCount]; //Bucket i counts calls under 2^i msecs, the last one everything above
+};
+
+#endif // COUCHDBOPERATIONSTATISTICS_H
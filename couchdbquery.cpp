@@ -1,7 +1,9 @@
 #include "couchdbquery.h"
 
 #include <QNetworkRequest>
-#include <QTimer>
+#include <QElapsedTimer>
+#include <QHttpMultiPart>
+#include <QPointer>
 
 class CouchDBQueryPrivate
 {
@@ -9,22 +11,34 @@ public:
     CouchDBQueryPrivate(CouchDBServer *s) :
         request(0),
         server(s),
-        timer(0)
+        retryCount(0),
+        priority(COUCHDB_PRIORITY_NORMAL),
+        failoverCount(0),
+        timeoutHandle(0)
     {}
 
     virtual ~CouchDBQueryPrivate()
     {
         if(request) delete request;
-        if(timer) delete timer;
+        if(multiPart && !multiPart->parent()) delete multiPart;
     }
 
     CouchDBServer *server; //Query doesn't own server
     QNetworkRequest *request;
+    QString path;
     CouchDBOperation operation;
     QString database;
     QString documentID;
+    QString revision;
     QByteArray body;
-    QTimer *timer;
+    QPointer<QHttpMultiPart> multiPart; //Owned by the query until sent, by the reply afterwards
+    int retryCount;
+    CouchDBPriority priority;
+    int failoverCount;
+    QElapsedTimer timing;
+    QElapsedTimer callTiming;
+    quint64 timeoutHandle;
+    CouchDBFuture future;
 };
 
 CouchDBQuery::CouchDBQuery(CouchDBServer *server, QObject *parent) :
@@ -33,10 +47,6 @@ CouchDBQuery::CouchDBQuery(CouchDBServer *server, QObject *parent) :
 {
     Q_D(CouchDBQuery);
     d->request = new QNetworkRequest;
-    d->timer = new QTimer(this);
-    d->timer->setInterval(20000);
-    d->timer->setSingleShot(true);
-    connect(d->timer, SIGNAL(timeout()), SIGNAL(timeout()));
 }
 
 CouchDBQuery::~CouchDBQuery()
@@ -50,12 +60,30 @@ CouchDBServer *CouchDBQuery::server() const
     return d->server;
 }
 
+void CouchDBQuery::setServer(CouchDBServer *server)
+{
+    Q_D(CouchDBQuery);
+    d->server = server;
+}
+
 QNetworkRequest* CouchDBQuery::request() const
 {
     Q_D(const CouchDBQuery);
     return d->request;
 }
 
+QString CouchDBQuery::path() const
+{
+    Q_D(const CouchDBQuery);
+    return d->path;
+}
+
+void CouchDBQuery::setPath(const QString &path)
+{
+    Q_D(CouchDBQuery);
+    d->path = path;
+}
+
 QUrl CouchDBQuery::url() const
 {
     Q_D(const CouchDBQuery);
@@ -104,6 +132,18 @@ void CouchDBQuery::setDocumentID(const QString &documentID)
     d->documentID = documentID;
 }
 
+QString CouchDBQuery::revision() const
+{
+    Q_D(const CouchDBQuery);
+    return d->revision;
+}
+
+void CouchDBQuery::setRevision(const QString &revision)
+{
+    Q_D(CouchDBQuery);
+    d->revision = revision;
+}
+
 QByteArray CouchDBQuery::body() const
 {
     Q_D(const CouchDBQuery);
@@ -116,8 +156,114 @@ void CouchDBQuery::setBody(const QByteArray &body)
     d->body = body;
 }
 
-void CouchDBQuery::startTimeoutTimer()
+QHttpMultiPart *CouchDBQuery::multiPart() const
+{
+    Q_D(const CouchDBQuery);
+    return d->multiPart;
+}
+
+void CouchDBQuery::setMultiPart(QHttpMultiPart *multiPart)
+{
+    Q_D(CouchDBQuery);
+    d->multiPart = multiPart;
+}
+
+int CouchDBQuery::retryCount() const
+{
+    Q_D(const CouchDBQuery);
+    return d->retryCount;
+}
+
+void CouchDBQuery::setRetryCount(const int &retryCount)
+{
+    Q_D(CouchDBQuery);
+    d->retryCount = retryCount;
+}
+
+CouchDBPriority CouchDBQuery::priority() const
+{
+    Q_D(const CouchDBQuery);
+    return d->priority;
+}
+
+void CouchDBQuery::setPriority(const CouchDBPriority &priority)
+{
+    Q_D(CouchDBQuery);
+    d->priority = priority;
+}
+
+int CouchDBQuery::failoverCount() const
+{
+    Q_D(const CouchDBQuery);
+    return d->failoverCount;
+}
+
+void CouchDBQuery::setFailoverCount(const int &failoverCount)
+{
+    Q_D(CouchDBQuery);
+    d->failoverCount = failoverCount;
+}
+
+void CouchDBQuery::startTiming()
+{
+    Q_D(CouchDBQuery);
+    d->timing.start();
+    if(!d->callTiming.isValid()) d->callTiming.start();
+}
+
+qint64 CouchDBQuery::elapsed() const
+{
+    Q_D(const CouchDBQuery);
+    return d->timing.isValid() ? d->timing.elapsed() : 0;
+}
+
+qint64 CouchDBQuery::callElapsed() const
+{
+    Q_D(const CouchDBQuery);
+    return d->callTiming.isValid() ? d->callTiming.elapsed() : 0;
+}
+
+quint64 CouchDBQuery::timeoutHandle() const
+{
+    Q_D(const CouchDBQuery);
+    return d->timeoutHandle;
+}
+
+void CouchDBQuery::setTimeoutHandle(const quint64 &timeoutHandle)
+{
+    Q_D(CouchDBQuery);
+    d->timeoutHandle = timeoutHandle;
+}
+
+CouchDBFuture CouchDBQuery::future() const
+{
+    Q_D(const CouchDBQuery);
+    return d->future;
+}
+
+void CouchDBQuery::setFuture(const CouchDBFuture &future)
+{
+    Q_D(CouchDBQuery);
+    d->future = future;
+}
+
+void CouchDBQuery::reset()
 {
     Q_D(CouchDBQuery);
-    d->timer->start();
+    *d->request = QNetworkRequest();
+    d->path.clear();
+    d->database.clear();
+    d->documentID.clear();
+    d->revision.clear();
+    d->body.clear();
+    //Never sent (e.g. shed by the rate limiter), nothing else would free it
+    if(d->multiPart && !d->multiPart->parent()) delete d->multiPart;
+    d->multiPart = 0;
+    d->retryCount = 0;
+    d->priority = COUCHDB_PRIORITY_NORMAL;
+    d->failoverCount = 0;
+    d->timing.invalidate();
+    d->callTiming.invalidate();
+    d->timeoutHandle = 0;
+    d->future = CouchDBFuture();
 }
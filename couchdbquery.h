@@ -4,8 +4,10 @@
 #include <QObject>
 
 #include "couchdbenums.h"
+#include "couchdbfuture.h"
 
 class QNetworkRequest;
+class QHttpMultiPart;
 class CouchDBServer;
 class CouchDBQueryPrivate;
 class CouchDBQuery : public QObject
@@ -16,8 +18,14 @@ public:
     virtual ~CouchDBQuery();
 
     CouchDBServer* server() const;
+    void setServer(CouchDBServer *server);
+
     QNetworkRequest* request() const;
 
+    //Path relative to the server base URL, kept to rebuild the URL
+    QString path() const;
+    void setPath(const QString& path);
+
     QUrl url() const;
     void setUrl(const QUrl& url);
 
@@ -30,15 +38,48 @@ public:
     QString documentID() const;
     void setDocumentID(const QString& documentID);
 
+    QString revision() const;
+    void setRevision(const QString& revision);
+
     QByteArray body() const;
     void setBody(const QByteArray& body);
 
+    //Streamed body sent instead of the plain one. It is consumed by the first send, so the query cannot be retried
+    QHttpMultiPart* multiPart() const;
+    void setMultiPart(QHttpMultiPart *multiPart);
+
+    int retryCount() const;
+    void setRetryCount(const int& retryCount);
+
+    //Order in which queries held back by a rate limiter are sent, and which ones are shed first
+    CouchDBPriority priority() const;
+    void setPriority(const CouchDBPriority& priority);
+
+    //Number of times the query was moved to another cluster node
+    int failoverCount() const;
+    void setFailoverCount(const int& failoverCount);
+
+    //Time since the request was last sent
+    void startTiming();
+    qint64 elapsed() const;
+
+    //Time since the call was first sent, across retries and failovers
+    qint64 callElapsed() const;
+
+    //Handle of the pending deadline in the owner's timing wheel
+    quint64 timeoutHandle() const;
+    void setTimeoutHandle(const quint64& timeoutHandle);
+
+    //Resolved for the caller once the query finishes
+    CouchDBFuture future() const;
+    void setFuture(const CouchDBFuture& future);
+
+    //Clears the query so it can be reused for another request
+    void reset();
+
 signals:
     void timeout();
 
-public slots:
-    void startTimeoutTimer();
-
 private:
     Q_DECLARE_PRIVATE(CouchDBQuery)
     CouchDBQueryPrivate * const d_ptr;
@@ -0,0 +1,363 @@
+#include "couchdbratelimiter.h"
+
+#include <QElapsedTimer>
+#include <QDateTime>
+#include <QNetworkReply>
+#include <QPointer>
+#include <QTimer>
+#include <QDebug>
+
+#include <cmath>
+
+namespace
+{
+    const double minimumFactor = 0.05;
+    const double increaseStep = 0.1;
+    const qint64 adjustInterval = 1000;
+    const int maxRetryAfter = 300000;
+
+    struct Bucket
+    {
+        Bucket() :
+            rate(0),
+            burst(1),
+            tokens(1),
+            updated(0)
+        {}
+
+        double available(const qint64& now, const double& factor) const
+        {
+            if(rate <= 0) return burst;
+            return qMin(burst, tokens + (now - updated) * rate * factor / 1000.0);
+        }
+
+        void refill(const qint64& now, const double& factor)
+        {
+            tokens = available(now, factor);
+            updated = now;
+        }
+
+        double rate;
+        double burst;
+        double tokens;
+        qint64 updated;
+    };
+
+    //Delay in seconds or an HTTP date, in milliseconds
+    int parseRetryAfter(const QByteArray& value)
+    {
+        const QByteArray trimmed = value.trimmed();
+        if(trimmed.isEmpty()) return 0;
+
+        bool ok;
+        const int seconds = trimmed.toInt(&ok);
+        if(ok) return qBound(0, seconds * 1000, maxRetryAfter);
+
+        const QDateTime date = QDateTime::fromString(QString::fromLatin1(trimmed), Qt::RFC2822Date);
+        if(!date.isValid()) return 0;
+        return int(qBound<qint64>(0, QDateTime::currentDateTimeUtc().msecsTo(date), maxRetryAfter));
+    }
+
+    struct Submission
+    {
+        bool write;
+        CouchDBPriority priority;
+        bool hasContext;
+        QPointer<QObject> context;
+        std::function<void()> send;
+    };
+}
+
+class CouchDBRateLimiterPrivate
+{
+public:
+    CouchDBRateLimiterPrivate() :
+        factor(1),
+        lastDecrease(-adjustInterval),
+        lastIncrease(0),
+        pausedUntil(0),
+        maxQueued(256),
+        dispatchTimer(0)
+    {}
+
+    virtual ~CouchDBRateLimiterPrivate()
+    {
+        if(dispatchTimer) delete dispatchTimer;
+    }
+
+    void setRate(Bucket& bucket, const double& perSecond, const int& burst)
+    {
+        bucket.rate = qMax(0.0, perSecond);
+        bucket.burst = burst > 0 ? burst : qMax(1.0, std::ceil(bucket.rate));
+        bucket.tokens = bucket.burst;
+        bucket.updated = clock.elapsed();
+    }
+
+    QElapsedTimer clock;
+    Bucket read;
+    Bucket write;
+    double factor;
+    qint64 lastDecrease;
+    qint64 lastIncrease;
+    qint64 pausedUntil;
+    int maxQueued;
+    QList<Submission> submissions; //Highest priority first, in arrival order within a priority
+    QTimer *dispatchTimer;
+};
+
+CouchDBRateLimiter::CouchDBRateLimiter(QObject *parent) :
+    QObject(parent),
+    d_ptr(new CouchDBRateLimiterPrivate)
+{
+    Q_D(CouchDBRateLimiter);
+    d->clock.start();
+
+    d->dispatchTimer = new QTimer(this);
+    d->dispatchTimer->setSingleShot(true);
+    connect(d->dispatchTimer, SIGNAL(timeout()), this, SLOT(dispatch()));
+}
+
+CouchDBRateLimiter::~CouchDBRateLimiter()
+{
+    delete d_ptr;
+}
+
+double CouchDBRateLimiter::readRate() const
+{
+    Q_D(const CouchDBRateLimiter);
+    return d->read.rate;
+}
+
+int CouchDBRateLimiter::readBurst() const
+{
+    Q_D(const CouchDBRateLimiter);
+    return int(d->read.burst);
+}
+
+void CouchDBRateLimiter::setReadRate(const double &perSecond, const int &burst)
+{
+    Q_D(CouchDBRateLimiter);
+    d->setRate(d->read, perSecond, burst);
+}
+
+double CouchDBRateLimiter::writeRate() const
+{
+    Q_D(const CouchDBRateLimiter);
+    return d->write.rate;
+}
+
+int CouchDBRateLimiter::writeBurst() const
+{
+    Q_D(const CouchDBRateLimiter);
+    return int(d->write.burst);
+}
+
+void CouchDBRateLimiter::setWriteRate(const double &perSecond, const int &burst)
+{
+    Q_D(CouchDBRateLimiter);
+    d->setRate(d->write, perSecond, burst);
+}
+
+int CouchDBRateLimiter::maxQueued() const
+{
+    Q_D(const CouchDBRateLimiter);
+    return d->maxQueued;
+}
+
+void CouchDBRateLimiter::setMaxQueued(const int &maxQueued)
+{
+    Q_D(CouchDBRateLimiter);
+    d->maxQueued = qMax(0, maxQueued);
+}
+
+double CouchDBRateLimiter::throttleFactor() const
+{
+    Q_D(const CouchDBRateLimiter);
+    return d->factor;
+}
+
+bool CouchDBRateLimiter::isBackingOff() const
+{
+    Q_D(const CouchDBRateLimiter);
+    return d->factor < 1 || d->clock.elapsed() < d->pausedUntil;
+}
+
+bool CouchDBRateLimiter::tryAcquire(const bool &write)
+{
+    Q_D(CouchDBRateLimiter);
+
+    const qint64 now = d->clock.elapsed();
+    if(now < d->pausedUntil) return false;
+
+    Bucket& bucket = write ? d->write : d->read;
+    if(bucket.rate <= 0) return true;
+
+    bucket.refill(now, d->factor);
+    if(bucket.tokens < 1) return false;
+
+    bucket.tokens -= 1;
+    return true;
+}
+
+int CouchDBRateLimiter::waitTime(const bool &write) const
+{
+    Q_D(const CouchDBRateLimiter);
+
+    const qint64 now = d->clock.elapsed();
+    const int paused = int(qMax<qint64>(0, d->pausedUntil - now));
+
+    const Bucket& bucket = write ? d->write : d->read;
+    if(bucket.rate <= 0) return paused;
+
+    const double tokens = bucket.available(now, d->factor);
+    if(tokens >= 1) return paused;
+    return qMax(paused, int(std::ceil((1 - tokens) * 1000.0 / (bucket.rate * d->factor))));
+}
+
+bool CouchDBRateLimiter::shouldShed(const CouchDBPriority &priority, const int &queued) const
+{
+    Q_D(const CouchDBRateLimiter);
+
+    switch(priority)
+    {
+    case COUCHDB_PRIORITY_HIGH:
+        return false;
+    case COUCHDB_PRIORITY_NORMAL:
+        return queued >= d->maxQueued;
+    case COUCHDB_PRIORITY_LOW:
+    default:
+        return queued >= d->maxQueued / 2 || isBackingOff();
+    }
+}
+
+bool CouchDBRateLimiter::submit(const bool &write, const CouchDBPriority &priority, QObject *context, const std::function<void()> &send,
+                                const bool &shed)
+{
+    Q_D(CouchDBRateLimiter);
+    if(!send) return false;
+
+    //Requests already waiting for the same bucket keep their turn
+    bool bucketQueued = false;
+    foreach(const Submission& waiting, d->submissions)
+    {
+        if(waiting.write == write) bucketQueued = true;
+    }
+
+    if(!bucketQueued && tryAcquire(write))
+    {
+        send();
+        return true;
+    }
+
+    if(shed && shouldShed(priority, d->submissions.size())) return false;
+
+    Submission submission;
+    submission.write = write;
+    submission.priority = priority;
+    submission.hasContext = context != 0;
+    submission.context = context;
+    submission.send = send;
+
+    int index = d->submissions.size();
+    while(index > 0 && d->submissions.at(index - 1).priority > priority) index--;
+    d->submissions.insert(index, submission);
+
+    const int wait = waitTime(write);
+    if(!d->dispatchTimer->isActive() || d->dispatchTimer->remainingTime() > wait) d->dispatchTimer->start(qMax(1, wait));
+    return true;
+}
+
+int CouchDBRateLimiter::pending() const
+{
+    Q_D(const CouchDBRateLimiter);
+    return d->submissions.size();
+}
+
+void CouchDBRateLimiter::dispatch()
+{
+    Q_D(CouchDBRateLimiter);
+
+    //An empty bucket doesn't hold back the other one
+    bool exhausted[2] = { false, false };
+    int wait = -1;
+
+    for(int i = 0; i < d->submissions.size();)
+    {
+        const Submission& submission = d->submissions.at(i);
+        if(submission.hasContext && !submission.context)
+        {
+            d->submissions.removeAt(i);
+            continue;
+        }
+
+        if(exhausted[submission.write ? 1 : 0])
+        {
+            i++;
+            continue;
+        }
+
+        if(!tryAcquire(submission.write))
+        {
+            exhausted[submission.write ? 1 : 0] = true;
+            const int bucketWait = waitTime(submission.write);
+            wait = wait < 0 ? bucketWait : qMin(wait, bucketWait);
+            i++;
+            continue;
+        }
+
+        //Taken out first, the send may submit again
+        const std::function<void()> send = d->submissions.takeAt(i).send;
+        send();
+    }
+
+    if(wait >= 0) d->dispatchTimer->start(qMax(1, wait));
+}
+
+void CouchDBRateLimiter::recordReply(QNetworkReply *reply)
+{
+    if(!reply) return;
+
+    const int httpStatus = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if(httpStatus > 0) recordResponse(httpStatus, reply->rawHeader("Retry-After"));
+}
+
+void CouchDBRateLimiter::recordResponse(const int &httpStatus, const QByteArray &retryAfter)
+{
+    Q_D(CouchDBRateLimiter);
+
+    const qint64 now = d->clock.elapsed();
+
+    //Time already passed is credited at the rate it passed at
+    d->read.refill(now, d->factor);
+    d->write.refill(now, d->factor);
+
+    if(httpStatus == 429 || httpStatus == 503)
+    {
+        const int pause = parseRetryAfter(retryAfter);
+        if(pause > 0) d->pausedUntil = qMax(d->pausedUntil, now + pause);
+
+        //Responses to requests sent before the last decrease took effect don't count again
+        const bool decrease = now - d->lastDecrease >= adjustInterval;
+        if(!decrease && pause == 0) return;
+
+        if(decrease)
+        {
+            d->factor = qMax(minimumFactor, d->factor / 2);
+            d->lastDecrease = now;
+            d->lastIncrease = now;
+            d->read.tokens = qMin(d->read.tokens, 0.0);
+            d->write.tokens = qMin(d->write.tokens, 0.0);
+        }
+
+        qWarning() << "Server pushing back with" << httpStatus << ", sending at" << d->factor << "of the configured rates";
+        emit throttled(d->factor, pause);
+        return;
+    }
+
+    if(d->factor < 1 && now - d->lastIncrease >= adjustInterval)
+    {
+        d->factor = qMin(1.0, d->factor + increaseStep);
+        d->lastIncrease = now;
+        if(d->factor >= 1) emit recovered();
+    }
+}
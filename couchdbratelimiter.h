@@ -0,0 +1,74 @@
+#ifndef COUCHDBRATELIMITER_H
+#define COUCHDBRATELIMITER_H
+
+#include <QObject>
+
+#include <functional>
+
+#include "couchdbenums.h"
+
+class QNetworkReply;
+class CouchDBRateLimiterPrivate;
+//Token buckets bounding the requests sent to one server, with separate budgets for reads and writes.
+//A 429 or 503 halves the allowed rates, at most once a second, and a Retry-After pauses sending altogether;
+//while the server keeps up the rates grow back by a tenth of the configured ones every second.
+//Without a configured rate (the default) there is nothing to halve: only a Retry-After slows requests down, a bare
+//429 or 503 doesn't. Set the rates to have the limiter back off on its own.
+//Requests without a token wait in priority order; low priority ones are shed first once the server pushes back.
+//CouchDB calls and the requests of the other components of a server all wait in the one queue of submit().
+class CouchDBRateLimiter : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CouchDBRateLimiter(QObject *parent = 0);
+    virtual ~CouchDBRateLimiter();
+
+    //Requests per second, 0 for no limit. The burst defaults to one second worth of requests
+    double readRate() const;
+    int readBurst() const;
+    void setReadRate(const double& perSecond, const int& burst = 0);
+
+    double writeRate() const;
+    int writeBurst() const;
+    void setWriteRate(const double& perSecond, const int& burst = 0);
+
+    //Requests allowed to wait for a token, normal priority ones are shed past it and low priority ones past half
+    int maxQueued() const;
+    void setMaxQueued(const int& maxQueued);
+
+    //Share of the configured rates currently allowed
+    double throttleFactor() const;
+    //Slowed down or paused by the server
+    bool isBackingOff() const;
+
+    bool tryAcquire(const bool& write);
+    //Milliseconds until tryAcquire may succeed
+    int waitTime(const bool& write) const;
+
+    bool shouldShed(const CouchDBPriority& priority, const int& queued) const;
+
+    //Sends right away when a token is available, otherwise once one is, after the waiting requests of higher priority.
+    //The send is dropped if the context is destroyed first. With shed set a request that would wait is refused
+    //(false) when shouldShed() says so; background requests (feeds, scans, polls) are bounded by their own components
+    bool submit(const bool& write, const CouchDBPriority& priority, QObject *context, const std::function<void()>& send,
+                const bool& shed = false);
+    //Requests waiting in submit()
+    int pending() const;
+
+    void recordResponse(const int& httpStatus, const QByteArray& retryAfter = QByteArray());
+    //Same, from a finished reply
+    void recordReply(QNetworkReply *reply);
+
+signals:
+    void throttled(const double& throttleFactor, const int& retryAfter);
+    void recovered();
+
+private slots:
+    void dispatch();
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBRateLimiter)
+    CouchDBRateLimiterPrivate * const d_ptr;
+};
+
+#endif // COUCHDBRATELIMITER_H
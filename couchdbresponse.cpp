@@ -1,21 +1,49 @@
 #include "couchdbresponse.h"
+#include "couchdbjson.h"
 
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QStringList>
 
 class CouchDBResponsePrivate
 {
 public:
     CouchDBResponsePrivate() :
         query(0),
-        status(COUCHDB_ERROR)
+        status(COUCHDB_ERROR),
+        parsed(true),
+        indexed(true)
     {}
 
+    //The DOM is only built for callers that ask for it, typed reads go straight from the bytes
+    void parse() const
+    {
+        if(parsed) return;
+        parsed = true;
+
+        document = QJsonDocument::fromJson(data);
+        if(document.isNull() || document.isEmpty()) document = QJsonDocument();
+    }
+
     CouchDBQuery *query; //Response do not own query
     CouchDBReplyStatus status;
     QString revisionData;
     QByteArray data;
-    QJsonDocument document;
+    mutable QJsonDocument document;
+    mutable bool parsed;
+    mutable CouchDBJsonView view;
+    mutable bool indexed;
+    QByteArray multipartBody;
+    QList<CouchDBMultipartPart> attachments;
+
+    const CouchDBMultipartPart *part(const QString& name) const
+    {
+        for(int i = 0; i < attachments.size(); ++i)
+        {
+            if(attachments.at(i).name == name) return &attachments.at(i);
+        }
+        return 0;
+    }
 };
 
 CouchDBResponse::CouchDBResponse(QObject *parent) :
@@ -56,7 +84,9 @@ void CouchDBResponse::setStatus(const CouchDBReplyStatus &status)
 QString CouchDBResponse::revisionData() const
 {
     Q_D(const CouchDBResponse);
-    return d->revisionData;
+    if(!d->revisionData.isEmpty() || d->data.isEmpty()) return d->revisionData;
+
+    return CouchDBJson::readString(d->data, QStringLiteral("revision"));
 }
 
 void CouchDBResponse::setRevisionData(const QString &revision)
@@ -75,29 +105,111 @@ void CouchDBResponse::setData(const QByteArray &data)
 {
     Q_D(CouchDBResponse);
     d->data = data;
-    d->document = QJsonDocument::fromJson(data);
+    d->document = QJsonDocument();
+    d->parsed = data.isEmpty();
+    d->view = CouchDBJsonView();
+    d->indexed = data.isEmpty();
+}
 
-    if(d->document.isNull() || d->document.isEmpty())
-    {
-        d->document = QJsonDocument();
-    }
-    else
+CouchDBJsonView CouchDBResponse::view() const
+{
+    Q_D(const CouchDBResponse);
+    if(!d->indexed)
     {
-        if(d->document.object().contains("revision"))
-        {
-            d->revisionData = d->document.object().value("revision").toString();
-        }
+        d->view = CouchDBJsonView(d->data);
+        d->indexed = true;
     }
+
+    return d->view;
 }
 
 QJsonDocument CouchDBResponse::document() const
 {
     Q_D(const CouchDBResponse);
+    d->parse();
     return d->document;
 }
 
 QJsonObject CouchDBResponse::documentObj() const
 {
     Q_D(const CouchDBResponse);
+    d->parse();
     return d->document.object();
 }
+
+QStringList CouchDBResponse::attachmentNames() const
+{
+    Q_D(const CouchDBResponse);
+
+    QStringList names;
+    foreach(const CouchDBMultipartPart& part, d->attachments) names.append(part.name);
+    return names;
+}
+
+QByteArray CouchDBResponse::attachment(const QString &name) const
+{
+    Q_D(const CouchDBResponse);
+
+    const CouchDBMultipartPart *part = d->part(name);
+    if(!part) return QByteArray();
+
+    return d->multipartBody.mid(part->offset, part->length);
+}
+
+QByteArray CouchDBResponse::attachmentContentType(const QString &name) const
+{
+    Q_D(const CouchDBResponse);
+
+    const CouchDBMultipartPart *part = d->part(name);
+    return part ? part->contentType : QByteArray();
+}
+
+QByteArray CouchDBResponse::multipartBody() const
+{
+    Q_D(const CouchDBResponse);
+    return d->multipartBody;
+}
+
+QList<CouchDBMultipartPart> CouchDBResponse::attachmentParts() const
+{
+    Q_D(const CouchDBResponse);
+    return d->attachments;
+}
+
+void CouchDBResponse::setAttachments(const QByteArray &body, const QList<CouchDBMultipartPart> &attachments)
+{
+    Q_D(CouchDBResponse);
+    d->multipartBody = body;
+    d->attachments = attachments;
+}
+
+QHash<QString, QString> CouchDBResponse::revisions() const
+{
+    QHash<QString, QString> revisions;
+    foreach(const CouchDBJsonView& row, view().value(QStringLiteral("rows")).elements())
+    {
+        const CouchDBJsonView value = row.value(QStringLiteral("value"));
+        if(value.isObject()) revisions.insert(row.value(QStringLiteral("key")).toString(), value.value(QStringLiteral("rev")).toString());
+    }
+    return revisions;
+}
+
+QStringList CouchDBResponse::deletedDocuments() const
+{
+    QStringList documentIDs;
+    foreach(const CouchDBJsonView& row, view().value(QStringLiteral("rows")).elements())
+    {
+        if(row.value(QStringLiteral("value")).value(QStringLiteral("deleted")).toBool()) documentIDs.append(row.value(QStringLiteral("key")).toString());
+    }
+    return documentIDs;
+}
+
+QStringList CouchDBResponse::missingDocuments() const
+{
+    QStringList documentIDs;
+    foreach(const CouchDBJsonView& row, view().value(QStringLiteral("rows")).elements())
+    {
+        if(row.contains(QStringLiteral("error"))) documentIDs.append(row.value(QStringLiteral("key")).toString());
+    }
+    return documentIDs;
+}
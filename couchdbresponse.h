@@ -2,8 +2,12 @@
 #define COUCHDBRESPONSE_H
 
 #include <QObject>
+#include <QHash>
+#include <QStringList>
 
 #include "couchdbenums.h"
+#include "couchdbjsonview.h"
+#include "couchdbmultipart.h"
 
 class CouchDBQuery;
 class CouchDBResponsePrivate;
@@ -26,9 +30,26 @@ public:
     QByteArray data() const;
     void setData(const QByteArray& data);
 
+    //On-demand view of the data, cheaper than the document when only a few members are read
+    CouchDBJsonView view() const;
+
     QJsonDocument document() const;
     QJsonObject documentObj() const;
 
+    //Attachments received as MIME parts. The body is implicitly shared with the future of the call, each attachment is
+    //copied out of it when read so it stays valid on its own
+    QStringList attachmentNames() const;
+    QByteArray attachment(const QString& name) const;
+    QByteArray attachmentContentType(const QString& name) const;
+    QByteArray multipartBody() const;
+    QList<CouchDBMultipartPart> attachmentParts() const;
+    void setAttachments(const QByteArray& body, const QList<CouchDBMultipartPart>& attachments);
+
+    //Results of retrieveRevisions. Deleted documents keep the revision of their deletion, missing ones have none
+    QHash<QString, QString> revisions() const;
+    QStringList deletedDocuments() const;
+    QStringList missingDocuments() const;
+
 private:
     Q_DECLARE_PRIVATE(CouchDBResponse)
     CouchDBResponsePrivate * const d_ptr;
@@ -0,0 +1,371 @@
+#include "couchdbrevisiontable.h"
+
+#include <QVector>
+#include <QHash>
+
+#include <cstring>
+
+namespace
+{
+    const quint32 npos = 0xFFFFFFFF;
+
+    //Set on the generation when the revision is not in the "N-<32 hex digits>" form and is stored verbatim in the arena
+    const quint32 verbatimRevision = 0x80000000;
+
+    struct Slot
+    {
+        Slot() :
+            keyOffset(npos),
+            keyLength(0),
+            hash(0),
+            generation(0),
+            previous(npos),
+            next(npos)
+        {
+            memset(digest, 0, sizeof(digest));
+        }
+
+        bool isEmpty() const { return keyOffset == npos; }
+
+        quint32 keyOffset;
+        quint32 keyLength;
+        quint32 hash;
+        quint32 generation;
+        quint32 previous; //Towards the most recently written entry
+        quint32 next;     //Towards the least recently written entry
+        uchar digest[16];
+    };
+
+    int hexValue(const ushort& c)
+    {
+        if(c >= '0' && c <= '9') return c - '0';
+        if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    bool parseRevision(const QString& revision, quint32 *generation, uchar *digest)
+    {
+        const int dash = revision.indexOf(QLatin1Char('-'));
+        if(dash <= 0 || revision.size() - dash - 1 != 32) return false;
+
+        bool ok;
+        const uint value = revision.left(dash).toUInt(&ok);
+        if(!ok || value >= verbatimRevision) return false;
+
+        const ushort *hex = revision.utf16() + dash + 1;
+        for(int i = 0; i < 16; ++i)
+        {
+            const int high = hexValue(hex[2 * i]);
+            const int low = hexValue(hex[2 * i + 1]);
+            if(high < 0 || low < 0) return false;
+            digest[i] = uchar((high << 4) | low);
+        }
+
+        *generation = value;
+        return true;
+    }
+}
+
+class CouchDBRevisionTablePrivate
+{
+public:
+    CouchDBRevisionTablePrivate() :
+        count(0),
+        capacity(0),
+        head(npos),
+        tail(npos),
+        garbage(0)
+    {}
+
+    static QByteArray key(const QString& database, const QString& documentID)
+    {
+        QByteArray key = database.toUtf8();
+        key.append('\n');
+        key.append(documentID.toUtf8());
+        return key;
+    }
+
+    quint32 mask() const { return quint32(slots.size()) - 1; }
+
+    quint32 find(const QByteArray& key, const quint32& hash) const
+    {
+        if(slots.isEmpty()) return npos;
+
+        for(quint32 i = hash & mask();; i = (i + 1) & mask())
+        {
+            const Slot& slot = slots.at(i);
+            if(slot.isEmpty()) return npos;
+            if(slot.hash == hash && slot.keyLength == quint32(key.size()) &&
+                    memcmp(arena.constData() + slot.keyOffset, key.constData(), key.size()) == 0) return i;
+        }
+    }
+
+    void unlink(const quint32& index)
+    {
+        Slot& slot = slots[index];
+        if(slot.previous != npos) slots[slot.previous].next = slot.next;
+        else head = slot.next;
+        if(slot.next != npos) slots[slot.next].previous = slot.previous;
+        else tail = slot.previous;
+        slot.previous = slot.next = npos;
+    }
+
+    void linkFront(const quint32& index)
+    {
+        Slot& slot = slots[index];
+        slot.previous = npos;
+        slot.next = head;
+        if(head != npos) slots[head].previous = index;
+        head = index;
+        if(tail == npos) tail = index;
+    }
+
+    //Points the neighbours of a slot moved by the backward shift at its new position
+    void relink(const quint32& index)
+    {
+        const Slot& slot = slots.at(index);
+        if(slot.previous != npos) slots[slot.previous].next = index;
+        else head = index;
+        if(slot.next != npos) slots[slot.next].previous = index;
+        else tail = index;
+    }
+
+    quint32 storedSize(const Slot& slot) const
+    {
+        return slot.keyLength + ((slot.generation & verbatimRevision) ? slot.generation & ~verbatimRevision : 0);
+    }
+
+    void erase(quint32 index)
+    {
+        unlink(index);
+        garbage += storedSize(slots.at(index));
+        slots[index] = Slot();
+        --count;
+
+        //Backward shift deletion keeps probe sequences intact without tombstones
+        quint32 j = index;
+        forever
+        {
+            j = (j + 1) & mask();
+            if(slots.at(j).isEmpty()) break;
+
+            const quint32 ideal = slots.at(j).hash & mask();
+            const bool reachable = index <= j ? (index < ideal && ideal <= j) : (index < ideal || ideal <= j);
+            if(reachable) continue;
+
+            slots[index] = slots.at(j);
+            relink(index);
+            slots[j] = Slot();
+            index = j;
+        }
+    }
+
+    void storeRevision(Slot& slot, const QString& revision)
+    {
+        if(parseRevision(revision, &slot.generation, slot.digest)) return;
+
+        const QByteArray bytes = revision.toUtf8();
+        slot.generation = verbatimRevision | quint32(bytes.size());
+        arena.append(bytes);
+    }
+
+    QString revision(const Slot& slot) const
+    {
+        if(slot.generation & verbatimRevision)
+        {
+            return QString::fromUtf8(arena.constData() + slot.keyOffset + slot.keyLength, slot.generation & ~verbatimRevision);
+        }
+
+        const QByteArray digest = QByteArray::fromRawData(reinterpret_cast<const char*>(slot.digest), sizeof(slot.digest));
+        return QString::number(slot.generation) + QLatin1Char('-') + QString::fromLatin1(digest.toHex());
+    }
+
+    void rehash(int size);
+    void compactArena();
+
+    QVector<Slot> slots;
+    QByteArray arena; //Interned UTF-8 keys, followed by the revision when it is stored verbatim
+    int count;
+    int capacity;
+    quint32 head;
+    quint32 tail;
+    quint32 garbage;
+};
+
+void CouchDBRevisionTablePrivate::rehash(int size)
+{
+    QVector<Slot> previousSlots = slots;
+    const quint32 previousTail = tail;
+
+    slots = QVector<Slot>(size);
+    head = tail = npos;
+
+    //Reinserting from the least recently written keeps the recency order
+    for(quint32 i = previousTail; i != npos; i = previousSlots.at(i).previous)
+    {
+        Slot slot = previousSlots.at(i);
+        quint32 index = slot.hash & mask();
+        while(!slots.at(index).isEmpty()) index = (index + 1) & mask();
+
+        slots[index] = slot;
+        linkFront(index);
+    }
+}
+
+void CouchDBRevisionTablePrivate::compactArena()
+{
+    QByteArray compacted;
+    compacted.reserve(arena.size() - garbage);
+
+    for(int i = 0; i < slots.size(); ++i)
+    {
+        Slot& slot = slots[i];
+        if(slot.isEmpty()) continue;
+
+        const quint32 offset = compacted.size();
+        compacted.append(arena.constData() + slot.keyOffset, storedSize(slot));
+        slot.keyOffset = offset;
+    }
+
+    arena = compacted;
+    garbage = 0;
+}
+
+CouchDBRevisionTable::CouchDBRevisionTable(QObject *parent) :
+    QObject(parent),
+    d_ptr(new CouchDBRevisionTablePrivate)
+{
+}
+
+CouchDBRevisionTable::~CouchDBRevisionTable()
+{
+    delete d_ptr;
+}
+
+QString CouchDBRevisionTable::revision(const QString &database, const QString &documentID) const
+{
+    Q_D(const CouchDBRevisionTable);
+
+    const QByteArray key = CouchDBRevisionTablePrivate::key(database, documentID);
+    const quint32 index = d->find(key, qHash(key));
+    if(index == npos) return QString();
+
+    return d->revision(d->slots.at(index));
+}
+
+void CouchDBRevisionTable::setRevision(const QString &database, const QString &documentID, const QString &revision)
+{
+    Q_D(CouchDBRevisionTable);
+    if(revision.isEmpty()) return;
+
+    const QByteArray key = CouchDBRevisionTablePrivate::key(database, documentID);
+    const quint32 hash = qHash(key);
+
+    quint32 index = d->find(key, hash);
+    if(index != npos)
+    {
+        Slot& slot = d->slots[index];
+
+        quint32 generation;
+        uchar digest[16];
+        if(parseRevision(revision, &generation, digest))
+        {
+            if(slot.generation & verbatimRevision) d->garbage += slot.generation & ~verbatimRevision;
+            slot.generation = generation;
+            memcpy(slot.digest, digest, sizeof(digest));
+        }
+        else
+        {
+            //A verbatim revision has to follow its key, both are appended again
+            d->garbage += d->storedSize(slot);
+            slot.keyOffset = d->arena.size();
+            d->arena.append(key);
+            d->storeRevision(slot, revision);
+        }
+
+        d->unlink(index);
+        d->linkFront(index);
+        return;
+    }
+
+    if(d->capacity > 0 && d->count >= d->capacity) d->erase(d->tail);
+    if(d->slots.isEmpty() || (d->count + 1) * 4 > d->slots.size() * 3) d->rehash(qMax(16, d->slots.size() * 2));
+
+    index = hash & d->mask();
+    while(!d->slots.at(index).isEmpty()) index = (index + 1) & d->mask();
+
+    Slot& slot = d->slots[index];
+    slot.hash = hash;
+    slot.keyOffset = d->arena.size();
+    slot.keyLength = key.size();
+    d->arena.append(key);
+    d->storeRevision(slot, revision);
+
+    d->linkFront(index);
+    ++d->count;
+
+    if(d->garbage > 65536 && d->garbage * 2 > quint32(d->arena.size())) d->compactArena();
+}
+
+void CouchDBRevisionTable::removeRevision(const QString &database, const QString &documentID)
+{
+    Q_D(CouchDBRevisionTable);
+
+    const QByteArray key = CouchDBRevisionTablePrivate::key(database, documentID);
+    const quint32 index = d->find(key, qHash(key));
+    if(index != npos) d->erase(index);
+}
+
+bool CouchDBRevisionTable::contains(const QString &database, const QString &documentID) const
+{
+    Q_D(const CouchDBRevisionTable);
+
+    const QByteArray key = CouchDBRevisionTablePrivate::key(database, documentID);
+    return d->find(key, qHash(key)) != npos;
+}
+
+int CouchDBRevisionTable::size() const
+{
+    Q_D(const CouchDBRevisionTable);
+    return d->count;
+}
+
+void CouchDBRevisionTable::clear()
+{
+    Q_D(CouchDBRevisionTable);
+    d->slots.clear();
+    d->arena.clear();
+    d->count = 0;
+    d->head = d->tail = npos;
+    d->garbage = 0;
+}
+
+int CouchDBRevisionTable::capacity() const
+{
+    Q_D(const CouchDBRevisionTable);
+    return d->capacity;
+}
+
+void CouchDBRevisionTable::setCapacity(const int &capacity)
+{
+    Q_D(CouchDBRevisionTable);
+    d->capacity = qMax(0, capacity);
+    if(d->capacity == 0) return;
+
+    while(d->count > d->capacity) d->erase(d->tail);
+
+    //Size the table once for the whole capacity so it never grows while in use
+    int size = 16;
+    while(size * 3 < d->capacity * 4) size *= 2;
+    if(size != d->slots.size()) d->rehash(size);
+
+    d->compactArena();
+    d->slots.squeeze();
+}
+
+qint64 CouchDBRevisionTable::memoryUsage() const
+{
+    Q_D(const CouchDBRevisionTable);
+    return sizeof(CouchDBRevisionTablePrivate) + qint64(d->slots.capacity()) * sizeof(Slot) + d->arena.capacity();
+}
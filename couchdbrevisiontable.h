@@ -0,0 +1,35 @@
+#ifndef COUCHDBREVISIONTABLE_H
+#define COUCHDBREVISIONTABLE_H
+
+#include <QObject>
+
+//Revisions are kept in an open addressing table of interned UTF-8 keys, a regular "N-<md5>" revision
+//takes a generation number and a 16 bytes digest. With a capacity set, the least recently written
+//entries are evicted so the table keeps a fixed footprint.
+class CouchDBRevisionTablePrivate;
+class CouchDBRevisionTable : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CouchDBRevisionTable(QObject *parent = 0);
+    virtual ~CouchDBRevisionTable();
+
+    QString revision(const QString& database, const QString& documentID) const;
+    void setRevision(const QString& database, const QString& documentID, const QString& revision);
+    void removeRevision(const QString& database, const QString& documentID);
+
+    bool contains(const QString& database, const QString& documentID) const;
+    int size() const;
+    void clear();
+
+    int capacity() const;
+    void setCapacity(const int& capacity);
+
+    qint64 memoryUsage() const;
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBRevisionTable)
+    CouchDBRevisionTablePrivate * const d_ptr;
+};
+
+#endif // COUCHDBREVISIONTABLE_H
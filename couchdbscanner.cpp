@@ -0,0 +1,462 @@
+#include "couchdbscanner.h"
+#include "couchdbserver.h"
+
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QPointer>
+#include <QHash>
+#include <QVector>
+#include <QUrl>
+#include <QDebug>
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    enum RequestType
+    {
+        REQUEST_INFO,
+        REQUEST_BOUNDS,
+        REQUEST_SPLIT,
+        REQUEST_PAGE
+    };
+
+    struct Request
+    {
+        RequestType type;
+        int index; //First or last key for bounds, sample for splits, partition for pages
+    };
+
+    struct Partition
+    {
+        Partition() :
+            finished(false),
+            rowCount(0),
+            retries(0)
+        {}
+
+        QString lastKey; //Document IDs are never empty, an empty key means nothing was delivered yet
+        bool finished;
+        qint64 rowCount;
+        int retries;
+    };
+
+    const int maxRetries = 3;
+
+    QString encodeKey(const QString& key)
+    {
+        const QByteArray json = QJsonDocument(QJsonArray() << key).toJson(QJsonDocument::Compact);
+        return QString::fromLatin1(QUrl::toPercentEncoding(json.mid(1, json.size() - 2)));
+    }
+
+    //Digits compared after the common prefix of the bounds, three UTF-16 units stay exact in a double
+    const int interpolationDigits = 3;
+
+    double keyPosition(const QString& key, const int& prefix)
+    {
+        double position = 0;
+        double scale = 1;
+        for(int i = 0; i < interpolationDigits; ++i)
+        {
+            scale /= 65536;
+            if(prefix + i < key.size()) position += key.at(prefix + i).unicode() * scale;
+        }
+        return position;
+    }
+
+    //Key at the given share of the way between first and last, in the raw order _all_docs keeps IDs in
+    QString interpolateKey(const QString& first, const QString& last, const double& share)
+    {
+        int prefix = 0;
+        while(prefix < first.size() && prefix < last.size() && first.at(prefix) == last.at(prefix)) ++prefix;
+
+        const double low = keyPosition(first, prefix);
+        double position = low + (keyPosition(last, prefix) - low) * share;
+
+        QString key = first.left(prefix);
+        for(int i = 0; i < interpolationDigits; ++i)
+        {
+            position *= 65536;
+            ushort digit = ushort(qBound(0.0, std::floor(position), 65535.0));
+            position -= digit;
+            if(digit >= 0xD800 && digit < 0xE000) digit = 0xE000; //No lone surrogates
+            key.append(QChar(digit));
+        }
+        return key;
+    }
+}
+
+class CouchDBScannerPrivate
+{
+public:
+    CouchDBScannerPrivate(CouchDBServer *s) :
+        server(s),
+        networkManager(0),
+        partitionCount(4),
+        pageSize(1000),
+        includeDocuments(true),
+        includeAttachments(false),
+        running(false),
+        generation(0),
+        pendingBounds(0),
+        pendingSamples(0),
+        rowCount(0)
+    {}
+
+    virtual ~CouchDBScannerPrivate()
+    {
+        if(networkManager) delete networkManager;
+    }
+
+    void send(CouchDBScanner *scanner, const QString& path, const RequestType& type, const int& index)
+    {
+        if(!server) return;
+
+        //Bulk reads give way to the application's calls, an abort drops the ones still waiting
+        const int current = generation;
+        server->submit(false, COUCHDB_PRIORITY_LOW, scanner, [this, scanner, path, type, index, current]() {
+            if(!server || generation != current) return;
+
+            QNetworkRequest request(QUrl(server->baseURL(false) + path));
+            request.setRawHeader("Accept", "application/json");
+            if(server->hasCredential()) request.setRawHeader("Authorization", server->authorizationHeader());
+
+            QNetworkReply *reply = networkManager->get(request);
+            QObject::connect(reply, SIGNAL(finished()), scanner, SLOT(replyFinished()));
+
+            Request entry;
+            entry.type = type;
+            entry.index = index;
+            requests.insert(reply, entry);
+        });
+    }
+
+    void requestPage(CouchDBScanner *scanner, const int& index)
+    {
+        const Partition& partition = partitions.at(index);
+
+        //A page resumed at the last key delivered asks for one more row, that row coming back again
+        const int limit = partition.lastKey.isEmpty() ? pageSize : pageSize + 1;
+        QString path = QStringLiteral("/%1/_all_docs?limit=%2").arg(database).arg(limit);
+        if(includeDocuments) path += QStringLiteral("&include_docs=true");
+        if(includeDocuments && includeAttachments) path += QStringLiteral("&attachments=true");
+
+        //Keyset paging: each page starts at the last key delivered, whose row is dropped when received. Not with skip=1,
+        //which would drop the next live row if the last one was deleted in between
+        if(!partition.lastKey.isEmpty()) path += QStringLiteral("&startkey=") + encodeKey(partition.lastKey);
+        else if(index > 0) path += QStringLiteral("&startkey=") + encodeKey(splitKeys.at(index - 1));
+
+        if(index < splitKeys.size()) path += QStringLiteral("&endkey=") + encodeKey(splitKeys.at(index)) + QStringLiteral("&inclusive_end=false");
+
+        send(scanner, path, REQUEST_PAGE, index);
+    }
+
+    void start(CouchDBScanner *scanner)
+    {
+        emit scanner->partitionsPlanned(database, splitKeys);
+
+        for(int i = 0; i < partitions.size(); ++i)
+        {
+            if(!partitions.at(i).finished) requestPage(scanner, i);
+        }
+    }
+
+    QPointer<CouchDBServer> server; //Scanner doesn't own server
+    QNetworkAccessManager *networkManager;
+    int partitionCount;
+    int pageSize;
+    bool includeDocuments;
+    bool includeAttachments;
+    QString database;
+    bool running;
+    int generation; //Bumped on abort, a consumer may restart the scanner from a signal
+    QStringList splitKeys;
+    QString bounds[2];
+    int pendingBounds;
+    QVector<QString> samples;
+    int pendingSamples;
+    QList<Partition> partitions;
+    QHash<QNetworkReply*, Request> requests;
+    qint64 rowCount;
+};
+
+CouchDBScanner::CouchDBScanner(CouchDBServer *server, QObject *parent) :
+    QObject(parent),
+    d_ptr(new CouchDBScannerPrivate(server))
+{
+    Q_D(CouchDBScanner);
+    d->networkManager = new QNetworkAccessManager(this);
+}
+
+CouchDBScanner::~CouchDBScanner()
+{
+    abort();
+    delete d_ptr;
+}
+
+int CouchDBScanner::partitions() const
+{
+    Q_D(const CouchDBScanner);
+    return d->partitionCount;
+}
+
+void CouchDBScanner::setPartitions(const int &partitions)
+{
+    Q_D(CouchDBScanner);
+    d->partitionCount = qMax(1, partitions);
+}
+
+int CouchDBScanner::pageSize() const
+{
+    Q_D(const CouchDBScanner);
+    return d->pageSize;
+}
+
+void CouchDBScanner::setPageSize(const int &pageSize)
+{
+    Q_D(CouchDBScanner);
+    d->pageSize = qMax(1, pageSize);
+}
+
+bool CouchDBScanner::includeDocuments() const
+{
+    Q_D(const CouchDBScanner);
+    return d->includeDocuments;
+}
+
+void CouchDBScanner::setIncludeDocuments(const bool &includeDocuments)
+{
+    Q_D(CouchDBScanner);
+    d->includeDocuments = includeDocuments;
+}
+
+bool CouchDBScanner::includeAttachments() const
+{
+    Q_D(const CouchDBScanner);
+    return d->includeAttachments;
+}
+
+void CouchDBScanner::setIncludeAttachments(const bool &includeAttachments)
+{
+    Q_D(CouchDBScanner);
+    d->includeAttachments = includeAttachments;
+}
+
+QString CouchDBScanner::database() const
+{
+    Q_D(const CouchDBScanner);
+    return d->database;
+}
+
+bool CouchDBScanner::isRunning() const
+{
+    Q_D(const CouchDBScanner);
+    return d->running;
+}
+
+QStringList CouchDBScanner::splitKeys() const
+{
+    Q_D(const CouchDBScanner);
+    return d->splitKeys;
+}
+
+QStringList CouchDBScanner::resumeKeys() const
+{
+    Q_D(const CouchDBScanner);
+
+    QStringList keys;
+    foreach(const Partition& partition, d->partitions) keys.append(partition.lastKey);
+    return keys;
+}
+
+void CouchDBScanner::scan(const QString &database)
+{
+    Q_D(CouchDBScanner);
+
+    abort();
+    d->database = database;
+    d->running = true;
+    d->rowCount = 0;
+    d->splitKeys.clear();
+    d->bounds[0].clear();
+    d->bounds[1].clear();
+    d->partitions.clear();
+
+    d->send(this, QStringLiteral("/%1").arg(database), REQUEST_INFO, 0);
+}
+
+void CouchDBScanner::resume(const QString &database, const QStringList &splitKeys, const QStringList &resumeKeys)
+{
+    Q_D(CouchDBScanner);
+
+    abort();
+    d->database = database;
+    d->running = true;
+    d->rowCount = 0;
+    d->splitKeys = splitKeys;
+
+    d->partitions.clear();
+    for(int i = 0; i <= splitKeys.size(); ++i)
+    {
+        Partition partition;
+        partition.lastKey = resumeKeys.value(i);
+        d->partitions.append(partition);
+    }
+
+    d->start(this);
+}
+
+void CouchDBScanner::abort()
+{
+    Q_D(CouchDBScanner);
+
+    d->generation++;
+    d->running = false;
+
+    QHash<QNetworkReply*, Request> requests;
+    requests.swap(d->requests);
+    foreach(QNetworkReply *reply, requests.keys())
+    {
+        disconnect(reply, 0, this, 0);
+        reply->abort();
+        reply->deleteLater();
+    }
+}
+
+void CouchDBScanner::replyFinished()
+{
+    Q_D(CouchDBScanner);
+
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if(!reply) return;
+
+    reply->deleteLater();
+    if(!d->requests.contains(reply)) return;
+
+    const Request request = d->requests.take(reply);
+    if(d->server) d->server->recordReply(reply);
+
+    if(reply->error() != QNetworkReply::NoError)
+    {
+        //Pages are retried where they stopped, a failure while planning ends the scan
+        if(request.type == REQUEST_PAGE && d->partitions[request.index].retries++ < maxRetries)
+        {
+            qWarning() << "Retrying partition" << request.index << "of" << d->database << ":" << reply->errorString();
+            d->requestPage(this, request.index);
+            return;
+        }
+
+        qWarning() << "Scan of" << d->database << "failed:" << reply->errorString();
+        const QString error = reply->errorString();
+        abort();
+        emit scanFailed(d->database, error);
+        return;
+    }
+
+    const CouchDBJsonView result(reply->readAll());
+
+    switch(request.type)
+    {
+    case REQUEST_INFO:
+    {
+        //Partitions smaller than a page would only add requests
+        const qint64 documentCount = result.value(QStringLiteral("doc_count")).toLongLong();
+        const int partitionCount = int(qBound<qint64>(1, d->partitionCount, (documentCount + d->pageSize - 1) / d->pageSize));
+
+        if(partitionCount == 1)
+        {
+            d->partitions.append(Partition());
+            d->start(this);
+            break;
+        }
+
+        //skip walks every row it skips, the split points are looked up by key instead: the key space between the
+        //first and last IDs is divided evenly and each point snapped to the next existing ID, one index seek each
+        d->samples = QVector<QString>(partitionCount - 1);
+        d->pendingBounds = 2;
+        d->send(this, QStringLiteral("/%1/_all_docs?limit=1").arg(d->database), REQUEST_BOUNDS, 0);
+        d->send(this, QStringLiteral("/%1/_all_docs?limit=1&descending=true").arg(d->database), REQUEST_BOUNDS, 1);
+        break;
+    }
+    case REQUEST_BOUNDS:
+    {
+        const CouchDBJsonView rows = result.value(QStringLiteral("rows"));
+        if(rows.size() > 0) d->bounds[request.index] = rows.at(0).value(QStringLiteral("key")).toString();
+        if(--d->pendingBounds > 0) break;
+
+        //Evenly spread over the key space, partitions are only even in size for evenly spread IDs such as UUIDs
+        const int partitionCount = d->samples.size() + 1;
+        d->pendingSamples = d->samples.size();
+        for(int i = 1; i < partitionCount; ++i)
+        {
+            const QString key = interpolateKey(d->bounds[0], d->bounds[1], double(i) / partitionCount);
+            d->send(this, QStringLiteral("/%1/_all_docs?limit=1&startkey=%2").arg(d->database).arg(encodeKey(key)), REQUEST_SPLIT, i - 1);
+        }
+        break;
+    }
+    case REQUEST_SPLIT:
+    {
+        const CouchDBJsonView rows = result.value(QStringLiteral("rows"));
+        if(rows.size() > 0) d->samples[request.index] = rows.at(0).value(QStringLiteral("key")).toString();
+        if(--d->pendingSamples > 0) break;
+
+        //Documents written or deleted while sampling may repeat or drop a key
+        QStringList keys;
+        foreach(const QString& key, d->samples)
+        {
+            //The first ID would only split off an empty partition
+            if(!key.isEmpty() && key != d->bounds[0]) keys.append(key);
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        d->samples.clear();
+
+        d->splitKeys = keys;
+        for(int i = 0; i <= keys.size(); ++i) d->partitions.append(Partition());
+        d->start(this);
+        break;
+    }
+    case REQUEST_PAGE:
+    {
+        CouchDBJsonView rows = result.value(QStringLiteral("rows"));
+        const int received = rows.size();
+
+        Partition& partition = d->partitions[request.index];
+        const bool resumed = !partition.lastKey.isEmpty();
+        if(resumed && received > 0 && rows.at(0).value(QStringLiteral("key")).toString() == partition.lastKey) rows = rows.mid(1);
+        const int count = rows.size();
+
+        partition.retries = 0;
+        partition.rowCount += count;
+        d->rowCount += count;
+        if(count > 0) partition.lastKey = rows.at(count - 1).value(QStringLiteral("key")).toString();
+
+        const int generation = d->generation;
+        if(count > 0) emit pageReceived(request.index, rows);
+        if(generation != d->generation) return;
+
+        if(received == (resumed ? d->pageSize + 1 : d->pageSize))
+        {
+            d->requestPage(this, request.index);
+            break;
+        }
+
+        d->partitions[request.index].finished = true;
+        emit partitionFinished(request.index, d->partitions.at(request.index).rowCount);
+        if(generation != d->generation) return;
+
+        foreach(const Partition& other, d->partitions)
+        {
+            if(!other.finished) return;
+        }
+
+        d->running = false;
+        emit scanFinished(d->database, d->rowCount);
+        break;
+    }
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef COUCHDBSCANNER_H
+#define COUCHDBSCANNER_H
+
+#include <QObject>
+#include <QStringList>
+
+#include "couchdbjsonview.h"
+
+class CouchDBServer;
+class CouchDBScannerPrivate;
+//Reads a whole database as several _all_docs key ranges fetched in parallel. Split points are looked up first, spread
+//evenly over the IDs between the first and the last one, then every partition is paged through on its own connection
+//and delivered with its index, so each partition can feed its own consumer. Parallelism is bounded by the connections
+//per host of the network manager (6).
+class CouchDBScanner : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CouchDBScanner(CouchDBServer *server, QObject *parent = 0);
+    virtual ~CouchDBScanner();
+
+    int partitions() const;
+    void setPartitions(const int& partitions);
+
+    //Rows per request within a partition
+    int pageSize() const;
+    void setPageSize(const int& pageSize);
+
+    bool includeDocuments() const;
+    void setIncludeDocuments(const bool& includeDocuments);
+
+    //Inline attachments of the included documents, base64 encoded
+    bool includeAttachments() const;
+    void setIncludeAttachments(const bool& includeAttachments);
+
+    QString database() const;
+    bool isRunning() const;
+
+    //Partition i runs from splitKeys[i - 1], included, to splitKeys[i], excluded
+    QStringList splitKeys() const;
+
+    //Last key delivered by each partition, to resume an interrupted scan
+    QStringList resumeKeys() const;
+
+signals:
+    void partitionsPlanned(const QString& database, const QStringList& splitKeys);
+    //Rows array of one page, in key order within the partition
+    void pageReceived(const int& partition, const CouchDBJsonView& rows);
+    void partitionFinished(const int& partition, const qint64& rowCount);
+    void scanFinished(const QString& database, const qint64& rowCount);
+    void scanFailed(const QString& database, const QString& error);
+
+public slots:
+    void scan(const QString& database);
+    //Continues a scan with the split and resume keys it had when it stopped
+    void resume(const QString& database, const QStringList& splitKeys, const QStringList& resumeKeys);
+    void abort();
+
+private slots:
+    void replyFinished();
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBScanner)
+    CouchDBScannerPrivate * const d_ptr;
+};
+
+#endif // COUCHDBSCANNER_H
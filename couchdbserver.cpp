@@ -1,4 +1,7 @@
 #include "couchdbserver.h"
+#include "couchdbratelimiter.h"
+
+#include <QPointer>
 
 class CouchDBServerPrivate
 {
@@ -6,15 +9,25 @@ public:
     CouchDBServerPrivate() :
         url("localhost"),
         port(5984),
-        secureConnection(false)
+        secureConnection(false),
+        cacheValid(false)
     {}
 
+    void invalidate() { cacheValid = false; }
+
     QString url;
     int  port;
     bool secureConnection;
     QString username;
     QString password;
     QByteArray credential;
+    QByteArray authorizationHeader;
+    QPointer<CouchDBRateLimiter> rateLimiter; //Server doesn't own rateLimiter
+
+    //Base URLs are rebuilt only after the configuration changes
+    mutable bool cacheValid;
+    mutable QString baseURL;
+    mutable QString credentialBaseURL;
 };
 
 CouchDBServer::CouchDBServer(QObject *parent) :
@@ -44,6 +57,7 @@ void CouchDBServer::setUrl(const QString& url)
     d->secureConnection = d->url.contains("https://");
     d->url.remove("https://");
     d->url.remove("http://");
+    d->invalidate();
 }
 
 int CouchDBServer::port() const
@@ -57,6 +71,7 @@ void CouchDBServer::setPort(const int& port)
     Q_D(CouchDBServer);
     if(d->port == port) return;
     d->port = port;
+    d->invalidate();
 }
 
 bool CouchDBServer::secureConnection() const
@@ -69,25 +84,29 @@ void CouchDBServer::setSecureConnection(const bool &secureConnection)
 {
     Q_D(CouchDBServer);
     d->secureConnection = secureConnection;
+    d->invalidate();
 }
 
 QString CouchDBServer::baseURL(const bool& withCredential) const
 {
     Q_D(const CouchDBServer);
-    QString url;
 
-    if(d->secureConnection)
+    if(!d->cacheValid)
     {
-        if(withCredential && hasCredential()) url = QString("https://%1:%2@%3").arg(d->username, d->password, d->url);
-        else url = QString("https://%1").arg(d->url);
-    }
-    else
-    {
-        if(withCredential && hasCredential()) url = QString("http://%1:%2@%3:%4").arg(d->username, d->password, d->url, QString::number(d->port));
-        else url = QString("http://%1:%2").arg(d->url, QString::number(d->port));
+        if(d->secureConnection)
+        {
+            d->credentialBaseURL = QString("https://%1:%2@%3").arg(d->username, d->password, d->url);
+            d->baseURL = QString("https://%1").arg(d->url);
+        }
+        else
+        {
+            d->credentialBaseURL = QString("http://%1:%2@%3:%4").arg(d->username, d->password, d->url, QString::number(d->port));
+            d->baseURL = QString("http://%1:%2").arg(d->url, QString::number(d->port));
+        }
+        d->cacheValid = true;
     }
 
-    return url;
+    return withCredential && hasCredential() ? d->credentialBaseURL : d->baseURL;
 }
 
 QByteArray CouchDBServer::credential() const
@@ -102,6 +121,14 @@ void CouchDBServer::setCredential(const QString& username, const QString& passwo
     d->username = username;
     d->password = password;
     d->credential = QByteArray(QString("%1:%2").arg(username, password).toLatin1()).toBase64();
+    d->authorizationHeader = "Basic " + d->credential;
+    d->invalidate();
+}
+
+QByteArray CouchDBServer::authorizationHeader() const
+{
+    Q_D(const CouchDBServer);
+    return d->authorizationHeader;
 }
 
 bool CouchDBServer::hasCredential() const
@@ -110,3 +137,29 @@ bool CouchDBServer::hasCredential() const
     return (d->credential != "");
 }
 
+
+CouchDBRateLimiter *CouchDBServer::rateLimiter() const
+{
+    Q_D(const CouchDBServer);
+    return d->rateLimiter;
+}
+
+void CouchDBServer::setRateLimiter(CouchDBRateLimiter *rateLimiter)
+{
+    Q_D(CouchDBServer);
+    d->rateLimiter = rateLimiter;
+}
+
+void CouchDBServer::submit(const bool &write, const CouchDBPriority &priority, QObject *context, const std::function<void()> &send)
+{
+    Q_D(CouchDBServer);
+
+    if(d->rateLimiter) d->rateLimiter->submit(write, priority, context, send);
+    else if(send) send();
+}
+
+void CouchDBServer::recordReply(QNetworkReply *reply)
+{
+    Q_D(CouchDBServer);
+    if(d->rateLimiter) d->rateLimiter->recordReply(reply);
+}
@@ -3,6 +3,12 @@
 
 #include <QObject>
 
+#include <functional>
+
+#include "couchdbenums.h"
+
+class QNetworkReply;
+class CouchDBRateLimiter;
 class CouchDBServerPrivate;
 class CouchDBServer : public QObject
 {
@@ -25,8 +31,20 @@ public:
     QByteArray credential() const;
     void setCredential(const QString& username, const QString& password);
 
+    //Precomputed "Basic <credential>" value for the Authorization header
+    QByteArray authorizationHeader() const;
+
     bool hasCredential() const;
 
+    //Optional limiter shared by every request sent to this server, not owned
+    CouchDBRateLimiter* rateLimiter() const;
+    void setRateLimiter(CouchDBRateLimiter *rateLimiter);
+
+    //For requests made outside CouchDB, which admits its own calls: sends through the rate limiter when there is one,
+    //right away otherwise, and reports the reply status back to it
+    void submit(const bool& write, const CouchDBPriority& priority, QObject *context, const std::function<void()>& send);
+    void recordReply(QNetworkReply *reply);
+
 private:
     Q_DECLARE_PRIVATE(CouchDBServer)
     CouchDBServerPrivate * const d_ptr;
@@ -0,0 +1,624 @@
+#include "couchdbstatspoller.h"
+#include "couchdb.h"
+#include "couchdbserver.h"
+#include "couchdbjsonview.h"
+
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QPointer>
+#include <QHash>
+#include <QSet>
+#include <QUrl>
+#include <QDebug>
+
+namespace
+{
+    enum RequestType
+    {
+        REQUEST_STATS,
+        REQUEST_TASKS,
+        REQUEST_UP,
+        REQUEST_DATABASE
+    };
+
+    struct Request
+    {
+        RequestType type;
+        QString path;
+        QString database;
+    };
+
+    struct DatabaseSample
+    {
+        DatabaseSample() :
+            documentCount(0),
+            updateSequence(0)
+        {}
+
+        QVariantMap info;
+        qint64 documentCount;
+        qint64 updateSequence;
+        QElapsedTimer clock;
+    };
+
+    QString operationName(const CouchDBOperation& operation)
+    {
+        switch(operation)
+        {
+        case COUCHDB_CHECKINSTALLATION: return QStringLiteral("checkInstallation");
+        case COUCHDB_STARTSESSION: return QStringLiteral("startSession");
+        case COUCHDB_ENDSESSION: return QStringLiteral("endSession");
+        case COUCHDB_LISTDATABASES: return QStringLiteral("listDatabases");
+        case COUCHDB_CREATEDATABASE: return QStringLiteral("createDatabase");
+        case COUCHDB_DELETEDATABASE: return QStringLiteral("deleteDatabase");
+        case COUCHDB_LISTDOCUMENTS: return QStringLiteral("listDocuments");
+        case COUCHDB_RETRIEVEREVISION: return QStringLiteral("retrieveRevision");
+        case COUCHDB_RETRIEVEDOCUMENT: return QStringLiteral("retrieveDocument");
+        case COUCHDB_UPDATEDOCUMENT: return QStringLiteral("updateDocument");
+        case COUCHDB_DELETEDOCUMENT: return QStringLiteral("deleteDocument");
+        case COUCHDB_UPLOADATTACHMENT: return QStringLiteral("uploadAttachment");
+        case COUCHDB_DELETEATTACHMENT: return QStringLiteral("deleteAttachment");
+        case COUCHDB_REPLICATEDATABASE: return QStringLiteral("replicateDatabase");
+        case COUCHDB_BULKDOCUMENTS: return QStringLiteral("bulkDocuments");
+        case COUCHDB_UPSERTDOCUMENT: return QStringLiteral("upsertDocument");
+        case COUCHDB_RETRIEVEREVISIONS: return QStringLiteral("retrieveRevisions");
+        }
+        return QString();
+    }
+
+    //Leaves of the node statistics carry their type, everything else is a group
+    void flattenStats(const CouchDBJsonView& node, const QString& name, QHash<QString, double> *counters, QVariantMap *gauges)
+    {
+        const CouchDBJsonView type = node.value(QStringLiteral("type"));
+        if(type.isString())
+        {
+            const CouchDBJsonView value = node.value(QStringLiteral("value"));
+            if(type.toString() == QLatin1String("counter"))
+            {
+                counters->insert(name, value.toDouble());
+                //CouchDB reports these two levels as counters, they go up and down and are read as they are
+                if(name == QLatin1String("couchdb.open_databases") || name == QLatin1String("couchdb.open_os_files"))
+                {
+                    gauges->insert(name, value.toDouble());
+                }
+            }
+            else if(type.toString() == QLatin1String("gauge"))
+            {
+                gauges->insert(name, value.toDouble());
+            }
+            else if(type.toString() == QLatin1String("histogram"))
+            {
+                gauges->insert(name + QStringLiteral(".median"), value.value(QStringLiteral("median")).toDouble());
+                foreach(const CouchDBJsonView& percentile, value.value(QStringLiteral("percentile")).elements())
+                {
+                    if(percentile.at(0).toDouble() == 99) gauges->insert(name + QStringLiteral(".p99"), percentile.at(1).toDouble());
+                }
+            }
+            return;
+        }
+
+        foreach(const QString& key, node.keys())
+        {
+            const CouchDBJsonView child = node.value(key);
+            if(child.isObject()) flattenStats(child, name.isEmpty() ? key : name + QLatin1Char('.') + key, counters, gauges);
+        }
+    }
+
+    qint64 sequenceNumber(const CouchDBJsonView& sequence)
+    {
+        if(!sequence.isString()) return sequence.toLongLong();
+
+        const QString text = sequence.toString();
+        return text.left(text.indexOf(QLatin1Char('-'))).toLongLong();
+    }
+}
+
+class CouchDBStatsPollerPrivate
+{
+public:
+    CouchDBStatsPollerPrivate(CouchDBServer *s) :
+        server(s),
+        networkManager(0),
+        statsTimer(0),
+        tasksTimer(0),
+        upTimer(0),
+        databaseTimer(0),
+        statsPath("/_node/_local/_stats"),
+        running(false),
+        up(false),
+        upKnown(false),
+        generation(0),
+        pollTimeout(10000)
+    {}
+
+    virtual ~CouchDBStatsPollerPrivate()
+    {
+        if(statsTimer) delete statsTimer;
+        if(tasksTimer) delete tasksTimer;
+        if(upTimer) delete upTimer;
+        if(databaseTimer) delete databaseTimer;
+        if(networkManager) delete networkManager;
+    }
+
+    void send(CouchDBStatsPoller *poller, const QString& path, const RequestType& type, const QString& database = QString())
+    {
+        if(!server || inFlight.contains(path)) return;
+        inFlight.insert(path);
+
+        //Polls are the first to wait while the server is throttled, a stop drops the ones still waiting
+        const int current = generation;
+        server->submit(false, COUCHDB_PRIORITY_LOW, poller, [this, poller, path, type, database, current]() {
+            if(!server || generation != current) return;
+
+            QNetworkRequest request(QUrl(server->baseURL(false) + path));
+            request.setRawHeader("Accept", "application/json");
+            if(server->hasCredential()) request.setRawHeader("Authorization", server->authorizationHeader());
+
+            QNetworkReply *reply = networkManager->get(request);
+            QObject::connect(reply, SIGNAL(finished()), poller, SLOT(replyFinished()));
+            //A hung node would otherwise hold the endpoint in flight and never be reported down
+            if(pollTimeout > 0) QTimer::singleShot(pollTimeout, reply, SLOT(abort()));
+
+            Request entry;
+            entry.type = type;
+            entry.path = path;
+            entry.database = database;
+            requests.insert(reply, entry);
+        });
+    }
+
+    void setInterval(QTimer *timer, const int& msec)
+    {
+        timer->setInterval(qMax(0, msec));
+        if(running && msec > 0) timer->start();
+        else timer->stop();
+    }
+
+    void updateStats(const CouchDBJsonView& stats);
+    void updateClient(const double& seconds);
+
+    QPointer<CouchDBServer> server; //Poller doesn't own server
+    QNetworkAccessManager *networkManager;
+    QTimer *statsTimer;
+    QTimer *tasksTimer;
+    QTimer *upTimer;
+    QTimer *databaseTimer;
+    QString statsPath;
+    QStringList databases;
+    QPointer<CouchDB> couchdb; //Poller doesn't own couchdb
+    bool running;
+    bool up;
+    bool upKnown;
+    int generation; //Bumped on stop
+    int pollTimeout;
+    QHash<QNetworkReply*, Request> requests;
+    QSet<QString> inFlight;
+
+    QHash<QString, double> counters;
+    QElapsedTimer statsClock;
+    QVariantMap rates;
+    QVariantMap gauges;
+    QVariantList activeTasks;
+    QVariantMap taskCounts;
+    QHash<QString, DatabaseSample> databaseSamples;
+    QMap<CouchDBOperation, CouchDBOperationStatistics> clientStatistics; //As of the previous node statistics poll
+    QVariantMap client;
+};
+
+void CouchDBStatsPollerPrivate::updateStats(const CouchDBJsonView& stats)
+{
+    QHash<QString, double> current;
+    QVariantMap currentGauges;
+    flattenStats(stats, QString(), &current, &currentGauges);
+
+    //Counters restart with the node, a drop is reported as no activity
+    const bool hasPrevious = statsClock.isValid() && !counters.isEmpty();
+    const double seconds = hasPrevious ? qMax<qint64>(1, statsClock.elapsed()) / 1000.0 : 0;
+
+    rates.clear();
+    if(hasPrevious)
+    {
+        for(QHash<QString, double>::const_iterator it = current.constBegin(); it != current.constEnd(); ++it)
+        {
+            if(!counters.contains(it.key())) continue;
+            rates.insert(it.key(), qMax(0.0, it.value() - counters.value(it.key())) / seconds);
+        }
+    }
+
+    counters = current;
+    gauges = currentGauges;
+    updateClient(seconds);
+    statsClock.start();
+}
+
+void CouchDBStatsPollerPrivate::updateClient(const double& seconds)
+{
+    if(!couchdb) return;
+
+    const QMap<CouchDBOperation, CouchDBOperationStatistics> current = couchdb->operationStatistics();
+
+    //Only calls made since the previous poll, so client latencies line up with the server rates
+    client.clear();
+    if(seconds > 0)
+    {
+        for(QMap<CouchDBOperation, CouchDBOperationStatistics>::const_iterator it = current.constBegin(); it != current.constEnd(); ++it)
+        {
+            const CouchDBOperationStatistics previous = clientStatistics.value(it.key());
+
+            const CouchDBOperationStatistics delta = it->since(previous);
+            if(delta.count <= 0) continue;
+
+            QVariantMap entry;
+            entry.insert(QStringLiteral("count"), delta.count);
+            entry.insert(QStringLiteral("rate"), delta.count / seconds);
+            entry.insert(QStringLiteral("errors"), delta.errors);
+            entry.insert(QStringLiteral("mean"), delta.meanTime());
+            entry.insert(QStringLiteral("p50"), delta.percentile(0.5));
+            entry.insert(QStringLiteral("p99"), delta.percentile(0.99));
+            entry.insert(QStringLiteral("max"), delta.maxTime);
+            client.insert(operationName(it.key()), entry);
+        }
+    }
+
+    clientStatistics = current;
+}
+
+CouchDBStatsPoller::CouchDBStatsPoller(CouchDBServer *server, QObject *parent) :
+    QObject(parent),
+    d_ptr(new CouchDBStatsPollerPrivate(server))
+{
+    Q_D(CouchDBStatsPoller);
+
+    d->networkManager = new QNetworkAccessManager(this);
+
+    d->statsTimer = new QTimer(this);
+    d->statsTimer->setInterval(10000);
+    connect(d->statsTimer, SIGNAL(timeout()), this, SLOT(pollStats()));
+
+    d->tasksTimer = new QTimer(this);
+    d->tasksTimer->setInterval(5000);
+    connect(d->tasksTimer, SIGNAL(timeout()), this, SLOT(pollTasks()));
+
+    d->upTimer = new QTimer(this);
+    d->upTimer->setInterval(5000);
+    connect(d->upTimer, SIGNAL(timeout()), this, SLOT(pollUp()));
+
+    d->databaseTimer = new QTimer(this);
+    d->databaseTimer->setInterval(30000);
+    connect(d->databaseTimer, SIGNAL(timeout()), this, SLOT(pollDatabases()));
+}
+
+CouchDBStatsPoller::~CouchDBStatsPoller()
+{
+    stop();
+    delete d_ptr;
+}
+
+int CouchDBStatsPoller::statsInterval() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->statsTimer->interval();
+}
+
+void CouchDBStatsPoller::setStatsInterval(const int &msec)
+{
+    Q_D(CouchDBStatsPoller);
+    d->setInterval(d->statsTimer, msec);
+}
+
+int CouchDBStatsPoller::tasksInterval() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->tasksTimer->interval();
+}
+
+void CouchDBStatsPoller::setTasksInterval(const int &msec)
+{
+    Q_D(CouchDBStatsPoller);
+    d->setInterval(d->tasksTimer, msec);
+}
+
+int CouchDBStatsPoller::upInterval() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->upTimer->interval();
+}
+
+void CouchDBStatsPoller::setUpInterval(const int &msec)
+{
+    Q_D(CouchDBStatsPoller);
+    d->setInterval(d->upTimer, msec);
+}
+
+int CouchDBStatsPoller::databaseInterval() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->databaseTimer->interval();
+}
+
+void CouchDBStatsPoller::setDatabaseInterval(const int &msec)
+{
+    Q_D(CouchDBStatsPoller);
+    d->setInterval(d->databaseTimer, msec);
+}
+
+int CouchDBStatsPoller::pollTimeout() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->pollTimeout;
+}
+
+void CouchDBStatsPoller::setPollTimeout(const int &msec)
+{
+    Q_D(CouchDBStatsPoller);
+    d->pollTimeout = msec;
+}
+
+QString CouchDBStatsPoller::statsPath() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->statsPath;
+}
+
+void CouchDBStatsPoller::setStatsPath(const QString &statsPath)
+{
+    Q_D(CouchDBStatsPoller);
+    d->statsPath = statsPath;
+    d->counters.clear();
+}
+
+QStringList CouchDBStatsPoller::databases() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->databases;
+}
+
+void CouchDBStatsPoller::addDatabase(const QString &database)
+{
+    Q_D(CouchDBStatsPoller);
+    if(!d->databases.contains(database)) d->databases.append(database);
+}
+
+void CouchDBStatsPoller::removeDatabase(const QString &database)
+{
+    Q_D(CouchDBStatsPoller);
+    d->databases.removeAll(database);
+    d->databaseSamples.remove(database);
+}
+
+CouchDB *CouchDBStatsPoller::couchdb() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->couchdb;
+}
+
+void CouchDBStatsPoller::setCouchDB(CouchDB *couchdb)
+{
+    Q_D(CouchDBStatsPoller);
+    d->couchdb = couchdb;
+    d->clientStatistics = couchdb ? couchdb->operationStatistics() : QMap<CouchDBOperation, CouchDBOperationStatistics>();
+    d->client.clear();
+}
+
+bool CouchDBStatsPoller::isRunning() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->running;
+}
+
+bool CouchDBStatsPoller::isUp() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->up;
+}
+
+QVariantMap CouchDBStatsPoller::rates() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->rates;
+}
+
+QVariantMap CouchDBStatsPoller::gauges() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->gauges;
+}
+
+double CouchDBStatsPoller::requestRate() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->rates.value(QStringLiteral("couchdb.httpd.requests")).toDouble();
+}
+
+int CouchDBStatsPoller::openDatabases() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->gauges.value(QStringLiteral("couchdb.open_databases")).toInt();
+}
+
+QVariantList CouchDBStatsPoller::activeTasks() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->activeTasks;
+}
+
+QVariantMap CouchDBStatsPoller::taskCounts() const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->taskCounts;
+}
+
+QVariantMap CouchDBStatsPoller::databaseInfo(const QString &database) const
+{
+    Q_D(const CouchDBStatsPoller);
+    return d->databaseSamples.value(database).info;
+}
+
+QVariantMap CouchDBStatsPoller::snapshot() const
+{
+    Q_D(const CouchDBStatsPoller);
+
+    QVariantMap databases;
+    for(QHash<QString, DatabaseSample>::const_iterator it = d->databaseSamples.constBegin(); it != d->databaseSamples.constEnd(); ++it)
+    {
+        databases.insert(it.key(), it->info);
+    }
+
+    QVariantMap snapshot;
+    snapshot.insert(QStringLiteral("up"), d->up);
+    snapshot.insert(QStringLiteral("rates"), d->rates);
+    snapshot.insert(QStringLiteral("gauges"), d->gauges);
+    snapshot.insert(QStringLiteral("tasks"), d->taskCounts);
+    snapshot.insert(QStringLiteral("databases"), databases);
+    snapshot.insert(QStringLiteral("client"), d->client);
+    return snapshot;
+}
+
+void CouchDBStatsPoller::start()
+{
+    Q_D(CouchDBStatsPoller);
+
+    d->running = true;
+    d->setInterval(d->statsTimer, d->statsTimer->interval());
+    d->setInterval(d->tasksTimer, d->tasksTimer->interval());
+    d->setInterval(d->upTimer, d->upTimer->interval());
+    d->setInterval(d->databaseTimer, d->databaseTimer->interval());
+
+    if(d->statsTimer->isActive()) pollStats();
+    if(d->tasksTimer->isActive()) pollTasks();
+    if(d->upTimer->isActive()) pollUp();
+    if(d->databaseTimer->isActive()) pollDatabases();
+}
+
+void CouchDBStatsPoller::stop()
+{
+    Q_D(CouchDBStatsPoller);
+
+    d->running = false;
+    d->statsTimer->stop();
+    d->tasksTimer->stop();
+    d->upTimer->stop();
+    d->databaseTimer->stop();
+
+    QHash<QNetworkReply*, Request> requests;
+    requests.swap(d->requests);
+    d->inFlight.clear();
+    d->generation++;
+    foreach(QNetworkReply *reply, requests.keys())
+    {
+        disconnect(reply, 0, this, 0);
+        reply->abort();
+        reply->deleteLater();
+    }
+}
+
+void CouchDBStatsPoller::pollStats()
+{
+    Q_D(CouchDBStatsPoller);
+    d->send(this, d->statsPath, REQUEST_STATS);
+}
+
+void CouchDBStatsPoller::pollTasks()
+{
+    Q_D(CouchDBStatsPoller);
+    d->send(this, QStringLiteral("/_active_tasks"), REQUEST_TASKS);
+}
+
+void CouchDBStatsPoller::pollUp()
+{
+    Q_D(CouchDBStatsPoller);
+    d->send(this, QStringLiteral("/_up"), REQUEST_UP);
+}
+
+void CouchDBStatsPoller::pollDatabases()
+{
+    Q_D(CouchDBStatsPoller);
+    foreach(const QString& database, d->databases) d->send(this, QStringLiteral("/%1").arg(database), REQUEST_DATABASE, database);
+}
+
+void CouchDBStatsPoller::replyFinished()
+{
+    Q_D(CouchDBStatsPoller);
+
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if(!reply) return;
+
+    reply->deleteLater();
+    if(!d->requests.contains(reply)) return;
+
+    const Request request = d->requests.take(reply);
+    d->inFlight.remove(request.path);
+    if(d->server) d->server->recordReply(reply);
+
+    //An unreachable or unhealthy node answers _up with an error, a hung one is aborted after pollTimeout
+    if(request.type == REQUEST_UP)
+    {
+        const bool up = reply->error() == QNetworkReply::NoError &&
+                CouchDBJsonView(reply->readAll()).value(QStringLiteral("status")).toString() == QLatin1String("ok");
+        if(d->upKnown && up == d->up) return;
+
+        d->up = up;
+        d->upKnown = true;
+        emit upChanged(up);
+        return;
+    }
+
+    if(reply->error() != QNetworkReply::NoError)
+    {
+        qWarning() << "Polling" << request.path << "failed:" << reply->errorString();
+        emit pollFailed(request.path, reply->errorString());
+        return;
+    }
+
+    const CouchDBJsonView result(reply->readAll());
+
+    switch(request.type)
+    {
+    case REQUEST_STATS:
+        d->updateStats(result);
+        emit statsUpdated(d->rates, d->gauges);
+        break;
+    case REQUEST_TASKS:
+    {
+        QVariantMap counts;
+        d->activeTasks.clear();
+        foreach(const CouchDBJsonView& task, result.elements())
+        {
+            const QString type = task.value(QStringLiteral("type")).toString();
+            counts.insert(type, counts.value(type).toInt() + 1);
+            d->activeTasks.append(task.toVariant());
+        }
+        d->taskCounts = counts;
+        emit tasksUpdated(counts);
+        break;
+    }
+    case REQUEST_DATABASE:
+    {
+        if(!d->databases.contains(request.database)) break;
+
+        DatabaseSample& sample = d->databaseSamples[request.database];
+        const qint64 documentCount = result.value(QStringLiteral("doc_count")).toLongLong();
+        const qint64 updateSequence = sequenceNumber(result.value(QStringLiteral("update_seq")));
+
+        QVariantMap info = result.toVariant().toMap();
+        if(sample.clock.isValid())
+        {
+            const double seconds = qMax<qint64>(1, sample.clock.elapsed()) / 1000.0;
+            info.insert(QStringLiteral("doc_rate"), (documentCount - sample.documentCount) / seconds);
+            info.insert(QStringLiteral("update_rate"), qMax<qint64>(0, updateSequence - sample.updateSequence) / seconds);
+        }
+
+        sample.info = info;
+        sample.documentCount = documentCount;
+        sample.updateSequence = updateSequence;
+        sample.clock.start();
+        emit databaseUpdated(request.database, info);
+        break;
+    }
+    case REQUEST_UP:
+        break;
+    }
+}
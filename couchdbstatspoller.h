@@ -0,0 +1,99 @@
+#ifndef COUCHDBSTATSPOLLER_H
+#define COUCHDBSTATSPOLLER_H
+
+#include <QObject>
+#include <QStringList>
+#include <QVariantMap>
+
+#include "couchdbenums.h"
+#include "couchdboperationstatistics.h"
+
+class CouchDB;
+class CouchDBServer;
+class CouchDBStatsPollerPrivate;
+//Polls the server health endpoints on their own intervals and reports what changed between polls: request and status
+//rates from the node statistics, open databases, compactions and indexers from the active tasks, availability from
+//_up and growth of the watched databases. With a CouchDB set, every snapshot also holds the client latencies of each
+//operation over the same period, so a stall can be told apart between the client, the network and the server.
+//A poll isn't sent while the previous one of the same endpoint is still running, which pollTimeout bounds.
+class CouchDBStatsPoller : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CouchDBStatsPoller(CouchDBServer *server, QObject *parent = 0);
+    virtual ~CouchDBStatsPoller();
+
+    //Intervals in msecs, 0 stops polling that endpoint
+    int statsInterval() const;
+    void setStatsInterval(const int& msec);
+
+    int tasksInterval() const;
+    void setTasksInterval(const int& msec);
+
+    int upInterval() const;
+    void setUpInterval(const int& msec);
+
+    int databaseInterval() const;
+    void setDatabaseInterval(const int& msec);
+
+    //A poll without an answer within this time is aborted, an aborted _up counting as down. 0 waits forever
+    int pollTimeout() const;
+    void setPollTimeout(const int& msec);
+
+    //Node statistics path, "_local" being the node answering
+    QString statsPath() const;
+    void setStatsPath(const QString& statsPath);
+
+    QStringList databases() const;
+    void addDatabase(const QString& database);
+    void removeDatabase(const QString& database);
+
+    CouchDB* couchdb() const;
+    void setCouchDB(CouchDB *couchdb);
+
+    bool isRunning() const;
+    bool isUp() const;
+
+    //Counters per second over the last two polls and current gauges, by dotted metric name
+    //(e.g. "couchdb.httpd.requests"). Histograms appear as gauges with ".median" and ".p99" appended
+    QVariantMap rates() const;
+    QVariantMap gauges() const;
+
+    double requestRate() const;
+    int openDatabases() const;
+
+    QVariantList activeTasks() const;
+    //Running tasks by type, e.g. "database_compaction", "view_compaction", "indexer", "replication"
+    QVariantMap taskCounts() const;
+
+    //Last info of a watched database, with "doc_rate" and "update_rate" per second added
+    QVariantMap databaseInfo(const QString& database) const;
+
+    //Everything above, plus the client latencies of each operation since the previous node statistics poll
+    QVariantMap snapshot() const;
+
+signals:
+    void statsUpdated(const QVariantMap& rates, const QVariantMap& gauges);
+    void tasksUpdated(const QVariantMap& taskCounts);
+    void upChanged(const bool& up);
+    void databaseUpdated(const QString& database, const QVariantMap& info);
+    void pollFailed(const QString& path, const QString& error);
+
+public slots:
+    void start();
+    void stop();
+
+    void pollStats();
+    void pollTasks();
+    void pollUp();
+    void pollDatabases();
+
+private slots:
+    void replyFinished();
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBStatsPoller)
+    CouchDBStatsPollerPrivate * const d_ptr;
+};
+
+#endif // COUCHDBSTATSPOLLER_H
@@ -0,0 +1,262 @@
+#include "couchdbtimingwheel.h"
+
+#include <QVector>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QMetaObject>
+#include <QPointer>
+
+namespace
+{
+    const quint32 npos = 0xFFFFFFFF;
+    const int slotBits = 6;
+    const int slotsPerLevel = 1 << slotBits;
+    const int levels = (64 + slotBits - 1) / slotBits;
+
+    struct Entry
+    {
+        Entry() :
+            expiry(0),
+            member(0),
+            previous(npos),
+            next(npos),
+            generation(1),
+            bucket(-1)
+        {}
+
+        quint64 expiry;
+        QPointer<QObject> receiver;
+        const char *member;
+        quint32 previous;
+        quint32 next; //Also links the free list
+        quint32 generation;
+        int bucket;
+    };
+}
+
+class CouchDBTimingWheelPrivate
+{
+public:
+    CouchDBTimingWheelPrivate() :
+        timer(0),
+        resolution(100),
+        currentTick(0),
+        freeList(npos),
+        count(0)
+    {
+        for(int i = 0; i < levels * slotsPerLevel; ++i) buckets[i] = npos;
+    }
+
+    virtual ~CouchDBTimingWheelPrivate()
+    {
+        if(timer) delete timer;
+    }
+
+    quint64 now() const
+    {
+        return quint64(clock.elapsed()) / quint64(resolution);
+    }
+
+    //First tick at or after the given time from now, rounded up so a deadline never fires early
+    quint64 tickAfter(const int& msec) const
+    {
+        return (quint64(clock.elapsed()) + quint64(qMax(1, msec)) + quint64(resolution) - 1) / quint64(resolution);
+    }
+
+    //An entry lives on the lowest level where its expiry and the current tick share every higher digit
+    int bucketFor(const quint64& expiry) const
+    {
+        quint64 difference = (expiry ^ currentTick) >> slotBits;
+        int level = 0;
+        while(difference)
+        {
+            difference >>= slotBits;
+            ++level;
+        }
+
+        return level * slotsPerLevel + int((expiry >> (level * slotBits)) & (slotsPerLevel - 1));
+    }
+
+    void link(const quint32& index)
+    {
+        Entry& entry = entries[index];
+        entry.bucket = bucketFor(entry.expiry);
+        entry.previous = npos;
+        entry.next = buckets[entry.bucket];
+        if(entry.next != npos) entries[entry.next].previous = index;
+        buckets[entry.bucket] = index;
+    }
+
+    void unlink(const quint32& index)
+    {
+        Entry& entry = entries[index];
+        if(entry.previous != npos) entries[entry.previous].next = entry.next;
+        else buckets[entry.bucket] = entry.next;
+        if(entry.next != npos) entries[entry.next].previous = entry.previous;
+        entry.previous = entry.next = npos;
+        entry.bucket = -1;
+    }
+
+    void release(const quint32& index)
+    {
+        Entry& entry = entries[index];
+        entry.receiver = 0;
+        entry.member = 0;
+        ++entry.generation;
+        entry.next = freeList;
+        freeList = index;
+        --count;
+    }
+
+    quint32 lookup(const quint64& handle) const
+    {
+        const quint32 index = quint32(handle & 0xFFFFFFFF);
+        if(index >= quint32(entries.size())) return npos;
+
+        const Entry& entry = entries.at(index);
+        if(entry.bucket < 0 || entry.generation != quint32(handle >> 32)) return npos;
+        return index;
+    }
+
+    QTimer *timer;
+    QElapsedTimer clock;
+    int resolution;
+    quint64 currentTick;
+    QVector<Entry> entries;
+    quint32 buckets[levels * slotsPerLevel];
+    quint32 freeList;
+    int count;
+};
+
+CouchDBTimingWheel::CouchDBTimingWheel(QObject *parent) :
+    QObject(parent),
+    d_ptr(new CouchDBTimingWheelPrivate)
+{
+    Q_D(CouchDBTimingWheel);
+
+    d->clock.start();
+
+    d->timer = new QTimer(this);
+    d->timer->setInterval(d->resolution);
+    d->timer->setTimerType(Qt::CoarseTimer);
+    connect(d->timer, SIGNAL(timeout()), this, SLOT(tick()));
+}
+
+CouchDBTimingWheel::~CouchDBTimingWheel()
+{
+    delete d_ptr;
+}
+
+int CouchDBTimingWheel::resolution() const
+{
+    Q_D(const CouchDBTimingWheel);
+    return d->resolution;
+}
+
+void CouchDBTimingWheel::setResolution(const int &msec)
+{
+    Q_D(CouchDBTimingWheel);
+    if(d->count > 0 || msec <= 0) return;
+
+    d->resolution = msec;
+    d->timer->setInterval(msec);
+}
+
+quint64 CouchDBTimingWheel::schedule(const int &msec, QObject *receiver, const char *member)
+{
+    Q_D(CouchDBTimingWheel);
+
+    //Nothing is pending while the timer is stopped, the wheel can jump straight to the current time
+    if(d->count == 0) d->currentTick = d->now();
+
+    quint32 index = d->freeList;
+    if(index != npos)
+    {
+        d->freeList = d->entries.at(index).next;
+    }
+    else
+    {
+        index = d->entries.size();
+        d->entries.append(Entry());
+    }
+
+    Entry& entry = d->entries[index];
+    //Based on the clock rather than the current tick, which lags behind it until the next tick() catches up
+    entry.expiry = qMax(d->tickAfter(msec), d->currentTick + 1);
+    entry.receiver = receiver;
+    entry.member = member;
+    d->link(index);
+    ++d->count;
+
+    if(!d->timer->isActive()) d->timer->start();
+
+    return (quint64(entry.generation) << 32) | index;
+}
+
+void CouchDBTimingWheel::cancel(const quint64 &handle)
+{
+    Q_D(CouchDBTimingWheel);
+
+    const quint32 index = d->lookup(handle);
+    if(index == npos) return;
+
+    d->unlink(index);
+    d->release(index);
+
+    if(d->count == 0) d->timer->stop();
+}
+
+bool CouchDBTimingWheel::isScheduled(const quint64 &handle) const
+{
+    Q_D(const CouchDBTimingWheel);
+    return d->lookup(handle) != npos;
+}
+
+int CouchDBTimingWheel::size() const
+{
+    Q_D(const CouchDBTimingWheel);
+    return d->count;
+}
+
+void CouchDBTimingWheel::tick()
+{
+    Q_D(CouchDBTimingWheel);
+
+    const quint64 target = d->now();
+    while(d->currentTick < target && d->count > 0)
+    {
+        ++d->currentTick;
+
+        //Entries of a higher level slot move down once the wheel enters their range
+        for(int level = 1; level < levels; ++level)
+        {
+            if((d->currentTick & ((quint64(1) << (level * slotBits)) - 1)) != 0) break;
+
+            const int bucket = level * slotsPerLevel + int((d->currentTick >> (level * slotBits)) & (slotsPerLevel - 1));
+            quint32 index = d->buckets[bucket];
+            d->buckets[bucket] = npos;
+            while(index != npos)
+            {
+                const quint32 next = d->entries.at(index).next;
+                d->link(index);
+                index = next;
+            }
+        }
+
+        const int bucket = int(d->currentTick & (slotsPerLevel - 1));
+
+        //Fired one at a time, a callback may cancel a later deadline of the same slot or delete its receiver
+        while(d->buckets[bucket] != npos)
+        {
+            const quint32 index = d->buckets[bucket];
+            QPointer<QObject> receiver = d->entries.at(index).receiver;
+            const char *member = d->entries.at(index).member;
+            d->unlink(index);
+            d->release(index);
+
+            if(receiver) QMetaObject::invokeMethod(receiver, member, Qt::DirectConnection);
+        }
+    }
+
+    if(d->count == 0) d->timer->stop();
+}
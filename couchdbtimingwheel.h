@@ -0,0 +1,34 @@
+#ifndef COUCHDBTIMINGWHEEL_H
+#define COUCHDBTIMINGWHEEL_H
+
+#include <QObject>
+
+//Hierarchical timing wheel tracking many deadlines with a single coarse timer.
+//Scheduling and cancelling are O(1); on expiry the member (slot or signal) is invoked on the receiver.
+//Deadlines of a destroyed receiver are skipped, cancelling them still frees their entries earlier.
+class CouchDBTimingWheelPrivate;
+class CouchDBTimingWheel : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CouchDBTimingWheel(QObject *parent = 0);
+    virtual ~CouchDBTimingWheel();
+
+    int resolution() const;
+    void setResolution(const int& msec);
+
+    quint64 schedule(const int& msec, QObject *receiver, const char *member);
+    void cancel(const quint64& handle);
+    bool isScheduled(const quint64& handle) const;
+
+    int size() const;
+
+private slots:
+    void tick();
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBTimingWheel)
+    CouchDBTimingWheelPrivate * const d_ptr;
+};
+
+#endif // COUCHDBTIMINGWHEEL_H
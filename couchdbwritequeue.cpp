@@ -0,0 +1,389 @@
+#include "couchdbwritequeue.h"
+
+#include <QFile>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QStringList>
+#include <QHash>
+#include <QMap>
+#include <QTimer>
+#include <QtEndian>
+#include <QDebug>
+
+#if defined(Q_OS_WIN)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace
+{
+    enum RecordType
+    {
+        RECORD_UPDATE = 1,
+        RECORD_DELETE = 2,
+        RECORD_ACKNOWLEDGE = 3
+    };
+
+    const int recordHeaderSize = 6; //quint32 payload size + quint16 checksum
+
+    QString entryKey(const QString& database, const QString& documentID)
+    {
+        return database + QLatin1Char('\n') + documentID;
+    }
+
+    void appendRecord(QByteArray& buffer, const QByteArray& payload)
+    {
+        uchar header[recordHeaderSize];
+        qToBigEndian<quint32>(payload.size(), header);
+        qToBigEndian<quint16>(qChecksum(payload.constData(), payload.size()), header + 4);
+        buffer.append(reinterpret_cast<const char*>(header), recordHeaderSize);
+        buffer.append(payload);
+    }
+
+    QByteArray encodeEntry(const CouchDBWriteQueueEntry& entry)
+    {
+        QByteArray payload;
+        QDataStream stream(&payload, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_5_0);
+        stream << quint8(entry.operation == COUCHDB_DELETEDOCUMENT ? RECORD_DELETE : RECORD_UPDATE) << entry.sequence
+               << entry.database << entry.documentID << entry.revision << entry.document;
+        return payload;
+    }
+
+    QByteArray encodeAcknowledge(const quint64& sequence)
+    {
+        QByteArray payload;
+        QDataStream stream(&payload, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_5_0);
+        stream << quint8(RECORD_ACKNOWLEDGE) << sequence;
+        return payload;
+    }
+
+    bool syncFile(QFile& file)
+    {
+        if(!file.flush()) return false;
+#if defined(Q_OS_WIN)
+        return _commit(file.handle()) == 0;
+#else
+        return ::fsync(file.handle()) == 0;
+#endif
+    }
+}
+
+class CouchDBWriteQueuePrivate
+{
+public:
+    CouchDBWriteQueuePrivate(const QString& p) :
+        path(p),
+        commitTimer(0),
+        nextSequence(1),
+        logRecords(0)
+    {}
+
+    virtual ~CouchDBWriteQueuePrivate()
+    {
+        if(commitTimer) delete commitTimer;
+    }
+
+    void insertPending(const CouchDBWriteQueueEntry& entry)
+    {
+        //Last write wins: an older pending write for the same document is never sent
+        const QString key = entryKey(entry.database, entry.documentID);
+        if(latest.contains(key)) pending.remove(latest.value(key));
+
+        pending.insert(entry.sequence, entry);
+        latest.insert(key, entry.sequence);
+    }
+
+    void append(const CouchDBWriteQueueEntry& entry)
+    {
+        insertPending(entry);
+        appendRecord(buffer, encodeEntry(entry));
+        ++logRecords;
+        if(!commitTimer->isActive()) commitTimer->start();
+    }
+
+    bool load();
+    bool rewrite();
+
+    QString path;
+    QFile file;
+    QByteArray buffer;
+    QTimer *commitTimer;
+    quint64 nextSequence;
+    int logRecords;
+    QMap<quint64, CouchDBWriteQueueEntry> pending;
+    QHash<QString, quint64> latest;
+    QHash<quint64, CouchDBWriteQueueEntry> inFlight;
+};
+
+bool CouchDBWriteQueuePrivate::load()
+{
+    const QByteArray log = file.readAll();
+    const uchar *data = reinterpret_cast<const uchar*>(log.constData());
+
+    int offset = 0;
+    while(offset + recordHeaderSize <= log.size())
+    {
+        const quint32 size = qFromBigEndian<quint32>(data + offset);
+        const quint16 checksum = qFromBigEndian<quint16>(data + offset + 4);
+        if(offset + recordHeaderSize + int(size) > log.size()) break;
+
+        const char *payloadData = log.constData() + offset + recordHeaderSize;
+        if(qChecksum(payloadData, size) != checksum) break;
+
+        QByteArray payload = QByteArray::fromRawData(payloadData, size);
+        QDataStream stream(payload);
+        stream.setVersion(QDataStream::Qt_5_0);
+
+        quint8 type;
+        CouchDBWriteQueueEntry entry;
+        stream >> type >> entry.sequence;
+        if(type == RECORD_ACKNOWLEDGE)
+        {
+            CouchDBWriteQueueEntry acknowledged = pending.take(entry.sequence);
+            const QString key = entryKey(acknowledged.database, acknowledged.documentID);
+            if(latest.value(key) == entry.sequence) latest.remove(key);
+        }
+        else
+        {
+            stream >> entry.database >> entry.documentID >> entry.revision >> entry.document;
+            entry.operation = type == RECORD_DELETE ? COUCHDB_DELETEDOCUMENT : COUCHDB_UPDATEDOCUMENT;
+            insertPending(entry);
+        }
+
+        if(entry.sequence >= nextSequence) nextSequence = entry.sequence + 1;
+        offset += recordHeaderSize + size;
+        ++logRecords;
+    }
+
+    //A torn record at the tail is the write that was in progress when the process died
+    if(offset != log.size())
+    {
+        qWarning() << "Write-ahead log" << path << "has a damaged tail, truncating at" << offset;
+        if(!file.resize(offset)) return false;
+    }
+
+    return file.seek(file.size());
+}
+
+bool CouchDBWriteQueuePrivate::rewrite()
+{
+    QByteArray log;
+    QList<CouchDBWriteQueueEntry> live = inFlight.values();
+    live.append(pending.values());
+    foreach(const CouchDBWriteQueueEntry& entry, live) appendRecord(log, encodeEntry(entry));
+
+    file.close();
+
+    QSaveFile saveFile(path);
+    if(!saveFile.open(QIODevice::WriteOnly) || saveFile.write(log) != log.size() || !saveFile.commit())
+    {
+        qWarning() << "Failed to compact write-ahead log" << path << saveFile.errorString();
+        return file.open(QIODevice::ReadWrite | QIODevice::Append);
+    }
+
+    logRecords = live.size();
+    return file.open(QIODevice::ReadWrite | QIODevice::Append);
+}
+
+CouchDBWriteQueue::CouchDBWriteQueue(const QString& path, QObject *parent) :
+    QObject(parent),
+    d_ptr(new CouchDBWriteQueuePrivate(path))
+{
+    Q_D(CouchDBWriteQueue);
+
+    d->file.setFileName(path);
+
+    d->commitTimer = new QTimer(this);
+    d->commitTimer->setInterval(5);
+    d->commitTimer->setSingleShot(true);
+    connect(d->commitTimer, SIGNAL(timeout()), this, SLOT(commit()));
+}
+
+CouchDBWriteQueue::~CouchDBWriteQueue()
+{
+    close();
+    delete d_ptr;
+}
+
+QString CouchDBWriteQueue::path() const
+{
+    Q_D(const CouchDBWriteQueue);
+    return d->path;
+}
+
+bool CouchDBWriteQueue::open()
+{
+    Q_D(CouchDBWriteQueue);
+    if(d->file.isOpen()) return true;
+
+    if(!d->file.open(QIODevice::ReadWrite))
+    {
+        qWarning() << "Failed to open write-ahead log" << d->path << d->file.errorString();
+        return false;
+    }
+
+    if(!d->load())
+    {
+        d->file.close();
+        return false;
+    }
+
+    qDebug() << "Write-ahead log" << d->path << "opened with" << d->pending.size() << "pending writes";
+    return true;
+}
+
+void CouchDBWriteQueue::close()
+{
+    Q_D(CouchDBWriteQueue);
+    if(!d->file.isOpen()) return;
+
+    commit();
+    d->file.close();
+}
+
+bool CouchDBWriteQueue::isOpen() const
+{
+    Q_D(const CouchDBWriteQueue);
+    return d->file.isOpen();
+}
+
+int CouchDBWriteQueue::commitInterval() const
+{
+    Q_D(const CouchDBWriteQueue);
+    return d->commitTimer->interval();
+}
+
+void CouchDBWriteQueue::setCommitInterval(const int &msec)
+{
+    Q_D(CouchDBWriteQueue);
+    d->commitTimer->setInterval(msec);
+}
+
+bool CouchDBWriteQueue::isEmpty() const
+{
+    Q_D(const CouchDBWriteQueue);
+    return d->pending.isEmpty() && d->inFlight.isEmpty();
+}
+
+int CouchDBWriteQueue::size() const
+{
+    Q_D(const CouchDBWriteQueue);
+    return d->pending.size() + d->inFlight.size();
+}
+
+QStringList CouchDBWriteQueue::databases() const
+{
+    Q_D(const CouchDBWriteQueue);
+
+    QStringList databases;
+    foreach(const CouchDBWriteQueueEntry& entry, d->pending)
+    {
+        if(!databases.contains(entry.database)) databases.append(entry.database);
+    }
+
+    return databases;
+}
+
+void CouchDBWriteQueue::enqueueUpdate(const QString &database, const QString &documentID, const QByteArray &document)
+{
+    Q_D(CouchDBWriteQueue);
+
+    CouchDBWriteQueueEntry entry;
+    entry.operation = COUCHDB_UPDATEDOCUMENT;
+    entry.sequence = d->nextSequence++;
+    entry.database = database;
+    entry.documentID = documentID;
+    entry.document = document;
+
+    d->append(entry);
+}
+
+void CouchDBWriteQueue::enqueueDelete(const QString &database, const QString &documentID, const QString &revision)
+{
+    Q_D(CouchDBWriteQueue);
+
+    CouchDBWriteQueueEntry entry;
+    entry.operation = COUCHDB_DELETEDOCUMENT;
+    entry.sequence = d->nextSequence++;
+    entry.database = database;
+    entry.documentID = documentID;
+    entry.revision = revision;
+
+    d->append(entry);
+}
+
+QList<CouchDBWriteQueueEntry> CouchDBWriteQueue::takeBatch(const QString &database, const int &maxCount)
+{
+    Q_D(CouchDBWriteQueue);
+
+    QList<CouchDBWriteQueueEntry> batch;
+    QMap<quint64, CouchDBWriteQueueEntry>::iterator it = d->pending.begin();
+    while(it != d->pending.end() && batch.size() < maxCount)
+    {
+        if(it.value().database != database)
+        {
+            ++it;
+            continue;
+        }
+
+        const CouchDBWriteQueueEntry entry = it.value();
+        d->latest.remove(entryKey(entry.database, entry.documentID));
+        d->inFlight.insert(entry.sequence, entry);
+        batch.append(entry);
+        it = d->pending.erase(it);
+    }
+
+    return batch;
+}
+
+void CouchDBWriteQueue::acknowledge(const quint64 &sequence)
+{
+    Q_D(CouchDBWriteQueue);
+    if(!d->inFlight.remove(sequence)) return;
+
+    appendRecord(d->buffer, encodeAcknowledge(sequence));
+    ++d->logRecords;
+    if(!d->commitTimer->isActive()) d->commitTimer->start();
+}
+
+void CouchDBWriteQueue::release(const quint64 &sequence)
+{
+    Q_D(CouchDBWriteQueue);
+    if(!d->inFlight.contains(sequence)) return;
+
+    //Put it back unless the document was written again while the batch was in flight
+    CouchDBWriteQueueEntry entry = d->inFlight.take(sequence);
+    if(!d->latest.contains(entryKey(entry.database, entry.documentID))) d->insertPending(entry);
+}
+
+void CouchDBWriteQueue::commit()
+{
+    Q_D(CouchDBWriteQueue);
+
+    d->commitTimer->stop();
+    if(!d->file.isOpen() || d->buffer.isEmpty()) return;
+
+    if(isEmpty())
+    {
+        //Everything has been flushed to the server, the log can start over
+        d->buffer.clear();
+        d->logRecords = 0;
+        if(!d->file.resize(0) || !d->file.seek(0) || !syncFile(d->file)) qWarning() << "Failed to truncate write-ahead log" << d->path;
+        emit committed();
+        return;
+    }
+
+    if(d->file.write(d->buffer) != d->buffer.size() || !syncFile(d->file))
+    {
+        qWarning() << "Failed to commit write-ahead log" << d->path << d->file.errorString();
+        return;
+    }
+    d->buffer.clear();
+
+    if(d->logRecords > 1024 && d->logRecords > 4 * size()) d->rewrite();
+
+    emit committed();
+}
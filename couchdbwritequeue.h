@@ -0,0 +1,66 @@
+#ifndef COUCHDBWRITEQUEUE_H
+#define COUCHDBWRITEQUEUE_H
+
+#include <QObject>
+#include <QList>
+
+#include "couchdbenums.h"
+
+struct CouchDBWriteQueueEntry
+{
+    CouchDBWriteQueueEntry() :
+        operation(COUCHDB_UPDATEDOCUMENT),
+        sequence(0)
+    {}
+
+    CouchDBOperation operation;
+    quint64 sequence;
+    QString database;
+    QString documentID;
+    QString revision;
+    QByteArray document;
+};
+
+class CouchDBWriteQueuePrivate;
+class CouchDBWriteQueue : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CouchDBWriteQueue(const QString& path, QObject *parent = 0);
+    virtual ~CouchDBWriteQueue();
+
+    QString path() const;
+
+    bool open();
+    void close();
+    bool isOpen() const;
+
+    //Time window during which appended writes are grouped into a single write + fsync
+    int commitInterval() const;
+    void setCommitInterval(const int& msec);
+
+    bool isEmpty() const;
+    int size() const;
+
+    QStringList databases() const;
+
+    void enqueueUpdate(const QString& database, const QString& documentID, const QByteArray& document);
+    void enqueueDelete(const QString& database, const QString& documentID, const QString& revision);
+
+    //Entries taken are kept in the log until acknowledged or released
+    QList<CouchDBWriteQueueEntry> takeBatch(const QString& database, const int& maxCount);
+    void acknowledge(const quint64& sequence);
+    void release(const quint64& sequence);
+
+signals:
+    void committed();
+
+public slots:
+    void commit();
+
+private:
+    Q_DECLARE_PRIVATE(CouchDBWriteQueue)
+    CouchDBWriteQueuePrivate * const d_ptr;
+};
+
+#endif // COUCHDBWRITEQUEUE_H
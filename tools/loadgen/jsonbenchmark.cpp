@@ -0,0 +1,143 @@
+#include "jsonbenchmark.h"
+
+#include <QElapsedTimer>
+#include <QList>
+
+#include "couchdbjsonview.h"
+
+namespace
+{
+    QByteArray documentText(const int& i, const int& size)
+    {
+        QByteArray padding(qMax(0, size - 96), 'x');
+        return QString("{\"_id\":\"doc-%1\",\"_rev\":\"1-%2\",\"counter\":%1,\"tags\":[\"a\",\"b\",\"c\"],\"nested\":{\"_rev\":\"not-this\"},\"payload\":\"%3\"}")
+                .arg(i).arg(i * 7919, 32, 16, QChar('0')).arg(QString::fromLatin1(padding)).toUtf8();
+    }
+
+    //One line per change, as read from a continuous feed with include_docs
+    QList<QByteArray> changeLines(const int& documents, const int& size)
+    {
+        QList<QByteArray> lines;
+        for(int i = 0; i < documents; ++i)
+        {
+            lines.append(QString("{\"seq\":\"%1-g1AAAAFTeJzLYWBg4MhgTmHgz8tPSTV0MDQy\",\"id\":\"doc-%1\",\"changes\":[{\"rev\":\"1-%2\"}],\"doc\":")
+                         .arg(i).arg(i * 7919, 32, 16, QChar('0')).toUtf8() + documentText(i, size) + "}");
+        }
+        return lines;
+    }
+
+    QByteArray allDocsPage(const int& documents, const int& size)
+    {
+        QByteArray page = QString("{\"total_rows\":%1,\"offset\":0,\"rows\":[").arg(documents).toUtf8();
+        for(int i = 0; i < documents; ++i)
+        {
+            if(i > 0) page.append(',');
+            page.append(QString("{\"id\":\"doc-%1\",\"key\":\"doc-%1\",\"value\":{\"rev\":\"1-%2\"},\"doc\":")
+                        .arg(i).arg(i * 7919, 32, 16, QChar('0')).toUtf8()).append(documentText(i, size)).append('}');
+        }
+        return page.append("]}");
+    }
+
+    //Same fields the listener reads from a change
+    int readChange(const QByteArray& line)
+    {
+        const CouchDBJsonView change(line);
+        return change.value(QStringLiteral("seq")).raw().size() + change.value(QStringLiteral("id")).toString().size() +
+                change.value(QStringLiteral("changes")).at(0).value(QStringLiteral("rev")).toString().size() +
+                change.value(QStringLiteral("doc")).raw().size();
+    }
+
+    //Same fields a paged read of _all_docs uses
+    int readPage(const QByteArray& page)
+    {
+        int total = 0;
+        foreach(const CouchDBJsonView& row, CouchDBJsonView(page).value(QStringLiteral("rows")).elements())
+        {
+            total += row.value(QStringLiteral("id")).toString().size() + row.value(QStringLiteral("value")).value(QStringLiteral("rev")).toString().size();
+        }
+        return total;
+    }
+
+    double timeLines(const QList<QByteArray>& lines, const int& iterations, const CouchDBJsonBackend& backend, int& sink)
+    {
+        CouchDBJsonView::setBackend(backend);
+
+        QElapsedTimer timer;
+        timer.start();
+        for(int i = 0; i < iterations; ++i)
+        {
+            foreach(const QByteArray& line, lines) sink += readChange(line);
+        }
+        return timer.nsecsElapsed() / 1e9;
+    }
+
+    double timePage(const QByteArray& page, const int& iterations, const CouchDBJsonBackend& backend, int& sink)
+    {
+        CouchDBJsonView::setBackend(backend);
+
+        QElapsedTimer timer;
+        timer.start();
+        for(int i = 0; i < iterations; ++i) sink += readPage(page);
+        return timer.nsecsElapsed() / 1e9;
+    }
+}
+
+double JsonBenchmarkResult::structuralThroughput() const
+{
+    return structuralSeconds > 0 ? bytes / structuralSeconds / 1e6 : 0;
+}
+
+double JsonBenchmarkResult::documentThroughput() const
+{
+    return documentSeconds > 0 ? bytes / documentSeconds / 1e6 : 0;
+}
+
+double JsonBenchmarkResult::speedup() const
+{
+    return structuralSeconds > 0 ? documentSeconds / structuralSeconds : 0;
+}
+
+QJsonObject JsonBenchmarkResult::toJson() const
+{
+    QJsonObject object;
+    object.insert("payload", payload);
+    object.insert("bytes", bytes);
+    object.insert("structuralMBps", structuralThroughput());
+    object.insert("qjsondocumentMBps", documentThroughput());
+    object.insert("speedup", speedup());
+    return object;
+}
+
+QList<JsonBenchmarkResult> runJsonBenchmark(const int& documents, const int& documentSize, const int& iterations)
+{
+    const CouchDBJsonBackend previous = CouchDBJsonView::backend();
+    int sink = 0;
+
+    JsonBenchmarkResult changes;
+    changes.payload = "changes";
+    const QList<QByteArray> lines = changeLines(documents, documentSize);
+    foreach(const QByteArray& line, lines) changes.bytes += line.size() * qint64(iterations);
+
+    //One untimed pass each so allocations and caches are warm for both
+    timeLines(lines, 1, COUCHDB_JSON_STRUCTURAL, sink);
+    timeLines(lines, 1, COUCHDB_JSON_QJSONDOCUMENT, sink);
+    changes.structuralSeconds = timeLines(lines, iterations, COUCHDB_JSON_STRUCTURAL, sink);
+    changes.documentSeconds = timeLines(lines, iterations, COUCHDB_JSON_QJSONDOCUMENT, sink);
+
+    JsonBenchmarkResult allDocs;
+    allDocs.payload = "all_docs";
+    const QByteArray page = allDocsPage(documents, documentSize);
+    allDocs.bytes = page.size() * qint64(iterations);
+
+    timePage(page, 1, COUCHDB_JSON_STRUCTURAL, sink);
+    timePage(page, 1, COUCHDB_JSON_QJSONDOCUMENT, sink);
+    allDocs.structuralSeconds = timePage(page, iterations, COUCHDB_JSON_STRUCTURAL, sink);
+    allDocs.documentSeconds = timePage(page, iterations, COUCHDB_JSON_QJSONDOCUMENT, sink);
+
+    CouchDBJsonView::setBackend(previous);
+
+    //Keeps the reads from being optimized away
+    if(sink == -1) changes.bytes = 0;
+
+    return QList<JsonBenchmarkResult>() << changes << allDocs;
+}
@@ -0,0 +1,29 @@
+#ifndef JSONBENCHMARK_H
+#define JSONBENCHMARK_H
+
+#include <QJsonObject>
+
+//Times the reads the client makes on its hottest payloads, changes feed lines and _all_docs pages, through
+//CouchDBJsonView with each backend. The structural index is expected to be at least 3x the QJsonDocument throughput.
+struct JsonBenchmarkResult
+{
+    JsonBenchmarkResult() :
+        bytes(0),
+        structuralSeconds(0),
+        documentSeconds(0)
+    {}
+
+    double structuralThroughput() const; //MB/s
+    double documentThroughput() const;
+    double speedup() const;
+    QJsonObject toJson() const;
+
+    QString payload;
+    qint64 bytes; //Total text read per backend
+    double structuralSeconds;
+    double documentSeconds;
+};
+
+QList<JsonBenchmarkResult> runJsonBenchmark(const int& documents, const int& documentSize, const int& iterations);
+
+#endif // JSONBENCHMARK_H
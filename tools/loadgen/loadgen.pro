@@ -0,0 +1,37 @@
+#-------------------------------------------------
+#
+# Load generator for the top_couchdb library, built after it
+#
+#-------------------------------------------------
+
+QT += core network qml
+QT -= gui
+
+ROOT_DIR = ../../../..
+
+CONFIG(debug, debug|release): DESTDIR = $${ROOT_DIR}/Output/debug
+CONFIG(release, debug|release): DESTDIR = $${ROOT_DIR}/Output/release
+
+TARGET = top_couchdb_loadgen
+TEMPLATE = app
+
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../..
+LIBS += -L$${DESTDIR} -ltop_couchdb
+#Relinks when the library changes, top-couchdb-all.pro builds the library first
+win32: PRE_TARGETDEPS += $${DESTDIR}/top_couchdb.lib
+else: PRE_TARGETDEPS += $${DESTDIR}/libtop_couchdb.a
+win32: LIBS += -lpsapi
+
+HEADERS += \
+    jsonbenchmark.h \
+    loadrunner.h \
+    standinserver.h
+
+SOURCES += \
+    main.cpp \
+    jsonbenchmark.cpp \
+    loadrunner.cpp \
+    standinserver.cpp
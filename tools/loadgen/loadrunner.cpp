@@ -0,0 +1,309 @@
+#include "loadrunner.h"
+
+#include "couchdb.h"
+#include "couchdblistener.h"
+
+#include <QFile>
+#include <QTextStream>
+#include <QDebug>
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    //User and system time of the whole process, stand-in server thread included
+    double cpuTime()
+    {
+#if defined(Q_OS_WIN)
+        FILETIME creation, exit, kernel, user;
+        if(!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) return 0;
+
+        ULARGE_INTEGER kernelTime, userTime;
+        kernelTime.LowPart = kernel.dwLowDateTime;
+        kernelTime.HighPart = kernel.dwHighDateTime;
+        userTime.LowPart = user.dwLowDateTime;
+        userTime.HighPart = user.dwHighDateTime;
+        return (kernelTime.QuadPart + userTime.QuadPart) / 1e7;
+#else
+        rusage usage;
+        if(getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+    }
+
+    //Current resident set where the platform reports it, peak otherwise
+    qint64 residentSetSize()
+    {
+#if defined(Q_OS_WIN)
+        PROCESS_MEMORY_COUNTERS counters;
+        if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+        return counters.WorkingSetSize;
+#elif defined(Q_OS_LINUX)
+        QFile statm(QStringLiteral("/proc/self/statm"));
+        if(!statm.open(QIODevice::ReadOnly)) return 0;
+        const QList<QByteArray> fields = statm.readAll().split(' ');
+        return fields.size() > 1 ? fields.at(1).toLongLong() * sysconf(_SC_PAGESIZE) : 0;
+#else
+        rusage usage;
+        if(getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+        return usage.ru_maxrss; //Bytes on macOS
+#endif
+    }
+
+    QString column(const double& value, const int& width, const int& precision = 2)
+    {
+        return QString("%1").arg(value, width, 'f', precision);
+    }
+}
+
+LoadScenario LoadScenario::fromJson(const QJsonObject &object, const LoadScenario &defaults)
+{
+    LoadScenario scenario = defaults;
+    scenario.name = object.value("name").toString(defaults.name);
+    scenario.readRatio = object.value("readRatio").toDouble(defaults.readRatio);
+    scenario.documentSize = object.value("documentSize").toInt(defaults.documentSize);
+    scenario.concurrency = qMax(1, object.value("concurrency").toInt(defaults.concurrency));
+    scenario.listeners = object.value("listeners").toInt(defaults.listeners);
+    scenario.attachmentRatio = object.value("attachmentRatio").toDouble(defaults.attachmentRatio);
+    scenario.attachmentSize = object.value("attachmentSize").toInt(defaults.attachmentSize);
+    scenario.duration = qMax(1, object.value("duration").toInt(defaults.duration));
+    scenario.documents = qMax(1, object.value("documents").toInt(defaults.documents));
+    return scenario;
+}
+
+QJsonObject LoadScenario::toJson() const
+{
+    QJsonObject object;
+    object.insert("name", name);
+    object.insert("readRatio", readRatio);
+    object.insert("documentSize", documentSize);
+    object.insert("concurrency", concurrency);
+    object.insert("listeners", listeners);
+    object.insert("attachmentRatio", attachmentRatio);
+    object.insert("attachmentSize", attachmentSize);
+    object.insert("duration", duration);
+    object.insert("documents", documents);
+    return object;
+}
+
+double LoadResult::percentile(const double &p) const
+{
+    if(latencies.isEmpty()) return 0;
+
+    //Nearest rank
+    const int rank = qBound(1, int(std::ceil(p * latencies.size())), latencies.size());
+    return latencies.at(rank - 1) / 1e6;
+}
+
+QJsonObject LoadResult::toJson() const
+{
+    QJsonObject object;
+    object.insert("scenario", scenario.toJson());
+    object.insert("operations", double(operations));
+    object.insert("errors", double(errors));
+    object.insert("seconds", seconds);
+    object.insert("throughput", seconds > 0 ? operations / seconds : 0);
+    object.insert("changesPerSecond", seconds > 0 ? changes / seconds : 0);
+
+    QJsonObject latency;
+    latency.insert("p50", percentile(0.5));
+    latency.insert("p90", percentile(0.9));
+    latency.insert("p99", percentile(0.99));
+    latency.insert("p999", percentile(0.999));
+    latency.insert("max", percentile(1));
+    object.insert("latencyMs", latency);
+
+    object.insert("cpuSeconds", cpuSeconds);
+    object.insert("cpuPercent", seconds > 0 ? 100 * cpuSeconds / seconds : 0);
+    object.insert("residentBytes", double(residentBytes));
+    return object;
+}
+
+LoadRunner::LoadRunner(CouchDB *couchdb, const QString &database, const QList<LoadScenario> &scenarios, QObject *parent) :
+    QObject(parent),
+    couchdb(couchdb),
+    database(database),
+    scenarios(scenarios),
+    current(0),
+    cpuAtStart(0),
+    inFlight(0),
+    seeded(0),
+    attachmentCounter(0),
+    random(std::random_device()())
+{
+}
+
+QList<LoadResult> LoadRunner::results() const
+{
+    return finishedResults;
+}
+
+void LoadRunner::run()
+{
+    QTextStream out(stdout);
+    out << QString("%1").arg("scenario", -20) << "     ops/s   p50 ms   p90 ms   p99 ms p99.9 ms   max ms   errors changes/s    cpu %   rss MB" << endl;
+
+    current = 0;
+    finishedResults.clear();
+    if(scenarios.isEmpty()) emit finished();
+    else prepare();
+}
+
+void LoadRunner::changeReceived()
+{
+    result.changes++;
+}
+
+void LoadRunner::prepare()
+{
+    result = LoadResult();
+    result.scenario = scenarios.at(current);
+    seeded = 0;
+    inFlight = 0;
+
+    //Every scenario starts from the same state, whatever the previous one left behind
+    couchdb->deleteDatabase(database).then(this, [this](const CouchDBResponse&) {
+        couchdb->createDatabase(database).then(this, [this](const CouchDBResponse& response) {
+            if(response.status() != COUCHDB_SUCCESS) qWarning() << "Failed to create database" << database;
+            seed();
+        });
+    });
+}
+
+void LoadRunner::seed()
+{
+    const LoadScenario& scenario = result.scenario;
+
+    while(inFlight < scenario.concurrency && seeded < scenario.documents)
+    {
+        inFlight++;
+        const QString documentID = QString("doc-%1").arg(seeded++, 8, 10, QLatin1Char('0'));
+        couchdb->updateDocument(database, documentID, documentBody(scenario.documentSize)).then(this, [this](const CouchDBResponse&) {
+            inFlight--;
+            seed();
+        });
+    }
+
+    if(inFlight == 0 && seeded == scenario.documents)
+    {
+        //Moved past the count so a nested call can't start the run twice
+        seeded++;
+        measure();
+    }
+}
+
+void LoadRunner::measure()
+{
+    for(int i = 0; i < result.scenario.listeners; ++i)
+    {
+        CouchDBListener *listener = couchdb->createListener(database, QString());
+        listener->clearFilter();
+        //Only changes made during the run are counted, not the seeded documents
+        listener->setParam("since", "now");
+        connect(listener, SIGNAL(changesMade(QString)), this, SLOT(changeReceived()));
+        listeners.append(listener);
+    }
+
+    cpuAtStart = cpuTime();
+    clock.start();
+    for(int i = 0; i < result.scenario.concurrency; ++i) issue();
+}
+
+void LoadRunner::issue()
+{
+    const LoadScenario& scenario = result.scenario;
+
+    if(clock.elapsed() >= scenario.duration * 1000)
+    {
+        if(inFlight == 0) complete();
+        return;
+    }
+
+    inFlight++;
+
+    //Started before the call, which already builds and sends the request
+    QElapsedTimer timer;
+    timer.start();
+
+    std::uniform_real_distribution<double> uniform(0, 1);
+    CouchDBFuture future;
+    if(uniform(random) < scenario.readRatio)
+    {
+        future = couchdb->retrieveDocument(database, randomDocument());
+    }
+    else if(scenario.attachmentSize > 0 && uniform(random) < scenario.attachmentRatio)
+    {
+        CouchDBAttachment attachment;
+        attachment.name = QStringLiteral("payload.bin");
+        attachment.contentType = QByteArrayLiteral("application/octet-stream");
+        attachment.data = QByteArray(scenario.attachmentSize, 'a');
+        future = couchdb->updateDocumentWithAttachments(database, QString("att-%1").arg(attachmentCounter++), documentBody(scenario.documentSize),
+                                                        QList<CouchDBAttachment>() << attachment);
+    }
+    else
+    {
+        future = couchdb->upsertDocument(database, randomDocument(), documentBody(scenario.documentSize));
+    }
+
+    future.then(this, [this, timer](const CouchDBResponse& response) {
+        result.latencies.append(timer.nsecsElapsed());
+        result.operations++;
+        if(response.status() != COUCHDB_SUCCESS) result.errors++;
+        inFlight--;
+        issue();
+    });
+}
+
+void LoadRunner::complete()
+{
+    result.seconds = clock.nsecsElapsed() / 1e9;
+    result.cpuSeconds = cpuTime() - cpuAtStart;
+    result.residentBytes = residentSetSize();
+    std::sort(result.latencies.begin(), result.latencies.end());
+
+    qDeleteAll(listeners);
+    listeners.clear();
+
+    const double seconds = qMax(result.seconds, 1e-9);
+    QTextStream out(stdout);
+    out << QString("%1").arg(result.scenario.name.left(20), -20)
+        << column(result.operations / seconds, 10)
+        << column(result.percentile(0.5), 9, 3) << column(result.percentile(0.9), 9, 3)
+        << column(result.percentile(0.99), 9, 3) << column(result.percentile(0.999), 9, 3)
+        << column(result.percentile(1), 9, 3)
+        << QString("%1").arg(result.errors, 9)
+        << column(result.changes / seconds, 10)
+        << column(100 * result.cpuSeconds / seconds, 9, 1)
+        << column(result.residentBytes / (1024.0 * 1024.0), 9, 1) << endl;
+
+    finishedResults.append(result);
+
+    if(++current < scenarios.size()) prepare();
+    else emit finished();
+}
+
+QByteArray LoadRunner::documentBody(const int &size)
+{
+    static const QByteArray prefix = QByteArrayLiteral("{\"payload\":\"");
+    static const QByteArray suffix = QByteArrayLiteral("\"}");
+
+    QByteArray body = prefix;
+    body.append(QByteArray(qMax(0, size - prefix.size() - suffix.size()), 'x'));
+    body.append(suffix);
+    return body;
+}
+
+QString LoadRunner::randomDocument()
+{
+    std::uniform_int_distribution<int> uniform(0, result.scenario.documents - 1);
+    return QString("doc-%1").arg(uniform(random), 8, 10, QLatin1Char('0'));
+}
@@ -0,0 +1,112 @@
+#ifndef LOADRUNNER_H
+#define LOADRUNNER_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QList>
+#include <QVector>
+
+#include <random>
+
+class CouchDB;
+class CouchDBListener;
+
+struct LoadScenario
+{
+    LoadScenario() :
+        readRatio(0.8),
+        documentSize(1024),
+        concurrency(8),
+        listeners(0),
+        attachmentRatio(0),
+        attachmentSize(0),
+        duration(10),
+        documents(1000)
+    {}
+
+    //Keys missing from the object keep the values of the defaults
+    static LoadScenario fromJson(const QJsonObject& object, const LoadScenario& defaults);
+    QJsonObject toJson() const;
+
+    QString name;
+    double readRatio; //Share of operations reading a document, the rest upsert one
+    int documentSize; //Bytes per written document
+    int concurrency; //Operations in flight at any time
+    int listeners; //Changes feeds open on the database during the run
+    double attachmentRatio; //Share of writes creating a document with an attachment
+    int attachmentSize;
+    int duration; //Seconds
+    int documents; //Documents written before the run, read and updated at random
+};
+
+struct LoadResult
+{
+    LoadResult() :
+        operations(0),
+        errors(0),
+        changes(0),
+        seconds(0),
+        cpuSeconds(0),
+        residentBytes(0)
+    {}
+
+    double percentile(const double& p) const;
+    QJsonObject toJson() const;
+
+    LoadScenario scenario;
+    qint64 operations;
+    qint64 errors;
+    qint64 changes; //Notifications received by all listeners
+    double seconds;
+    double cpuSeconds;
+    qint64 residentBytes;
+    QVector<qint64> latencies; //Nanoseconds, sorted once the run is over
+};
+
+//Runs scenarios one after the other against a fresh database, as a closed loop: each finished operation
+//issues the next one, keeping the configured concurrency until the duration is over.
+class LoadRunner : public QObject
+{
+    Q_OBJECT
+public:
+    LoadRunner(CouchDB *couchdb, const QString& database, const QList<LoadScenario>& scenarios, QObject *parent = 0);
+
+    QList<LoadResult> results() const;
+
+signals:
+    void finished();
+
+public slots:
+    void run();
+
+private slots:
+    void changeReceived();
+
+private:
+    void prepare();
+    void seed();
+    void measure();
+    void issue();
+    void complete();
+
+    QByteArray documentBody(const int& size);
+    QString randomDocument();
+
+    CouchDB *couchdb;
+    QString database;
+    QList<LoadScenario> scenarios;
+    QList<LoadResult> finishedResults;
+
+    int current;
+    LoadResult result;
+    QList<CouchDBListener*> listeners;
+    QElapsedTimer clock;
+    double cpuAtStart;
+    int inFlight;
+    int seeded;
+    qint64 attachmentCounter;
+    std::mt19937 random;
+};
+
+#endif // LOADRUNNER_H
@@ -0,0 +1,196 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QTextStream>
+#include <QThread>
+#include <QDebug>
+
+#include <cstdio>
+
+#include "couchdb.h"
+#include "loadrunner.h"
+#include "jsonbenchmark.h"
+#include "standinserver.h"
+
+//Drives a mix of CouchDB operations through the client and reports throughput, latency percentiles, CPU and memory
+//per scenario. Runs against the server given with --url, or an in-process stand-in when there is none.
+//
+//  top_couchdb_loadgen --reads 0.5 --concurrency 32 --listeners 4 --duration 30
+//  top_couchdb_loadgen --url 127.0.0.1 --user admin --password secret --scenarios scenarios.json --output results.json
+//  top_couchdb_loadgen --json-benchmark --documents 2000 --document-size 1024
+//
+//A scenarios file holds an array of objects with the keys of LoadScenario, missing keys come from the command line.
+namespace
+{
+    bool verbose = false;
+
+    //The client logs every request, which would flood the report and cost as much as the requests themselves
+    void messageHandler(QtMsgType type, const QMessageLogContext& context, const QString& message)
+    {
+        Q_UNUSED(context);
+        if(type == QtDebugMsg && !verbose) return;
+        fprintf(stderr, "%s\n", qPrintable(message));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication application(argc, argv);
+    QCoreApplication::setApplicationName("top_couchdb_loadgen");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Load generator for the top-couchdb client");
+    parser.addHelpOption();
+    parser.addOptions({
+        {"url", "CouchDB host, the in-process stand-in is used without one.", "host"},
+        {"port", "CouchDB port.", "port", "5984"},
+        {"user", "CouchDB user name.", "user"},
+        {"password", "CouchDB password.", "password"},
+        {"database", "Database recreated for every scenario.", "name", "loadgen"},
+        {"scenarios", "JSON file with an array of scenarios.", "file"},
+        {"output", "Writes the results as JSON, to compare runs.", "file"},
+        {"name", "Scenario name.", "name", "default"},
+        {"reads", "Share of operations reading a document.", "ratio", "0.8"},
+        {"document-size", "Bytes per written document.", "bytes", "1024"},
+        {"concurrency", "Operations in flight.", "count", "8"},
+        {"listeners", "Changes feeds open during the run.", "count", "0"},
+        {"attachments", "Share of writes creating a document with an attachment.", "ratio", "0"},
+        {"attachment-size", "Bytes per attachment.", "bytes", "0"},
+        {"duration", "Seconds per scenario.", "seconds", "10"},
+        {"documents", "Documents written before each scenario.", "count", "1000"},
+        {"json-benchmark", "Compares the JSON backends on generated feed lines and _all_docs pages, without a server."},
+        {"iterations", "Passes over the generated payloads in the JSON benchmark.", "count", "20"},
+        {"verbose", "Shows the client debug output."}
+    });
+    parser.process(application);
+
+    verbose = parser.isSet("verbose");
+    qInstallMessageHandler(messageHandler);
+
+    if(parser.isSet("json-benchmark"))
+    {
+        const QList<JsonBenchmarkResult> results = runJsonBenchmark(parser.value("documents").toInt(), parser.value("document-size").toInt(),
+                                                                    qMax(1, parser.value("iterations").toInt()));
+
+        QTextStream out(stdout);
+        out << QString("%1%2%3%4").arg("payload", -12).arg("structural MB/s", 18).arg("QJsonDocument MB/s", 20).arg("speedup", 10) << endl;
+
+        QJsonArray array;
+        foreach(const JsonBenchmarkResult& result, results)
+        {
+            out << QString("%1%2%3%4").arg(result.payload, -12).arg(result.structuralThroughput(), 18, 'f', 1)
+                   .arg(result.documentThroughput(), 20, 'f', 1).arg(result.speedup(), 9, 'f', 2) << "x" << endl;
+            array.append(result.toJson());
+        }
+
+        if(parser.isSet("output"))
+        {
+            QFile file(parser.value("output"));
+            if(!file.open(QIODevice::WriteOnly) || file.write(QJsonDocument(array).toJson()) < 0)
+            {
+                qWarning() << "Failed to write" << file.fileName() << file.errorString();
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    QJsonObject options;
+    options.insert("name", parser.value("name"));
+    options.insert("readRatio", parser.value("reads").toDouble());
+    options.insert("documentSize", parser.value("document-size").toInt());
+    options.insert("concurrency", parser.value("concurrency").toInt());
+    options.insert("listeners", parser.value("listeners").toInt());
+    options.insert("attachmentRatio", parser.value("attachments").toDouble());
+    options.insert("attachmentSize", parser.value("attachment-size").toInt());
+    options.insert("duration", parser.value("duration").toInt());
+    options.insert("documents", parser.value("documents").toInt());
+    const LoadScenario defaults = LoadScenario::fromJson(options, LoadScenario());
+
+    QList<LoadScenario> scenarios;
+    if(parser.isSet("scenarios"))
+    {
+        QFile file(parser.value("scenarios"));
+        if(!file.open(QIODevice::ReadOnly))
+        {
+            qWarning() << "Failed to open" << file.fileName() << file.errorString();
+            return 1;
+        }
+
+        const QJsonArray array = QJsonDocument::fromJson(file.readAll()).array();
+        for(int i = 0; i < array.size(); ++i)
+        {
+            LoadScenario scenario = LoadScenario::fromJson(array.at(i).toObject(), defaults);
+            if(!array.at(i).toObject().contains("name")) scenario.name = QString("scenario-%1").arg(i + 1);
+            scenarios.append(scenario);
+        }
+    }
+    else
+    {
+        scenarios.append(defaults);
+    }
+
+    if(scenarios.isEmpty())
+    {
+        qWarning() << "No scenario to run";
+        return 1;
+    }
+
+    //The stand-in answers from its own thread so it doesn't queue behind the client in the event loop
+    QThread serverThread;
+    StandInServer *standIn = 0;
+
+    CouchDB couchdb;
+    if(parser.isSet("url"))
+    {
+        couchdb.setServerConfiguration(parser.value("url"), parser.value("port").toInt(), parser.value("user"), parser.value("password"));
+    }
+    else
+    {
+        standIn = new StandInServer;
+        standIn->moveToThread(&serverThread);
+        QObject::connect(&serverThread, SIGNAL(finished()), standIn, SLOT(deleteLater()));
+        serverThread.start();
+
+        quint16 port = 0;
+        QMetaObject::invokeMethod(standIn, "start", Qt::BlockingQueuedConnection, Q_RETURN_ARG(quint16, port));
+        if(port == 0)
+        {
+            serverThread.quit();
+            serverThread.wait();
+            return 1;
+        }
+
+        couchdb.setServerConfiguration("127.0.0.1", port);
+        qWarning() << "Running against the in-process stand-in, CPU and memory include it";
+    }
+
+    LoadRunner runner(&couchdb, parser.value("database"), scenarios);
+    QObject::connect(&runner, SIGNAL(finished()), &application, SLOT(quit()));
+    QMetaObject::invokeMethod(&runner, "run", Qt::QueuedConnection);
+
+    const int code = application.exec();
+
+    if(standIn)
+    {
+        serverThread.quit();
+        serverThread.wait();
+    }
+
+    if(parser.isSet("output"))
+    {
+        QJsonArray results;
+        foreach(const LoadResult& result, runner.results()) results.append(result.toJson());
+
+        QFile file(parser.value("output"));
+        if(!file.open(QIODevice::WriteOnly) || file.write(QJsonDocument(results).toJson()) < 0)
+        {
+            qWarning() << "Failed to write" << file.fileName() << file.errorString();
+            return 1;
+        }
+    }
+
+    return code;
+}
@@ -0,0 +1,351 @@
+#include "standinserver.h"
+
+#include <QTcpSocket>
+#include <QHostAddress>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QStringList>
+#include <QUrl>
+#include <QVector>
+#include <QPair>
+#include <QDebug>
+
+#include <algorithm>
+
+namespace
+{
+    QByteArray reasonPhrase(const int& status)
+    {
+        switch(status)
+        {
+        case 200: return QByteArrayLiteral("OK");
+        case 201: return QByteArrayLiteral("Created");
+        case 400: return QByteArrayLiteral("Bad Request");
+        case 404: return QByteArrayLiteral("Not Found");
+        case 412: return QByteArrayLiteral("Precondition Failed");
+        default: return QByteArrayLiteral("Unknown");
+        }
+    }
+
+    void writeChunk(QTcpSocket *socket, const QByteArray& data)
+    {
+        socket->write(QByteArray::number(data.size(), 16) + "\r\n" + data + "\r\n");
+    }
+
+    QByteArray okBody(const QString& id, const QByteArray& revision)
+    {
+        return "{\"ok\":true,\"id\":\"" + id.toUtf8() + "\",\"rev\":\"" + revision + "\"}";
+    }
+
+    const QByteArray notFound = QByteArrayLiteral("{\"error\":\"not_found\",\"reason\":\"missing\"}");
+}
+
+StandInServer::StandInServer(QObject *parent) :
+    QTcpServer(parent),
+    heartbeatTimer(this)
+{
+    heartbeatTimer.setInterval(5000);
+    connect(&heartbeatTimer, SIGNAL(timeout()), this, SLOT(sendHeartbeats()));
+}
+
+quint16 StandInServer::start()
+{
+    if(!isListening() && !listen(QHostAddress::LocalHost, 0))
+    {
+        qWarning() << "Stand-in server failed to listen" << errorString();
+        return 0;
+    }
+
+    heartbeatTimer.start();
+    return serverPort();
+}
+
+void StandInServer::incomingConnection(qintptr socketDescriptor)
+{
+    QTcpSocket *socket = new QTcpSocket(this);
+    if(!socket->setSocketDescriptor(socketDescriptor))
+    {
+        delete socket;
+        return;
+    }
+
+    buffers.insert(socket, QByteArray());
+    connect(socket, SIGNAL(readyRead()), this, SLOT(readRequest()));
+    connect(socket, SIGNAL(disconnected()), this, SLOT(socketDisconnected()));
+}
+
+void StandInServer::readRequest()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+    if(!socket) return;
+
+    QByteArray& buffer = buffers[socket];
+    buffer.append(socket->readAll());
+
+    //Keep-alive connections may carry several requests, and a request may span several reads
+    forever
+    {
+        const int headerEnd = buffer.indexOf("\r\n\r\n");
+        if(headerEnd < 0) return;
+
+        const QList<QByteArray> lines = buffer.left(headerEnd).split('\n');
+        const QList<QByteArray> requestLine = lines.first().trimmed().split(' ');
+        if(requestLine.size() < 2)
+        {
+            socket->disconnectFromHost();
+            return;
+        }
+
+        Request request;
+        for(int i = 1; i < lines.size(); ++i)
+        {
+            const int colon = lines.at(i).indexOf(':');
+            if(colon > 0) request.headers.insert(lines.at(i).left(colon).trimmed().toLower(), lines.at(i).mid(colon + 1).trimmed());
+        }
+
+        const int contentLength = request.headers.value("content-length").toInt();
+        if(buffer.size() < headerEnd + 4 + contentLength) return;
+
+        const QUrl url(QString::fromLatin1(requestLine.at(1)));
+        foreach(const QString& segment, url.path(QUrl::FullyEncoded).split('/', QString::SkipEmptyParts))
+        {
+            request.path.append(QUrl::fromPercentEncoding(segment.toLatin1()));
+        }
+        request.method = requestLine.at(0);
+        request.query = QUrlQuery(url);
+        request.body = buffer.mid(headerEnd + 4, contentLength);
+        buffer.remove(0, headerEnd + 4 + contentLength);
+
+        handle(socket, request);
+    }
+}
+
+void StandInServer::socketDisconnected()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+    if(!socket) return;
+
+    buffers.remove(socket);
+    for(int i = feeds.size() - 1; i >= 0; --i)
+    {
+        if(feeds.at(i).socket == socket) feeds.removeAt(i);
+    }
+    socket->deleteLater();
+}
+
+void StandInServer::sendHeartbeats()
+{
+    foreach(const Feed& feed, feeds) writeChunk(feed.socket, QByteArrayLiteral("\n"));
+}
+
+void StandInServer::handle(QTcpSocket *socket, const Request &request)
+{
+    const QStringList& path = request.path;
+    const QByteArray& method = request.method;
+
+    if(path.isEmpty())
+    {
+        respond(socket, 200, QByteArrayLiteral("{\"couchdb\":\"Welcome\",\"version\":\"stand-in\"}"));
+        return;
+    }
+
+    if(path.first() == QLatin1String("_session"))
+    {
+        respond(socket, 200, QByteArrayLiteral("{\"ok\":true}"));
+        return;
+    }
+
+    if(path.first() == QLatin1String("_all_dbs"))
+    {
+        respond(socket, 200, QJsonDocument::fromVariant(QStringList(databases.keys())).toJson(QJsonDocument::Compact));
+        return;
+    }
+
+    const QString& name = path.first();
+
+    if(path.size() == 1)
+    {
+        if(method == "PUT")
+        {
+            if(databases.contains(name)) respond(socket, 412, QByteArrayLiteral("{\"error\":\"file_exists\"}"));
+            else
+            {
+                databases.insert(name, Database());
+                respond(socket, 201, QByteArrayLiteral("{\"ok\":true}"));
+            }
+        }
+        else if(method == "DELETE")
+        {
+            if(databases.remove(name)) respond(socket, 200, QByteArrayLiteral("{\"ok\":true}"));
+            else respond(socket, 404, notFound);
+        }
+        else if(databases.contains(name))
+        {
+            const Database& database = databases[name];
+            respond(socket, 200, "{\"db_name\":\"" + name.toUtf8() + "\",\"doc_count\":" + QByteArray::number(database.documents.size()) +
+                    ",\"update_seq\":" + QByteArray::number(database.sequence) + "}");
+        }
+        else respond(socket, 404, notFound);
+        return;
+    }
+
+    if(!databases.contains(name))
+    {
+        respond(socket, 404, notFound);
+        return;
+    }
+
+    Database& database = databases[name];
+    const QString& id = path.at(1);
+
+    if(path.size() == 2 && id == QLatin1String("_changes"))
+    {
+        openFeed(socket, name, request);
+        return;
+    }
+
+    if(path.size() == 2 && id == QLatin1String("_all_docs"))
+    {
+        QByteArray rows;
+        for(QHash<QString, Document>::const_iterator it = database.documents.constBegin(); it != database.documents.constEnd(); ++it)
+        {
+            if(!rows.isEmpty()) rows.append(',');
+            rows.append("{\"id\":\"" + it.key().toUtf8() + "\",\"key\":\"" + it.key().toUtf8() + "\",\"value\":{\"rev\":\"" +
+                        revision(it.key(), it.value().generation) + "\"}}");
+        }
+        respond(socket, 200, "{\"total_rows\":" + QByteArray::number(database.documents.size()) + ",\"offset\":0,\"rows\":[" + rows + "]}");
+        return;
+    }
+
+    if(path.size() == 2)
+    {
+        if(method == "PUT")
+        {
+            storeDocument(socket, name, id, request.headers.value("content-type").startsWith("multipart/") ? QByteArray("{}") : request.body);
+        }
+        else if(!database.documents.contains(id))
+        {
+            respond(socket, 404, notFound, QByteArray(), method != "HEAD");
+        }
+        else if(method == "DELETE")
+        {
+            Document document = database.documents.take(id);
+            document.generation++;
+            document.sequence = ++database.sequence;
+            document.body.clear();
+            publish(name, id, document, true);
+            respond(socket, 200, okBody(id, revision(id, document.generation)));
+        }
+        else
+        {
+            const Document& document = database.documents[id];
+            respond(socket, 200, document.body, "ETag: \"" + revision(id, document.generation) + "\"\r\n", method != "HEAD");
+        }
+        return;
+    }
+
+    if(path.size() == 3 && method == "PUT")
+    {
+        //Attachment content isn't kept, only the revision moves forward
+        if(!database.documents.contains(id)) storeDocument(socket, name, id, QByteArrayLiteral("{}"));
+        else storeDocument(socket, name, id, database.documents[id].body);
+        return;
+    }
+
+    respond(socket, 400, QByteArrayLiteral("{\"error\":\"bad_request\"}"));
+}
+
+void StandInServer::openFeed(QTcpSocket *socket, const QString &database, const Request &request)
+{
+    Feed feed;
+    feed.socket = socket;
+    feed.database = database;
+    feed.includeDocuments = request.query.queryItemValue("include_docs") == QLatin1String("true");
+
+    socket->write(QByteArrayLiteral("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n"));
+
+    //Deleted documents aren't kept, a resumed feed only replays the live ones
+    const QString since = request.query.queryItemValue("since");
+    if(since != QLatin1String("now"))
+    {
+        const qint64 sequence = since.toLongLong();
+        const QHash<QString, Document>& documents = databases[database].documents;
+
+        QVector<QPair<qint64, QString> > pending;
+        for(QHash<QString, Document>::const_iterator it = documents.constBegin(); it != documents.constEnd(); ++it)
+        {
+            if(it.value().sequence > sequence) pending.append(qMakePair(it.value().sequence, it.key()));
+        }
+        std::sort(pending.begin(), pending.end());
+
+        QByteArray lines;
+        foreach(const QPair<qint64, QString>& change, pending)
+        {
+            lines.append(changeLine(change.second, documents[change.second], false, feed.includeDocuments));
+        }
+        if(!lines.isEmpty()) writeChunk(socket, lines);
+    }
+
+    feeds.append(feed);
+}
+
+void StandInServer::storeDocument(QTcpSocket *socket, const QString &database, const QString &id, const QByteArray &document)
+{
+    Document& stored = databases[database].documents[id];
+    stored.generation++;
+    stored.sequence = ++databases[database].sequence;
+
+    const QByteArray rev = revision(id, stored.generation);
+
+    QJsonObject object = QJsonDocument::fromJson(document).object();
+    object.insert("_id", id);
+    object.insert("_rev", QString::fromLatin1(rev));
+    stored.body = QJsonDocument(object).toJson(QJsonDocument::Compact);
+
+    publish(database, id, stored, false);
+    respond(socket, 201, okBody(id, rev));
+}
+
+void StandInServer::publish(const QString &database, const QString &id, const Document &document, const bool &deleted)
+{
+    QByteArray lines[2];
+    foreach(const Feed& feed, feeds)
+    {
+        if(feed.database != database) continue;
+
+        QByteArray& line = lines[feed.includeDocuments ? 1 : 0];
+        if(line.isEmpty()) line = changeLine(id, document, deleted, feed.includeDocuments);
+        writeChunk(feed.socket, line);
+    }
+}
+
+QByteArray StandInServer::changeLine(const QString &id, const Document &document, const bool &deleted, const bool &includeDocuments)
+{
+    const QByteArray rev = revision(id, document.generation);
+
+    QByteArray line = "{\"seq\":" + QByteArray::number(document.sequence) + ",\"id\":\"" + id.toUtf8() +
+            "\",\"changes\":[{\"rev\":\"" + rev + "\"}]";
+    if(deleted) line.append(",\"deleted\":true");
+    if(includeDocuments)
+    {
+        line.append(",\"doc\":");
+        if(deleted) line.append("{\"_id\":\"" + id.toUtf8() + "\",\"_rev\":\"" + rev + "\",\"_deleted\":true}");
+        else line.append(document.body);
+    }
+    line.append("}\n");
+    return line;
+}
+
+QByteArray StandInServer::revision(const QString &id, const int &generation)
+{
+    return QByteArray::number(generation) + '-' + QByteArray::number(qHash(id) ^ uint(generation), 16);
+}
+
+void StandInServer::respond(QTcpSocket *socket, const int &status, const QByteArray &body, const QByteArray &extraHeaders, const bool &withBody)
+{
+    QByteArray response = "HTTP/1.1 " + QByteArray::number(status) + ' ' + reasonPhrase(status) + "\r\n" +
+            "Content-Type: application/json\r\nContent-Length: " + QByteArray::number(body.size()) + "\r\n" +
+            extraHeaders + "\r\n";
+    if(withBody) response.append(body);
+    socket->write(response);
+}
@@ -0,0 +1,88 @@
+#ifndef STANDINSERVER_H
+#define STANDINSERVER_H
+
+#include <QTcpServer>
+#include <QHash>
+#include <QList>
+#include <QTimer>
+#include <QUrlQuery>
+
+class QTcpSocket;
+
+//Minimal in-memory CouchDB answering the calls issued by the load generator: databases, documents,
+//attachments and the continuous changes feed. Meant to measure the client alone, it checks nothing
+//a real server would (revisions, authentication, validation) and runs in its own thread.
+class StandInServer : public QTcpServer
+{
+    Q_OBJECT
+public:
+    explicit StandInServer(QObject *parent = 0);
+
+public slots:
+    //Listens on a free local port, to be invoked from the thread owning the server
+    quint16 start();
+
+protected:
+    void incomingConnection(qintptr socketDescriptor);
+
+private slots:
+    void readRequest();
+    void socketDisconnected();
+    void sendHeartbeats();
+
+private:
+    struct Document
+    {
+        Document() :
+            generation(0),
+            sequence(0)
+        {}
+
+        int generation;
+        qint64 sequence;
+        QByteArray body; //Serialized with _id and _rev
+    };
+
+    struct Database
+    {
+        Database() :
+            sequence(0)
+        {}
+
+        qint64 sequence;
+        QHash<QString, Document> documents;
+    };
+
+    struct Feed
+    {
+        QTcpSocket *socket;
+        QString database;
+        bool includeDocuments;
+    };
+
+    struct Request
+    {
+        QByteArray method;
+        QStringList path;
+        QUrlQuery query;
+        QHash<QByteArray, QByteArray> headers;
+        QByteArray body;
+    };
+
+    void handle(QTcpSocket *socket, const Request& request);
+    void openFeed(QTcpSocket *socket, const QString& database, const Request& request);
+    void storeDocument(QTcpSocket *socket, const QString& database, const QString& id, const QByteArray& document);
+    void publish(const QString& database, const QString& id, const Document& document, const bool& deleted);
+
+    static QByteArray changeLine(const QString& id, const Document& document, const bool& deleted, const bool& includeDocuments);
+    static QByteArray revision(const QString& id, const int& generation);
+    static void respond(QTcpSocket *socket, const int& status, const QByteArray& body,
+                        const QByteArray& extraHeaders = QByteArray(), const bool& withBody = true);
+
+    QHash<QString, Database> databases;
+    QHash<QTcpSocket*, QByteArray> buffers;
+    QList<Feed> feeds;
+    QTimer heartbeatTimer;
+};
+
+#endif // STANDINSERVER_H
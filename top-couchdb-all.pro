@@ -0,0 +1,16 @@
+#-------------------------------------------------
+#
+# The top_couchdb library and the tools linking it, built in order
+#
+#-------------------------------------------------
+
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    library \
+    loadgen
+
+library.file = top-couchdb.pro
+
+loadgen.subdir = tools/loadgen
+loadgen.depends = library
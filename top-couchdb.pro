@@ -22,12 +22,48 @@ HEADERS += \
     couchdbserver.h \
     couchdbresponse.h \
     couchdbquery.h \
-    couchdblistener.h
+    couchdblistener.h \
+    couchdbwritequeue.h \
+    couchdbrevisiontable.h \
+    couchdbtimingwheel.h \
+    couchdbcluster.h \
+    couchdbfuture.h \
+    couchdbfuturewatcher.h \
+    couchdbjson.h \
+    couchdbjsonview.h \
+    couchdbmultipart.h \
+    couchdbmaintenance.h \
+    couchdblocalreplica.h \
+    couchdbscanner.h \
+    couchdblistmodel.h \
+    couchdbindex.h \
+    couchdbratelimiter.h \
+    couchdbarchive.h \
+    couchdbstatspoller.h \
+    couchdboperationstatistics.h
 
 SOURCES += \
     couchdb.cpp \
     couchdbserver.cpp \
     couchdbresponse.cpp \
     couchdbquery.cpp \
-    couchdblistener.cpp
+    couchdblistener.cpp \
+    couchdbwritequeue.cpp \
+    couchdbrevisiontable.cpp \
+    couchdbtimingwheel.cpp \
+    couchdbcluster.cpp \
+    couchdbfuture.cpp \
+    couchdbfuturewatcher.cpp \
+    couchdbjson.cpp \
+    couchdbjsonview.cpp \
+    couchdbmultipart.cpp \
+    couchdbmaintenance.cpp \
+    couchdblocalreplica.cpp \
+    couchdbscanner.cpp \
+    couchdblistmodel.cpp \
+    couchdbindex.cpp \
+    couchdbratelimiter.cpp \
+    couchdbarchive.cpp \
+    couchdbstatspoller.cpp \
+    couchdboperationstatistics.cpp
 